@@ -4,6 +4,8 @@
 #include <type_traits>
 #include <random>
 
+#include "mmpacket.h"
+
 namespace mm
 {
 
@@ -13,16 +15,216 @@ using enable_if_compound =
 
 template<typename T>
 using op_dtype =
-	typename std::remove_reference<decltype( std::declval<T>()( 0, 0 ) )>::type;
+	typename std::remove_cv<typename std::remove_reference<
+		decltype( std::declval<const T&>()( 0, 0 ) )>::type>::type;
+
+namespace detail
+{
+
+template<typename T>
+struct Void
+{
+	typedef void type;
+};
+
+template<typename Top, typename Enable = void>
+struct OpAccum
+{
+	typedef op_dtype<Top> type;
+};
+
+template<typename Top>
+struct OpAccum<Top, typename Void<typename Top::ACCUM>::type>
+{
+	typedef typename Top::ACCUM type;
+};
+
+}
+
+/*
+ * Type that reductions over op accumulate in. Functions take it from their
+ * precision policy and operators combine it like op_dtype, anything else
+ * accumulates in op_dtype.
+ */
+template<typename T>
+using op_accum = typename detail::OpAccum<T>::type;
+
+template<typename Tacc, typename Top>
+using sum_dtype = typename std::conditional<std::is_void<Tacc>::value,
+	op_accum<Top>, Tacc>::type;
+
+namespace detail
+{
+
+template<typename Top, typename Enable = void>
+struct OpOperand
+{
+	typedef Top type;
+};
+
+template<typename Top>
+struct OpOperand<Top, typename Void<typename Top::OPERAND>::type>
+{
+	typedef typename Top::OPERAND type;
+};
+
+}
+
+/*
+ * Type an operator stores its operand as. Operators keep operands by value,
+ * leaves that are too large to copy name a cheap OPERAND type instead.
+ */
+template<typename Top>
+using op_operand = typename detail::OpOperand<Top>::type;
+
+template<typename T, unsigned int Dim>
+struct Tuple;
+
+namespace detail
+{
+
+/*
+ * Expressions describe what they read through visit( visitor, offsetX,
+ * offsetY, offsetZ ): operators pass it on to their operands at the offset
+ * they evaluate them at, leaves call visitor.read( data, offsetX, offsetY,
+ * offsetZ ) with the address of their first element. Operands without a
+ * visit() member, or that read other than at a fixed offset, call
+ * visitor.unknown() instead.
+ */
+struct NullVisitor
+{
+	void read( const void*, int, int, int )
+	{
+	}
+
+	void unknown()
+	{
+	}
+};
+
+template<typename Top>
+class has_visit
+{
+private:
+	template<typename U>
+	static auto test( int ) -> decltype(
+			std::declval<const U&>().visit( std::declval<NullVisitor&>(), 0, 0, 0 ),
+			std::true_type() );
+
+	template<typename U>
+	static std::false_type test( ... );
+
+public:
+	static const bool value = decltype( test<Top>( 0 ) )::value;
+};
+
+template<typename Top, typename Tvisitor>
+inline void visit( const Top& op, Tvisitor& visitor,
+		int offsetX, int offsetY, int offsetZ, std::true_type )
+{
+	op.visit( visitor, offsetX, offsetY, offsetZ );
+}
+
+template<typename Top, typename Tvisitor>
+inline void visit( const Top&, Tvisitor& visitor, int, int, int, std::false_type )
+{
+	visitor.unknown();
+}
+
+template<typename Top, typename Tvisitor>
+inline void visit( const Top& op, Tvisitor& visitor,
+		int offsetX = 0, int offsetY = 0, int offsetZ = 0 )
+{
+	detail::visit( op, visitor, offsetX, offsetY, offsetZ,
+			std::integral_constant<bool, has_visit<Top>::value>() );
+}
+
+template<typename Tfunc>
+class has_written
+{
+private:
+	template<typename U>
+	static auto test( int ) -> decltype(
+			std::declval<U&>().written( 0, 0, 0, 0, 0, 0 ),
+			std::true_type() );
+
+	template<typename U>
+	static std::false_type test( ... );
+
+public:
+	static const bool value = decltype( test<Tfunc>( 0 ) )::value;
+};
+
+template<typename Tfunc>
+inline void written( Tfunc& func, int beginX, int beginY, int beginZ,
+		int endX, int endY, int endZ, std::true_type )
+{
+	func.written( beginX, beginY, beginZ, endX, endY, endZ );
+}
+
+template<typename Tfunc>
+inline void written( Tfunc&, int, int, int, int, int, int, std::false_type )
+{
+}
+
+/*
+ * Tells a target that set() has written the box [ begin, end ), for
+ * targets that keep track of it through a written() member.
+ */
+template<typename Tfunc>
+inline void written( Tfunc& func, int beginX, int beginY, int beginZ,
+		int endX, int endY, int endZ )
+{
+	detail::written( func, beginX, beginY, beginZ, endX, endY, endZ,
+			std::integral_constant<bool, has_written<Tfunc>::value>() );
+}
+
+}
+
+namespace detail
+{
+
+template<unsigned int Dim>
+struct DimTag
+{
+};
+
+template<typename Tfunc, typename Enable = void>
+struct FuncDim
+{
+	static const unsigned int value = 2;
+};
+
+template<typename Tfunc>
+struct FuncDim<Tfunc, typename Void<decltype( Tfunc::DIM )>::type>
+{
+	static const unsigned int value = Tfunc::DIM;
+};
+
+template<typename Tcoord>
+struct CoordDim
+{
+	static const unsigned int value = 2;
+};
+
+template<typename T, unsigned int Dim>
+struct CoordDim<Tuple<T, Dim>>
+{
+	static const unsigned int value = Dim;
+};
+
+}
 
 template<typename Tfunc>
 class FunctionView
 {
 public:
 	static const unsigned int DIM = Tfunc::DIM;
+	typedef op_accum<Tfunc> ACCUM;
 
 private:
 	typedef op_dtype<Tfunc> DTYPE;
+	typedef decltype( std::declval<Tfunc&>()( 0, 0 ) ) REFERENCE;
 
 public:
 	FunctionView( Tfunc& func, int beginX, int beginY, int endX, int endY )
@@ -32,19 +234,37 @@ public:
 		m_pBegin[ 1 ] = beginY;
 		m_pSize[ 0 ] = endX - beginX;
 		m_pSize[ 1 ] = endY - beginY;
+		for( unsigned int i = 2; i < DIM; ++i )
+		{
+			m_pBegin[ i ] = 0;
+			m_pSize[ i ] = 1;
+		}
+	}
+
+	FunctionView( Tfunc& func, int beginX, int beginY, int beginZ,
+			int endX, int endY, int endZ )
+		: m_pFunc( &func )
+	{
+		m_pBegin[ 0 ] = beginX;
+		m_pBegin[ 1 ] = beginY;
+		m_pBegin[ 2 ] = beginZ;
+		m_pSize[ 0 ] = endX - beginX;
+		m_pSize[ 1 ] = endY - beginY;
+		m_pSize[ 2 ] = endZ - beginZ;
 	}
 
 	template<typename Tbegin, typename Tend>
 	FunctionView( Tfunc& func, const Tbegin& begin, const Tend& end )
 		: m_pFunc( &func )
 	{
-		m_pBegin[ 0 ] = begin[ 0 ];
-		m_pBegin[ 1 ] = begin[ 1 ];
-		m_pSize[ 0 ] = end[ 0 ] - begin[ 0 ];
-		m_pSize[ 1 ] = end[ 1 ] - begin[ 1 ];
+		for( unsigned int i = 0; i < DIM; ++i )
+		{
+			m_pBegin[ i ] = begin[ i ];
+			m_pSize[ i ] = end[ i ] - begin[ i ];
+		}
 	}
 
-	DTYPE& operator[]( int i )
+	REFERENCE operator[]( int i )
 	{
 		return ( *m_pFunc )[ i ];
 	}
@@ -54,21 +274,54 @@ public:
 		return ( *m_pFunc )[ i ];
 	}
 
-	DTYPE& operator()( int x, int y )
+	REFERENCE operator()( int x, int y )
 	{
 		return ( *m_pFunc )( m_pBegin[ 0 ] + x, m_pBegin[ 1 ] + y );
 	}
 
+	REFERENCE operator()( int x, int y, int z )
+	{
+		return ( *m_pFunc )( m_pBegin[ 0 ] + x, m_pBegin[ 1 ] + y,
+				m_pBegin[ 2 ] + z );
+	}
+
 	DTYPE operator()( int x, int y ) const
 	{
 		return ( *m_pFunc )( m_pBegin[ 0 ] + x, m_pBegin[ 1 ] + y );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return ( *m_pFunc )( m_pBegin[ 0 ] + x, m_pBegin[ 1 ] + y,
+				m_pBegin[ 2 ] + z );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return mm::packet<N>( *m_pFunc, m_pBegin[ 0 ] + x, m_pBegin[ 1 ] + y );
+	}
+
 	const int* size() const
 	{
 		return m_pSize;
 	}
 
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( *m_pFunc, visitor, m_pBegin[ 0 ] + offsetX, m_pBegin[ 1 ] + offsetY,
+				( DIM > 2 ? m_pBegin[ DIM - 1 ] : 0 ) + offsetZ );
+	}
+
+	void written( int beginX, int beginY, int beginZ, int endX, int endY, int endZ )
+	{
+		int beginZ0 = ( DIM > 2 ? m_pBegin[ DIM - 1 ] : 0 );
+		detail::written( *m_pFunc, m_pBegin[ 0 ] + beginX, m_pBegin[ 1 ] + beginY,
+				beginZ0 + beginZ, m_pBegin[ 0 ] + endX, m_pBegin[ 1 ] + endY,
+				beginZ0 + endZ );
+	}
+
 	template<typename Top>
 	FunctionView<Tfunc>& operator=( const Top& op )
 	{
@@ -82,14 +335,68 @@ private:
 	int m_pSize[ DIM ];
 };
 
+/*
+ * Non-owning reference to a leaf, used as the OPERAND of leaves that keep
+ * their data inline. The referenced leaf must outlive the expression.
+ */
+template<typename Tfunc>
+class FunctionRef
+{
+public:
+	static const unsigned int DIM = Tfunc::DIM;
+	typedef op_accum<Tfunc> ACCUM;
+
+private:
+	typedef op_dtype<Tfunc> DTYPE;
+
+public:
+	FunctionRef( const Tfunc& func )
+		: m_pFunc( &func )
+	{
+	}
+
+	DTYPE operator()( int x, int y ) const
+	{
+		return ( *m_pFunc )( x, y );
+	}
+
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return ( *m_pFunc )( x, y, z );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return mm::packet<N>( *m_pFunc, x, y );
+	}
+
+	auto size() const -> decltype( std::declval<const Tfunc&>().size() )
+	{
+		return m_pFunc->size();
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( *m_pFunc, visitor, offsetX, offsetY, offsetZ );
+	}
+
+private:
+	const Tfunc* m_pFunc;
+};
+
 namespace op
 {
 
 /* === BEGIN OPERATOR DECLARATIONS === */
 
-template<typename Tfunc, int OffsetX = 0, int OffsetY = 0>
+template<typename Tfunc, int OffsetX = 0, int OffsetY = 0, int OffsetZ = 0>
 class Eval
 {
+public:
+	typedef op_accum<Tfunc> ACCUM;
+
 private:
 	typedef op_dtype<Tfunc> DTYPE;
 
@@ -104,13 +411,33 @@ public:
 		return m_Func( x + OffsetX, y + OffsetY );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return m_Func( x + OffsetX, y + OffsetY, z + OffsetZ );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return mm::packet<N>( m_Func, x + OffsetX, y + OffsetY );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Func, visitor, offsetX + OffsetX, offsetY + OffsetY, offsetZ + OffsetZ );
+	}
+
 private:
-	const Tfunc m_Func;
+	const op_operand<Tfunc> m_Func;
 };
 
 template<typename Tfunc>
-class Eval<Tfunc, 0, 0>
+class Eval<Tfunc, 0, 0, 0>
 {
+public:
+	typedef op_accum<Tfunc> ACCUM;
+
 private:
 	typedef op_dtype<Tfunc> DTYPE;
 
@@ -125,13 +452,33 @@ public:
 		return m_Func( x, y );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return m_Func( x, y, z );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return mm::packet<N>( m_Func, x, y );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Func, visitor, offsetX, offsetY, offsetZ );
+	}
+
 private:
-	const Tfunc m_Func;
+	const op_operand<Tfunc> m_Func;
 };
 
 template<typename Tfunc, int OffsetX>
-class Eval<Tfunc, OffsetX, 0>
+class Eval<Tfunc, OffsetX, 0, 0>
 {
+public:
+	typedef op_accum<Tfunc> ACCUM;
+
 private:
 	typedef op_dtype<Tfunc> DTYPE;
 
@@ -146,13 +493,33 @@ public:
 		return m_Func( x + OffsetX, y );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return m_Func( x + OffsetX, y, z );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return mm::packet<N>( m_Func, x + OffsetX, y );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Func, visitor, offsetX + OffsetX, offsetY, offsetZ );
+	}
+
 private:
-	const Tfunc m_Func;
+	const op_operand<Tfunc> m_Func;
 };
 
 template<typename Tfunc, int OffsetY>
-class Eval<Tfunc, 0, OffsetY>
+class Eval<Tfunc, 0, OffsetY, 0>
 {
+public:
+	typedef op_accum<Tfunc> ACCUM;
+
 private:
 	typedef op_dtype<Tfunc> DTYPE;
 
@@ -167,8 +534,25 @@ public:
 		return m_Func( x, y + OffsetY );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return m_Func( x, y + OffsetY, z );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return mm::packet<N>( m_Func, x, y + OffsetY );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Func, visitor, offsetX, offsetY + OffsetY, offsetZ );
+	}
+
 private:
-	const Tfunc m_Func;
+	const op_operand<Tfunc> m_Func;
 };
 
 template<typename T>
@@ -185,6 +569,22 @@ public:
 		return m_Constant;
 	}
 
+	T operator()( int x, int y, int z ) const
+	{
+		return m_Constant;
+	}
+
+	template<int N>
+	Packet<T, N> packet( int x, int y ) const
+	{
+		return Packet<T, N>( m_Constant );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor&, int, int, int ) const
+	{
+	}
+
 private:
 	T m_Constant;
 };
@@ -203,6 +603,16 @@ public:
 		return ( m_Min + ( rand() / (double)RAND_MAX ) * ( m_Max - m_Min ) );
 	}
 
+	T operator()( int x, int y, int z ) const
+	{
+		return ( m_Min + ( rand() / (double)RAND_MAX ) * ( m_Max - m_Min ) );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor&, int, int, int ) const
+	{
+	}
+
 private:
 	T m_Min;
 	T m_Max;
@@ -211,6 +621,10 @@ private:
 template<typename Top1, typename Top2>
 class Add
 {
+public:
+	typedef decltype(std::declval<op_accum<Top1>>()
+			+ std::declval<op_accum<Top2>>()) ACCUM;
+
 private:
 	typedef decltype(std::declval<op_dtype<Top1>>()
 			+ std::declval<op_dtype<Top2>>()) DTYPE;
@@ -226,14 +640,36 @@ public:
 		return ( m_Op1( x, y ) + m_Op2( x, y ) );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return ( m_Op1( x, y, z ) + m_Op2( x, y, z ) );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return ( mm::packet<N>( m_Op1, x, y ) + mm::packet<N>( m_Op2, x, y ) );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Op1, visitor, offsetX, offsetY, offsetZ );
+		detail::visit( m_Op2, visitor, offsetX, offsetY, offsetZ );
+	}
+
 private:
-	const Top1 m_Op1;
-	const Top2 m_Op2;
+	const op_operand<Top1> m_Op1;
+	const op_operand<Top2> m_Op2;
 };
 
 template<typename Top1, typename Top2>
 class Sub
 {
+public:
+	typedef decltype(std::declval<op_accum<Top1>>()
+			- std::declval<op_accum<Top2>>()) ACCUM;
+
 private:
 	typedef decltype(std::declval<op_dtype<Top1>>()
 			- std::declval<op_dtype<Top2>>()) DTYPE;
@@ -249,14 +685,36 @@ public:
 		return ( m_Op1( x, y ) - m_Op2( x, y ) );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return ( m_Op1( x, y, z ) - m_Op2( x, y, z ) );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return ( mm::packet<N>( m_Op1, x, y ) - mm::packet<N>( m_Op2, x, y ) );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Op1, visitor, offsetX, offsetY, offsetZ );
+		detail::visit( m_Op2, visitor, offsetX, offsetY, offsetZ );
+	}
+
 private:
-	const Top1 m_Op1;
-	const Top2 m_Op2;
+	const op_operand<Top1> m_Op1;
+	const op_operand<Top2> m_Op2;
 };
 
 template<typename Top1, typename Top2>
 class Mul
 {
+public:
+	typedef decltype(std::declval<op_accum<Top1>>()
+			* std::declval<op_accum<Top2>>()) ACCUM;
+
 private:
 	typedef decltype(std::declval<op_dtype<Top1>>()
 			* std::declval<op_dtype<Top2>>()) DTYPE;
@@ -272,15 +730,37 @@ public:
 		return ( m_Op1( x, y ) * m_Op2( x, y ) );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return ( m_Op1( x, y, z ) * m_Op2( x, y, z ) );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return ( mm::packet<N>( m_Op1, x, y ) * mm::packet<N>( m_Op2, x, y ) );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Op1, visitor, offsetX, offsetY, offsetZ );
+		detail::visit( m_Op2, visitor, offsetX, offsetY, offsetZ );
+	}
+
 private:
-	const Top1 m_Op1;
-	const Top2 m_Op2;
+	const op_operand<Top1> m_Op1;
+	const op_operand<Top2> m_Op2;
 };
 
 template<typename Top1, typename Top2>
 class Div
 {
-private:
+public:
+	typedef decltype(std::declval<op_accum<Top1>>()
+			/ std::declval<op_accum<Top2>>()) ACCUM;
+
+private:
 	typedef decltype(std::declval<op_dtype<Top1>>()
 			/ std::declval<op_dtype<Top2>>()) DTYPE;
 
@@ -295,14 +775,35 @@ public:
 		return ( m_Op1( x, y ) / m_Op2( x, y ) );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return ( m_Op1( x, y, z ) / m_Op2( x, y, z ) );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return ( mm::packet<N>( m_Op1, x, y ) / mm::packet<N>( m_Op2, x, y ) );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Op1, visitor, offsetX, offsetY, offsetZ );
+		detail::visit( m_Op2, visitor, offsetX, offsetY, offsetZ );
+	}
+
 private:
-	const Top1 m_Op1;
-	const Top2 m_Op2;
+	const op_operand<Top1> m_Op1;
+	const op_operand<Top2> m_Op2;
 };
 
 template<typename Top>
 class Scale
 {
+public:
+	typedef op_accum<Top> ACCUM;
+
 private:
 	typedef op_dtype<Top> DTYPE;
 
@@ -317,14 +818,34 @@ public:
 		return ( m_Factor * m_Op( x, y ) );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return ( m_Factor * m_Op( x, y, z ) );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return ( m_Factor * mm::packet<N>( m_Op, x, y ) );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Op, visitor, offsetX, offsetY, offsetZ );
+	}
+
 private:
-	const Top m_Op;
+	const op_operand<Top> m_Op;
 	DTYPE m_Factor;
 };
 
 template<typename Top>
 class Abs
 {
+public:
+	typedef op_accum<Top> ACCUM;
+
 private:
 	typedef op_dtype<Top> DTYPE;
 
@@ -340,13 +861,39 @@ public:
 		return ( val >= 0 ? val : -val );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		DTYPE val = m_Op( x, y, z );
+		return ( val >= 0 ? val : -val );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		Packet<DTYPE, N> val = mm::packet<N>( m_Op, x, y );
+		for( int k = 0; k < N; ++k )
+		{
+			val.v[ k ] = ( val.v[ k ] >= 0 ? val.v[ k ] : -val.v[ k ] );
+		}
+		return val;
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Op, visitor, offsetX, offsetY, offsetZ );
+	}
+
 private:
-	const Top m_Op;
+	const op_operand<Top> m_Op;
 };
 
 template<typename Top>
 class Sqr
 {
+public:
+	typedef op_accum<Top> ACCUM;
+
 private:
 	typedef op_dtype<Top> DTYPE;
 
@@ -362,13 +909,35 @@ public:
 		return ( val * val );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		DTYPE val = m_Op( x, y, z );
+		return ( val * val );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		Packet<DTYPE, N> val = mm::packet<N>( m_Op, x, y );
+		return ( val * val );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Op, visitor, offsetX, offsetY, offsetZ );
+	}
+
 private:
-	const Top m_Op;
+	const op_operand<Top> m_Op;
 };
 
 template<typename Top>
 class Neg
 {
+public:
+	typedef op_accum<Top> ACCUM;
+
 private:
 	typedef op_dtype<Top> DTYPE;
 
@@ -383,13 +952,33 @@ public:
 		return -m_Op( x, y );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return -m_Op( x, y, z );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return -mm::packet<N>( m_Op, x, y );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Op, visitor, offsetX, offsetY, offsetZ );
+	}
+
 private:
-	const Top m_Op;
+	const op_operand<Top> m_Op;
 };
 
 template<typename Top>
 class Transpose
 {
+public:
+	typedef op_accum<Top> ACCUM;
+
 private:
 	typedef op_dtype<Top> DTYPE;
 
@@ -404,8 +993,20 @@ public:
 		return m_Op( y, x );
 	}
 
+	DTYPE operator()( int x, int y, int z ) const
+	{
+		return m_Op( y, x, z );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int, int, int ) const
+	{
+		// reads are mirrored, not offset
+		visitor.unknown();
+	}
+
 private:
-	const Top m_Op;
+	const op_operand<Top> m_Op;
 };
 
 /* === END OPERATOR DECLARATIONS === */
@@ -421,6 +1022,13 @@ inline FunctionView<Tfunc> view( Tfunc& func, int beginX, int beginY,
 	return FunctionView<Tfunc>( func, beginX, beginY, endX, endY );
 }
 
+template<typename Tfunc>
+inline FunctionView<Tfunc> view( Tfunc& func, int beginX, int beginY,
+		int beginZ, int endX, int endY, int endZ )
+{
+	return FunctionView<Tfunc>( func, beginX, beginY, beginZ, endX, endY, endZ );
+}
+
 template<typename Tfunc, typename Tbegin, typename Tend>
 inline FunctionView<Tfunc> view( Tfunc& func, const Tbegin& begin,
 		const Tend& end )
@@ -428,14 +1036,14 @@ inline FunctionView<Tfunc> view( Tfunc& func, const Tbegin& begin,
 	return FunctionView<Tfunc>( func, begin, end );
 }
 
-template<int OffsetX, int OffsetY, typename Tfunc>
-inline op::Eval<Tfunc, OffsetX, OffsetY> eval( const Tfunc& func )
+template<int OffsetX, int OffsetY, int OffsetZ = 0, typename Tfunc>
+inline op::Eval<Tfunc, OffsetX, OffsetY, OffsetZ> eval( const Tfunc& func )
 {
-	return op::Eval<Tfunc, OffsetX, OffsetY>( func );
+	return op::Eval<Tfunc, OffsetX, OffsetY, OffsetZ>( func );
 }
 
 template<typename Tfunc>
-inline Tfunc eval( const Tfunc& func )
+inline op_operand<Tfunc> eval( const Tfunc& func )
 {
 	return func;
 }
@@ -566,14 +1174,38 @@ inline op::Transpose<Top> transpose( const Top& op )
 
 /* === END OPERATOR PROXIES === */
 
+namespace detail
+{
+
+/*
+ * Operands that are cheaper to evaluate a row segment at a time, such as
+ * compiled expressions, provide row( x, y, z, n, pOut ) writing the n
+ * values from ( x, y, z ) on, at most Top::BATCH per call. set() then
+ * goes through rows instead of points.
+ */
+template<typename Top>
+class has_rows
+{
+private:
+	template<typename U>
+	static auto test( int ) -> decltype(
+			std::declval<const U&>().row( 0, 0, 0, 0, (op_dtype<U>*)nullptr ),
+			U::BATCH, std::true_type() );
+
+	template<typename U>
+	static std::false_type test( ... );
+
+public:
+	static const bool value = decltype( test<Top>( 0 ) )::value;
+};
+
 template<typename Tfunc, typename Top>
-inline void set( Tfunc& func, const Top& op )
+inline void setRange( Tfunc& func, int beginX, int beginY,
+		int endX, int endY, const Top& op, std::false_type )
 {
-	int sizeX = func.size()[ 0 ];
-	int sizeY = func.size()[ 1 ];
-	for( int j = 0; j < sizeY; ++j )
+	for( int j = beginY; j < endY; ++j )
 	{
-		for( int i = 0; i < sizeX; ++i )
+		for( int i = beginX; i < endX; ++i )
 		{
 			func( i, j ) = op( i, j );
 		}
@@ -581,23 +1213,139 @@ inline void set( Tfunc& func, const Top& op )
 }
 
 template<typename Tfunc, typename Top>
-inline void set( Tfunc& func, int beginX, int beginY,
-		int endX, int endY, const Top& op )
+inline void setRange( Tfunc& func, int beginX, int beginY,
+		int endX, int endY, const Top& op, std::true_type )
 {
+	op_dtype<Top> batch[ Top::BATCH ];
 	for( int j = beginY; j < endY; ++j )
 	{
-		for( int i = beginX; i < endX; ++i )
+		for( int i = beginX; i < endX; i += Top::BATCH )
 		{
-			func( i, j ) = op( i, j );
+			int n = ( endX - i < Top::BATCH ? endX - i : (int)Top::BATCH );
+			op.row( i, j, 0, n, batch );
+			for( int k = 0; k < n; ++k )
+			{
+				func( i + k, j ) = batch[ k ];
+			}
+		}
+	}
+}
+
+template<typename Tfunc, typename Top>
+inline void setRange( Tfunc& func, int beginX, int beginY, int beginZ,
+		int endX, int endY, int endZ, const Top& op, std::false_type )
+{
+	for( int k = beginZ; k < endZ; ++k )
+	{
+		for( int j = beginY; j < endY; ++j )
+		{
+			for( int i = beginX; i < endX; ++i )
+			{
+				func( i, j, k ) = op( i, j, k );
+			}
+		}
+	}
+}
+
+template<typename Tfunc, typename Top>
+inline void setRange( Tfunc& func, int beginX, int beginY, int beginZ,
+		int endX, int endY, int endZ, const Top& op, std::true_type )
+{
+	op_dtype<Top> batch[ Top::BATCH ];
+	for( int k = beginZ; k < endZ; ++k )
+	{
+		for( int j = beginY; j < endY; ++j )
+		{
+			for( int i = beginX; i < endX; i += Top::BATCH )
+			{
+				int n = ( endX - i < Top::BATCH ? endX - i : (int)Top::BATCH );
+				op.row( i, j, k, n, batch );
+				for( int l = 0; l < n; ++l )
+				{
+					func( i + l, j, k ) = batch[ l ];
+				}
+			}
 		}
 	}
 }
 
+template<typename Tfunc, typename Top>
+inline void set( Tfunc& func, const Top& op, DimTag<2> )
+{
+	int sizeX = func.size()[ 0 ];
+	int sizeY = func.size()[ 1 ];
+	setRange( func, 0, 0, sizeX, sizeY, op,
+			std::integral_constant<bool, has_rows<Top>::value>() );
+	detail::written( func, 0, 0, 0, sizeX, sizeY, 1 );
+}
+
+template<typename Tfunc, typename Top>
+inline void set( Tfunc& func, const Top& op, DimTag<3> )
+{
+	int sizeX = func.size()[ 0 ];
+	int sizeY = func.size()[ 1 ];
+	int sizeZ = func.size()[ 2 ];
+	setRange( func, 0, 0, 0, sizeX, sizeY, sizeZ, op,
+			std::integral_constant<bool, has_rows<Top>::value>() );
+	detail::written( func, 0, 0, 0, sizeX, sizeY, sizeZ );
+}
+
+}
+
+/*
+ * Evaluates op over the whole of func, in 2D or 3D by func's DIM. The
+ * begin/end overloads go by the dimension of the coordinates instead.
+ */
+template<typename Tfunc, typename Top>
+inline void set( Tfunc& func, const Top& op )
+{
+	detail::set( func, op, detail::DimTag<detail::FuncDim<Tfunc>::value>() );
+}
+
+template<typename Tfunc, typename Top>
+inline void set( Tfunc& func, int beginX, int beginY,
+		int endX, int endY, const Top& op )
+{
+	detail::setRange( func, beginX, beginY, endX, endY, op,
+			std::integral_constant<bool, detail::has_rows<Top>::value>() );
+	detail::written( func, beginX, beginY, 0, endX, endY, 1 );
+}
+
+template<typename Tfunc, typename Top>
+inline void set( Tfunc& func, int beginX, int beginY, int beginZ,
+		int endX, int endY, int endZ, const Top& op )
+{
+	detail::setRange( func, beginX, beginY, beginZ, endX, endY, endZ, op,
+			std::integral_constant<bool, detail::has_rows<Top>::value>() );
+	detail::written( func, beginX, beginY, beginZ, endX, endY, endZ );
+}
+
+namespace detail
+{
+
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
+inline void set( Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Top& op, DimTag<2> )
+{
+	mm::set( func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], op );
+}
+
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
+inline void set( Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Top& op, DimTag<3> )
+{
+	mm::set( func, begin[ 0 ], begin[ 1 ], begin[ 2 ],
+			end[ 0 ], end[ 1 ], end[ 2 ], op );
+}
+
+}
+
 template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
 inline void set( Tfunc& func, const Tbegin& begin,
 		const Tend& end, const Top& op )
 {
-	set( func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], op );
+	detail::set( func, begin, end, op,
+			detail::DimTag<detail::CoordDim<Tbegin>::value>() );
 }
 
 template<typename Tfunc, typename Top, typename Tbegin, typename Tend, typename Tstep>
@@ -617,84 +1365,938 @@ inline void set( Tfunc& func, const Tbegin& begin,
 			func( i, j ) = op( i, j );
 		}
 	}
+	detail::written( func, beginX, beginY, 0, endX, endY, 1 );
 }
 
-template<typename Top>
-inline op_dtype<Top> max( const Top& op, int beginX, int beginY,
-		int endX, int endY )
+/*
+ * Like set(), but evaluates op through the packet path. A whole packet is
+ * evaluated before any of it is stored, so op must not read func at a
+ * negative x offset; in-place sweeps that rely on that need set().
+ */
+template<int N = 0, typename Tfunc, typename Top>
+inline void setPacket( Tfunc& func, int beginX, int beginY,
+		int endX, int endY, const Top& op )
 {
 	typedef op_dtype<Top> DTYPE;
+	static const int W = ( N > 0 ? N : Packet<DTYPE>::SIZE );
 
-	DTYPE maxVal = op( beginX, beginY );
 	for( int j = beginY; j < endY; ++j )
 	{
-		for( int i = beginX; i < endX; ++i )
+		int i = beginX;
+		for( ; i + W <= endX; i += W )
 		{
-			DTYPE curVal = op( i, j );
-			if( curVal > maxVal )
+			Packet<DTYPE, W> val = mm::packet<W>( op, i, j );
+			for( int k = 0; k < W; ++k )
 			{
-				maxVal = curVal;
+				func( i + k, j ) = val.v[ k ];
 			}
 		}
+		for( ; i < endX; ++i )
+		{
+			func( i, j ) = op( i, j );
+		}
 	}
-	return maxVal;
+	detail::written( func, beginX, beginY, 0, endX, endY, 1 );
 }
 
-template<typename Top, typename Tbegin, typename Tend>
-inline op_dtype<Top> max( const Top& op, const Tbegin& begin,
-		const Tend& end )
+template<int N = 0, typename Tfunc, typename Top>
+inline void setPacket( Tfunc& func, const Top& op )
 {
-	return max( op, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ] );
+	setPacket<N>( func, 0, 0, func.size()[ 0 ], func.size()[ 1 ], op );
 }
 
-template<typename Top>
-inline op_dtype<Top> min( const Top& op, int beginX, int beginY,
-		int endX, int endY )
+template<int N = 0, typename Tfunc, typename Top, typename Tbegin, typename Tend>
+inline void setPacket( Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Top& op )
 {
-	typedef op_dtype<Top> DTYPE;
+	setPacket<N>( func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], op );
+}
 
-	DTYPE minVal = op( beginX, beginY );
-	for( int j = beginY; j < endY; ++j )
+/*
+ * One assignment func = op of a fused() evaluation.
+ */
+template<typename Tfunc, typename Top>
+class Assign
+{
+public:
+	Assign( Tfunc& func, const Top& op )
+		: m_pFunc( &func ), m_Op( op )
 	{
-		for( int i = beginX; i < endX; ++i )
+	}
+
+	void operator()( int x, int y ) const
+	{
+		( *m_pFunc )( x, y ) = m_Op( x, y );
+	}
+
+	void operator()( int x, int y, int z ) const
+	{
+		( *m_pFunc )( x, y, z ) = m_Op( x, y, z );
+	}
+
+	Tfunc& func() const
+	{
+		return *m_pFunc;
+	}
+
+	const op_operand<Top>& op() const
+	{
+		return m_Op;
+	}
+
+private:
+	Tfunc* m_pFunc;
+	const op_operand<Top> m_Op;
+};
+
+template<typename Tfunc, typename Top>
+inline Assign<Tfunc, Top> assign( Tfunc& func, const Top& op )
+{
+	return Assign<Tfunc, Top>( func, op );
+}
+
+namespace detail
+{
+
+template<typename T>
+struct IsAssign : std::false_type
+{
+};
+
+template<typename Tfunc, typename Top>
+struct IsAssign<Assign<Tfunc, Top>> : std::true_type
+{
+};
+
+struct FusedTarget
+{
+	const void* pData;
+	int offset[ 3 ];
+};
+
+/*
+ * Records the point a target writes at, relative to the evaluated point.
+ */
+struct TargetVisitor
+{
+	FusedTarget* pTarget;
+	bool bUnknown;
+
+	void read( const void* pData, int offsetX, int offsetY, int offsetZ )
+	{
+		pTarget->pData = pData;
+		pTarget->offset[ 0 ] = offsetX;
+		pTarget->offset[ 1 ] = offsetY;
+		pTarget->offset[ 2 ] = offsetZ;
+	}
+
+	void unknown()
+	{
+		bUnknown = true;
+	}
+};
+
+/*
+ * Flags reads of another assignment's target away from the point being
+ * evaluated. Within one sweep those see a mix of old and new values, where
+ * separate set() calls would see only one of them.
+ */
+struct HazardVisitor
+{
+	const FusedTarget* pTargets;
+	int numTargets;
+	int self;
+	bool bHazard;
+
+	void read( const void* pData, int offsetX, int offsetY, int offsetZ )
+	{
+		for( int m = 0; m < numTargets; ++m )
 		{
-			DTYPE curVal = op( i, j );
-			if( curVal < minVal )
+			const FusedTarget& target = pTargets[ m ];
+			if( m != self && target.pData == pData
+					&& ( target.offset[ 0 ] != offsetX
+						|| target.offset[ 1 ] != offsetY
+						|| target.offset[ 2 ] != offsetZ ) )
 			{
-				minVal = curVal;
+				bHazard = true;
 			}
 		}
 	}
-	return minVal;
+
+	void unknown()
+	{
+		bHazard = true;
+	}
+};
+
+inline bool findTargets( FusedTarget* )
+{
+	return true;
 }
 
-template<typename Top, typename Tbegin, typename Tend>
-inline op_dtype<Top> min( const Top& op, const Tbegin& begin,
-		const Tend& end )
+template<typename Tassign, typename... Trest>
+inline bool findTargets( FusedTarget* pTargets,
+		const Tassign& assign, const Trest&... rest )
 {
-	return max( op, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ] );
+	TargetVisitor visitor = { pTargets, false };
+	detail::visit( assign.func(), visitor );
+	return ( !visitor.bUnknown && findTargets( pTargets + 1, rest... ) );
 }
 
-template<typename Top>
-inline op_dtype<Top> sum( const Top& op, int beginX, int beginY,
-		int endX, int endY )
+inline bool findHazards( const FusedTarget*, int, int )
 {
-	op_dtype<Top> sum = 0;
-	for( int j = beginY; j < endY; ++j )
-	{
-		for( int i = beginX; i < endX; ++i )
-		{
-			sum += op( i, j );
-		}
-	}
-	return sum;
+	return false;
+}
+
+template<typename Tassign, typename... Trest>
+inline bool findHazards( const FusedTarget* pTargets, int numTargets,
+		int self, const Tassign& assign, const Trest&... rest )
+{
+	HazardVisitor visitor = { pTargets, numTargets, self, false };
+	detail::visit( assign.op(), visitor );
+	return ( visitor.bHazard
+			|| findHazards( pTargets, numTargets, self + 1, rest... ) );
+}
+
+template<typename... Tassign>
+inline bool canFuse( const Tassign&... assigns )
+{
+	FusedTarget pTargets[ sizeof...( Tassign ) ];
+	return ( findTargets( pTargets, assigns... )
+			&& !findHazards( pTargets, (int)sizeof...( Tassign ), 0, assigns... ) );
+}
+
+inline void assignAll( int, int )
+{
+}
+
+template<typename Tassign, typename... Trest>
+inline void assignAll( int x, int y, const Tassign& assign, const Trest&... rest )
+{
+	assign( x, y );
+	assignAll( x, y, rest... );
+}
+
+inline void assignAll( int, int, int )
+{
+}
+
+template<typename Tassign, typename... Trest>
+inline void assignAll( int x, int y, int z,
+		const Tassign& assign, const Trest&... rest )
+{
+	assign( x, y, z );
+	assignAll( x, y, z, rest... );
+}
+
+template<typename Tbegin, typename Tend>
+inline void setEach( const Tbegin&, const Tend& )
+{
+}
+
+template<typename Tbegin, typename Tend, typename Tassign, typename... Trest>
+inline void setEach( const Tbegin& begin, const Tend& end,
+		const Tassign& assign, const Trest&... rest )
+{
+	mm::set( assign.func(), begin, end, assign.op() );
+	setEach( begin, end, rest... );
+}
+
+inline void writtenAll( int, int, int, int, int, int )
+{
+}
+
+template<typename Tassign, typename... Trest>
+inline void writtenAll( int beginX, int beginY, int beginZ,
+		int endX, int endY, int endZ, const Tassign& assign, const Trest&... rest )
+{
+	detail::written( assign.func(), beginX, beginY, beginZ, endX, endY, endZ );
+	writtenAll( beginX, beginY, beginZ, endX, endY, endZ, rest... );
+}
+
+template<typename Tbegin, typename Tend, typename... Tassign>
+inline void fused( const Tbegin& begin, const Tend& end, DimTag<2>,
+		const Tassign&... assigns )
+{
+	int beginX = begin[ 0 ];
+	int beginY = begin[ 1 ];
+	int endX = end[ 0 ];
+	int endY = end[ 1 ];
+	for( int j = beginY; j < endY; ++j )
+	{
+		for( int i = beginX; i < endX; ++i )
+		{
+			assignAll( i, j, assigns... );
+		}
+	}
+	writtenAll( beginX, beginY, 0, endX, endY, 1, assigns... );
+}
+
+template<typename Tbegin, typename Tend, typename... Tassign>
+inline void fused( const Tbegin& begin, const Tend& end, DimTag<3>,
+		const Tassign&... assigns )
+{
+	int beginX = begin[ 0 ];
+	int beginY = begin[ 1 ];
+	int beginZ = begin[ 2 ];
+	int endX = end[ 0 ];
+	int endY = end[ 1 ];
+	int endZ = end[ 2 ];
+	for( int k = beginZ; k < endZ; ++k )
+	{
+		for( int j = beginY; j < endY; ++j )
+		{
+			for( int i = beginX; i < endX; ++i )
+			{
+				assignAll( i, j, k, assigns... );
+			}
+		}
+	}
+	writtenAll( beginX, beginY, beginZ, endX, endY, endZ, assigns... );
+}
+
+}
+
+/*
+ * Evaluates several assignments in one sweep over [ begin, end ):
+ *
+ * fused( assign( a, e1( u, v ) ), assign( b, e2( u, v ) ) );
+ *
+ * writes a and b at each point in turn, so u and v are streamed once. The
+ * result is the same as set() on each assignment in order. That only holds
+ * if no expression reads another assignment's target at a nonzero offset,
+ * and if every operand reports its reads through visit(); otherwise the
+ * assignments are evaluated one after another by set().
+ */
+template<typename Tbegin, typename Tend, typename... Tassign>
+inline typename std::enable_if<!detail::IsAssign<Tbegin>::value>::type
+fused( const Tbegin& begin, const Tend& end, const Tassign&... assigns )
+{
+	if( detail::canFuse( assigns... ) )
+	{
+		detail::fused( begin, end,
+				detail::DimTag<detail::CoordDim<Tbegin>::value>(), assigns... );
+	}
+	else
+	{
+		detail::setEach( begin, end, assigns... );
+	}
+}
+
+/*
+ * Fused evaluation over the whole of the first target.
+ */
+template<typename Tfunc, typename Top, typename... Trest>
+inline void fused( const Assign<Tfunc, Top>& assign, const Trest&... rest )
+{
+	Tfunc& func = assign.func();
+	Tuple<int, detail::FuncDim<Tfunc>::value> begin;
+	fused( begin, func.size(), assign, rest... );
+}
+
+template<typename Top>
+inline op_dtype<Top> max( const Top& op, int beginX, int beginY,
+		int endX, int endY )
+{
+	typedef op_dtype<Top> DTYPE;
+
+	DTYPE maxVal = op( beginX, beginY );
+	for( int j = beginY; j < endY; ++j )
+	{
+		for( int i = beginX; i < endX; ++i )
+		{
+			DTYPE curVal = op( i, j );
+			if( curVal > maxVal )
+			{
+				maxVal = curVal;
+			}
+		}
+	}
+	return maxVal;
+}
+
+template<typename Top>
+inline op_dtype<Top> max( const Top& op, int beginX, int beginY, int beginZ,
+		int endX, int endY, int endZ )
+{
+	typedef op_dtype<Top> DTYPE;
+
+	DTYPE maxVal = op( beginX, beginY, beginZ );
+	for( int k = beginZ; k < endZ; ++k )
+	{
+		for( int j = beginY; j < endY; ++j )
+		{
+			for( int i = beginX; i < endX; ++i )
+			{
+				DTYPE curVal = op( i, j, k );
+				if( curVal > maxVal )
+				{
+					maxVal = curVal;
+				}
+			}
+		}
+	}
+	return maxVal;
+}
+
+template<typename Top>
+inline op_dtype<Top> min( const Top& op, int beginX, int beginY,
+		int endX, int endY )
+{
+	typedef op_dtype<Top> DTYPE;
+
+	DTYPE minVal = op( beginX, beginY );
+	for( int j = beginY; j < endY; ++j )
+	{
+		for( int i = beginX; i < endX; ++i )
+		{
+			DTYPE curVal = op( i, j );
+			if( curVal < minVal )
+			{
+				minVal = curVal;
+			}
+		}
+	}
+	return minVal;
+}
+
+template<typename Top>
+inline op_dtype<Top> min( const Top& op, int beginX, int beginY, int beginZ,
+		int endX, int endY, int endZ )
+{
+	typedef op_dtype<Top> DTYPE;
+
+	DTYPE minVal = op( beginX, beginY, beginZ );
+	for( int k = beginZ; k < endZ; ++k )
+	{
+		for( int j = beginY; j < endY; ++j )
+		{
+			for( int i = beginX; i < endX; ++i )
+			{
+				DTYPE curVal = op( i, j, k );
+				if( curVal < minVal )
+				{
+					minVal = curVal;
+				}
+			}
+		}
+	}
+	return minVal;
+}
+
+/*
+ * Accumulates in op_accum<Top>, or in Tacc when given, i.e.
+ * sum<double>( op, ... ) for a float expression.
+ */
+template<typename Tacc = void, typename Top>
+inline sum_dtype<Tacc, Top> sum( const Top& op, int beginX, int beginY,
+		int endX, int endY )
+{
+	sum_dtype<Tacc, Top> sum = 0;
+	for( int j = beginY; j < endY; ++j )
+	{
+		for( int i = beginX; i < endX; ++i )
+		{
+			sum += op( i, j );
+		}
+	}
+	return sum;
+}
+
+template<typename Tacc = void, typename Top>
+inline sum_dtype<Tacc, Top> sum( const Top& op, int beginX, int beginY,
+		int beginZ, int endX, int endY, int endZ )
+{
+	sum_dtype<Tacc, Top> sum = 0;
+	for( int k = beginZ; k < endZ; ++k )
+	{
+		for( int j = beginY; j < endY; ++j )
+		{
+			for( int i = beginX; i < endX; ++i )
+			{
+				sum += op( i, j, k );
+			}
+		}
+	}
+	return sum;
+}
+
+namespace detail
+{
+
+template<typename Top, typename Tbegin, typename Tend>
+inline op_dtype<Top> max( const Top& op, const Tbegin& begin,
+		const Tend& end, DimTag<2> )
+{
+	return mm::max( op, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ] );
+}
+
+template<typename Top, typename Tbegin, typename Tend>
+inline op_dtype<Top> max( const Top& op, const Tbegin& begin,
+		const Tend& end, DimTag<3> )
+{
+	return mm::max( op, begin[ 0 ], begin[ 1 ], begin[ 2 ],
+			end[ 0 ], end[ 1 ], end[ 2 ] );
 }
 
 template<typename Top, typename Tbegin, typename Tend>
-inline op_dtype<Top> sum( const Top& op, const Tbegin& begin,
+inline op_dtype<Top> min( const Top& op, const Tbegin& begin,
+		const Tend& end, DimTag<2> )
+{
+	return mm::min( op, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ] );
+}
+
+template<typename Top, typename Tbegin, typename Tend>
+inline op_dtype<Top> min( const Top& op, const Tbegin& begin,
+		const Tend& end, DimTag<3> )
+{
+	return mm::min( op, begin[ 0 ], begin[ 1 ], begin[ 2 ],
+			end[ 0 ], end[ 1 ], end[ 2 ] );
+}
+
+template<typename Tacc, typename Top, typename Tbegin, typename Tend>
+inline sum_dtype<Tacc, Top> sum( const Top& op, const Tbegin& begin,
+		const Tend& end, DimTag<2> )
+{
+	return mm::sum<Tacc>( op, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ] );
+}
+
+template<typename Tacc, typename Top, typename Tbegin, typename Tend>
+inline sum_dtype<Tacc, Top> sum( const Top& op, const Tbegin& begin,
+		const Tend& end, DimTag<3> )
+{
+	return mm::sum<Tacc>( op, begin[ 0 ], begin[ 1 ], begin[ 2 ],
+			end[ 0 ], end[ 1 ], end[ 2 ] );
+}
+
+}
+
+template<typename Top, typename Tbegin, typename Tend>
+inline op_dtype<Top> max( const Top& op, const Tbegin& begin,
 		const Tend& end )
 {
-	return sum( op, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ] );
+	return detail::max( op, begin, end,
+			detail::DimTag<detail::CoordDim<Tbegin>::value>() );
+}
+
+template<typename Top, typename Tbegin, typename Tend>
+inline op_dtype<Top> min( const Top& op, const Tbegin& begin,
+		const Tend& end )
+{
+	return detail::min( op, begin, end,
+			detail::DimTag<detail::CoordDim<Tbegin>::value>() );
+}
+
+template<typename Tacc = void, typename Top, typename Tbegin, typename Tend>
+inline sum_dtype<Tacc, Top> sum( const Top& op, const Tbegin& begin,
+		const Tend& end )
+{
+	return detail::sum<Tacc>( op, begin, end,
+			detail::DimTag<detail::CoordDim<Tbegin>::value>() );
+}
+
+/*
+ * Reducers for setReduce(). Each is called with every value written, the
+ * value it replaced and the point, and result() gives the reduction. The
+ * change reducers compare with the replaced value, or with ref when one is
+ * given, as for unew = update( u ) where u holds the previous iterate.
+ *
+ * Reducers keep LANES partial results, and setReduce() hands consecutive
+ * points of a row to consecutive lanes. Lanes do not depend on each other,
+ * so the sweep vectorizes without reassociating, as a single running max
+ * or sum in floating point would require.
+ */
+namespace reduce
+{
+
+namespace detail
+{
+
+template<typename Tref>
+class From
+{
+public:
+	typedef Tref REF;
+
+	From( const Tref& ref )
+		: m_Ref( ref )
+	{
+	}
+
+	template<typename U>
+	U from( U, int x, int y ) const
+	{
+		return m_Ref( x, y );
+	}
+
+	template<typename U>
+	U from( U, int x, int y, int z ) const
+	{
+		return m_Ref( x, y, z );
+	}
+
+private:
+	const op_operand<Tref> m_Ref;
+};
+
+template<>
+class From<void>
+{
+public:
+	struct REF
+	{
+	};
+
+	template<typename U>
+	U from( U old, int, int ) const
+	{
+		return old;
+	}
+
+	template<typename U>
+	U from( U old, int, int, int ) const
+	{
+		return old;
+	}
+};
+
+static const int LANES = 8;
+
+template<typename T>
+inline void zero( T* pValues )
+{
+	for( int k = 0; k < LANES; ++k )
+	{
+		pValues[ k ] = 0;
+	}
+}
+
+/*
+ * The max drops NaN, the sum of the same magnitudes keeps it: it can grow
+ * to infinity but not become NaN otherwise, so result() checks it.
+ */
+template<typename T>
+inline void maxAbs( T& value, T& total, T arg )
+{
+	T cur = value;
+	arg = ( arg < 0 ? -arg : arg );
+	value = ( arg > cur ? arg : cur );
+	total += arg;
+}
+
+template<typename T>
+inline T max( const T* pValues )
+{
+	T res = pValues[ 0 ];
+	for( int k = 1; k < LANES; ++k )
+	{
+		res = ( pValues[ k ] > res ? pValues[ k ] : res );
+	}
+	return res;
+}
+
+template<typename T>
+inline T sum( const T* pValues )
+{
+	T res = 0;
+	for( int k = 0; k < LANES; ++k )
+	{
+		res += pValues[ k ];
+	}
+	return res;
+}
+
+template<typename T>
+inline T maxAbs( const T* pValues, const T* pTotals )
+{
+	T total = sum( pTotals );
+	return ( total != total ? total : max( pValues ) );
+}
+
+}
+
+/*
+ * Each reducer keeps its partial results as a member of its own. GCC does
+ * not vectorize the sweep when they are kept in a common base class.
+ */
+template<typename T = double>
+class Sum
+{
+public:
+	typedef T RESULT;
+	static const int LANES = detail::LANES;
+
+	Sum()
+	{
+		detail::zero( m_Value );
+	}
+
+	template<typename U>
+	void operator()( int lane, U now, U, int, int )
+	{
+		m_Value[ lane ] += now;
+	}
+
+	template<typename U>
+	void operator()( int lane, U now, U, int, int, int )
+	{
+		m_Value[ lane ] += now;
+	}
+
+	T result() const
+	{
+		return detail::sum( m_Value );
+	}
+
+private:
+	T m_Value[ LANES ];
+};
+
+template<typename T = double>
+class MaxAbs
+{
+public:
+	typedef T RESULT;
+	static const int LANES = detail::LANES;
+
+	MaxAbs()
+	{
+		detail::zero( m_Value );
+		detail::zero( m_Total );
+	}
+
+	template<typename U>
+	void operator()( int lane, U now, U, int, int )
+	{
+		detail::maxAbs<T>( m_Value[ lane ], m_Total[ lane ], now );
+	}
+
+	template<typename U>
+	void operator()( int lane, U now, U, int, int, int )
+	{
+		detail::maxAbs<T>( m_Value[ lane ], m_Total[ lane ], now );
+	}
+
+	T result() const
+	{
+		return detail::maxAbs( m_Value, m_Total );
+	}
+
+private:
+	T m_Value[ LANES ];
+	T m_Total[ LANES ];
+};
+
+/* max | now - old |, the usual convergence test. */
+template<typename T = double, typename Tref = void>
+class MaxAbsChange
+{
+public:
+	typedef T RESULT;
+	static const int LANES = detail::LANES;
+
+	MaxAbsChange()
+	{
+		detail::zero( m_Value );
+		detail::zero( m_Total );
+	}
+
+	MaxAbsChange( const typename detail::From<Tref>::REF& ref )
+		: m_From( ref )
+	{
+		detail::zero( m_Value );
+		detail::zero( m_Total );
+	}
+
+	template<typename U>
+	void operator()( int lane, U now, U old, int x, int y )
+	{
+		detail::maxAbs<T>( m_Value[ lane ], m_Total[ lane ],
+				now - m_From.from( old, x, y ) );
+	}
+
+	template<typename U>
+	void operator()( int lane, U now, U old, int x, int y, int z )
+	{
+		detail::maxAbs<T>( m_Value[ lane ], m_Total[ lane ],
+				now - m_From.from( old, x, y, z ) );
+	}
+
+	T result() const
+	{
+		return detail::maxAbs( m_Value, m_Total );
+	}
+
+private:
+	T m_Value[ LANES ];
+	T m_Total[ LANES ];
+	detail::From<Tref> m_From;
+};
+
+/* Sum of ( now - old )^2, for an L2 residual. */
+template<typename T = double, typename Tref = void>
+class SumSqChange
+{
+public:
+	typedef T RESULT;
+	static const int LANES = detail::LANES;
+
+	SumSqChange()
+	{
+		detail::zero( m_Value );
+	}
+
+	SumSqChange( const typename detail::From<Tref>::REF& ref )
+		: m_From( ref )
+	{
+		detail::zero( m_Value );
+	}
+
+	template<typename U>
+	void operator()( int lane, U now, U old, int x, int y )
+	{
+		T change = now - m_From.from( old, x, y );
+		m_Value[ lane ] += change * change;
+	}
+
+	template<typename U>
+	void operator()( int lane, U now, U old, int x, int y, int z )
+	{
+		T change = now - m_From.from( old, x, y, z );
+		m_Value[ lane ] += change * change;
+	}
+
+	T result() const
+	{
+		return detail::sum( m_Value );
+	}
+
+private:
+	T m_Value[ LANES ];
+	detail::From<Tref> m_From;
+};
+
+template<typename T = double, typename Tref>
+inline MaxAbsChange<T, Tref> maxAbsChange( const Tref& ref )
+{
+	return MaxAbsChange<T, Tref>( ref );
+}
+
+template<typename T = double, typename Tref>
+inline SumSqChange<T, Tref> sumSqChange( const Tref& ref )
+{
+	return SumSqChange<T, Tref>( ref );
+}
+
+}
+
+/*
+ * set() that also reduces over what it writes in the same sweep, so a
+ * convergence check costs no second pass over func:
+ *
+ * double change = setReduce( unew, update( u ), reduce::maxAbsChange( u ) );
+ *
+ * Works on a copy of reducer and returns its result().
+ */
+template<typename Tfunc, typename Top, typename Treducer>
+inline typename Treducer::RESULT setReduce( Tfunc& func, int beginX, int beginY,
+		int endX, int endY, const Top& op, const Treducer& reducer )
+{
+	typedef op_dtype<Top> DTYPE;
+	static const int L = Treducer::LANES;
+
+	Treducer acc( reducer );
+	for( int j = beginY; j < endY; ++j )
+	{
+		int i = beginX;
+		for( ; i + L <= endX; i += L )
+		{
+			for( int k = 0; k < L; ++k )
+			{
+				DTYPE now = op( i + k, j );
+				acc( k, now, (DTYPE)func( i + k, j ), i + k, j );
+				func( i + k, j ) = now;
+			}
+		}
+		for( ; i < endX; ++i )
+		{
+			DTYPE now = op( i, j );
+			acc( 0, now, (DTYPE)func( i, j ), i, j );
+			func( i, j ) = now;
+		}
+	}
+	detail::written( func, beginX, beginY, 0, endX, endY, 1 );
+	return acc.result();
+}
+
+template<typename Tfunc, typename Top, typename Treducer>
+inline typename Treducer::RESULT setReduce( Tfunc& func, int beginX, int beginY,
+		int beginZ, int endX, int endY, int endZ, const Top& op, const Treducer& reducer )
+{
+	typedef op_dtype<Top> DTYPE;
+	static const int L = Treducer::LANES;
+
+	Treducer acc( reducer );
+	for( int k = beginZ; k < endZ; ++k )
+	{
+		for( int j = beginY; j < endY; ++j )
+		{
+			int i = beginX;
+			for( ; i + L <= endX; i += L )
+			{
+				for( int l = 0; l < L; ++l )
+				{
+					DTYPE now = op( i + l, j, k );
+					acc( l, now, (DTYPE)func( i + l, j, k ), i + l, j, k );
+					func( i + l, j, k ) = now;
+				}
+			}
+			for( ; i < endX; ++i )
+			{
+				DTYPE now = op( i, j, k );
+				acc( 0, now, (DTYPE)func( i, j, k ), i, j, k );
+				func( i, j, k ) = now;
+			}
+		}
+	}
+	detail::written( func, beginX, beginY, beginZ, endX, endY, endZ );
+	return acc.result();
+}
+
+namespace detail
+{
+
+template<typename Tfunc, typename Top, typename Treducer, typename Tbegin, typename Tend>
+inline typename Treducer::RESULT setReduce( Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Top& op, const Treducer& reducer, DimTag<2> )
+{
+	return mm::setReduce( func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], op, reducer );
+}
+
+template<typename Tfunc, typename Top, typename Treducer, typename Tbegin, typename Tend>
+inline typename Treducer::RESULT setReduce( Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Top& op, const Treducer& reducer, DimTag<3> )
+{
+	return mm::setReduce( func, begin[ 0 ], begin[ 1 ], begin[ 2 ],
+			end[ 0 ], end[ 1 ], end[ 2 ], op, reducer );
+}
+
+}
+
+template<typename Tfunc, typename Top, typename Treducer, typename Tbegin, typename Tend>
+inline typename Treducer::RESULT setReduce( Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Top& op, const Treducer& reducer )
+{
+	return detail::setReduce( func, begin, end, op, reducer,
+			detail::DimTag<detail::CoordDim<Tbegin>::value>() );
+}
+
+template<typename Tfunc, typename Top, typename Treducer>
+inline typename Treducer::RESULT setReduce( Tfunc& func, const Top& op,
+		const Treducer& reducer )
+{
+	Tuple<int, detail::FuncDim<Tfunc>::value> begin;
+	return setReduce( func, begin, func.size(), op, reducer );
 }
 
 }
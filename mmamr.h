@@ -0,0 +1,790 @@
+#ifndef _MMAMR_H_
+#define _MMAMR_H_
+
+#include "metamath.h"
+#include "mmfunction.h"
+#include "mmparallel.h"
+#include "mmprecision.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace mm
+{
+
+namespace amr
+{
+
+/*
+ * Leaf patch of a Field: B x B cells with G ghost layers around them,
+ * addressed in patch coordinates, ( 0, 0 ) being the first interior cell
+ * and the ghosts at -G ... -1 and B ... B + G - 1. It only points into
+ * the field's storage and is cheap to copy, so expressions take it by
+ * value like any other leaf.
+ */
+template<typename T, int B, int G>
+class Patch
+{
+public:
+	typedef precision_type<T> PRECISION;
+	typedef typename PRECISION::COMPUTE DTYPE;
+	typedef typename PRECISION::STORAGE STYPE;
+	typedef typename PRECISION::ACCUM ACCUM;
+	static const unsigned int DIM = 2;
+	static const int PITCH = B + 2 * G;
+	static const int CELLS = PITCH * PITCH;
+
+private:
+	typedef mm::detail::PrecisionAccess<PRECISION> ACCESS;
+
+public:
+	typedef typename ACCESS::REFERENCE REFERENCE;
+	typedef typename ACCESS::CONST_REFERENCE CONST_REFERENCE;
+
+public:
+	Patch( STYPE* pData )
+		: m_pData( pData )
+	{
+	}
+
+	REFERENCE operator()( int x, int y ) const
+	{
+		return ACCESS::ref( m_pData[ index( x, y ) ] );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		Packet<DTYPE, N> res;
+		const STYPE* pRow = &m_pData[ index( x, y ) ];
+		for( int k = 0; k < N; ++k )
+		{
+			res.v[ k ] = PRECISION::load( pRow[ k ] );
+		}
+		return res;
+	}
+
+	Tuple<int> size() const
+	{
+		return Tuple<int>( B, B );
+	}
+
+	STYPE* data() const
+	{
+		return m_pData;
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		visitor.read( m_pData, offsetX, offsetY, offsetZ );
+	}
+
+	template<typename Top>
+	Patch<T, B, G>& operator=( const Top& op )
+	{
+		set( *this, op );
+		return *this;
+	}
+
+	static int index( int x, int y )
+	{
+		return ( y + G ) * PITCH + x + G;
+	}
+
+private:
+	STYPE* m_pData;
+};
+
+/*
+ * Place of a block in the tree: level 0 are the root blocks, each level
+ * halves the cell size, x and y count blocks of B cells at that level.
+ */
+struct Block
+{
+	int level;
+	int x;
+	int y;
+};
+
+namespace detail
+{
+
+/*
+ * Pool of equally sized blocks, allocated a chunk at a time and recycled
+ * through a free list, so that refining and coarsening do not go to the
+ * heap per patch.
+ */
+template<typename T>
+class Arena
+{
+public:
+	static const int CHUNK = 64;
+
+	Arena( int blockSize )
+		: m_BlockSize( blockSize )
+	{
+	}
+
+	~Arena()
+	{
+		for( size_t c = 0; c < m_Chunks.size(); ++c )
+		{
+			delete[] m_Chunks[ c ];
+		}
+	}
+
+	T* allocate()
+	{
+		if( m_Free.empty() )
+		{
+			T* pChunk = new T[ (size_t)m_BlockSize * CHUNK ]();
+			m_Chunks.push_back( pChunk );
+			for( int b = CHUNK - 1; b >= 0; --b )
+			{
+				m_Free.push_back( pChunk + (size_t)b * m_BlockSize );
+			}
+		}
+		T* pBlock = m_Free.back();
+		m_Free.pop_back();
+		return pBlock;
+	}
+
+	void release( T* pBlock )
+	{
+		m_Free.push_back( pBlock );
+	}
+
+private:
+	Arena( const Arena<T>& );
+	Arena<T>& operator=( const Arena<T>& );
+
+private:
+	int m_BlockSize;
+	std::vector<T*> m_Chunks;
+	std::vector<T*> m_Free;
+};
+
+struct Node
+{
+	Block block;
+	int parent;
+	int children[ 4 ];
+	bool bLeaf;
+};
+
+/*
+ * What a Mesh needs from the fields on it to keep them in step with the
+ * tree.
+ */
+class FieldBase
+{
+public:
+	virtual ~FieldBase()
+	{
+	}
+
+	virtual void refined( int node, const int* children ) = 0;
+	virtual void coarsened( int node, const int* children ) = 0;
+};
+
+}
+
+/*
+ * Block-structured quadtree: rootsX x rootsY root blocks that refine into
+ * four blocks of half the cell size each, down to maxLevel. Only the
+ * leaves carry data, a B x B patch per Field defined on the mesh. Leaves
+ * that touch, also across corners, differ by at most one level. Leaf
+ * indices run over [ 0, leaves() ) and change whenever the tree does.
+ */
+template<int B, int G = 1>
+class Mesh
+{
+public:
+	static const int SIZE = B;
+	static const int GHOSTS = G;
+
+	Mesh( int rootsX, int rootsY, int maxLevel )
+		: m_RootsX( rootsX ), m_RootsY( rootsY ), m_MaxLevel( maxLevel )
+	{
+		static_assert( G <= B / 2, "ghost layers must lie in the adjacent blocks" );
+		for( int y = 0; y < rootsY; ++y )
+		{
+			for( int x = 0; x < rootsX; ++x )
+			{
+				Block block = { 0, x, y };
+				newNode( block, -1 );
+			}
+		}
+		updateLeaves();
+	}
+
+	int leaves() const
+	{
+		return (int)m_Leaves.size();
+	}
+
+	const Block& block( int leaf ) const
+	{
+		return m_Nodes[ m_Leaves[ leaf ] ].block;
+	}
+
+	int maxLevel() const
+	{
+		return m_MaxLevel;
+	}
+
+	/*
+	 * Blocks across the domain at level.
+	 */
+	Tuple<int> blocks( int level ) const
+	{
+		return Tuple<int>( m_RootsX << level, m_RootsY << level );
+	}
+
+	/*
+	 * Splits leaf into four, first refining the neighbours that would
+	 * otherwise be two levels coarser. Returns false at maxLevel.
+	 */
+	bool refine( int leaf )
+	{
+		bool bDone = refineNode( m_Leaves[ leaf ] );
+		updateLeaves();
+		return bDone;
+	}
+
+	/*
+	 * Merges leaf and its three siblings into their parent, unless one of
+	 * them is refined or a neighbour would end up two levels finer.
+	 */
+	bool coarsen( int leaf )
+	{
+		bool bDone = coarsenNode( m_Nodes[ m_Leaves[ leaf ] ].parent );
+		updateLeaves();
+		return bDone;
+	}
+
+	/*
+	 * Refines the leaves where criterion exceeds refineAbove and coarsens
+	 * sibling quadruples where it stays below coarsenBelow everywhere.
+	 * criterion( leaf ) returns the expression to test over the leaf's
+	 * patch, built from Field::patch() like for amr::set(); fill the
+	 * ghosts first if it reads them. Returns whether the tree changed.
+	 */
+	template<typename Tcriterion, typename T>
+	bool adapt( const Tcriterion& criterion, T refineAbove, T coarsenBelow )
+	{
+		std::vector<char> marks( m_Leaves.size() );
+		for( size_t l = 0; l < m_Leaves.size(); ++l )
+		{
+			T value = (T)mm::max( criterion( (int)l ), 0, 0, B, B );
+			marks[ l ] = ( value > refineAbove ? 1 : ( value < coarsenBelow ? -1 : 0 ) );
+		}
+		return apply( marks );
+	}
+
+	template<typename Tcriterion, typename T>
+	bool adapt( parallel::ThreadPool& pool, const Tcriterion& criterion,
+			T refineAbove, T coarsenBelow )
+	{
+		std::vector<char> marks( m_Leaves.size() );
+		pool.parallelFor( 0, (int)m_Leaves.size(),
+				[&]( int first, int last )
+				{
+					for( int l = first; l < last; ++l )
+					{
+						T value = (T)mm::max( criterion( l ), 0, 0, B, B );
+						marks[ l ] = ( value > refineAbove ? 1
+								: ( value < coarsenBelow ? -1 : 0 ) );
+					}
+				} );
+		return apply( marks );
+	}
+
+	/*
+	 * Node of the block, -1 if it is not in the tree.
+	 */
+	int find( int level, int x, int y ) const
+	{
+		std::unordered_map<std::uint64_t, int>::const_iterator it =
+				m_Index.find( key( level, x, y ) );
+		return ( it != m_Index.end() ? it->second : -1 );
+	}
+
+	const detail::Node& node( int id ) const
+	{
+		return m_Nodes[ id ];
+	}
+
+	int leafNode( int leaf ) const
+	{
+		return m_Leaves[ leaf ];
+	}
+
+	int nodes() const
+	{
+		return (int)m_Nodes.size();
+	}
+
+	void attach( detail::FieldBase* pField )
+	{
+		m_Fields.push_back( pField );
+	}
+
+	void detach( detail::FieldBase* pField )
+	{
+		for( size_t f = 0; f < m_Fields.size(); ++f )
+		{
+			if( m_Fields[ f ] == pField )
+			{
+				m_Fields[ f ] = m_Fields.back();
+				m_Fields.pop_back();
+				return;
+			}
+		}
+	}
+
+private:
+	Mesh( const Mesh<B, G>& );
+	Mesh<B, G>& operator=( const Mesh<B, G>& );
+
+	static std::uint64_t key( int level, int x, int y )
+	{
+		return ( ( std::uint64_t )level << 56 ) | ( ( std::uint64_t )(unsigned)x << 28 )
+				| (std::uint64_t)(unsigned)y;
+	}
+
+	int newNode( const Block& block, int parent )
+	{
+		detail::Node node = { block, parent, { -1, -1, -1, -1 }, true };
+		int id;
+		if( !m_FreeNodes.empty() )
+		{
+			id = m_FreeNodes.back();
+			m_FreeNodes.pop_back();
+			m_Nodes[ id ] = node;
+		}
+		else
+		{
+			id = (int)m_Nodes.size();
+			m_Nodes.push_back( node );
+		}
+		m_Index[ key( block.level, block.x, block.y ) ] = id;
+		return id;
+	}
+
+	void deleteNode( int id )
+	{
+		const Block& block = m_Nodes[ id ].block;
+		m_Index.erase( key( block.level, block.x, block.y ) );
+		m_Nodes[ id ].bLeaf = false;
+		m_FreeNodes.push_back( id );
+	}
+
+	bool inside( int level, int x, int y ) const
+	{
+		return ( x >= 0 && y >= 0 && x < ( m_RootsX << level ) && y < ( m_RootsY << level ) );
+	}
+
+	bool refineNode( int id )
+	{
+		Block block = m_Nodes[ id ].block;
+		if( !m_Nodes[ id ].bLeaf )
+		{
+			return true;
+		}
+		if( block.level >= m_MaxLevel )
+		{
+			return false;
+		}
+		// neighbours must be at least as fine as this block first
+		for( int dy = -1; dy <= 1; ++dy )
+		{
+			for( int dx = -1; dx <= 1; ++dx )
+			{
+				int x = block.x + dx;
+				int y = block.y + dy;
+				if( ( dx == 0 && dy == 0 ) || !inside( block.level, x, y )
+						|| find( block.level, x, y ) >= 0 )
+				{
+					continue;
+				}
+				refineNode( find( block.level - 1, x >> 1, y >> 1 ) );
+			}
+		}
+
+		int children[ 4 ];
+		for( int c = 0; c < 4; ++c )
+		{
+			Block child = { block.level + 1, 2 * block.x + ( c & 1 ), 2 * block.y + ( c >> 1 ) };
+			children[ c ] = newNode( child, id );
+		}
+		for( int c = 0; c < 4; ++c )
+		{
+			m_Nodes[ id ].children[ c ] = children[ c ];
+		}
+		m_Nodes[ id ].bLeaf = false;
+		for( size_t f = 0; f < m_Fields.size(); ++f )
+		{
+			m_Fields[ f ]->refined( id, children );
+		}
+		return true;
+	}
+
+	bool coarsenNode( int id )
+	{
+		if( id < 0 )
+		{
+			return false;
+		}
+		const detail::Node& parent = m_Nodes[ id ];
+		for( int c = 0; c < 4; ++c )
+		{
+			if( !m_Nodes[ parent.children[ c ] ].bLeaf )
+			{
+				return false;
+			}
+		}
+		// a neighbour refined below the children would become two levels finer
+		Block block = parent.block;
+		for( int dy = -1; dy <= 1; ++dy )
+		{
+			for( int dx = -1; dx <= 1; ++dx )
+			{
+				int neighbour = find( block.level, block.x + dx, block.y + dy );
+				if( ( dx == 0 && dy == 0 ) || neighbour < 0 || m_Nodes[ neighbour ].bLeaf )
+				{
+					continue;
+				}
+				for( int c = 0; c < 4; ++c )
+				{
+					if( !m_Nodes[ m_Nodes[ neighbour ].children[ c ] ].bLeaf )
+					{
+						return false;
+					}
+				}
+			}
+		}
+
+		int children[ 4 ];
+		for( int c = 0; c < 4; ++c )
+		{
+			children[ c ] = parent.children[ c ];
+		}
+		for( size_t f = 0; f < m_Fields.size(); ++f )
+		{
+			m_Fields[ f ]->coarsened( id, children );
+		}
+		for( int c = 0; c < 4; ++c )
+		{
+			deleteNode( children[ c ] );
+			m_Nodes[ id ].children[ c ] = -1;
+		}
+		m_Nodes[ id ].bLeaf = true;
+		return true;
+	}
+
+	bool apply( const std::vector<char>& marks )
+	{
+		std::vector<int> leaves( m_Leaves );
+		bool bChanged = false;
+		for( size_t l = 0; l < leaves.size(); ++l )
+		{
+			if( marks[ l ] > 0 && m_Nodes[ leaves[ l ] ].bLeaf )
+			{
+				bChanged |= refineNode( leaves[ l ] );
+			}
+		}
+		// coarsen a quadruple only if all four asked for it and are still leaves
+		std::vector<char> coarsen( m_Nodes.size() );
+		for( size_t l = 0; l < leaves.size(); ++l )
+		{
+			coarsen[ leaves[ l ] ] = ( marks[ l ] < 0 && m_Nodes[ leaves[ l ] ].bLeaf );
+		}
+		std::vector<int> coarse;
+		for( size_t l = 0; l < leaves.size(); ++l )
+		{
+			const detail::Node& node = m_Nodes[ leaves[ l ] ];
+			if( !coarsen[ leaves[ l ] ] || node.parent < 0
+					|| m_Nodes[ node.parent ].children[ 0 ] != leaves[ l ] )
+			{
+				continue;
+			}
+			const int* children = m_Nodes[ node.parent ].children;
+			if( coarsen[ children[ 1 ] ] && coarsen[ children[ 2 ] ] && coarsen[ children[ 3 ] ] )
+			{
+				coarse.push_back( node.parent );
+			}
+		}
+		for( size_t c = 0; c < coarse.size(); ++c )
+		{
+			bChanged |= coarsenNode( coarse[ c ] );
+		}
+		updateLeaves();
+		return bChanged;
+	}
+
+	void updateLeaves()
+	{
+		m_Leaves.clear();
+		for( int id = 0; id < (int)m_Nodes.size(); ++id )
+		{
+			if( m_Nodes[ id ].bLeaf )
+			{
+				m_Leaves.push_back( id );
+			}
+		}
+	}
+
+private:
+	int m_RootsX;
+	int m_RootsY;
+	int m_MaxLevel;
+	std::vector<detail::Node> m_Nodes;
+	std::vector<int> m_FreeNodes;
+	std::vector<int> m_Leaves;
+	std::unordered_map<std::uint64_t, int> m_Index;
+	std::vector<detail::FieldBase*> m_Fields;
+};
+
+/*
+ * Scalar field on a Mesh, one pooled patch per leaf. Refining injects the
+ * parent's values into the children, coarsening averages the children.
+ * fillGhosts() copies the ghosts from the neighbours, injecting from
+ * coarser and averaging finer ones, and extends the field constantly
+ * across the domain boundary.
+ */
+template<typename T, int B, int G = 1>
+class Field : public detail::FieldBase
+{
+public:
+	typedef Patch<T, B, G> PATCH;
+	typedef typename PATCH::DTYPE DTYPE;
+	typedef typename PATCH::STYPE STYPE;
+	typedef typename PATCH::PRECISION PRECISION;
+
+	Field( Mesh<B, G>& mesh )
+		: m_pMesh( &mesh ), m_Arena( PATCH::CELLS )
+	{
+		m_Slots.resize( mesh.nodes(), nullptr );
+		for( int l = 0; l < mesh.leaves(); ++l )
+		{
+			m_Slots[ mesh.leafNode( l ) ] = m_Arena.allocate();
+		}
+		mesh.attach( this );
+	}
+
+	~Field()
+	{
+		m_pMesh->detach( this );
+	}
+
+	PATCH patch( int leaf ) const
+	{
+		return PATCH( m_Slots[ m_pMesh->leafNode( leaf ) ] );
+	}
+
+	Mesh<B, G>& mesh() const
+	{
+		return *m_pMesh;
+	}
+
+	void fillGhosts( int leaf )
+	{
+		int id = m_pMesh->leafNode( leaf );
+		const Block& block = m_pMesh->node( id ).block;
+		STYPE* pData = m_Slots[ id ];
+		static const int LO[ 3 ] = { -G, 0, B };
+		static const int HI[ 3 ] = { 0, B, B + G };
+		for( int dy = -1; dy <= 1; ++dy )
+		{
+			for( int dx = -1; dx <= 1; ++dx )
+			{
+				if( dx == 0 && dy == 0 )
+				{
+					continue;
+				}
+				int x = block.x + dx;
+				int y = block.y + dy;
+				Tuple<int> blocks = m_pMesh->blocks( block.level );
+				bool bInside = ( x >= 0 && y >= 0 && x < blocks[ 0 ] && y < blocks[ 1 ] );
+				int level = block.level;
+				int neighbour = ( bInside ? m_pMesh->find( level, x, y ) : -1 );
+				while( bInside && neighbour < 0 )
+				{
+					--level;
+					neighbour = m_pMesh->find( level, x >> ( block.level - level ),
+							y >> ( block.level - level ) );
+				}
+				int shift = block.level - level;
+				for( int j = LO[ dy + 1 ]; j < HI[ dy + 1 ]; ++j )
+				{
+					for( int i = LO[ dx + 1 ]; i < HI[ dx + 1 ]; ++i )
+					{
+						if( !bInside )
+						{
+							int ci = std::min( std::max( i, 0 ), B - 1 );
+							int cj = std::min( std::max( j, 0 ), B - 1 );
+							pData[ PATCH::index( i, j ) ] = pData[ PATCH::index( ci, cj ) ];
+							continue;
+						}
+						int gx = block.x * B + i;
+						int gy = block.y * B + j;
+						pData[ PATCH::index( i, j ) ] = PRECISION::store(
+								cell( neighbour, gx >> shift, gy >> shift ) );
+					}
+				}
+			}
+		}
+	}
+
+	void fillGhosts()
+	{
+		for( int l = 0; l < m_pMesh->leaves(); ++l )
+		{
+			fillGhosts( l );
+		}
+	}
+
+	void fillGhosts( parallel::ThreadPool& pool )
+	{
+		pool.parallelFor( 0, m_pMesh->leaves(),
+				[&]( int first, int last )
+				{
+					for( int l = first; l < last; ++l )
+					{
+						fillGhosts( l );
+					}
+				} );
+	}
+
+	virtual void refined( int node, const int* children )
+	{
+		if( (int)m_Slots.size() < m_pMesh->nodes() )
+		{
+			m_Slots.resize( m_pMesh->nodes(), nullptr );
+		}
+		const STYPE* pParent = m_Slots[ node ];
+		for( int c = 0; c < 4; ++c )
+		{
+			STYPE* pChild = m_Arena.allocate();
+			int offsetX = ( c & 1 ) * B / 2;
+			int offsetY = ( c >> 1 ) * B / 2;
+			for( int j = 0; j < B; ++j )
+			{
+				for( int i = 0; i < B; ++i )
+				{
+					pChild[ PATCH::index( i, j ) ] =
+							pParent[ PATCH::index( offsetX + i / 2, offsetY + j / 2 ) ];
+				}
+			}
+			m_Slots[ children[ c ] ] = pChild;
+		}
+		m_Arena.release( m_Slots[ node ] );
+		m_Slots[ node ] = nullptr;
+	}
+
+	virtual void coarsened( int node, const int* children )
+	{
+		STYPE* pParent = m_Arena.allocate();
+		for( int c = 0; c < 4; ++c )
+		{
+			const STYPE* pChild = m_Slots[ children[ c ] ];
+			int offsetX = ( c & 1 ) * B / 2;
+			int offsetY = ( c >> 1 ) * B / 2;
+			for( int j = 0; j < B / 2; ++j )
+			{
+				for( int i = 0; i < B / 2; ++i )
+				{
+					DTYPE sum = PRECISION::load( pChild[ PATCH::index( 2 * i, 2 * j ) ] )
+							+ PRECISION::load( pChild[ PATCH::index( 2 * i + 1, 2 * j ) ] )
+							+ PRECISION::load( pChild[ PATCH::index( 2 * i, 2 * j + 1 ) ] )
+							+ PRECISION::load( pChild[ PATCH::index( 2 * i + 1, 2 * j + 1 ) ] );
+					pParent[ PATCH::index( offsetX + i, offsetY + j ) ] =
+							PRECISION::store( sum / 4 );
+				}
+			}
+			m_Arena.release( m_Slots[ children[ c ] ] );
+			m_Slots[ children[ c ] ] = nullptr;
+		}
+		m_Slots[ node ] = pParent;
+	}
+
+private:
+	Field( const Field<T, B, G>& );
+	Field<T, B, G>& operator=( const Field<T, B, G>& );
+
+	/*
+	 * Value of cell ( gx, gy ), counted across the domain at the level of
+	 * node, averaged from the leaves below it if it is refined.
+	 */
+	DTYPE cell( int id, int gx, int gy ) const
+	{
+		const detail::Node& node = m_pMesh->node( id );
+		if( node.bLeaf )
+		{
+			return PRECISION::load( m_Slots[ id ][ PATCH::index(
+					gx - node.block.x * B, gy - node.block.y * B ) ] );
+		}
+		DTYPE sum = 0;
+		for( int j = 0; j < 2; ++j )
+		{
+			for( int i = 0; i < 2; ++i )
+			{
+				int fx = 2 * gx + i;
+				int fy = 2 * gy + j;
+				int c = ( fy / B - 2 * node.block.y ) * 2 + ( fx / B - 2 * node.block.x );
+				sum += cell( node.children[ c ], fx, fy );
+			}
+		}
+		return sum / 4;
+	}
+
+private:
+	Mesh<B, G>* m_pMesh;
+	detail::Arena<STYPE> m_Arena;
+	std::vector<STYPE*> m_Slots;
+};
+
+/*
+ * Evaluates build( leaf ) into the interior of each leaf patch of field,
+ * e.g.
+ *
+ * amr::set( out, [&]( int leaf )
+ *		{
+ *			return utils::laplace( u.patch( leaf ), h / ( 1 << mesh.block( leaf ).level ) );
+ *		} );
+ *
+ * Stencils read the ghosts, so fill them beforehand.
+ */
+template<typename T, int B, int G, typename Tbuild>
+inline void set( Field<T, B, G>& field, const Tbuild& build )
+{
+	for( int l = 0; l < field.mesh().leaves(); ++l )
+	{
+		typename Field<T, B, G>::PATCH patch = field.patch( l );
+		mm::set( patch, 0, 0, B, B, build( l ) );
+	}
+}
+
+template<typename T, int B, int G, typename Tbuild>
+inline void set( parallel::ThreadPool& pool, Field<T, B, G>& field, const Tbuild& build )
+{
+	pool.parallelFor( 0, field.mesh().leaves(),
+			[&]( int first, int last )
+			{
+				for( int l = first; l < last; ++l )
+				{
+					typename Field<T, B, G>::PATCH patch = field.patch( l );
+					mm::set( patch, 0, 0, B, B, build( l ) );
+				}
+			} );
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,350 @@
+#ifndef _MMBOUNDARY_H_
+#define _MMBOUNDARY_H_
+
+#include "metamath.h"
+#include "mmparallel.h"
+
+#include <algorithm>
+#include <climits>
+
+namespace mm
+{
+
+namespace bc
+{
+
+/*
+ * Boundary policies. map() moves an index that lies outside [ 0, n ) back
+ * inside and returns true, or returns false when the point takes the
+ * policy's outside() value instead. They assume that no read lands more
+ * than n points outside, so none of them needs a modulo.
+ */
+struct Periodic
+{
+	bool map( int& i, int n ) const
+	{
+		if( i < 0 )
+		{
+			i += n;
+		}
+		else if( i >= n )
+		{
+			i -= n;
+		}
+		return true;
+	}
+
+	template<typename T>
+	T outside() const
+	{
+		return T();
+	}
+};
+
+/* Repeats the edge value: zero gradient across the face (Neumann). */
+struct Clamp
+{
+	bool map( int& i, int n ) const
+	{
+		i = ( i < 0 ? 0 : ( i >= n ? n - 1 : i ) );
+		return true;
+	}
+
+	template<typename T>
+	T outside() const
+	{
+		return T();
+	}
+};
+
+/* Mirrors about the edge point: -1 reads 1, n reads n - 2. */
+struct Reflect
+{
+	bool map( int& i, int n ) const
+	{
+		if( i < 0 )
+		{
+			i = -i;
+		}
+		else if( i >= n )
+		{
+			i = 2 * ( n - 1 ) - i;
+		}
+		return true;
+	}
+
+	template<typename T>
+	T outside() const
+	{
+		return T();
+	}
+};
+
+/* Reads a constant outside the domain. */
+template<typename T>
+struct Dirichlet
+{
+	Dirichlet( T value = T() )
+		: m_Value( value )
+	{
+	}
+
+	bool map( int& i, int n ) const
+	{
+		return ( i >= 0 && i < n );
+	}
+
+	template<typename U>
+	U outside() const
+	{
+		return U( m_Value );
+	}
+
+	T m_Value;
+};
+
+namespace detail
+{
+
+/*
+ * Collects the box of points at which every Bounded leaf of an expression
+ * is read inside its domain. Reads through anything that does not report
+ * fixed offsets leave the box empty.
+ */
+struct ReachVisitor
+{
+	int lo[ 2 ];
+	int hi[ 2 ];
+	bool bUnknown;
+
+	ReachVisitor()
+		: bUnknown( false )
+	{
+		lo[ 0 ] = lo[ 1 ] = INT_MIN;
+		hi[ 0 ] = hi[ 1 ] = INT_MAX;
+	}
+
+	void read( const void*, int, int, int )
+	{
+	}
+
+	void bounded( int sizeX, int sizeY, int offsetX, int offsetY )
+	{
+		lo[ 0 ] = std::max( lo[ 0 ], -offsetX );
+		lo[ 1 ] = std::max( lo[ 1 ], -offsetY );
+		hi[ 0 ] = std::min( hi[ 0 ], sizeX - offsetX );
+		hi[ 1 ] = std::min( hi[ 1 ], sizeY - offsetY );
+	}
+
+	void unknown()
+	{
+		bUnknown = true;
+	}
+};
+
+}
+
+/*
+ * 2D leaf with a boundary policy per axis. operator() resolves the policy
+ * and is safe at any point a stencil may reach; packet() reads the
+ * wrapped leaf directly and is only valid inside. setBounded() uses each
+ * where it belongs, while plain set() goes through operator() everywhere.
+ */
+template<typename Tfunc, typename TpolicyX, typename TpolicyY = TpolicyX>
+class Bounded
+{
+public:
+	static const unsigned int DIM = 2;
+	typedef op_accum<Tfunc> ACCUM;
+
+private:
+	typedef op_dtype<Tfunc> DTYPE;
+
+public:
+	Bounded( const Tfunc& func, const TpolicyX& policyX, const TpolicyY& policyY )
+		: m_Func( func ), m_PolicyX( policyX ), m_PolicyY( policyY ),
+		  m_SizeX( func.size()[ 0 ] ), m_SizeY( func.size()[ 1 ] )
+	{
+	}
+
+	DTYPE operator()( int x, int y ) const
+	{
+		if( !m_PolicyX.map( x, m_SizeX ) )
+		{
+			return m_PolicyX.template outside<DTYPE>();
+		}
+		if( !m_PolicyY.map( y, m_SizeY ) )
+		{
+			return m_PolicyY.template outside<DTYPE>();
+		}
+		return m_Func( x, y );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		return mm::packet<N>( m_Func, x, y );
+	}
+
+	/*
+	 * Near the edges the policy reads other points than the offset says,
+	 * so other visitors only learn that the reads are unknown.
+	 */
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int, int, int ) const
+	{
+		visitor.unknown();
+	}
+
+	void visit( detail::ReachVisitor& visitor, int offsetX, int offsetY, int ) const
+	{
+		visitor.bounded( m_SizeX, m_SizeY, offsetX, offsetY );
+	}
+
+private:
+	const op_operand<Tfunc> m_Func;
+	TpolicyX m_PolicyX;
+	TpolicyY m_PolicyY;
+	int m_SizeX;
+	int m_SizeY;
+};
+
+template<typename Tfunc, typename TpolicyX, typename TpolicyY>
+inline Bounded<Tfunc, TpolicyX, TpolicyY> bounded( const Tfunc& func,
+		const TpolicyX& policyX, const TpolicyY& policyY )
+{
+	return Bounded<Tfunc, TpolicyX, TpolicyY>( func, policyX, policyY );
+}
+
+template<typename Tfunc, typename Tpolicy>
+inline Bounded<Tfunc, Tpolicy> bounded( const Tfunc& func, const Tpolicy& policy )
+{
+	return Bounded<Tfunc, Tpolicy>( func, policy, policy );
+}
+
+template<typename Tfunc>
+inline Bounded<Tfunc, Periodic> periodic( const Tfunc& func )
+{
+	return bounded( func, Periodic() );
+}
+
+template<typename Tfunc>
+inline Bounded<Tfunc, Clamp> clamp( const Tfunc& func )
+{
+	return bounded( func, Clamp() );
+}
+
+template<typename Tfunc>
+inline Bounded<Tfunc, Reflect> reflect( const Tfunc& func )
+{
+	return bounded( func, Reflect() );
+}
+
+template<typename Tfunc, typename T>
+inline Bounded<Tfunc, Dirichlet<T> > dirichlet( const Tfunc& func, T value )
+{
+	return bounded( func, Dirichlet<T>( value ) );
+}
+
+namespace detail
+{
+
+/*
+ * Evaluates the rectangle in up to five pieces: the rows above and below
+ * the interior box and the columns left and right of it through set(),
+ * which resolves boundary policies, and the interior through setPacket(),
+ * which does not.
+ */
+template<int N, typename Tfunc, typename Top>
+inline void setSplit( Tfunc& func, int beginX, int beginY, int endX, int endY,
+		const Top& op, const ReachVisitor& reach )
+{
+	int loX = std::min( std::max( reach.lo[ 0 ], beginX ), endX );
+	int hiX = std::min( std::max( reach.hi[ 0 ], loX ), endX );
+	int loY = std::min( std::max( reach.lo[ 1 ], beginY ), endY );
+	int hiY = std::min( std::max( reach.hi[ 1 ], loY ), endY );
+	if( reach.bUnknown )
+	{
+		loY = hiY = endY;
+	}
+
+	if( beginY < loY )
+	{
+		mm::set( func, beginX, beginY, endX, loY, op );
+	}
+	if( loY < hiY )
+	{
+		if( beginX < loX )
+		{
+			mm::set( func, beginX, loY, loX, hiY, op );
+		}
+		if( loX < hiX )
+		{
+			setPacket<N>( func, loX, loY, hiX, hiY, op );
+		}
+		if( hiX < endX )
+		{
+			mm::set( func, hiX, loY, endX, hiY, op );
+		}
+	}
+	if( hiY < endY )
+	{
+		mm::set( func, beginX, hiY, endX, endY, op );
+	}
+}
+
+}
+
+/*
+ * func = op over a 2D range, where op reads Bounded leaves at fixed
+ * offsets. Only the band where some stencil point falls outside a Bounded
+ * leaf pays for its policy; the interior runs the packet path unchecked.
+ * As with setPacket(), op must not read func.
+ */
+template<int N = 0, typename Tfunc, typename Top>
+inline void setBounded( Tfunc& func, int beginX, int beginY, int endX, int endY, const Top& op )
+{
+	detail::ReachVisitor reach;
+	mm::detail::visit( op, reach );
+	detail::setSplit<N>( func, beginX, beginY, endX, endY, op, reach );
+}
+
+template<int N = 0, typename Tfunc, typename Top, typename Tbegin, typename Tend>
+inline void setBounded( Tfunc& func, const Tbegin& begin, const Tend& end, const Top& op )
+{
+	setBounded<N>( func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], op );
+}
+
+template<int N = 0, typename Tfunc, typename Top>
+inline void setBounded( Tfunc& func, const Top& op )
+{
+	setBounded<N>( func, 0, 0, func.size()[ 0 ], func.size()[ 1 ], op );
+}
+
+/* Rows split among the threads of pool, as in parallel::set(). */
+template<int N = 0, typename Tfunc, typename Top, typename Tbegin, typename Tend>
+inline void setBounded( parallel::ThreadPool& pool, Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Top& op )
+{
+	detail::ReachVisitor reach;
+	mm::detail::visit( op, reach );
+	int beginX = begin[ 0 ];
+	int endX = end[ 0 ];
+	pool.parallelFor( begin[ 1 ], end[ 1 ],
+			[&]( int beginY, int endY )
+			{
+				detail::setSplit<N>( func, beginX, beginY, endX, endY, op, reach );
+			} );
+}
+
+template<int N = 0, typename Tfunc, typename Top>
+inline void setBounded( parallel::ThreadPool& pool, Tfunc& func, const Top& op )
+{
+	setBounded<N>( pool, func, parallel::detail::zero( func ), func.size(), op );
+}
+
+}
+
+}
+
+#endif
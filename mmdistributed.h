@@ -0,0 +1,858 @@
+#ifndef _MMDISTRIBUTED_H_
+#define _MMDISTRIBUTED_H_
+
+#include "metamath.h"
+#include "mmfunction.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace mm
+{
+
+namespace distributed
+{
+
+template<typename T>
+class DistributedFunction;
+
+}
+
+template<typename T, typename Top>
+void set( distributed::DistributedFunction<T>& func, const Top& op );
+
+namespace distributed
+{
+
+/*
+ * Point-to-point byte channel between the processes of a decomposition.
+ * Messages between two ranks arrive in the order they were sent. send()
+ * and recv() may be called from different threads at the same time.
+ */
+class Transport
+{
+public:
+	virtual ~Transport()
+	{
+	}
+
+	virtual int rank() const = 0;
+	virtual int size() const = 0;
+	virtual void send( int to, const void* pData, size_t bytes ) = 0;
+	virtual void recv( int from, void* pData, size_t bytes ) = 0;
+};
+
+/*
+ * Transport over Unix domain stream sockets named prefix.<rank>. Every
+ * rank listens on its own socket and connects to the lower ranks.
+ */
+class UnixSocketTransport : public Transport
+{
+public:
+	UnixSocketTransport( const std::string& prefix, int rank, int size )
+		: m_Prefix( prefix ), m_Rank( rank ), m_Size( size ), m_Sockets( size, -1 )
+	{
+		sockaddr_un address = this->address( rank );
+		int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+		unlink( address.sun_path );
+		if( listener < 0
+				|| bind( listener, (sockaddr*)&address, sizeof( address ) ) != 0
+				|| listen( listener, size ) != 0 )
+		{
+			throw std::runtime_error( "cannot listen on " + path( rank ) );
+		}
+
+		for( int other = 0; other < rank; ++other )
+		{
+			sockaddr_un otherAddress = this->address( other );
+			int sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+			while( connect( sock, (sockaddr*)&otherAddress, sizeof( otherAddress ) ) != 0 )
+			{
+				usleep( 1000 );
+			}
+			m_Sockets[ other ] = sock;
+			send( other, &m_Rank, sizeof( m_Rank ) );
+		}
+		for( int i = rank + 1; i < size; ++i )
+		{
+			int sock = accept( listener, nullptr, nullptr );
+			int other;
+			receive( sock, &other, sizeof( other ) );
+			m_Sockets[ other ] = sock;
+		}
+		close( listener );
+	}
+
+	~UnixSocketTransport()
+	{
+		for( int i = 0; i < m_Size; ++i )
+		{
+			if( m_Sockets[ i ] >= 0 )
+			{
+				close( m_Sockets[ i ] );
+			}
+		}
+		unlink( path( m_Rank ).c_str() );
+	}
+
+	int rank() const
+	{
+		return m_Rank;
+	}
+
+	int size() const
+	{
+		return m_Size;
+	}
+
+	void send( int to, const void* pData, size_t bytes )
+	{
+		const char* pBytes = static_cast<const char*>( pData );
+		while( bytes > 0 )
+		{
+			ssize_t sent = ::send( m_Sockets[ to ], pBytes, bytes, MSG_NOSIGNAL );
+			if( sent < 0 && errno != EINTR )
+			{
+				throw std::runtime_error( "send failed" );
+			}
+			pBytes += std::max<ssize_t>( sent, 0 );
+			bytes -= std::max<ssize_t>( sent, 0 );
+		}
+	}
+
+	void recv( int from, void* pData, size_t bytes )
+	{
+		receive( m_Sockets[ from ], pData, bytes );
+	}
+
+private:
+	UnixSocketTransport( const UnixSocketTransport& );
+	UnixSocketTransport& operator=( const UnixSocketTransport& );
+
+	std::string path( int rank ) const
+	{
+		return m_Prefix + "." + std::to_string( rank );
+	}
+
+	sockaddr_un address( int rank ) const
+	{
+		sockaddr_un address;
+		std::memset( &address, 0, sizeof( address ) );
+		address.sun_family = AF_UNIX;
+		std::strncpy( address.sun_path, path( rank ).c_str(),
+				sizeof( address.sun_path ) - 1 );
+		return address;
+	}
+
+	static void receive( int sock, void* pData, size_t bytes )
+	{
+		char* pBytes = static_cast<char*>( pData );
+		while( bytes > 0 )
+		{
+			ssize_t received = ::recv( sock, pBytes, bytes, 0 );
+			if( received == 0 || ( received < 0 && errno != EINTR ) )
+			{
+				throw std::runtime_error( "recv failed" );
+			}
+			pBytes += std::max<ssize_t>( received, 0 );
+			bytes -= std::max<ssize_t>( received, 0 );
+		}
+	}
+
+private:
+	std::string m_Prefix;
+	int m_Rank;
+	int m_Size;
+	std::vector<int> m_Sockets;
+};
+
+/*
+ * Transport over a POSIX shared memory object holding one single-producer
+ * single-consumer ring per ordered pair of ranks. Rank 0 creates the
+ * object, so name has to be unique to the run.
+ */
+class SharedMemoryTransport : public Transport
+{
+public:
+	static const size_t RING_BYTES = 1 << 18;
+
+	SharedMemoryTransport( const std::string& name, int rank, int size )
+		: m_Name( name ), m_Rank( rank ), m_Size( size ),
+		m_Bytes( sizeof( Header ) + sizeof( Ring ) * size * size )
+	{
+		int fd;
+		if( rank == 0 )
+		{
+			shm_unlink( name.c_str() );
+			fd = shm_open( name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600 );
+			if( fd < 0 || ftruncate( fd, (off_t)m_Bytes ) != 0 )
+			{
+				throw std::runtime_error( "cannot create " + name );
+			}
+		}
+		else
+		{
+			struct stat info;
+			while( ( fd = shm_open( name.c_str(), O_RDWR, 0600 ) ) < 0
+					|| fstat( fd, &info ) != 0 || (size_t)info.st_size < m_Bytes )
+			{
+				if( fd >= 0 )
+				{
+					close( fd );
+				}
+				usleep( 1000 );
+			}
+		}
+		void* pMapping = mmap( nullptr, m_Bytes, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0 );
+		close( fd );
+		if( pMapping == MAP_FAILED )
+		{
+			throw std::runtime_error( "cannot map " + name );
+		}
+		m_pHeader = static_cast<Header*>( pMapping );
+		m_pRings = reinterpret_cast<Ring*>( m_pHeader + 1 );
+		if( rank == 0 )
+		{
+			m_pHeader->ready.store( READY );
+		}
+		while( m_pHeader->ready.load() != READY )
+		{
+			sched_yield();
+		}
+	}
+
+	~SharedMemoryTransport()
+	{
+		munmap( m_pHeader, m_Bytes );
+		if( m_Rank == 0 )
+		{
+			shm_unlink( m_Name.c_str() );
+		}
+	}
+
+	int rank() const
+	{
+		return m_Rank;
+	}
+
+	int size() const
+	{
+		return m_Size;
+	}
+
+	void send( int to, const void* pData, size_t bytes )
+	{
+		Ring& ring = m_pRings[ m_Rank * m_Size + to ];
+		const char* pBytes = static_cast<const char*>( pData );
+		std::uint64_t head = ring.head.load( std::memory_order_relaxed );
+		while( bytes > 0 )
+		{
+			std::uint64_t tail = ring.tail.load( std::memory_order_acquire );
+			size_t offset = (size_t)( head % RING_BYTES );
+			size_t chunk = std::min( std::min( bytes, RING_BYTES - offset ),
+					RING_BYTES - (size_t)( head - tail ) );
+			if( chunk == 0 )
+			{
+				sched_yield();
+				continue;
+			}
+			std::memcpy( ring.data + offset, pBytes, chunk );
+			head += chunk;
+			ring.head.store( head, std::memory_order_release );
+			pBytes += chunk;
+			bytes -= chunk;
+		}
+	}
+
+	void recv( int from, void* pData, size_t bytes )
+	{
+		Ring& ring = m_pRings[ from * m_Size + m_Rank ];
+		char* pBytes = static_cast<char*>( pData );
+		std::uint64_t tail = ring.tail.load( std::memory_order_relaxed );
+		while( bytes > 0 )
+		{
+			std::uint64_t head = ring.head.load( std::memory_order_acquire );
+			size_t offset = (size_t)( tail % RING_BYTES );
+			size_t chunk = std::min( std::min( bytes, RING_BYTES - offset ),
+					(size_t)( head - tail ) );
+			if( chunk == 0 )
+			{
+				sched_yield();
+				continue;
+			}
+			std::memcpy( pBytes, ring.data + offset, chunk );
+			tail += chunk;
+			ring.tail.store( tail, std::memory_order_release );
+			pBytes += chunk;
+			bytes -= chunk;
+		}
+	}
+
+private:
+	static const std::uint32_t READY = 0x6d6d7368;
+
+	// the mapping starts zeroed, which is a valid state of both
+	struct Header
+	{
+		std::atomic<std::uint32_t> ready;
+		char pad[ 60 ];
+	};
+
+	struct Ring
+	{
+		std::atomic<std::uint64_t> head;
+		char pad0[ 56 ];
+		std::atomic<std::uint64_t> tail;
+		char pad1[ 56 ];
+		char data[ RING_BYTES ];
+	};
+
+	SharedMemoryTransport( const SharedMemoryTransport& );
+	SharedMemoryTransport& operator=( const SharedMemoryTransport& );
+
+private:
+	std::string m_Name;
+	int m_Rank;
+	int m_Size;
+	size_t m_Bytes;
+	Header* m_pHeader;
+	Ring* m_pRings;
+};
+
+/*
+ * Forks size - 1 child processes and returns the rank of the calling
+ * process, 0 in the parent. Used to run a decomposition on one machine;
+ * the parent collects the children with join().
+ */
+inline int spawn( int size )
+{
+	for( int rank = 1; rank < size; ++rank )
+	{
+		pid_t pid = fork();
+		if( pid == 0 )
+		{
+			return rank;
+		}
+		if( pid < 0 )
+		{
+			throw std::runtime_error( "fork failed" );
+		}
+	}
+	return 0;
+}
+
+/*
+ * Waits for all children started by spawn(), true if all exited with 0.
+ */
+inline bool join()
+{
+	bool bOk = true;
+	int status;
+	while( wait( &status ) > 0 )
+	{
+		bOk = bOk && WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+	}
+	return bOk;
+}
+
+/*
+ * Combines value over all ranks with fn, the result on every rank.
+ */
+template<typename T, typename Tfn>
+inline T allReduce( Transport& transport, T value, const Tfn& fn )
+{
+	if( transport.rank() == 0 )
+	{
+		for( int other = 1; other < transport.size(); ++other )
+		{
+			T otherValue;
+			transport.recv( other, &otherValue, sizeof( T ) );
+			value = fn( value, otherValue );
+		}
+		for( int other = 1; other < transport.size(); ++other )
+		{
+			transport.send( other, &value, sizeof( T ) );
+		}
+	}
+	else
+	{
+		transport.send( 0, &value, sizeof( T ) );
+		transport.recv( 0, &value, sizeof( T ) );
+	}
+	return value;
+}
+
+namespace detail
+{
+
+/*
+ * Distributed field as seen by the halo exchange and the reductions.
+ */
+class Field
+{
+public:
+	virtual ~Field()
+	{
+	}
+
+	virtual Tuple<int> begin() const = 0;
+	virtual Tuple<int> end() const = 0;
+	virtual int halo() const = 0;
+	virtual Transport& transport() const = 0;
+	virtual void sendHalo( int above, int below ) const = 0;
+	virtual void recvHalo( int above, int below ) = 0;
+};
+
+struct HaloRead
+{
+	Field* pField;
+	int above;
+	int below;
+};
+
+/*
+ * Collects the distributed fields an expression reads and how far above
+ * and below a row it reads them. Throws std::runtime_error for a read
+ * further away than the field's halo.
+ */
+struct HaloVisitor
+{
+	std::vector<HaloRead> reads;
+
+	void read( const void*, int, int, int )
+	{
+	}
+
+	void unknown()
+	{
+	}
+
+	void field( Field* pField, int offsetY )
+	{
+		if( offsetY > pField->halo() || -offsetY > pField->halo() )
+		{
+			throw std::runtime_error( "stencil reaches beyond the halo" );
+		}
+		for( size_t i = 0; i < reads.size(); ++i )
+		{
+			if( reads[ i ].pField == pField )
+			{
+				reads[ i ].above = std::max( reads[ i ].above, -offsetY );
+				reads[ i ].below = std::max( reads[ i ].below, offsetY );
+				return;
+			}
+		}
+		HaloRead read = { pField, std::max( 0, -offsetY ), std::max( 0, offsetY ) };
+		reads.push_back( read );
+	}
+};
+
+/*
+ * Exchanges the halo rows of reads on two helper threads while overlap()
+ * runs on the calling one.
+ */
+template<typename Tfn>
+inline void exchange( const std::vector<HaloRead>& reads, const Tfn& overlap )
+{
+	std::thread sender( [&reads]()
+			{
+				for( size_t i = 0; i < reads.size(); ++i )
+				{
+					reads[ i ].pField->sendHalo( reads[ i ].above, reads[ i ].below );
+				}
+			} );
+	std::thread receiver( [&reads]()
+			{
+				for( size_t i = 0; i < reads.size(); ++i )
+				{
+					reads[ i ].pField->recvHalo( reads[ i ].above, reads[ i ].below );
+				}
+			} );
+	overlap();
+	sender.join();
+	receiver.join();
+}
+
+/*
+ * Fills the halos op reads and narrows [ beginY, endY ) to the rows this
+ * rank owns. Returns the first field read, or null if op reads none, in
+ * which case every rank covers the whole range.
+ */
+template<typename Top>
+inline Field* prepare( const Top& op, int& beginY, int& endY )
+{
+	HaloVisitor visitor;
+	mm::detail::visit( op, visitor );
+	if( visitor.reads.empty() )
+	{
+		return nullptr;
+	}
+	detail::exchange( visitor.reads, []() {} );
+	Field* pField = visitor.reads[ 0 ].pField;
+	beginY = std::max( beginY, pField->begin()[ 1 ] );
+	endY = std::min( endY, pField->end()[ 1 ] );
+	return pField;
+}
+
+}
+
+/*
+ * Function split into slabs of rows, one per rank, each stored with halo
+ * rows above and below. Coordinates are global: a rank evaluates and
+ * stores only its own rows [ begin()[ 1 ], end()[ 1 ] ), and set() fills
+ * the halo rows of the fields it reads from the neighbors first, as many
+ * as the stencil offsets need. All distributed operands of one set() have
+ * to share the transport and the global size; other leaves are read at
+ * global coordinates on every rank. Expressions of distributed fields are
+ * reduced with distributed::sum(), max() and min().
+ */
+template<typename T>
+class DistributedFunction : public detail::Field
+{
+public:
+	typedef precision_type<T> PRECISION;
+	typedef typename PRECISION::COMPUTE DTYPE;
+	typedef typename PRECISION::STORAGE STYPE;
+	typedef typename PRECISION::ACCUM ACCUM;
+	typedef FunctionRef<DistributedFunction<T>> OPERAND;
+	static const unsigned int DIM = 2;
+
+private:
+	typedef mm::detail::PrecisionAccess<PRECISION> ACCESS;
+
+public:
+	typedef typename ACCESS::REFERENCE REFERENCE;
+	typedef typename ACCESS::CONST_REFERENCE CONST_REFERENCE;
+
+public:
+	template<typename U>
+	DistributedFunction( Transport& transport, const U& _size, int halo )
+		: m_pTransport( &transport ), m_Size( _size[ 0 ], _size[ 1 ] ), m_Halo( halo )
+	{
+		m_BeginY = m_Size[ 1 ] * transport.rank() / transport.size();
+		m_EndY = m_Size[ 1 ] * ( transport.rank() + 1 ) / transport.size();
+		m_Data.resize( (size_t)m_Size[ 0 ] * ( m_EndY - m_BeginY + 2 * halo ) );
+	}
+
+	REFERENCE operator()( int x, int y )
+	{
+		return ACCESS::ref( m_Data[ index( x, y ) ] );
+	}
+
+	CONST_REFERENCE operator()( int x, int y ) const
+	{
+		return ACCESS::cref( m_Data[ index( x, y ) ] );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		Packet<DTYPE, N> res;
+		const STYPE* pRow = &m_Data[ index( x, y ) ];
+		for( int k = 0; k < N; ++k )
+		{
+			res.v[ k ] = PRECISION::load( pRow[ k ] );
+		}
+		return res;
+	}
+
+	const Tuple<int>& size() const
+	{
+		return m_Size;
+	}
+
+	/*
+	 * Region owned by this rank.
+	 */
+	Tuple<int> begin() const
+	{
+		return Tuple<int>( 0, m_BeginY );
+	}
+
+	Tuple<int> end() const
+	{
+		return Tuple<int>( m_Size[ 0 ], m_EndY );
+	}
+
+	int halo() const
+	{
+		return m_Halo;
+	}
+
+	Transport& transport() const
+	{
+		return *m_pTransport;
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		visitor.read( this, offsetX, offsetY, offsetZ );
+	}
+
+	void visit( detail::HaloVisitor& visitor, int, int offsetY, int ) const
+	{
+		visitor.field( const_cast<DistributedFunction<T>*>( this ), offsetY );
+	}
+
+	template<typename Top>
+	DistributedFunction<T>& operator=( const Top& op )
+	{
+		set( *this, op );
+		return *this;
+	}
+
+	void sendHalo( int above, int below ) const
+	{
+		int rank = m_pTransport->rank();
+		above = std::min( above, m_EndY - m_BeginY );
+		below = std::min( below, m_EndY - m_BeginY );
+		if( rank > 0 && below > 0 )
+		{
+			m_pTransport->send( rank - 1, &m_Data[ index( 0, m_BeginY ) ],
+					sizeof( STYPE ) * m_Size[ 0 ] * below );
+		}
+		if( rank + 1 < m_pTransport->size() && above > 0 )
+		{
+			m_pTransport->send( rank + 1, &m_Data[ index( 0, m_EndY - above ) ],
+					sizeof( STYPE ) * m_Size[ 0 ] * above );
+		}
+	}
+
+	void recvHalo( int above, int below )
+	{
+		int rank = m_pTransport->rank();
+		int numRanks = m_pTransport->size();
+		if( rank > 0 && above > 0 )
+		{
+			int rows = std::min( above, m_BeginY - m_Size[ 1 ] * ( rank - 1 ) / numRanks );
+			m_pTransport->recv( rank - 1, &m_Data[ index( 0, m_BeginY - rows ) ],
+					sizeof( STYPE ) * m_Size[ 0 ] * rows );
+		}
+		if( rank + 1 < numRanks && below > 0 )
+		{
+			int rows = std::min( below, m_Size[ 1 ] * ( rank + 2 ) / numRanks - m_EndY );
+			m_pTransport->recv( rank + 1, &m_Data[ index( 0, m_EndY ) ],
+					sizeof( STYPE ) * m_Size[ 0 ] * rows );
+		}
+	}
+
+private:
+	DistributedFunction( const DistributedFunction<T>& );
+	DistributedFunction<T>& operator=( const DistributedFunction<T>& );
+
+	size_t index( int x, int y ) const
+	{
+		return (size_t)( y - m_BeginY + m_Halo ) * m_Size[ 0 ] + x;
+	}
+
+private:
+	Transport* m_pTransport;
+	Tuple<int> m_Size;
+	int m_Halo;
+	int m_BeginY;
+	int m_EndY;
+	std::vector<STYPE> m_Data;
+};
+
+}
+
+/*
+ * Evaluates op over the rows of [ begin, end ) this rank owns. The halo
+ * exchange runs on two helper threads while the rows that need no halo
+ * are computed, the rows next to the neighbors follow once it is done.
+ * Every rank has to call it, with the same expression. op must not read
+ * func at a nonzero offset, nor any field further away than its halo.
+ */
+template<typename T, typename Top, typename Tbegin, typename Tend>
+inline void set( distributed::DistributedFunction<T>& func, const Tbegin& begin,
+		const Tend& end, const Top& op )
+{
+	int beginX = begin[ 0 ];
+	int endX = end[ 0 ];
+	int beginY = std::max( (int)begin[ 1 ], func.begin()[ 1 ] );
+	int endY = std::min( (int)end[ 1 ], func.end()[ 1 ] );
+
+	distributed::detail::HaloVisitor visitor;
+	detail::visit( op, visitor );
+	if( visitor.reads.empty() )
+	{
+		mm::set( func, beginX, beginY, endX, endY, op );
+		return;
+	}
+
+	int above = 0;
+	int below = 0;
+	for( size_t i = 0; i < visitor.reads.size(); ++i )
+	{
+		above = std::max( above, visitor.reads[ i ].above );
+		below = std::max( below, visitor.reads[ i ].below );
+	}
+
+	int interiorBeginY = std::min( endY, std::max( beginY, func.begin()[ 1 ] + above ) );
+	int interiorEndY = std::max( interiorBeginY,
+			std::min( endY, func.end()[ 1 ] - below ) );
+	distributed::detail::exchange( visitor.reads, [&]()
+			{
+				mm::set( func, beginX, interiorBeginY, endX, interiorEndY, op );
+			} );
+	mm::set( func, beginX, beginY, endX, interiorBeginY, op );
+	mm::set( func, beginX, interiorEndY, endX, endY, op );
+}
+
+template<typename T, typename Top>
+inline void set( distributed::DistributedFunction<T>& func, const Top& op )
+{
+	mm::set( func, Tuple<int>(), func.size(), op );
+}
+
+/*
+ * Reductions over a distributed field combine the owned rows of every
+ * rank; all ranks get the result.
+ */
+template<typename Tacc = void, typename T, typename Tbegin, typename Tend>
+inline sum_dtype<Tacc, distributed::DistributedFunction<T>> sum(
+		const distributed::DistributedFunction<T>& func,
+		const Tbegin& begin, const Tend& end )
+{
+	typedef sum_dtype<Tacc, distributed::DistributedFunction<T>> ACC;
+	int beginY = std::max( (int)begin[ 1 ], func.begin()[ 1 ] );
+	int endY = std::min( (int)end[ 1 ], func.end()[ 1 ] );
+	ACC res = ( beginY < endY
+			? mm::sum<ACC>( mm::eval<0,0>( func ), begin[ 0 ], beginY, end[ 0 ], endY )
+			: ACC() );
+	return distributed::allReduce( func.transport(), res,
+			[]( ACC a, ACC b ) { return a + b; } );
+}
+
+template<typename Tacc = void, typename T>
+inline sum_dtype<Tacc, distributed::DistributedFunction<T>> sum(
+		const distributed::DistributedFunction<T>& func )
+{
+	return mm::sum<Tacc>( func, Tuple<int>(), func.size() );
+}
+
+template<typename T, typename Tbegin, typename Tend>
+inline typename distributed::DistributedFunction<T>::DTYPE max(
+		const distributed::DistributedFunction<T>& func,
+		const Tbegin& begin, const Tend& end )
+{
+	typedef typename distributed::DistributedFunction<T>::DTYPE DTYPE;
+	int beginY = std::max( (int)begin[ 1 ], func.begin()[ 1 ] );
+	int endY = std::min( (int)end[ 1 ], func.end()[ 1 ] );
+	DTYPE res = ( beginY < endY
+			? mm::max( mm::eval<0,0>( func ), begin[ 0 ], beginY, end[ 0 ], endY )
+			: std::numeric_limits<DTYPE>::lowest() );
+	return distributed::allReduce( func.transport(), res,
+			[]( DTYPE a, DTYPE b ) { return std::max( a, b ); } );
+}
+
+template<typename T>
+inline typename distributed::DistributedFunction<T>::DTYPE max(
+		const distributed::DistributedFunction<T>& func )
+{
+	return mm::max( func, Tuple<int>(), func.size() );
+}
+
+template<typename T, typename Tbegin, typename Tend>
+inline typename distributed::DistributedFunction<T>::DTYPE min(
+		const distributed::DistributedFunction<T>& func,
+		const Tbegin& begin, const Tend& end )
+{
+	typedef typename distributed::DistributedFunction<T>::DTYPE DTYPE;
+	int beginY = std::max( (int)begin[ 1 ], func.begin()[ 1 ] );
+	int endY = std::min( (int)end[ 1 ], func.end()[ 1 ] );
+	DTYPE res = ( beginY < endY
+			? mm::min( mm::eval<0,0>( func ), begin[ 0 ], beginY, end[ 0 ], endY )
+			: std::numeric_limits<DTYPE>::max() );
+	return distributed::allReduce( func.transport(), res,
+			[]( DTYPE a, DTYPE b ) { return std::min( a, b ); } );
+}
+
+template<typename T>
+inline typename distributed::DistributedFunction<T>::DTYPE min(
+		const distributed::DistributedFunction<T>& func )
+{
+	return mm::min( func, Tuple<int>(), func.size() );
+}
+
+namespace distributed
+{
+
+/*
+ * Reductions over expressions of distributed fields, which the generic
+ * ones would evaluate outside the owned rows. The halos op reads are
+ * filled, each rank reduces the rows of [ begin, end ) it owns and all
+ * ranks get the combined result. Every rank has to call them, with the
+ * same expression.
+ */
+template<typename Tacc = void, typename Top, typename Tbegin, typename Tend>
+inline sum_dtype<Tacc, Top> sum( const Top& op, const Tbegin& begin, const Tend& end )
+{
+	typedef sum_dtype<Tacc, Top> ACC;
+	int beginY = begin[ 1 ];
+	int endY = end[ 1 ];
+	detail::Field* pField = detail::prepare( op, beginY, endY );
+	ACC res = ( beginY < endY
+			? mm::sum<ACC>( mm::eval( op ), begin[ 0 ], beginY, end[ 0 ], endY )
+			: ACC() );
+	return ( pField != nullptr
+			? allReduce( pField->transport(), res, []( ACC a, ACC b ) { return a + b; } )
+			: res );
+}
+
+template<typename Top, typename Tbegin, typename Tend>
+inline op_dtype<Top> max( const Top& op, const Tbegin& begin, const Tend& end )
+{
+	typedef op_dtype<Top> DTYPE;
+	int beginY = begin[ 1 ];
+	int endY = end[ 1 ];
+	detail::Field* pField = detail::prepare( op, beginY, endY );
+	DTYPE res = ( beginY < endY
+			? mm::max( mm::eval( op ), begin[ 0 ], beginY, end[ 0 ], endY )
+			: std::numeric_limits<DTYPE>::lowest() );
+	return ( pField != nullptr
+			? allReduce( pField->transport(), res,
+					[]( DTYPE a, DTYPE b ) { return std::max( a, b ); } )
+			: res );
+}
+
+template<typename Top, typename Tbegin, typename Tend>
+inline op_dtype<Top> min( const Top& op, const Tbegin& begin, const Tend& end )
+{
+	typedef op_dtype<Top> DTYPE;
+	int beginY = begin[ 1 ];
+	int endY = end[ 1 ];
+	detail::Field* pField = detail::prepare( op, beginY, endY );
+	DTYPE res = ( beginY < endY
+			? mm::min( mm::eval( op ), begin[ 0 ], beginY, end[ 0 ], endY )
+			: std::numeric_limits<DTYPE>::max() );
+	return ( pField != nullptr
+			? allReduce( pField->transport(), res,
+					[]( DTYPE a, DTYPE b ) { return std::min( a, b ); } )
+			: res );
+}
+
+}
+
+}
+
+#endif
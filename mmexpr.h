@@ -0,0 +1,943 @@
+#ifndef _MMEXPR_H_
+#define _MMEXPR_H_
+
+#include "metamath.h"
+#include "mmfunction.h"
+#include "mmfunctions.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Registers of a Program never overlap, telling the compiler so lets it
+ * vectorize the instruction loops without runtime alias checks.
+ */
+#if defined( _MSC_VER ) || defined( __GNUC__ )
+#define MM_RESTRICT __restrict
+#else
+#define MM_RESTRICT
+#endif
+
+namespace mm
+{
+
+namespace expr
+{
+
+/*
+ * Instructions of a compiled expression. Each works on whole registers,
+ * i.e. on a batch of consecutive points of a row, so the loops in
+ * Program::row() vectorize like the packet path of the templates.
+ */
+enum Opcode
+{
+	ADD,
+	SUB,
+	MUL,
+	DIV,
+	NEG,
+	ABS,
+	SQR,
+	SIN,
+	COS,
+	TAN,
+	SQRT,
+	EXP,
+	LOG,
+	TANH,
+	ERF,
+	POW,
+	ATAN2,
+	NUM_OPCODES
+};
+
+namespace detail
+{
+
+/*
+ * Registers are numbered constants first, then loads, then temporaries.
+ * The constants are filled in once at compile time, loads and
+ * temporaries live on the stack of row().
+ */
+struct Instruction
+{
+	int code;
+	int dst;
+	int a;
+	int b;
+};
+
+struct Load
+{
+	int binding;
+	int offset[ 3 ];
+};
+
+struct Read
+{
+	const void* pData;
+	int offset[ 3 ];
+};
+
+/*
+ * Records what a bound function reads, so that Program::visit() can
+ * report it at the offsets the expression loads it at.
+ */
+struct RecordVisitor
+{
+	std::vector<Read>* pReads;
+	bool bUnknown;
+
+	void read( const void* pData, int offsetX, int offsetY, int offsetZ )
+	{
+		Read read = { pData, { offsetX, offsetY, offsetZ } };
+		pReads->push_back( read );
+	}
+
+	void unknown()
+	{
+		bUnknown = true;
+	}
+};
+
+template<typename T, typename Tfunc>
+inline void loadRow( const void* pFunc, int x, int y, int, int n, T* MM_RESTRICT pOut,
+		mm::detail::DimTag<2> )
+{
+	const Tfunc& func = *static_cast<const Tfunc*>( pFunc );
+	for( int k = 0; k < n; ++k )
+	{
+		pOut[ k ] = (T)func( x + k, y );
+	}
+}
+
+template<typename T, typename Tfunc>
+inline void loadRow( const void* pFunc, int x, int y, int z, int n,
+		T* MM_RESTRICT pOut, mm::detail::DimTag<3> )
+{
+	const Tfunc& func = *static_cast<const Tfunc*>( pFunc );
+	for( int k = 0; k < n; ++k )
+	{
+		pOut[ k ] = (T)func( x + k, y, z );
+	}
+}
+
+template<typename T, typename Tfunc>
+inline void loadRow( const void* pFunc, int x, int y, int z, int n, T* pOut )
+{
+	loadRow<T, Tfunc>( pFunc, x, y, z, n, pOut,
+			mm::detail::DimTag<mm::detail::FuncDim<Tfunc>::value>() );
+}
+
+/*
+ * Functions that store T contiguously along x are read in place, the
+ * others are copied into a register by load.
+ */
+template<typename T>
+struct Binding
+{
+	const void* pFunc;
+	void ( *load )( const void* pFunc, int x, int y, int z, int n, T* pOut );
+	const T* ( *address )( const void* pFunc, int x, int y, int z );
+	std::vector<Read> reads;
+	bool bUnknown;
+};
+
+template<typename T, typename Tfunc>
+struct DirectRows
+{
+	static const bool value = false;
+};
+
+template<typename T, typename U, unsigned int Dim>
+struct DirectRows<T, Function<U, Dim>>
+{
+	static const bool value = std::is_same<
+		typename Function<U, Dim>::CONST_REFERENCE, const T&>::value;
+};
+
+template<typename T, typename Tfunc>
+inline const T* address( const void* pFunc, int x, int y, int,
+		mm::detail::DimTag<2> )
+{
+	return &( *static_cast<const Tfunc*>( pFunc ) )( x, y );
+}
+
+template<typename T, typename Tfunc>
+inline const T* address( const void* pFunc, int x, int y, int z,
+		mm::detail::DimTag<3> )
+{
+	return &( *static_cast<const Tfunc*>( pFunc ) )( x, y, z );
+}
+
+template<typename T, typename Tfunc>
+inline const T* address( const void* pFunc, int x, int y, int z )
+{
+	return address<T, Tfunc>( pFunc, x, y, z,
+			mm::detail::DimTag<mm::detail::FuncDim<Tfunc>::value>() );
+}
+
+template<typename T, typename Tfunc>
+inline void bindRows( Binding<T>& binding, std::true_type )
+{
+	binding.load = nullptr;
+	binding.address = &address<T, Tfunc>;
+}
+
+template<typename T, typename Tfunc>
+inline void bindRows( Binding<T>& binding, std::false_type )
+{
+	binding.load = &loadRow<T, Tfunc>;
+	binding.address = nullptr;
+}
+
+/*
+ * Scalar semantics of the instructions, used for constant folding. The
+ * functions go through the same kernels as mm::fun.
+ */
+template<typename T>
+inline T apply( int code, T a, T b )
+{
+	switch( code )
+	{
+	case ADD: return a + b;
+	case SUB: return a - b;
+	case MUL: return a * b;
+	case DIV: return a / b;
+	case NEG: return -a;
+	case ABS: return ( a >= 0 ? a : -a );
+	case SQR: return a * a;
+	case SIN: return fun::kernel::sin<MM_FUN_MODE>( a );
+	case COS: return fun::kernel::cos<MM_FUN_MODE>( a );
+	case TAN: return fun::kernel::tan<MM_FUN_MODE>( a );
+	case SQRT: return fun::kernel::sqrt<MM_FUN_MODE>( a );
+	case EXP: return fun::kernel::exp<MM_FUN_MODE>( a );
+	case LOG: return fun::kernel::log<MM_FUN_MODE>( a );
+	case TANH: return fun::kernel::tanh<MM_FUN_MODE>( a );
+	case ERF: return fun::kernel::erf<MM_FUN_MODE>( a );
+	case POW: return fun::kernel::pow<MM_FUN_MODE>( a, b );
+	case ATAN2: return fun::kernel::atan2<MM_FUN_MODE>( a, b );
+	}
+	return T();
+}
+
+template<typename T>
+struct Code
+{
+	std::vector<Binding<T>> bindings;
+	std::vector<Load> loads;
+	std::vector<Instruction> instructions;
+	std::vector<T> constants;
+	int numConstants;
+	int numRegisters;
+	int result;
+};
+
+}
+
+/*
+ * Expression compiled at run time by Compiler. It is an operand like the
+ * templates: set( out, program ) evaluates it a row segment at a time
+ * through row(), everything else works point by point or by packets.
+ * As with setPacket(), a whole segment is evaluated before any of it is
+ * stored, so a program must not read its target at a negative x offset.
+ * Copies share the code.
+ */
+template<typename T>
+class Program
+{
+public:
+	typedef T DTYPE;
+	static const int BATCH = 64;
+	static const int MAX_REGISTERS = 64;
+
+public:
+	Program( const std::shared_ptr<const detail::Code<T>>& pCode )
+		: m_pCode( pCode )
+	{
+	}
+
+	T operator()( int x, int y ) const
+	{
+		T val;
+		row( x, y, 0, 1, &val );
+		return val;
+	}
+
+	T operator()( int x, int y, int z ) const
+	{
+		T val;
+		row( x, y, z, 1, &val );
+		return val;
+	}
+
+	template<int N>
+	Packet<T, N> packet( int x, int y ) const
+	{
+		Packet<T, N> res;
+		for( int k = 0; k < N; k += BATCH )
+		{
+			row( x + k, y, 0, ( N - k < BATCH ? N - k : BATCH ), res.v + k );
+		}
+		return res;
+	}
+
+	/*
+	 * Evaluates the n <= BATCH points from ( x, y, z ) on into pOut.
+	 */
+	void row( int x, int y, int z, int n, T* pOut ) const
+	{
+		const detail::Code<T>& code = *m_pCode;
+		T registers[ MAX_REGISTERS ][ BATCH ];
+		const T* pRegisters[ MAX_REGISTERS ];
+		for( int r = 0; r < code.numConstants; ++r )
+		{
+			pRegisters[ r ] = &code.constants[ r * BATCH ];
+		}
+		for( int r = code.numConstants; r < code.numRegisters; ++r )
+		{
+			pRegisters[ r ] = registers[ r - code.numConstants ];
+		}
+
+		for( size_t l = 0; l < code.loads.size(); ++l )
+		{
+			const detail::Load& load = code.loads[ l ];
+			const detail::Binding<T>& binding = code.bindings[ load.binding ];
+			int r = code.numConstants + (int)l;
+			if( binding.address )
+			{
+				pRegisters[ r ] = binding.address( binding.pFunc, x + load.offset[ 0 ],
+						y + load.offset[ 1 ], z + load.offset[ 2 ] );
+			}
+			else
+			{
+				binding.load( binding.pFunc, x + load.offset[ 0 ], y + load.offset[ 1 ],
+						z + load.offset[ 2 ], n, registers[ r - code.numConstants ] );
+			}
+		}
+
+		for( size_t i = 0; i < code.instructions.size(); ++i )
+		{
+			const detail::Instruction& ins = code.instructions[ i ];
+			T* pDst = ( ins.dst < 0 ? pOut : registers[ ins.dst - code.numConstants ] );
+			const T* pA = pRegisters[ ins.a ];
+			const T* pB = pRegisters[ ins.b ];
+			if( n == BATCH )
+			{
+				execute( ins.code, BATCH, pDst, pA, pB );
+			}
+			else
+			{
+				execute( ins.code, n, pDst, pA, pB );
+			}
+		}
+
+		if( code.instructions.empty() )
+		{
+			const T* pResult = pRegisters[ code.result ];
+			for( int k = 0; k < n; ++k )
+			{
+				pOut[ k ] = pResult[ k ];
+			}
+		}
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		const detail::Code<T>& code = *m_pCode;
+		for( size_t l = 0; l < code.loads.size(); ++l )
+		{
+			const detail::Load& load = code.loads[ l ];
+			const detail::Binding<T>& binding = code.bindings[ load.binding ];
+			if( binding.bUnknown )
+			{
+				visitor.unknown();
+			}
+			for( size_t r = 0; r < binding.reads.size(); ++r )
+			{
+				const detail::Read& read = binding.reads[ r ];
+				visitor.read( read.pData,
+						offsetX + load.offset[ 0 ] + read.offset[ 0 ],
+						offsetY + load.offset[ 1 ] + read.offset[ 1 ],
+						offsetZ + load.offset[ 2 ] + read.offset[ 2 ] );
+			}
+		}
+	}
+
+private:
+#define MM_EXPR_UNARY(opCode,expr) \
+	case opCode: \
+		for( int k = 0; k < n; ++k ) \
+		{ \
+			T a = pA[ k ]; \
+			pDst[ k ] = ( expr ); \
+		} \
+		break;
+
+#define MM_EXPR_BINARY(opCode,expr) \
+	case opCode: \
+		for( int k = 0; k < n; ++k ) \
+		{ \
+			T a = pA[ k ]; \
+			T b = pB[ k ]; \
+			pDst[ k ] = ( expr ); \
+		} \
+		break;
+
+	MM_KERNEL_INLINE static void execute( int opCode, int n, T* MM_RESTRICT pDst,
+			const T* MM_RESTRICT pA, const T* MM_RESTRICT pB )
+	{
+		switch( opCode )
+		{
+		MM_EXPR_BINARY( ADD, a + b )
+		MM_EXPR_BINARY( SUB, a - b )
+		MM_EXPR_BINARY( MUL, a * b )
+		MM_EXPR_BINARY( DIV, a / b )
+		MM_EXPR_UNARY( NEG, -a )
+		MM_EXPR_UNARY( ABS, a >= 0 ? a : -a )
+		MM_EXPR_UNARY( SQR, a * a )
+		MM_EXPR_UNARY( SIN, fun::kernel::sin<MM_FUN_MODE>( a ) )
+		MM_EXPR_UNARY( COS, fun::kernel::cos<MM_FUN_MODE>( a ) )
+		MM_EXPR_UNARY( TAN, fun::kernel::tan<MM_FUN_MODE>( a ) )
+		MM_EXPR_UNARY( SQRT, fun::kernel::sqrt<MM_FUN_MODE>( a ) )
+		MM_EXPR_UNARY( EXP, fun::kernel::exp<MM_FUN_MODE>( a ) )
+		MM_EXPR_UNARY( LOG, fun::kernel::log<MM_FUN_MODE>( a ) )
+		MM_EXPR_UNARY( TANH, fun::kernel::tanh<MM_FUN_MODE>( a ) )
+		MM_EXPR_UNARY( ERF, fun::kernel::erf<MM_FUN_MODE>( a ) )
+		MM_EXPR_BINARY( POW, fun::kernel::pow<MM_FUN_MODE>( a, b ) )
+		MM_EXPR_BINARY( ATAN2, fun::kernel::atan2<MM_FUN_MODE>( a, b ) )
+		}
+	}
+
+#undef MM_EXPR_BINARY
+
+#undef MM_EXPR_UNARY
+
+private:
+	std::shared_ptr<const detail::Code<T>> m_pCode;
+};
+
+/*
+ * Turns formulas given at run time into Programs:
+ *
+ * Compiler<float> compiler;
+ * compiler.bind( "u", u );
+ * compiler.constant( "dt", dt );
+ * compiler.constant( "h", h );
+ * set( out, compiler.compile(
+ *		"u + dt*(u[-1,0]+u[1,0]+u[0,-1]+u[0,1]-4*u)/h^2" ) );
+ *
+ * The syntax is that of the operators: + - * / and ^ for pow, unary minus,
+ * parentheses, name[ dx, dy ] or name[ dx, dy, dz ] for eval at an
+ * offset, and the functions abs, sqr, sin, cos, tan, sqrt, exp, log,
+ * tanh, erf, pow and atan2. Constant subexpressions are folded and equal
+ * loads are shared. Bound functions are referenced, not copied. Errors
+ * throw std::runtime_error.
+ */
+template<typename T>
+class Compiler
+{
+public:
+	template<typename Tfunc>
+	void bind( const std::string& name, const Tfunc& func )
+	{
+		detail::Binding<T> binding;
+		binding.pFunc = &func;
+		detail::bindRows<T, Tfunc>( binding,
+				std::integral_constant<bool, detail::DirectRows<T, Tfunc>::value>() );
+		detail::RecordVisitor visitor = { &binding.reads, false };
+		mm::detail::visit( func, visitor );
+		binding.bUnknown = visitor.bUnknown;
+		m_Names[ name ] = Name( BOUND, (int)m_Bindings.size(), T() );
+		m_Bindings.push_back( binding );
+	}
+
+	void constant( const std::string& name, T value )
+	{
+		m_Names[ name ] = Name( CONSTANT, 0, value );
+	}
+
+	Program<T> compile( const std::string& source ) const
+	{
+		Parser parser( *this, source );
+		return Program<T>( parser.compile() );
+	}
+
+private:
+	enum Kind
+	{
+		BOUND,
+		CONSTANT
+	};
+
+	struct Name
+	{
+		Name()
+			: kind( CONSTANT ), index( 0 ), value()
+		{
+		}
+
+		Name( Kind _kind, int _index, T _value )
+			: kind( _kind ), index( _index ), value( _value )
+		{
+		}
+
+		Kind kind;
+		int index;
+		T value;
+	};
+
+	/*
+	 * Expression tree node. Leaves are constants or loads, code is -1 for
+	 * those.
+	 */
+	struct Node
+	{
+		int code;
+		int a;
+		int b;
+		T value;
+		int load;
+	};
+
+	class Parser
+	{
+	public:
+		Parser( const Compiler<T>& compiler, const std::string& source )
+			: m_Compiler( compiler ), m_Source( source ), m_Pos( 0 ),
+			m_pCode( new detail::Code<T>() ), m_NumTemporaries( 0 )
+		{
+			m_pCode->bindings = compiler.m_Bindings;
+		}
+
+		std::shared_ptr<const detail::Code<T>> compile()
+		{
+			int root = parseSum();
+			skipSpace();
+			if( m_Pos != m_Source.size() )
+			{
+				fail( "unexpected input" );
+			}
+
+			detail::Code<T>& code = *m_pCode;
+			collectConstants( root );
+			code.numConstants = (int)m_Constants.size();
+			code.constants.resize( m_Constants.size() * Program<T>::BATCH );
+			for( size_t c = 0; c < m_Constants.size(); ++c )
+			{
+				for( int k = 0; k < Program<T>::BATCH; ++k )
+				{
+					code.constants[ c * Program<T>::BATCH + k ] = m_Constants[ c ];
+				}
+			}
+			m_FirstTemporary = code.numConstants + (int)code.loads.size();
+			code.result = generate( root );
+			code.numRegisters = m_FirstTemporary + m_NumTemporaries;
+			// constants are registers too, row() keeps a pointer to each
+			if( code.numRegisters > Program<T>::MAX_REGISTERS )
+			{
+				fail( "expression needs too many registers" );
+			}
+			if( !code.instructions.empty() )
+			{
+				code.instructions.back().dst = -1;
+			}
+			return m_pCode;
+		}
+
+	private:
+		void collectConstants( int node )
+		{
+			const Node& n = m_Nodes[ node ];
+			if( n.code >= 0 )
+			{
+				collectConstants( n.a );
+				if( n.b >= 0 )
+				{
+					collectConstants( n.b );
+				}
+			}
+			else if( n.load < 0 )
+			{
+				constantRegister( n.value );
+			}
+		}
+
+		/*
+		 * Temporaries an evaluation of node needs, to order the operands
+		 * so that the larger one goes first.
+		 */
+		int need( int node ) const
+		{
+			const Node& n = m_Nodes[ node ];
+			if( n.code < 0 )
+			{
+				return 0;
+			}
+			int needA = need( n.a );
+			if( n.b < 0 )
+			{
+				return std::max( 1, needA );
+			}
+			int needB = need( n.b );
+			return std::max( 1, needA == needB ? needA + 1 : std::max( needA, needB ) );
+		}
+
+		int generate( int node )
+		{
+			const Node n = m_Nodes[ node ];
+			if( n.code < 0 )
+			{
+				return ( n.load >= 0 ? m_pCode->numConstants + n.load
+						: constantRegister( n.value ) );
+			}
+			int regA;
+			int regB;
+			if( n.b >= 0 && need( n.b ) > need( n.a ) )
+			{
+				regB = generate( n.b );
+				regA = generate( n.a );
+			}
+			else
+			{
+				regA = generate( n.a );
+				regB = ( n.b >= 0 ? generate( n.b ) : regA );
+			}
+			// the destination is never an operand, row() relies on that
+			detail::Instruction ins = { n.code, allocate(), regA, regB };
+			release( regA );
+			if( regB != regA )
+			{
+				release( regB );
+			}
+			m_pCode->instructions.push_back( ins );
+			return ins.dst;
+		}
+
+		int allocate()
+		{
+			if( !m_Free.empty() )
+			{
+				int reg = m_Free.back();
+				m_Free.pop_back();
+				return reg;
+			}
+			return m_FirstTemporary + m_NumTemporaries++;
+		}
+
+		void release( int reg )
+		{
+			if( reg >= m_FirstTemporary )
+			{
+				m_Free.push_back( reg );
+			}
+		}
+
+		int constantRegister( T value )
+		{
+			for( size_t c = 0; c < m_Constants.size(); ++c )
+			{
+				if( m_Constants[ c ] == value )
+				{
+					return (int)c;
+				}
+			}
+			m_Constants.push_back( value );
+			return (int)m_Constants.size() - 1;
+		}
+
+		int constantNode( T value )
+		{
+			Node n = { -1, -1, -1, value, -1 };
+			m_Nodes.push_back( n );
+			return (int)m_Nodes.size() - 1;
+		}
+
+		int loadNode( int binding, const int* offset )
+		{
+			std::vector<detail::Load>& loads = m_pCode->loads;
+			int load = 0;
+			while( load < (int)loads.size() && !( loads[ load ].binding == binding
+					&& loads[ load ].offset[ 0 ] == offset[ 0 ]
+					&& loads[ load ].offset[ 1 ] == offset[ 1 ]
+					&& loads[ load ].offset[ 2 ] == offset[ 2 ] ) )
+			{
+				++load;
+			}
+			if( load == (int)loads.size() )
+			{
+				detail::Load l = { binding, { offset[ 0 ], offset[ 1 ], offset[ 2 ] } };
+				loads.push_back( l );
+			}
+			Node n = { -1, -1, -1, T(), load };
+			m_Nodes.push_back( n );
+			return (int)m_Nodes.size() - 1;
+		}
+
+		bool isConstant( int node ) const
+		{
+			return ( m_Nodes[ node ].code < 0 && m_Nodes[ node ].load < 0 );
+		}
+
+		int node( int code, int a, int b = -1 )
+		{
+			if( isConstant( a ) && ( b < 0 || isConstant( b ) ) )
+			{
+				T valA = m_Nodes[ a ].value;
+				T valB = ( b < 0 ? T() : m_Nodes[ b ].value );
+				return constantNode( detail::apply<T>( code, valA, valB ) );
+			}
+			if( code == POW && isConstant( b ) && m_Nodes[ b ].value == T( 2 ) )
+			{
+				return node( SQR, a );
+			}
+			Node n = { code, a, b, T(), -1 };
+			m_Nodes.push_back( n );
+			return (int)m_Nodes.size() - 1;
+		}
+
+		int parseSum()
+		{
+			int lhs = parseProduct();
+			for( ;; )
+			{
+				if( accept( '+' ) )
+				{
+					lhs = node( ADD, lhs, parseProduct() );
+				}
+				else if( accept( '-' ) )
+				{
+					lhs = node( SUB, lhs, parseProduct() );
+				}
+				else
+				{
+					return lhs;
+				}
+			}
+		}
+
+		int parseProduct()
+		{
+			int lhs = parseUnary();
+			for( ;; )
+			{
+				if( accept( '*' ) )
+				{
+					lhs = node( MUL, lhs, parseUnary() );
+				}
+				else if( accept( '/' ) )
+				{
+					lhs = node( DIV, lhs, parseUnary() );
+				}
+				else
+				{
+					return lhs;
+				}
+			}
+		}
+
+		int parseUnary()
+		{
+			if( accept( '-' ) )
+			{
+				return node( NEG, parseUnary() );
+			}
+			if( accept( '+' ) )
+			{
+				return parseUnary();
+			}
+			return parsePower();
+		}
+
+		int parsePower()
+		{
+			int base = parsePrimary();
+			if( accept( '^' ) )
+			{
+				return node( POW, base, parseUnary() );
+			}
+			return base;
+		}
+
+		int parsePrimary()
+		{
+			skipSpace();
+			if( accept( '(' ) )
+			{
+				int inner = parseSum();
+				expect( ')' );
+				return inner;
+			}
+			if( m_Pos < m_Source.size() && ( std::isdigit( (unsigned char)m_Source[ m_Pos ] )
+					|| m_Source[ m_Pos ] == '.' ) )
+			{
+				const char* pBegin = m_Source.c_str() + m_Pos;
+				char* pEnd;
+				double value = std::strtod( pBegin, &pEnd );
+				m_Pos += pEnd - pBegin;
+				return constantNode( (T)value );
+			}
+
+			std::string name = parseName();
+			if( accept( '(' ) )
+			{
+				return parseCall( name );
+			}
+			typename std::map<std::string, Name>::const_iterator it =
+					m_Compiler.m_Names.find( name );
+			if( it == m_Compiler.m_Names.end() )
+			{
+				fail( "unknown name '" + name + "'" );
+			}
+			if( it->second.kind == CONSTANT )
+			{
+				return constantNode( it->second.value );
+			}
+
+			int offset[ 3 ] = { 0, 0, 0 };
+			if( accept( '[' ) )
+			{
+				int numOffsets = 0;
+				do
+				{
+					if( numOffsets == 3 )
+					{
+						fail( "too many offsets" );
+					}
+					offset[ numOffsets++ ] = parseInteger();
+				}
+				while( accept( ',' ) );
+				if( numOffsets < 2 )
+				{
+					fail( "expected two or three offsets" );
+				}
+				expect( ']' );
+			}
+			return loadNode( it->second.index, offset );
+		}
+
+		int parseCall( const std::string& name )
+		{
+			static const struct
+			{
+				const char* name;
+				int code;
+				int numArgs;
+			} FUNCTIONS[] = {
+				{ "abs", ABS, 1 }, { "sqr", SQR, 1 }, { "sin", SIN, 1 },
+				{ "cos", COS, 1 }, { "tan", TAN, 1 }, { "sqrt", SQRT, 1 },
+				{ "exp", EXP, 1 }, { "log", LOG, 1 }, { "tanh", TANH, 1 },
+				{ "erf", ERF, 1 }, { "pow", POW, 2 }, { "atan2", ATAN2, 2 }
+			};
+			for( size_t f = 0; f < sizeof( FUNCTIONS ) / sizeof( FUNCTIONS[ 0 ] ); ++f )
+			{
+				if( name == FUNCTIONS[ f ].name )
+				{
+					int a = parseSum();
+					int b = -1;
+					if( FUNCTIONS[ f ].numArgs == 2 )
+					{
+						expect( ',' );
+						b = parseSum();
+					}
+					expect( ')' );
+					return node( FUNCTIONS[ f ].code, a, b );
+				}
+			}
+			fail( "unknown function '" + name + "'" );
+			return -1;
+		}
+
+		std::string parseName()
+		{
+			skipSpace();
+			size_t begin = m_Pos;
+			while( m_Pos < m_Source.size() && ( std::isalnum( (unsigned char)m_Source[ m_Pos ] )
+					|| m_Source[ m_Pos ] == '_' ) )
+			{
+				++m_Pos;
+			}
+			if( m_Pos == begin )
+			{
+				fail( "expected an operand" );
+			}
+			return m_Source.substr( begin, m_Pos - begin );
+		}
+
+		int parseInteger()
+		{
+			skipSpace();
+			const char* pBegin = m_Source.c_str() + m_Pos;
+			char* pEnd;
+			long value = std::strtol( pBegin, &pEnd, 10 );
+			if( pEnd == pBegin )
+			{
+				fail( "expected an integer offset" );
+			}
+			m_Pos += pEnd - pBegin;
+			return (int)value;
+		}
+
+		void skipSpace()
+		{
+			while( m_Pos < m_Source.size() && std::isspace( (unsigned char)m_Source[ m_Pos ] ) )
+			{
+				++m_Pos;
+			}
+		}
+
+		bool accept( char c )
+		{
+			skipSpace();
+			if( m_Pos < m_Source.size() && m_Source[ m_Pos ] == c )
+			{
+				++m_Pos;
+				return true;
+			}
+			return false;
+		}
+
+		void expect( char c )
+		{
+			if( !accept( c ) )
+			{
+				fail( std::string( "expected '" ) + c + "'" );
+			}
+		}
+
+		void fail( const std::string& message ) const
+		{
+			throw std::runtime_error( "expression, position "
+					+ std::to_string( m_Pos ) + ": " + message );
+		}
+
+	private:
+		const Compiler<T>& m_Compiler;
+		const std::string& m_Source;
+		size_t m_Pos;
+		std::shared_ptr<detail::Code<T>> m_pCode;
+		std::vector<Node> m_Nodes;
+		std::vector<T> m_Constants;
+		std::vector<int> m_Free;
+		int m_FirstTemporary;
+		int m_NumTemporaries;
+	};
+
+private:
+	std::map<std::string, Name> m_Names;
+	std::vector<detail::Binding<T>> m_Bindings;
+};
+
+}
+
+}
+
+#endif
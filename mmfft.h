@@ -0,0 +1,655 @@
+#ifndef _MMFFT_H_
+#define _MMFFT_H_
+
+#include "metamath.h"
+#include "mmfunction.h"
+#include "mmparallel.h"
+
+#include <cmath>
+#include <complex>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace mm
+{
+
+namespace fft
+{
+
+/*
+ * What lies outside the grid: PERIODIC wraps around, DIRICHLET reads
+ * zero, i.e. u = 0 one point beyond every edge.
+ */
+enum Boundary
+{
+	PERIODIC,
+	DIRICHLET
+};
+
+namespace detail
+{
+
+typedef std::complex<double> Complex;
+
+/* Plain complex product, without the NaN recovery of operator*. */
+inline Complex mul( const Complex& a, const Complex& b )
+{
+	return Complex( a.real() * b.real() - a.imag() * b.imag(),
+			a.real() * b.imag() + a.imag() * b.real() );
+}
+
+inline int nextPow2( int n )
+{
+	int m = 1;
+	while( m < n )
+	{
+		m <<= 1;
+	}
+	return m;
+}
+
+class Plan;
+
+const Plan& plan( int n );
+
+/*
+ * Unnormalized complex DFT of length n, exp( -2 pi i j k / n ) forward.
+ * Powers of two run an iterative radix-2 transform; other lengths go
+ * through Bluestein's chirp-z on a power of two of at least 2n - 1.
+ */
+class Plan
+{
+public:
+	explicit Plan( int n )
+		: m_Size( n ), m_pInner( nullptr )
+	{
+		const double PI = 3.14159265358979323846;
+		if( nextPow2( n ) == n )
+		{
+			int bits = 0;
+			while( ( 1 << bits ) < n )
+			{
+				++bits;
+			}
+			m_Reverse.resize( n );
+			for( int i = 0; i < n; ++i )
+			{
+				int r = 0;
+				for( int b = 0; b < bits; ++b )
+				{
+					r |= ( ( i >> b ) & 1 ) << ( bits - 1 - b );
+				}
+				m_Reverse[ i ] = r;
+			}
+			m_Twiddles.resize( n / 2 );
+			for( int k = 0; k < n / 2; ++k )
+			{
+				m_Twiddles[ k ] = std::polar( 1.0, -2 * PI * k / n );
+			}
+		}
+		else
+		{
+			int m = nextPow2( 2 * n - 1 );
+			m_pInner = &plan( m );
+			m_Chirp.resize( n );
+			for( int k = 0; k < n; ++k )
+			{
+				long long k2 = (long long)k * k % ( 2 * n );
+				m_Chirp[ k ] = std::polar( 1.0, -PI * k2 / n );
+			}
+			m_Filter.assign( m, Complex( 0 ) );
+			m_Filter[ 0 ] = std::conj( m_Chirp[ 0 ] );
+			for( int k = 1; k < n; ++k )
+			{
+				m_Filter[ k ] = m_Filter[ m - k ] = std::conj( m_Chirp[ k ] );
+			}
+			m_pInner->forward( m_Filter.data() );
+		}
+	}
+
+	int size() const
+	{
+		return m_Size;
+	}
+
+	void forward( Complex* p ) const
+	{
+		if( m_pInner == nullptr )
+		{
+			radix2( p );
+		}
+		else
+		{
+			bluestein( p );
+		}
+	}
+
+	void inverse( Complex* p ) const
+	{
+		for( int i = 0; i < m_Size; ++i )
+		{
+			p[ i ] = std::conj( p[ i ] );
+		}
+		forward( p );
+		for( int i = 0; i < m_Size; ++i )
+		{
+			p[ i ] = std::conj( p[ i ] );
+		}
+	}
+
+private:
+	void radix2( Complex* p ) const
+	{
+		int n = m_Size;
+		for( int i = 0; i < n; ++i )
+		{
+			if( i < m_Reverse[ i ] )
+			{
+				std::swap( p[ i ], p[ m_Reverse[ i ] ] );
+			}
+		}
+		for( int len = 2; len <= n; len <<= 1 )
+		{
+			int half = len >> 1;
+			int step = n / len;
+			for( int i = 0; i < n; i += len )
+			{
+				for( int k = 0; k < half; ++k )
+				{
+					Complex u = p[ i + k ];
+					Complex v = mul( p[ i + k + half ], m_Twiddles[ k * step ] );
+					p[ i + k ] = u + v;
+					p[ i + k + half ] = u - v;
+				}
+			}
+		}
+	}
+
+	void bluestein( Complex* p ) const
+	{
+		static thread_local std::vector<Complex> buffer;
+		int n = m_Size;
+		int m = m_pInner->size();
+		buffer.assign( m, Complex( 0 ) );
+		for( int k = 0; k < n; ++k )
+		{
+			buffer[ k ] = mul( p[ k ], m_Chirp[ k ] );
+		}
+		m_pInner->forward( buffer.data() );
+		for( int k = 0; k < m; ++k )
+		{
+			buffer[ k ] = mul( buffer[ k ], m_Filter[ k ] );
+		}
+		m_pInner->inverse( buffer.data() );
+		double scale = 1.0 / m;
+		for( int k = 0; k < n; ++k )
+		{
+			p[ k ] = mul( buffer[ k ], m_Chirp[ k ] ) * scale;
+		}
+	}
+
+private:
+	int m_Size;
+	std::vector<int> m_Reverse;
+	std::vector<Complex> m_Twiddles;
+	const Plan* m_pInner;
+	std::vector<Complex> m_Chirp;
+	std::vector<Complex> m_Filter;
+};
+
+/*
+ * Plans are built once per length and kept for the lifetime of the
+ * program. Building happens outside the lock, as Bluestein plans ask for
+ * their inner power-of-two plan.
+ */
+inline const Plan& plan( int n )
+{
+	static std::mutex mutex;
+	static std::map<int, std::unique_ptr<Plan>> plans;
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		std::map<int, std::unique_ptr<Plan>>::const_iterator it = plans.find( n );
+		if( it != plans.end() )
+		{
+			return *it->second;
+		}
+	}
+	std::unique_ptr<Plan> pPlan( new Plan( n ) );
+	std::lock_guard<std::mutex> lock( mutex );
+	std::unique_ptr<Plan>& entry = plans[ n ];
+	if( !entry )
+	{
+		entry = std::move( pPlan );
+	}
+	return *entry;
+}
+
+/*
+ * Real 2D DFT of an sizeY x sizeX row-major array into its sizeX / 2 + 1
+ * non-redundant columns. Rows are transformed two at a time as the real
+ * and imaginary parts of one complex row, columns one by one; both are
+ * split among the threads of the pool.
+ */
+class RealTransform
+{
+public:
+	RealTransform( int sizeX, int sizeY )
+		: m_SizeX( sizeX ), m_SizeY( sizeY ), m_Half( sizeX / 2 + 1 ),
+		  m_PlanX( plan( sizeX ) ), m_PlanY( plan( sizeY ) )
+	{
+	}
+
+	int half() const
+	{
+		return m_Half;
+	}
+
+	void forward( parallel::ThreadPool& pool, const double* pIn, Complex* pSpec ) const
+	{
+		int sizeX = m_SizeX;
+		int sizeY = m_SizeY;
+		int half = m_Half;
+		pool.parallelFor( 0, ( sizeY + 1 ) / 2,
+				[&]( int begin, int end )
+				{
+					std::vector<Complex> row( sizeX );
+					for( int r = begin; r < end; ++r )
+					{
+						int j0 = 2 * r;
+						int j1 = j0 + 1;
+						for( int i = 0; i < sizeX; ++i )
+						{
+							row[ i ] = Complex( pIn[ j0 * sizeX + i ],
+									j1 < sizeY ? pIn[ j1 * sizeX + i ] : 0.0 );
+						}
+						m_PlanX.forward( row.data() );
+						for( int k = 0; k < half; ++k )
+						{
+							Complex a = row[ k ];
+							Complex b = std::conj( row[ ( sizeX - k ) % sizeX ] );
+							pSpec[ j0 * half + k ] = 0.5 * ( a + b );
+							if( j1 < sizeY )
+							{
+								pSpec[ j1 * half + k ] = mul( a - b, Complex( 0, -0.5 ) );
+							}
+						}
+					}
+				} );
+		columns( pool, pSpec, false );
+	}
+
+	/* Inverse of forward() including the 1 / ( sizeX sizeY ); pSpec is overwritten. */
+	void inverse( parallel::ThreadPool& pool, Complex* pSpec, double* pOut ) const
+	{
+		columns( pool, pSpec, true );
+		int sizeX = m_SizeX;
+		int sizeY = m_SizeY;
+		int half = m_Half;
+		double scale = 1.0 / ( (double)sizeX * sizeY );
+		pool.parallelFor( 0, ( sizeY + 1 ) / 2,
+				[&]( int begin, int end )
+				{
+					std::vector<Complex> row( sizeX );
+					Complex i1( 0, 1 );
+					for( int r = begin; r < end; ++r )
+					{
+						int j0 = 2 * r;
+						int j1 = j0 + 1;
+						for( int k = 0; k < sizeX; ++k )
+						{
+							bool bMirror = ( k >= half );
+							int kk = ( bMirror ? sizeX - k : k );
+							Complex a = pSpec[ j0 * half + kk ];
+							Complex b = ( j1 < sizeY ? pSpec[ j1 * half + kk ] : Complex( 0 ) );
+							if( bMirror )
+							{
+								a = std::conj( a );
+								b = std::conj( b );
+							}
+							row[ k ] = a + mul( i1, b );
+						}
+						m_PlanX.inverse( row.data() );
+						for( int i = 0; i < sizeX; ++i )
+						{
+							pOut[ j0 * sizeX + i ] = row[ i ].real() * scale;
+							if( j1 < sizeY )
+							{
+								pOut[ j1 * sizeX + i ] = row[ i ].imag() * scale;
+							}
+						}
+					}
+				} );
+	}
+
+private:
+	void columns( parallel::ThreadPool& pool, Complex* pSpec, bool bInverse ) const
+	{
+		int sizeY = m_SizeY;
+		int half = m_Half;
+		pool.parallelFor( 0, half,
+				[&]( int begin, int end )
+				{
+					std::vector<Complex> column( sizeY );
+					for( int k = begin; k < end; ++k )
+					{
+						for( int j = 0; j < sizeY; ++j )
+						{
+							column[ j ] = pSpec[ j * half + k ];
+						}
+						if( bInverse )
+						{
+							m_PlanY.inverse( column.data() );
+						}
+						else
+						{
+							m_PlanY.forward( column.data() );
+						}
+						for( int j = 0; j < sizeY; ++j )
+						{
+							pSpec[ j * half + k ] = column[ j ];
+						}
+					}
+				} );
+	}
+
+private:
+	int m_SizeX;
+	int m_SizeY;
+	int m_Half;
+	const Plan& m_PlanX;
+	const Plan& m_PlanY;
+};
+
+/*
+ * 2D DST-I, sum over j of a_j sin( pi j k / ( n + 1 ) ) along both axes,
+ * in place. Each 1D transform is the odd extension to 2 ( n + 1 ) points;
+ * two rows (or columns) share one complex FFT. It is its own inverse up
+ * to 4 / ( ( sizeX + 1 ) ( sizeY + 1 ) ).
+ */
+class SineTransform
+{
+public:
+	SineTransform( int sizeX, int sizeY )
+		: m_SizeX( sizeX ), m_SizeY( sizeY ),
+		  m_PlanX( plan( 2 * ( sizeX + 1 ) ) ), m_PlanY( plan( 2 * ( sizeY + 1 ) ) )
+	{
+	}
+
+	void apply( parallel::ThreadPool& pool, double* pData ) const
+	{
+		int sizeX = m_SizeX;
+		int sizeY = m_SizeY;
+		pool.parallelFor( 0, ( sizeY + 1 ) / 2,
+				[&]( int begin, int end )
+				{
+					std::vector<Complex> buffer( m_PlanX.size() );
+					for( int r = begin; r < end; ++r )
+					{
+						int j1 = 2 * r + 1;
+						pair( m_PlanX, sizeX, &pData[ 2 * r * sizeX ],
+								j1 < sizeY ? &pData[ j1 * sizeX ] : nullptr, 1, buffer.data() );
+					}
+				} );
+		pool.parallelFor( 0, ( sizeX + 1 ) / 2,
+				[&]( int begin, int end )
+				{
+					std::vector<Complex> buffer( m_PlanY.size() );
+					for( int r = begin; r < end; ++r )
+					{
+						int i1 = 2 * r + 1;
+						pair( m_PlanY, sizeY, &pData[ 2 * r ],
+								i1 < sizeX ? &pData[ i1 ] : nullptr, sizeX, buffer.data() );
+					}
+				} );
+	}
+
+private:
+	static void pair( const Plan& plan, int n, double* pA, double* pB, int stride,
+			Complex* pBuffer )
+	{
+		int m = 2 * ( n + 1 );
+		pBuffer[ 0 ] = pBuffer[ n + 1 ] = Complex( 0 );
+		for( int j = 1; j <= n; ++j )
+		{
+			Complex z( pA[ ( j - 1 ) * stride ], pB != nullptr ? pB[ ( j - 1 ) * stride ] : 0.0 );
+			pBuffer[ j ] = z;
+			pBuffer[ m - j ] = -z;
+		}
+		plan.forward( pBuffer );
+		for( int k = 1; k <= n; ++k )
+		{
+			pA[ ( k - 1 ) * stride ] = -0.5 * pBuffer[ k ].imag();
+			if( pB != nullptr )
+			{
+				pB[ ( k - 1 ) * stride ] = 0.5 * pBuffer[ k ].real();
+			}
+		}
+	}
+
+private:
+	int m_SizeX;
+	int m_SizeY;
+	const Plan& m_PlanX;
+	const Plan& m_PlanY;
+};
+
+template<typename Tfunc>
+inline void load( const Tfunc& func, int sizeX, int sizeY, double* pOut, int pitch )
+{
+	for( int y = 0; y < sizeY; ++y )
+	{
+		for( int x = 0; x < sizeX; ++x )
+		{
+			pOut[ y * pitch + x ] = func( x, y );
+		}
+	}
+}
+
+template<typename Tfunc>
+inline void store( Tfunc& func, int sizeX, int sizeY, const double* pIn, int pitch )
+{
+	for( int y = 0; y < sizeY; ++y )
+	{
+		for( int x = 0; x < sizeX; ++x )
+		{
+			func( x, y ) = pIn[ y * pitch + x ];
+		}
+	}
+	mm::detail::written( func, 0, 0, 0, sizeX, sizeY, 1 );
+}
+
+}
+
+/*
+ * Exact solver for diffXX_YY( u, h ) = f on a sizeX x sizeY grid. With
+ * PERIODIC the mean of f is dropped and u comes out with zero mean; with
+ * DIRICHLET u is zero one point beyond every edge, as when u is read
+ * through bc::dirichlet( u, 0 ). Plans and eigenvalues are computed once,
+ * so keep the solver around for repeated solves. Sizes that make the
+ * transform lengths powers of two, size for PERIODIC and size + 1 for
+ * DIRICHLET, are several times faster than others.
+ */
+class Poisson
+{
+public:
+	template<typename U>
+	Poisson( const U& _size, Boundary boundary )
+	{
+		double h[ 2 ] = { 1, 1 };
+		init( _size[ 0 ], _size[ 1 ], boundary, h );
+	}
+
+	template<typename U, typename Th>
+	Poisson( const U& _size, Boundary boundary, const Th& h )
+	{
+		double spacing[ 2 ] = { (double)h[ 0 ], (double)h[ 1 ] };
+		init( _size[ 0 ], _size[ 1 ], boundary, spacing );
+	}
+
+	template<typename Tu, typename Tf>
+	void solve( parallel::ThreadPool& pool, Tu& u, const Tf& f ) const
+	{
+		int sizeX = m_SizeX;
+		int sizeY = m_SizeY;
+		std::vector<double> data( sizeX * sizeY );
+		detail::load( f, sizeX, sizeY, data.data(), sizeX );
+		if( m_Boundary == PERIODIC )
+		{
+			int half = m_pReal->half();
+			std::vector<detail::Complex> spec( half * sizeY );
+			m_pReal->forward( pool, data.data(), spec.data() );
+			for( size_t i = 0; i < spec.size(); ++i )
+			{
+				spec[ i ] *= m_Inverse[ i ];
+			}
+			m_pReal->inverse( pool, spec.data(), data.data() );
+		}
+		else
+		{
+			m_pSine->apply( pool, data.data() );
+			for( size_t i = 0; i < data.size(); ++i )
+			{
+				data[ i ] *= m_Inverse[ i ];
+			}
+			m_pSine->apply( pool, data.data() );
+		}
+		detail::store( u, sizeX, sizeY, data.data(), sizeX );
+	}
+
+	template<typename Tu, typename Tf>
+	void solve( Tu& u, const Tf& f ) const
+	{
+		solve( parallel::ThreadPool::instance(), u, f );
+	}
+
+private:
+	void init( int sizeX, int sizeY, Boundary boundary, const double* h )
+	{
+		const double PI = 3.14159265358979323846;
+		m_SizeX = sizeX;
+		m_SizeY = sizeY;
+		m_Boundary = boundary;
+		double wx = 1 / ( h[ 0 ] * h[ 0 ] );
+		double wy = 1 / ( h[ 1 ] * h[ 1 ] );
+		if( boundary == PERIODIC )
+		{
+			m_pReal.reset( new detail::RealTransform( sizeX, sizeY ) );
+			int half = m_pReal->half();
+			m_Inverse.resize( half * sizeY );
+			for( int ky = 0; ky < sizeY; ++ky )
+			{
+				for( int kx = 0; kx < half; ++kx )
+				{
+					double lambda = wx * ( 2 * std::cos( 2 * PI * kx / sizeX ) - 2 )
+							+ wy * ( 2 * std::cos( 2 * PI * ky / sizeY ) - 2 );
+					m_Inverse[ ky * half + kx ] = ( kx == 0 && ky == 0 ? 0.0 : 1 / lambda );
+				}
+			}
+		}
+		else
+		{
+			m_pSine.reset( new detail::SineTransform( sizeX, sizeY ) );
+			double scale = 4 / ( ( sizeX + 1.0 ) * ( sizeY + 1.0 ) );
+			m_Inverse.resize( sizeX * sizeY );
+			for( int ky = 0; ky < sizeY; ++ky )
+			{
+				for( int kx = 0; kx < sizeX; ++kx )
+				{
+					double lambda = wx * ( 2 * std::cos( PI * ( kx + 1 ) / ( sizeX + 1 ) ) - 2 )
+							+ wy * ( 2 * std::cos( PI * ( ky + 1 ) / ( sizeY + 1 ) ) - 2 );
+					m_Inverse[ ky * sizeX + kx ] = scale / lambda;
+				}
+			}
+		}
+	}
+
+private:
+	int m_SizeX;
+	int m_SizeY;
+	Boundary m_Boundary;
+	std::unique_ptr<detail::RealTransform> m_pReal;
+	std::unique_ptr<detail::SineTransform> m_pSine;
+	std::vector<double> m_Inverse;
+};
+
+/*
+ * Applies a large stencil by FFT: out( x, y ) is the sum over the kernel
+ * of kernel( i, j ) in( x + i - centerX, y + j - centerY ), the sum of
+ * Eval offsets it replaces. Reads beyond the grid wrap around (PERIODIC)
+ * or are zero (DIRICHLET, computed on a grid padded to powers of two).
+ * The kernel spectrum is computed once.
+ */
+class Convolution
+{
+public:
+	template<typename U, typename Tkernel>
+	Convolution( const U& _size, const Tkernel& kernel, int centerX, int centerY,
+			Boundary boundary )
+		: m_SizeX( _size[ 0 ] ), m_SizeY( _size[ 1 ] )
+	{
+		int kernelX = kernel.size()[ 0 ];
+		int kernelY = kernel.size()[ 1 ];
+		if( boundary == PERIODIC )
+		{
+			m_PaddedX = m_SizeX;
+			m_PaddedY = m_SizeY;
+		}
+		else
+		{
+			m_PaddedX = detail::nextPow2( m_SizeX + kernelX - 1 );
+			m_PaddedY = detail::nextPow2( m_SizeY + kernelY - 1 );
+		}
+		m_pReal.reset( new detail::RealTransform( m_PaddedX, m_PaddedY ) );
+
+		std::vector<double> weights( m_PaddedX * m_PaddedY, 0.0 );
+		for( int j = 0; j < kernelY; ++j )
+		{
+			for( int i = 0; i < kernelX; ++i )
+			{
+				int x = ( ( centerX - i ) % m_PaddedX + m_PaddedX ) % m_PaddedX;
+				int y = ( ( centerY - j ) % m_PaddedY + m_PaddedY ) % m_PaddedY;
+				weights[ y * m_PaddedX + x ] += kernel( i, j );
+			}
+		}
+		m_Spectrum.resize( m_pReal->half() * m_PaddedY );
+		m_pReal->forward( parallel::ThreadPool::instance(), weights.data(), m_Spectrum.data() );
+	}
+
+	/* out and in may be the same function. */
+	template<typename Tout, typename Tin>
+	void apply( parallel::ThreadPool& pool, Tout& out, const Tin& in ) const
+	{
+		std::vector<double> data( m_PaddedX * m_PaddedY, 0.0 );
+		detail::load( in, m_SizeX, m_SizeY, data.data(), m_PaddedX );
+		std::vector<detail::Complex> spec( m_Spectrum.size() );
+		m_pReal->forward( pool, data.data(), spec.data() );
+		for( size_t i = 0; i < spec.size(); ++i )
+		{
+			spec[ i ] = detail::mul( spec[ i ], m_Spectrum[ i ] );
+		}
+		m_pReal->inverse( pool, spec.data(), data.data() );
+		detail::store( out, m_SizeX, m_SizeY, data.data(), m_PaddedX );
+	}
+
+	template<typename Tout, typename Tin>
+	void apply( Tout& out, const Tin& in ) const
+	{
+		apply( parallel::ThreadPool::instance(), out, in );
+	}
+
+private:
+	int m_SizeX;
+	int m_SizeY;
+	int m_PaddedX;
+	int m_PaddedY;
+	std::unique_ptr<detail::RealTransform> m_pReal;
+	std::vector<detail::Complex> m_Spectrum;
+};
+
+}
+
+}
+
+#endif
@@ -0,0 +1,479 @@
+#ifndef _MMFILTER_H_
+#define _MMFILTER_H_
+
+#include "metamath.h"
+#include "mmparallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace mm
+{
+
+/*
+ * Separable 2D filters, evaluated with set() instead of as expressions:
+ *
+ * set( smooth, begin, end, filter::box( q, 8 ) );
+ * parallel::set( pool, smooth, filter::gaussian( bc::clamp( q ), 3.0 ) );
+ *
+ * Rows are filtered into a ring of row buffers as they are needed and the
+ * output row is combined from the ring, so the loops run along x and the
+ * vertical ones vectorize, and src is evaluated once per point and pass.
+ * src is read up to the filter's radius outside the written range and
+ * must not read the function being written.
+ */
+namespace filter
+{
+
+namespace detail
+{
+
+/* Row splitting of the filters: all rows at once, or rows across a pool. */
+struct Serial
+{
+	template<typename Tfn>
+	void operator()( int begin, int end, int, const Tfn& fn ) const
+	{
+		if( begin < end )
+		{
+			fn( begin, end );
+		}
+	}
+};
+
+/*
+ * Every share primes its ring with overlap rows first, so shares are kept
+ * at least twice that high.
+ */
+struct Parallel
+{
+	template<typename Tfn>
+	void operator()( int begin, int end, int overlap, const Tfn& fn ) const
+	{
+		int numChunks = 4 * ( (int)pool.size() + 1 );
+		int grain = std::max( ( end - begin + numChunks - 1 ) / numChunks, 2 * overlap );
+		pool.parallelFor( begin, end, grain, fn );
+	}
+
+	parallel::ThreadPool& pool;
+};
+
+/* Intermediate result of a multi-pass filter over [ begin, end ). */
+template<typename T>
+class Plane
+{
+public:
+	Plane( int beginX, int beginY, int endX, int endY )
+		: m_BeginX( beginX ), m_BeginY( beginY ), m_Width( endX - beginX ),
+		  m_Data( (size_t)( endX - beginX ) * ( endY - beginY ) )
+	{
+	}
+
+	T& operator()( int x, int y )
+	{
+		return m_Data[ (size_t)( y - m_BeginY ) * m_Width + ( x - m_BeginX ) ];
+	}
+
+	const T& operator()( int x, int y ) const
+	{
+		return m_Data[ (size_t)( y - m_BeginY ) * m_Width + ( x - m_BeginX ) ];
+	}
+
+private:
+	Plane( const Plane& );
+
+private:
+	int m_BeginX;
+	int m_BeginY;
+	int m_Width;
+	std::vector<T> m_Data;
+};
+
+template<typename T, typename Tsrc>
+inline void readRow( const Tsrc& src, int beginX, int y, int n, T* pIn )
+{
+	for( int i = 0; i < n; ++i )
+	{
+		pIn[ i ] = src( beginX + i, y );
+	}
+}
+
+/*
+ * Sliding sum of width points along pIn. The row is cut into segments of
+ * at least width points, and SEGMENTS of them advance together, which
+ * gives that many independent dependency chains. Each segment starts
+ * with an exact sum, so rounding errors of floating point sums do not
+ * grow along the row, at O( 1 ) extra cost per point.
+ */
+template<typename T>
+inline void slidingSum( const T* pIn, int n, int width, T* pOut )
+{
+	const int SEGMENTS = 8;
+	int length = std::max( width, 64 );
+	int first = 0;
+	for( ; first + SEGMENTS * length <= n; first += SEGMENTS * length )
+	{
+		T s[ SEGMENTS ];
+		for( int c = 0; c < SEGMENTS; ++c )
+		{
+			const T* pSeg = pIn + first + c * length;
+			s[ c ] = 0;
+			for( int k = 0; k < width; ++k )
+			{
+				s[ c ] += pSeg[ k ];
+			}
+			pOut[ first + c * length ] = s[ c ];
+		}
+		for( int i = 1; i < length; ++i )
+		{
+			for( int c = 0; c < SEGMENTS; ++c )
+			{
+				const T* pSeg = pIn + first + c * length;
+				s[ c ] += pSeg[ i + width - 1 ] - pSeg[ i - 1 ];
+				pOut[ first + c * length + i ] = s[ c ];
+			}
+		}
+	}
+	for( ; first < n; first += length )
+	{
+		T s = 0;
+		for( int k = 0; k < width; ++k )
+		{
+			s += pIn[ first + k ];
+		}
+		pOut[ first ] = s;
+		int last = std::min( first + length, n );
+		for( int i = first + 1; i < last; ++i )
+		{
+			s += pIn[ i + width - 1 ] - pIn[ i - 1 ];
+			pOut[ i ] = s;
+		}
+	}
+}
+
+/*
+ * Mean over ( 2 rx + 1 ) x ( 2 ry + 1 ) boxes for the rows [ beginY,
+ * endY ). The column sums slide down a ring of row sums, one loop per row
+ * replacing the oldest ring row and writing the output, and are summed
+ * anew from the ring whenever it has been replaced completely.
+ */
+template<typename T, typename Tfunc, typename Tsrc>
+inline void boxRows( Tfunc& func, const Tsrc& src, int beginX, int beginY,
+		int endX, int endY, int rx, int ry )
+{
+	int n = endX - beginX;
+	int width = 2 * rx + 1;
+	int height = 2 * ry + 1;
+	T scale = T( 1 ) / T( width * height );
+	std::vector<T> in( n + 2 * rx );
+	std::vector<T> row( n );
+	std::vector<T> sum( n );
+	std::vector<T> ring( (size_t)height * n );
+	const T* pNew = row.data();
+	T* pSum = sum.data();
+	for( int y = beginY - ry; y < endY + ry; ++y )
+	{
+		readRow( src, beginX - rx, y, n + 2 * rx, in.data() );
+		int slot = ( y - beginY + ry ) % height;
+		T* pOld = &ring[ (size_t)slot * n ];
+		if( y < beginY + ry || slot == height - 1 )
+		{
+			slidingSum( in.data(), n, width, pOld );
+			if( slot != height - 1 )
+			{
+				continue;
+			}
+			std::fill( sum.begin(), sum.end(), T( 0 ) );
+			for( int k = 0; k < height; ++k )
+			{
+				const T* pRow = &ring[ (size_t)k * n ];
+				for( int i = 0; i < n; ++i )
+				{
+					pSum[ i ] += pRow[ i ];
+				}
+			}
+			for( int i = 0; i < n; ++i )
+			{
+				func( beginX + i, y - ry ) = pSum[ i ] * scale;
+			}
+			continue;
+		}
+		slidingSum( in.data(), n, width, row.data() );
+		for( int i = 0; i < n; ++i )
+		{
+			T s = pSum[ i ] + ( pNew[ i ] - pOld[ i ] );
+			pSum[ i ] = s;
+			pOld[ i ] = pNew[ i ];
+			func( beginX + i, y - ry ) = s * scale;
+		}
+	}
+}
+
+/*
+ * Correlation with kx along x, then with ky along y, for the rows
+ * [ beginY, endY ). Source row y lands in ring slot ( y - beginY + ry )
+ * modulo the height of ky.
+ */
+template<typename T, typename Tfunc, typename Tsrc>
+inline void separableRows( Tfunc& func, const Tsrc& src, int beginX, int beginY,
+		int endX, int endY, const std::vector<T>& kx, const std::vector<T>& ky )
+{
+	int n = endX - beginX;
+	int width = (int)kx.size();
+	int height = (int)ky.size();
+	int rx = width / 2;
+	int ry = height / 2;
+	std::vector<T> in( n + width - 1 );
+	std::vector<T> out( n );
+	std::vector<T> ring( (size_t)height * n );
+	const T* pIn = in.data();
+	T* pOut = out.data();
+	for( int y = beginY - ry; y < endY + ry; ++y )
+	{
+		readRow( src, beginX - rx, y, n + width - 1, in.data() );
+		T* pRow = &ring[ (size_t)( ( y - beginY + ry ) % height ) * n ];
+		std::fill( pRow, pRow + n, T( 0 ) );
+		for( int k = 0; k < width; ++k )
+		{
+			T w = kx[ k ];
+			for( int i = 0; i < n; ++i )
+			{
+				pRow[ i ] += w * pIn[ i + k ];
+			}
+		}
+		int outY = y - ry;
+		if( outY < beginY )
+		{
+			continue;
+		}
+		std::fill( out.begin(), out.end(), T( 0 ) );
+		for( int k = 0; k < height; ++k )
+		{
+			T w = ky[ k ];
+			const T* pSrc = &ring[ (size_t)( ( outY - beginY + k ) % height ) * n ];
+			for( int i = 0; i < n; ++i )
+			{
+				pOut[ i ] += w * pSrc[ i ];
+			}
+		}
+		for( int i = 0; i < n; ++i )
+		{
+			func( beginX + i, outY ) = pOut[ i ];
+		}
+	}
+}
+
+}
+
+/* Mean over a box of ( 2 radiusX + 1 ) x ( 2 radiusY + 1 ) points. */
+struct Box
+{
+	template<typename Tfunc, typename Tsrc, typename Tsplit>
+	void apply( Tfunc& func, const Tsrc& src, int beginX, int beginY, int endX, int endY,
+			const Tsplit& split ) const
+	{
+		typedef op_accum<Tsrc> T;
+		int rx = radiusX;
+		int ry = radiusY;
+		split( beginY, endY, 2 * ry + 1,
+				[&]( int first, int last )
+				{
+					detail::boxRows<T>( func, src, beginX, first, endX, last, rx, ry );
+				} );
+	}
+
+	int radiusX;
+	int radiusY;
+};
+
+/*
+ * Correlation with the odd-length weights kernelX along x and kernelY
+ * along y, weight k applying at offset k - size / 2.
+ */
+template<typename T>
+struct Separable
+{
+	template<typename Tfunc, typename Tsrc, typename Tsplit>
+	void apply( Tfunc& func, const Tsrc& src, int beginX, int beginY, int endX, int endY,
+			const Tsplit& split ) const
+	{
+		split( beginY, endY, (int)kernelY.size(),
+				[&]( int first, int last )
+				{
+					detail::separableRows( func, src, beginX, first, endX, last,
+							kernelX, kernelY );
+				} );
+	}
+
+	std::vector<T> kernelX;
+	std::vector<T> kernelY;
+};
+
+/*
+ * Gaussian of standard deviation sigma, approximated by passes box means
+ * whose widths are chosen to match its variance. Each pass but the last
+ * is written to an intermediate plane grown by the radii of the passes
+ * after it, so src is read up to the sum of all radii outside.
+ */
+struct Gaussian
+{
+	template<typename Tfunc, typename Tsrc, typename Tsplit>
+	void apply( Tfunc& func, const Tsrc& src, int beginX, int beginY, int endX, int endY,
+			const Tsplit& split ) const
+	{
+		typedef op_accum<Tsrc> T;
+		std::vector<int> radii = this->radii();
+		int reach = 0;
+		for( size_t k = 1; k < radii.size(); ++k )
+		{
+			reach += radii[ k ];
+		}
+		if( reach == 0 )
+		{
+			Box box = { radii[ 0 ], radii[ 0 ] };
+			box.apply( func, src, beginX, beginY, endX, endY, split );
+			return;
+		}
+		detail::Plane<T> planeA( beginX - reach, beginY - reach, endX + reach, endY + reach );
+		detail::Plane<T> planeB( beginX - reach, beginY - reach, endX + reach, endY + reach );
+		Box box = { radii[ 0 ], radii[ 0 ] };
+		box.apply( planeA, src, beginX - reach, beginY - reach, endX + reach, endY + reach,
+				split );
+		detail::Plane<T>* pFrom = &planeA;
+		detail::Plane<T>* pTo = &planeB;
+		for( size_t k = 1; k + 1 < radii.size(); ++k )
+		{
+			reach -= radii[ k ];
+			Box pass = { radii[ k ], radii[ k ] };
+			pass.apply( *pTo, *pFrom, beginX - reach, beginY - reach, endX + reach,
+					endY + reach, split );
+			std::swap( pFrom, pTo );
+		}
+		Box last = { radii.back(), radii.back() };
+		last.apply( func, *pFrom, beginX, beginY, endX, endY, split );
+	}
+
+	/* Box radii after Kovesi, "Fast almost-Gaussian filtering", 2010. */
+	std::vector<int> radii() const
+	{
+		double variance = 12.0 * sigma * sigma;
+		int widthLow = (int)std::sqrt( variance / passes + 1.0 );
+		widthLow -= ( widthLow % 2 == 0 ? 1 : 0 );
+		int numLow = (int)std::floor( ( variance - passes * widthLow * widthLow
+				- 4.0 * passes * widthLow - 3.0 * passes ) / ( -4.0 * widthLow - 4.0 ) + 0.5 );
+		std::vector<int> res( passes );
+		for( int k = 0; k < passes; ++k )
+		{
+			res[ k ] = ( k < numLow ? widthLow - 1 : widthLow + 1 ) / 2;
+		}
+		return res;
+	}
+
+	double sigma;
+	int passes;
+};
+
+/* src with a filter applied, written by set(). */
+template<typename Tsrc, typename Tkernel>
+class Filtered
+{
+public:
+	Filtered( const Tsrc& src, const Tkernel& kernel )
+		: m_Src( src ), m_Kernel( kernel )
+	{
+	}
+
+	template<typename Tfunc, typename Tsplit>
+	void apply( Tfunc& func, int beginX, int beginY, int endX, int endY,
+			const Tsplit& split ) const
+	{
+		m_Kernel.apply( func, m_Src, beginX, beginY, endX, endY, split );
+	}
+
+private:
+	const op_operand<Tsrc> m_Src;
+	Tkernel m_Kernel;
+};
+
+template<typename Tsrc>
+inline Filtered<Tsrc, Box> box( const Tsrc& src, int radiusX, int radiusY )
+{
+	Box kernel = { radiusX, radiusY };
+	return Filtered<Tsrc, Box>( src, kernel );
+}
+
+template<typename Tsrc>
+inline Filtered<Tsrc, Box> box( const Tsrc& src, int radius )
+{
+	return filter::box( src, radius, radius );
+}
+
+template<typename Tsrc, typename T>
+inline Filtered<Tsrc, Separable<T> > separable( const Tsrc& src,
+		const std::vector<T>& kernelX, const std::vector<T>& kernelY )
+{
+	Separable<T> kernel = { kernelX, kernelY };
+	return Filtered<Tsrc, Separable<T> >( src, kernel );
+}
+
+template<typename Tsrc>
+inline Filtered<Tsrc, Gaussian> gaussian( const Tsrc& src, double sigma, int passes = 3 )
+{
+	Gaussian kernel = { sigma, passes };
+	return Filtered<Tsrc, Gaussian>( src, kernel );
+}
+
+}
+
+template<typename Tfunc, typename Tbegin, typename Tend, typename Tsrc, typename Tkernel>
+inline void set( Tfunc& func, const Tbegin& begin, const Tend& end,
+		const filter::Filtered<Tsrc, Tkernel>& filtered )
+{
+	filtered.apply( func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], filter::detail::Serial() );
+	detail::written( func, begin[ 0 ], begin[ 1 ], 0, end[ 0 ], end[ 1 ], 1 );
+}
+
+template<typename Tfunc, typename Tsrc, typename Tkernel>
+inline void set( Tfunc& func, const filter::Filtered<Tsrc, Tkernel>& filtered )
+{
+	mm::set( func, parallel::detail::zero( func ), func.size(), filtered );
+}
+
+namespace parallel
+{
+
+/* Rows split among the threads of pool, as in parallel::set(). */
+template<typename Tfunc, typename Tbegin, typename Tend, typename Tsrc, typename Tkernel>
+inline void set( ThreadPool& pool, Tfunc& func, const Tbegin& begin, const Tend& end,
+		const filter::Filtered<Tsrc, Tkernel>& filtered )
+{
+	filter::detail::Parallel split = { pool };
+	filtered.apply( func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], split );
+	mm::detail::written( func, begin[ 0 ], begin[ 1 ], 0, end[ 0 ], end[ 1 ], 1 );
+}
+
+template<typename Tfunc, typename Tbegin, typename Tend, typename Tsrc, typename Tkernel>
+inline void set( Tfunc& func, const Tbegin& begin, const Tend& end,
+		const filter::Filtered<Tsrc, Tkernel>& filtered )
+{
+	parallel::set( ThreadPool::instance(), func, begin, end, filtered );
+}
+
+template<typename Tfunc, typename Tsrc, typename Tkernel>
+inline void set( ThreadPool& pool, Tfunc& func, const filter::Filtered<Tsrc, Tkernel>& filtered )
+{
+	parallel::set( pool, func, detail::zero( func ), func.size(), filtered );
+}
+
+template<typename Tfunc, typename Tsrc, typename Tkernel>
+inline void set( Tfunc& func, const filter::Filtered<Tsrc, Tkernel>& filtered )
+{
+	parallel::set( ThreadPool::instance(), func, filtered );
+}
+
+}
+
+}
+
+#endif
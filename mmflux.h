@@ -0,0 +1,324 @@
+#ifndef _MMFLUX_H_
+#define _MMFLUX_H_
+
+#include "metamath.h"
+#include "mmparallel.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace mm
+{
+
+/*
+ * Finite-volume updates from face fluxes. A flux expression is evaluated
+ * at face index i, the face between cells i - 1 and i along its axis, so
+ * fluxX( x, y ) is the flux through the left face of cell ( x, y ) and
+ * fluxY( x, y ) the one through its lower face.
+ */
+namespace fv
+{
+
+namespace detail
+{
+
+template<int Axis>
+struct Along;
+
+template<>
+struct Along<0>
+{
+	template<typename Top>
+	static op_dtype<Top> at( const Top& op, int x, int y, int d )
+	{
+		return op( x + d, y );
+	}
+
+	template<typename Top, typename Tvisitor>
+	static void visit( const Top& op, Tvisitor& visitor, int offsetX, int offsetY,
+			int offsetZ, int d )
+	{
+		mm::detail::visit( op, visitor, offsetX + d, offsetY, offsetZ );
+	}
+};
+
+template<>
+struct Along<1>
+{
+	template<typename Top>
+	static op_dtype<Top> at( const Top& op, int x, int y, int d )
+	{
+		return op( x, y + d );
+	}
+
+	template<typename Top, typename Tvisitor>
+	static void visit( const Top& op, Tvisitor& visitor, int offsetX, int offsetY,
+			int offsetZ, int d )
+	{
+		mm::detail::visit( op, visitor, offsetX, offsetY + d, offsetZ );
+	}
+};
+
+template<typename T>
+inline T minmod( T a, T b )
+{
+	T m = ( a < 0 ? -a : a ) < ( b < 0 ? -b : b ) ? a : b;
+	return ( a * b > 0 ? m : T( 0 ) );
+}
+
+}
+
+/*
+ * Advective flux a q through a face, q taken from the upwind cell. a is
+ * the face velocity, evaluated at the face index.
+ */
+template<typename Tq, typename Ta, int Axis>
+class Upwind
+{
+public:
+	typedef op_accum<Tq> ACCUM;
+
+private:
+	typedef op_dtype<Tq> DTYPE;
+	typedef detail::Along<Axis> ALONG;
+
+public:
+	Upwind( const Tq& q, const Ta& a )
+		: m_Q( q ), m_A( a )
+	{
+	}
+
+	DTYPE operator()( int x, int y ) const
+	{
+		DTYPE a = m_A( x, y );
+		DTYPE qUp = ( a > 0 ? ALONG::at( m_Q, x, y, -1 ) : ALONG::at( m_Q, x, y, 0 ) );
+		return a * qUp;
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		mm::detail::visit( m_A, visitor, offsetX, offsetY, offsetZ );
+		ALONG::visit( m_Q, visitor, offsetX, offsetY, offsetZ, -1 );
+		ALONG::visit( m_Q, visitor, offsetX, offsetY, offsetZ, 0 );
+	}
+
+private:
+	const op_operand<Tq> m_Q;
+	const op_operand<Ta> m_A;
+};
+
+/*
+ * Second-order upwind (MUSCL) flux: q reconstructed at the face from the
+ * upwind cell with minmod-limited slopes, so no new extrema appear.
+ */
+template<typename Tq, typename Ta, int Axis>
+class Limited
+{
+public:
+	typedef op_accum<Tq> ACCUM;
+
+private:
+	typedef op_dtype<Tq> DTYPE;
+	typedef detail::Along<Axis> ALONG;
+
+public:
+	Limited( const Tq& q, const Ta& a )
+		: m_Q( q ), m_A( a )
+	{
+	}
+
+	DTYPE operator()( int x, int y ) const
+	{
+		DTYPE a = m_A( x, y );
+		DTYPE qm2 = ALONG::at( m_Q, x, y, -2 );
+		DTYPE qm1 = ALONG::at( m_Q, x, y, -1 );
+		DTYPE q0 = ALONG::at( m_Q, x, y, 0 );
+		DTYPE qp1 = ALONG::at( m_Q, x, y, 1 );
+		DTYPE qLeft = qm1 + DTYPE( 0.5 ) * detail::minmod( q0 - qm1, qm1 - qm2 );
+		DTYPE qRight = q0 - DTYPE( 0.5 ) * detail::minmod( qp1 - q0, q0 - qm1 );
+		return a * ( a > 0 ? qLeft : qRight );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		mm::detail::visit( m_A, visitor, offsetX, offsetY, offsetZ );
+		for( int d = -2; d <= 1; ++d )
+		{
+			ALONG::visit( m_Q, visitor, offsetX, offsetY, offsetZ, d );
+		}
+	}
+
+private:
+	const op_operand<Tq> m_Q;
+	const op_operand<Ta> m_A;
+};
+
+template<typename Tq, typename Ta>
+inline Upwind<Tq, Ta, 0> upwindX( const Tq& q, const Ta& a )
+{
+	return Upwind<Tq, Ta, 0>( q, a );
+}
+
+template<typename Tq, typename Ta>
+inline Upwind<Tq, Ta, 1> upwindY( const Tq& q, const Ta& a )
+{
+	return Upwind<Tq, Ta, 1>( q, a );
+}
+
+template<typename Tq, typename Ta>
+inline Limited<Tq, Ta, 0> limitedX( const Tq& q, const Ta& a )
+{
+	return Limited<Tq, Ta, 0>( q, a );
+}
+
+template<typename Tq, typename Ta>
+inline Limited<Tq, Ta, 1> limitedY( const Tq& q, const Ta& a )
+{
+	return Limited<Tq, Ta, 1>( q, a );
+}
+
+namespace detail
+{
+
+template<typename T>
+struct Divergence
+{
+	T operator()( int, int, T div ) const
+	{
+		return div;
+	}
+};
+
+template<typename Tu>
+struct Update
+{
+	typedef op_dtype<Tu> T;
+
+	T operator()( int x, int y, T div ) const
+	{
+		return u( x, y ) - dt * div;
+	}
+
+	const Tu& u;
+	T dt;
+};
+
+/*
+ * Rows [ beginY, endY ) in one pass. Each row evaluates its endX - beginX
+ * + 1 x faces into one buffer and the y faces above it into another; the
+ * y faces below are the ones above the previous row, so every face is
+ * evaluated once, plus one row of y faces per call.
+ */
+template<typename Tfunc, typename Tfx, typename Tfy, typename Tcombine, typename T>
+inline void sweep( Tfunc& func, int beginX, int beginY, int endX, int endY,
+		const Tfx& fluxX, const Tfy& fluxY, T invHx, T invHy, const Tcombine& combine )
+{
+	int n = endX - beginX;
+	std::vector<T> buffer( 3 * ( n + 1 ) );
+	T* pFx = buffer.data();
+	T* pLow = pFx + ( n + 1 );
+	T* pHigh = pLow + ( n + 1 );
+	for( int i = 0; i < n; ++i )
+	{
+		pLow[ i ] = fluxY( beginX + i, beginY );
+	}
+	for( int j = beginY; j < endY; ++j )
+	{
+		for( int i = 0; i <= n; ++i )
+		{
+			pFx[ i ] = fluxX( beginX + i, j );
+		}
+		for( int i = 0; i < n; ++i )
+		{
+			pHigh[ i ] = fluxY( beginX + i, j + 1 );
+		}
+		for( int i = 0; i < n; ++i )
+		{
+			T div = ( pFx[ i + 1 ] - pFx[ i ] ) * invHx + ( pHigh[ i ] - pLow[ i ] ) * invHy;
+			func( beginX + i, j ) = combine( beginX + i, j, div );
+		}
+		std::swap( pLow, pHigh );
+	}
+}
+
+template<typename Tfunc, typename Tfx, typename Tfy, typename Tcombine, typename T>
+inline void sweep( parallel::ThreadPool& pool, Tfunc& func, int beginX, int beginY,
+		int endX, int endY, const Tfx& fluxX, const Tfy& fluxY, T invHx, T invHy,
+		const Tcombine& combine )
+{
+	pool.parallelFor( beginY, endY,
+			[&]( int first, int last )
+			{
+				sweep( func, beginX, first, endX, last, fluxX, fluxY, invHx, invHy, combine );
+			} );
+}
+
+}
+
+/*
+ * func = d fluxX / dx + d fluxY / dy over [ begin, end ), h being the cell
+ * extents, evaluating every face flux once. Fluxes are read at faces
+ * begin through end inclusive and must not read func.
+ */
+template<typename Tfunc, typename Tbegin, typename Tend, typename Tfx, typename Tfy,
+	typename Th>
+inline void setDivergence( Tfunc& func, const Tbegin& begin, const Tend& end,
+		const Tfx& fluxX, const Tfy& fluxY, const Th& h )
+{
+	typedef op_dtype<Tfx> T;
+	detail::sweep( func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], fluxX, fluxY,
+			T( 1 ) / T( h[ 0 ] ), T( 1 ) / T( h[ 1 ] ), detail::Divergence<T>() );
+	mm::detail::written( func, begin[ 0 ], begin[ 1 ], 0, end[ 0 ], end[ 1 ], 1 );
+}
+
+/*
+ * Conservative step func = u - dt div( flux ). u is read at the point
+ * only and may be func itself; the fluxes must not read func.
+ */
+template<typename Tfunc, typename Tbegin, typename Tend, typename Tu, typename Tfx,
+	typename Tfy, typename Th>
+inline void setUpdate( Tfunc& func, const Tbegin& begin, const Tend& end, const Tu& u,
+		op_dtype<Tu> dt, const Tfx& fluxX, const Tfy& fluxY, const Th& h )
+{
+	typedef op_dtype<Tu> T;
+	detail::Update<Tu> update = { u, dt };
+	detail::sweep( func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], fluxX, fluxY,
+			T( 1 ) / T( h[ 0 ] ), T( 1 ) / T( h[ 1 ] ), update );
+	mm::detail::written( func, begin[ 0 ], begin[ 1 ], 0, end[ 0 ], end[ 1 ], 1 );
+}
+
+/*
+ * Rows split among the threads of pool; each share evaluates the y faces
+ * at its lower edge itself, so those are the only ones computed twice.
+ */
+template<typename Tfunc, typename Tbegin, typename Tend, typename Tfx, typename Tfy,
+	typename Th>
+inline void setDivergence( parallel::ThreadPool& pool, Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Tfx& fluxX, const Tfy& fluxY, const Th& h )
+{
+	typedef op_dtype<Tfx> T;
+	detail::sweep( pool, func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], fluxX, fluxY,
+			T( 1 ) / T( h[ 0 ] ), T( 1 ) / T( h[ 1 ] ), detail::Divergence<T>() );
+	mm::detail::written( func, begin[ 0 ], begin[ 1 ], 0, end[ 0 ], end[ 1 ], 1 );
+}
+
+template<typename Tfunc, typename Tbegin, typename Tend, typename Tu, typename Tfx,
+	typename Tfy, typename Th>
+inline void setUpdate( parallel::ThreadPool& pool, Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Tu& u, op_dtype<Tu> dt, const Tfx& fluxX,
+		const Tfy& fluxY, const Th& h )
+{
+	typedef op_dtype<Tu> T;
+	detail::Update<Tu> update = { u, dt };
+	detail::sweep( pool, func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], fluxX, fluxY,
+			T( 1 ) / T( h[ 0 ] ), T( 1 ) / T( h[ 1 ] ), update );
+	mm::detail::written( func, begin[ 0 ], begin[ 1 ], 0, end[ 0 ], end[ 1 ], 1 );
+}
+
+}
+
+}
+
+#endif
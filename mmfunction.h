@@ -2,6 +2,9 @@
 #define _MMFUNCTION_H_
 
 #include <metamath/metamath.h>
+#include <metamath/mmmemory.h>
+#include <metamath/mmprecision.h>
+#include <cstddef>
 #include <cstdio>
 
 namespace mm
@@ -69,7 +72,7 @@ public:
 
 	Tuple<T, Dim> operator +( const Tuple<T, Dim>& rhs ) const
 	{
-		Tuple<T> res( *this );
+		Tuple<T, Dim> res( *this );
 		for( unsigned int i = 0; i < Dim; ++i )
 		{
 			res.coord[ i ] += rhs.coord[ i ];
@@ -88,7 +91,7 @@ public:
 
 	Tuple<T, Dim> operator -( const Tuple<T, Dim>& rhs ) const
 	{
-		Tuple<T> res( *this );
+		Tuple<T, Dim> res( *this );
 		for( unsigned int i = 0; i < Dim; ++i )
 		{
 			res.coord[ i ] -= rhs.coord[ i ];
@@ -194,16 +197,120 @@ const Tuple<T, 2> Tuple<T, 2>::ZERO( 0, 0 );
 template<typename T>
 const Tuple<T, 2> Tuple<T, 2>::ONE( 1, 1 );
 
+template<typename T>
+struct Tuple<T, 3>
+{
+public:
+	Tuple()
+		: x( 0 ), y( 0 ), z( 0 )
+	{
+	}
+
+	Tuple( T _x, T _y, T _z )
+		: x( _x ), y( _y ), z( _z )
+	{
+	}
+
+	Tuple<T, 3>& operator =( const Tuple<T, 3>& rhs )
+	{
+		x = rhs.x;
+		y = rhs.y;
+		z = rhs.z;
+		return *this;
+	}
+
+	bool operator ==( const Tuple<T, 3>& rhs ) const
+	{
+		return ( x == rhs.x && y == rhs.y && z == rhs.z );
+	}
+
+	bool operator !=( const Tuple<T, 3>& rhs ) const
+	{
+		return !( *this == rhs );
+	}
+
+	T& operator []( unsigned int index )
+	{
+		return coord[ index ];
+	}
+
+	const T& operator []( unsigned int index ) const
+	{
+		return coord[ index ];
+	}
+
+	Tuple<T, 3> operator +( const Tuple<T, 3>& rhs ) const
+	{
+		return Tuple<T, 3>( x + rhs.x, y + rhs.y, z + rhs.z );
+	}
+
+	Tuple<T, 3>& operator +=( const Tuple<T, 3>& rhs )
+	{
+		x += rhs.x;
+		y += rhs.y;
+		z += rhs.z;
+		return *this;
+	}
+
+	Tuple<T, 3> operator -( const Tuple<T, 3>& rhs ) const
+	{
+		return Tuple<T, 3>( x - rhs.x, y - rhs.y, z - rhs.z );
+	}
+
+	Tuple<T, 3>& operator -=( const Tuple<T, 3>& rhs )
+	{
+		x -= rhs.x;
+		y -= rhs.y;
+		z -= rhs.z;
+		return *this;
+	}
+
+public:
+	static const Tuple<T, 3> ZERO;
+	static const Tuple<T, 3> ONE;
+
+	union
+	{
+		T coord[ 3 ];
+		struct
+		{
+			T x;
+			T y;
+			T z;
+		};
+	};
+};
+
+template<typename T>
+const Tuple<T, 3> Tuple<T, 3>::ZERO( 0, 0, 0 );
+template<typename T>
+const Tuple<T, 3> Tuple<T, 3>::ONE( 1, 1, 1 );
+
+/*
+ * T is either the element type or a Precision<> policy. With a converting
+ * policy elements are loaded as PRECISION::COMPUTE, which is then DTYPE,
+ * and the non-const accessors return a PrecisionRef instead of DTYPE&.
+ */
 template<typename T, unsigned int Dim = 2>
 class Function
 {
 public:
-	typedef T DTYPE;
+	typedef precision_type<T> PRECISION;
+	typedef typename PRECISION::COMPUTE DTYPE;
+	typedef typename PRECISION::STORAGE STYPE;
+	typedef typename PRECISION::ACCUM ACCUM;
 	static const unsigned int DIM = Dim;
 
+private:
+	typedef detail::PrecisionAccess<PRECISION> ACCESS;
+
+public:
+	typedef typename ACCESS::REFERENCE REFERENCE;
+	typedef typename ACCESS::CONST_REFERENCE CONST_REFERENCE;
+
 public:
 	Function()
-		: m_pData( nullptr ), m_bOwnsData( true )
+		: m_pData( nullptr ), m_bOwnsData( true ), m_bMapped( false )
 	{
 		for( unsigned int i = 0; i < Dim; ++i )
 		{
@@ -215,8 +322,31 @@ public:
 
 	template<typename U>
 	Function( const U& _size )
-		: m_bOwnsData( true )
+		: m_bOwnsData( true ), m_bMapped( false )
+	{
+		int totalSize = 1;
+		for( unsigned int i = 0; i < Dim; ++i )
+		{
+			int dimSize = _size[ i ];
+			m_Size[ i ] = dimSize;
+			totalSize *= dimSize;
+		}
+
+		m_pData = new STYPE[ totalSize ];
+	}
+
+	/*
+	 * Allocates with the given NUMA placement, on transparent huge pages if
+	 * bHugePages. Other than with HEAP the storage is not constructed, it
+	 * reads as zero bits until written.
+	 */
+	template<typename U>
+	Function( const U& _size, memory::Placement placement, bool bHugePages = false )
+		: m_bOwnsData( true ), m_bMapped( placement != memory::HEAP || bHugePages )
 	{
+		static_assert( std::is_trivially_copyable<STYPE>::value,
+				"placed storage is not constructed" );
+
 		int totalSize = 1;
 		for( unsigned int i = 0; i < Dim; ++i )
 		{
@@ -225,11 +355,19 @@ public:
 			totalSize *= dimSize;
 		}
 
-		m_pData = new DTYPE[ totalSize ];
+		if( m_bMapped )
+		{
+			m_pData = static_cast<STYPE*>( memory::allocate(
+					totalSize * sizeof( STYPE ), placement, bHugePages ) );
+		}
+		else
+		{
+			m_pData = new STYPE[ totalSize ];
+		}
 	}
 
 	Function( const Function<T, Dim>& ref )
-		: m_pData( ref.m_pData ), m_bOwnsData( false )
+		: m_pData( ref.m_pData ), m_bOwnsData( false ), m_bMapped( ref.m_bMapped )
 	{
 		for( unsigned int i = 0; i < Dim; ++i )
 		{
@@ -238,7 +376,7 @@ public:
 	}
 
 	Function( Function<T, Dim>&& ref )
-		: m_pData( ref.m_pData ), m_bOwnsData( true )
+		: m_pData( ref.m_pData ), m_bOwnsData( true ), m_bMapped( ref.m_bMapped )
 	{
 		for( unsigned int i = 0; i < Dim; ++i )
 		{
@@ -254,28 +392,50 @@ public:
 	{
 		if( m_bOwnsData && m_pData != nullptr )
 		{
-			delete[] m_pData;
+			release();
 		}
 	}
 
-	DTYPE& operator[]( int i )
+	REFERENCE operator[]( int i )
+	{
+		return ACCESS::ref( m_pData[ i ] );
+	}
+
+	CONST_REFERENCE operator[]( int i ) const
 	{
-		return m_pData[ i ];
+		return ACCESS::cref( m_pData[ i ] );
 	}
 
-	const DTYPE& operator[]( int i ) const
+	REFERENCE operator()( int x, int y )
 	{
-		return m_pData[ i ];
+		return ACCESS::ref( m_pData[ y * m_Size[ 0 ] + x ] );
 	}
 
-	DTYPE& operator()( int x, int y )
+	CONST_REFERENCE operator()( int x, int y ) const
 	{
-		return m_pData[ y * m_Size[ 0 ] + x ];
+		return ACCESS::cref( m_pData[ y * m_Size[ 0 ] + x ] );
 	}
 
-	const DTYPE& operator()( int x, int y ) const
+	REFERENCE operator()( int x, int y, int z )
 	{
-		return m_pData[ y * m_Size[ 0 ] + x ];
+		return ACCESS::ref( m_pData[ ( z * m_Size[ 1 ] + y ) * m_Size[ 0 ] + x ] );
+	}
+
+	CONST_REFERENCE operator()( int x, int y, int z ) const
+	{
+		return ACCESS::cref( m_pData[ ( z * m_Size[ 1 ] + y ) * m_Size[ 0 ] + x ] );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		Packet<DTYPE, N> res;
+		const STYPE* pRow = &m_pData[ y * m_Size[ 0 ] + x ];
+		for( int k = 0; k < N; ++k )
+		{
+			res.v[ k ] = PRECISION::load( pRow[ k ] );
+		}
+		return res;
 	}
 
 	const Tuple<int, Dim>& size() const
@@ -294,11 +454,12 @@ public:
 	{
 		if( m_pData != nullptr && m_bOwnsData )
 		{
-			delete[] m_pData;
+			release();
 		}
 
 		m_pData = ref.m_pData;
 		m_bOwnsData = true;
+		m_bMapped = ref.m_bMapped;
 
 		for( unsigned int i = 0; i < Dim; ++i )
 		{
@@ -312,12 +473,279 @@ public:
 		return *this;
 	}
 
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		visitor.read( m_pData, offsetX, offsetY, offsetZ );
+	}
+
+private:
+	void release()
+	{
+		if( m_bMapped )
+		{
+			memory::release( m_pData );
+		}
+		else
+		{
+			delete[] m_pData;
+		}
+	}
+
 private:
-	DTYPE* m_pData;
+	STYPE* m_pData;
 	Tuple<int, Dim> m_Size;
 	bool m_bOwnsData;
+	bool m_bMapped;
+};
+
+/*
+ * Function with extents fixed at compile time, 3D when SizeZ > 1. The data
+ * is stored inline and aligned to MM_PACKET_BYTES, the strides are
+ * constants, so loops over small patches can be unrolled and vectorized
+ * completely. Copies are
+ * deep; expressions refer to the patch through FunctionRef, so it has to
+ * outlive them. Over-aligned heap allocation needs C++17, keep patches on
+ * the stack or as members.
+ */
+template<typename T, int SizeX, int SizeY, int SizeZ = 1>
+class FixedFunction
+{
+public:
+	typedef precision_type<T> PRECISION;
+	typedef typename PRECISION::COMPUTE DTYPE;
+	typedef typename PRECISION::STORAGE STYPE;
+	typedef typename PRECISION::ACCUM ACCUM;
+	typedef FunctionRef<FixedFunction<T, SizeX, SizeY, SizeZ>> OPERAND;
+	static const unsigned int DIM = ( SizeZ > 1 ? 3 : 2 );
+	static const int SIZE_X = SizeX;
+	static const int SIZE_Y = SizeY;
+	static const int SIZE_Z = SizeZ;
+
+private:
+	typedef detail::PrecisionAccess<PRECISION> ACCESS;
+
+public:
+	typedef typename ACCESS::REFERENCE REFERENCE;
+	typedef typename ACCESS::CONST_REFERENCE CONST_REFERENCE;
+
+public:
+	FixedFunction()
+	{
+	}
+
+	REFERENCE operator[]( int i )
+	{
+		return ACCESS::ref( m_Data[ i ] );
+	}
+
+	CONST_REFERENCE operator[]( int i ) const
+	{
+		return ACCESS::cref( m_Data[ i ] );
+	}
+
+	REFERENCE operator()( int x, int y )
+	{
+		return ACCESS::ref( m_Data[ y * SizeX + x ] );
+	}
+
+	CONST_REFERENCE operator()( int x, int y ) const
+	{
+		return ACCESS::cref( m_Data[ y * SizeX + x ] );
+	}
+
+	REFERENCE operator()( int x, int y, int z )
+	{
+		return ACCESS::ref( m_Data[ ( z * SizeY + y ) * SizeX + x ] );
+	}
+
+	CONST_REFERENCE operator()( int x, int y, int z ) const
+	{
+		return ACCESS::cref( m_Data[ ( z * SizeY + y ) * SizeX + x ] );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		Packet<DTYPE, N> res;
+		const STYPE* pRow = &m_Data[ y * SizeX + x ];
+		for( int k = 0; k < N; ++k )
+		{
+			res.v[ k ] = PRECISION::load( pRow[ k ] );
+		}
+		return res;
+	}
+
+	Tuple<int, DIM> size() const
+	{
+		Tuple<int, DIM> res;
+		res[ 0 ] = SizeX;
+		res[ 1 ] = SizeY;
+		if( DIM > 2 )
+		{
+			res[ DIM - 1 ] = SizeZ;
+		}
+		return res;
+	}
+
+	template<typename Top>
+	FixedFunction<T, SizeX, SizeY, SizeZ>& operator=( const Top& op )
+	{
+		set( *this, op );
+		return *this;
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		visitor.read( m_Data, offsetX, offsetY, offsetZ );
+	}
+
+private:
+	alignas( MM_PACKET_BYTES ) STYPE m_Data[ SizeX * SizeY * SizeZ ];
 };
 
+/*
+ * Non-owning view of an external buffer, usable as expression leaf and as
+ * set() target. Rows are rowPitch bytes apart, slices slicePitch bytes,
+ * and consecutive x are Stride elements apart, i.e. Stride = 3 addresses
+ * one channel of interleaved RGB. Copies alias the same buffer. With a
+ * Precision policy T the buffer holds the policy's storage type.
+ */
+template<typename T, unsigned int Dim = 2, int Stride = 1>
+class StridedView
+{
+public:
+	typedef precision_type<T> PRECISION;
+	typedef typename std::remove_const<typename PRECISION::COMPUTE>::type DTYPE;
+	typedef typename PRECISION::STORAGE STYPE;
+	typedef typename PRECISION::ACCUM ACCUM;
+	static const unsigned int DIM = Dim;
+	static const int STRIDE = Stride;
+
+private:
+	typedef detail::PrecisionAccess<PRECISION> ACCESS;
+	typedef typename std::conditional<std::is_const<STYPE>::value,
+		const char, char>::type BYTE;
+
+public:
+	typedef typename ACCESS::REFERENCE REFERENCE;
+	typedef typename ACCESS::CONST_REFERENCE CONST_REFERENCE;
+
+public:
+	template<typename U>
+	StridedView( STYPE* pData, const U& _size, int rowPitch, int slicePitch = 0 )
+		: m_pData( pData ), m_RowPitch( rowPitch ), m_SlicePitch( slicePitch )
+	{
+		for( unsigned int i = 0; i < Dim; ++i )
+		{
+			m_Size[ i ] = _size[ i ];
+		}
+	}
+
+	REFERENCE operator()( int x, int y )
+	{
+		return ACCESS::ref( row( y )[ x * Stride ] );
+	}
+
+	CONST_REFERENCE operator()( int x, int y ) const
+	{
+		return ACCESS::cref( row( y )[ x * Stride ] );
+	}
+
+	REFERENCE operator()( int x, int y, int z )
+	{
+		return ACCESS::ref( row( y, z )[ x * Stride ] );
+	}
+
+	CONST_REFERENCE operator()( int x, int y, int z ) const
+	{
+		return ACCESS::cref( row( y, z )[ x * Stride ] );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		Packet<DTYPE, N> res;
+		const STYPE* pRow = &row( y )[ x * Stride ];
+		for( int k = 0; k < N; ++k )
+		{
+			res.v[ k ] = PRECISION::load( pRow[ k * Stride ] );
+		}
+		return res;
+	}
+
+	const Tuple<int, Dim>& size() const
+	{
+		return m_Size;
+	}
+
+	STYPE* data() const
+	{
+		return m_pData;
+	}
+
+	int rowPitch() const
+	{
+		return m_RowPitch;
+	}
+
+	int slicePitch() const
+	{
+		return m_SlicePitch;
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		visitor.read( m_pData, offsetX, offsetY, offsetZ );
+	}
+
+	template<typename Top>
+	StridedView<T, Dim, Stride>& operator=( const Top& op )
+	{
+		set( *this, op );
+		return *this;
+	}
+
+private:
+	STYPE* row( int y ) const
+	{
+		return reinterpret_cast<STYPE*>( reinterpret_cast<BYTE*>( m_pData )
+				+ (std::ptrdiff_t)y * m_RowPitch );
+	}
+
+	STYPE* row( int y, int z ) const
+	{
+		return reinterpret_cast<STYPE*>( reinterpret_cast<BYTE*>( m_pData )
+				+ (std::ptrdiff_t)z * m_SlicePitch + (std::ptrdiff_t)y * m_RowPitch );
+	}
+
+private:
+	STYPE* m_pData;
+	Tuple<int, Dim> m_Size;
+	int m_RowPitch;
+	int m_SlicePitch;
+};
+
+/*
+ * Wraps a dense-x buffer of sizeX * sizeY elements whose rows are rowPitch
+ * bytes apart.
+ */
+template<typename T>
+inline StridedView<T> wrap( T* pData, int sizeX, int sizeY, int rowPitch )
+{
+	return StridedView<T>( pData, Tuple<int, 2>( sizeX, sizeY ), rowPitch );
+}
+
+template<typename T>
+inline StridedView<T, 3> wrap( T* pData, int sizeX, int sizeY, int sizeZ,
+		int rowPitch, int slicePitch )
+{
+	return StridedView<T, 3>( pData, Tuple<int, 3>( sizeX, sizeY, sizeZ ),
+			rowPitch, slicePitch );
+}
+
 template<typename Tfunc, typename Tbegin, typename Tend>
 void printFunc( const Tfunc& func, const Tbegin& begin, const Tend& end )
 {
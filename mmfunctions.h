@@ -1,7 +1,8 @@
 #ifndef _MMFUNCTIONS_H_
 #define _MMFUNCTIONS_H_
 
-#include <cmath>
+#include "metamath.h"
+#include "mmkernels.h"
 
 namespace mm
 {
@@ -9,14 +10,13 @@ namespace mm
 namespace fun
 {
 
-#define MM_OP_VAL m_Op( x, y )
-
-#define MM_DECL_SCALAR_FUN(clsName,funName,functionality) \
-template<typename Top> \
+#define MM_DECL_UNARY_FUN(clsName,funName) \
+template<typename Top, Mode M = MM_FUN_MODE> \
 class clsName \
 { \
 public: \
-	typedef typename Top::DTYPE DTYPE; \
+	typedef op_dtype<Top> DTYPE; \
+	typedef op_accum<Top> ACCUM; \
 \
 public: \
 	clsName( const Top& op ) \
@@ -26,33 +26,146 @@ public: \
 \
 	DTYPE operator()( int x, int y ) const \
 	{ \
-		functionality\
+		return kernel::funName<M>( (DTYPE)m_Op( x, y ) ); \
+	} \
+\
+	DTYPE operator()( int x, int y, int z ) const \
+	{ \
+		return kernel::funName<M>( (DTYPE)m_Op( x, y, z ) ); \
+	} \
+\
+	template<int N> \
+	MM_KERNEL_INLINE Packet<DTYPE, N> packet( int x, int y ) const \
+	{ \
+		Packet<DTYPE, N> val = mm::packet<N>( m_Op, x, y ); \
+		for( int k = 0; k < N; ++k ) \
+		{ \
+			val.v[ k ] = kernel::funName<M>( val.v[ k ] ); \
+		} \
+		return val; \
+	} \
+\
+	template<typename Tvisitor> \
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const \
+	{ \
+		detail::visit( m_Op, visitor, offsetX, offsetY, offsetZ ); \
 	} \
 \
 private: \
-	const Top m_Op; \
+	const op_operand<Top> m_Op; \
 }; \
 \
 template<typename Top> \
 inline clsName<Top> funName( const Top& op ) \
 { \
 	return clsName<Top>( op ); \
+} \
+\
+template<Mode M, typename Top> \
+inline clsName<Top, M> funName( const Top& op ) \
+{ \
+	return clsName<Top, M>( op ); \
 }
 
-#define MM_WRAP_STD_FUN(clsName,funName,stdName) MM_DECL_SCALAR_FUN(clsName,funName,return std::stdName( MM_OP_VAL );)
+#define MM_DECL_BINARY_FUN(clsName,funName) \
+template<typename Top1, typename Top2, Mode M = MM_FUN_MODE> \
+class clsName \
+{ \
+public: \
+	typedef decltype(std::declval<op_dtype<Top1>>() \
+			+ std::declval<op_dtype<Top2>>()) DTYPE; \
+	typedef decltype(std::declval<op_accum<Top1>>() \
+			+ std::declval<op_accum<Top2>>()) ACCUM; \
+\
+public: \
+	clsName( const Top1& op1, const Top2& op2 ) \
+		: m_Op1( op1 ), m_Op2( op2 ) \
+	{ \
+	} \
+\
+	DTYPE operator()( int x, int y ) const \
+	{ \
+		return kernel::funName<M>( (DTYPE)m_Op1( x, y ), (DTYPE)m_Op2( x, y ) ); \
+	} \
+\
+	DTYPE operator()( int x, int y, int z ) const \
+	{ \
+		return kernel::funName<M>( (DTYPE)m_Op1( x, y, z ), \
+				(DTYPE)m_Op2( x, y, z ) ); \
+	} \
+\
+	template<int N> \
+	MM_KERNEL_INLINE Packet<DTYPE, N> packet( int x, int y ) const \
+	{ \
+		Packet<op_dtype<Top1>, N> val1 = mm::packet<N>( m_Op1, x, y ); \
+		Packet<op_dtype<Top2>, N> val2 = mm::packet<N>( m_Op2, x, y ); \
+		Packet<DTYPE, N> res; \
+		for( int k = 0; k < N; ++k ) \
+		{ \
+			res.v[ k ] = kernel::funName<M>( (DTYPE)val1.v[ k ], (DTYPE)val2.v[ k ] ); \
+		} \
+		return res; \
+	} \
+\
+	template<typename Tvisitor> \
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const \
+	{ \
+		detail::visit( m_Op1, visitor, offsetX, offsetY, offsetZ ); \
+		detail::visit( m_Op2, visitor, offsetX, offsetY, offsetZ ); \
+	} \
+\
+private: \
+	const op_operand<Top1> m_Op1; \
+	const op_operand<Top2> m_Op2; \
+}; \
+\
+template<typename Top1, typename Top2, \
+	typename Enable1 = enable_if_compound<Top1>, \
+	typename Enable2 = enable_if_compound<Top2>> \
+inline clsName<Top1, Top2> funName( const Top1& op1, const Top2& op2 ) \
+{ \
+	return clsName<Top1, Top2>( op1, op2 ); \
+} \
+\
+template<Mode M, typename Top1, typename Top2, \
+	typename Enable1 = enable_if_compound<Top1>, \
+	typename Enable2 = enable_if_compound<Top2>> \
+inline clsName<Top1, Top2, M> funName( const Top1& op1, const Top2& op2 ) \
+{ \
+	return clsName<Top1, Top2, M>( op1, op2 ); \
+} \
+\
+template<typename Top> \
+inline clsName<Top, mm::op::Const<op_dtype<Top>>> funName( const Top& op1, \
+		op_dtype<Top> val2 ) \
+{ \
+	return clsName<Top, mm::op::Const<op_dtype<Top>>>( \
+			op1, mm::op::Const<op_dtype<Top>>( val2 ) ); \
+} \
+\
+template<Mode M, typename Top> \
+inline clsName<Top, mm::op::Const<op_dtype<Top>>, M> funName( const Top& op1, \
+		op_dtype<Top> val2 ) \
+{ \
+	return clsName<Top, mm::op::Const<op_dtype<Top>>, M>( \
+			op1, mm::op::Const<op_dtype<Top>>( val2 ) ); \
+}
 
-MM_WRAP_STD_FUN( Sin, sin, sin )
-MM_WRAP_STD_FUN( Cos, cos, cos )
-MM_WRAP_STD_FUN( Tan, tan, tan )
-MM_WRAP_STD_FUN( Sqrt, sqrt, sqrt )
-MM_WRAP_STD_FUN( Exp, exp, exp )
-MM_WRAP_STD_FUN( Log, log, log )
+MM_DECL_UNARY_FUN( Sin, sin )
+MM_DECL_UNARY_FUN( Cos, cos )
+MM_DECL_UNARY_FUN( Tan, tan )
+MM_DECL_UNARY_FUN( Sqrt, sqrt )
+MM_DECL_UNARY_FUN( Exp, exp )
+MM_DECL_UNARY_FUN( Log, log )
+MM_DECL_UNARY_FUN( Tanh, tanh )
+MM_DECL_UNARY_FUN( Erf, erf )
 
-#undef MM_WRAP_STD_FUN
+MM_DECL_BINARY_FUN( Pow, pow )
+MM_DECL_BINARY_FUN( Atan2, atan2 )
 
-#undef MM_DECL_SCALAR_FUN
+#undef MM_DECL_BINARY_FUN
 
-#undef MM_OP_VAL
+#undef MM_DECL_UNARY_FUN
 
 }
 
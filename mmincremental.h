@@ -0,0 +1,537 @@
+#ifndef _MMINCREMENTAL_H_
+#define _MMINCREMENTAL_H_
+
+#include "metamath.h"
+#include "mmfunction.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace mm
+{
+
+namespace detail
+{
+
+/*
+ * Half-open box [ lo, hi ), 2D boxes span z in [ 0, 1 ).
+ */
+struct Box
+{
+	int lo[ 3 ];
+	int hi[ 3 ];
+
+	bool empty() const
+	{
+		return ( lo[ 0 ] >= hi[ 0 ] || lo[ 1 ] >= hi[ 1 ] || lo[ 2 ] >= hi[ 2 ] );
+	}
+
+	void merge( const Box& box )
+	{
+		for( int d = 0; d < 3; ++d )
+		{
+			lo[ d ] = std::min( lo[ d ], box.lo[ d ] );
+			hi[ d ] = std::max( hi[ d ], box.hi[ d ] );
+		}
+	}
+};
+
+/*
+ * Boxes written into a TrackedFunction, each stamped with the version it
+ * was written at. Only the last MAX_ENTRIES boxes are kept apart, older
+ * ones are merged into their bounding box, which can only make readers
+ * recompute more than needed.
+ */
+class DirtyLog
+{
+public:
+	static const size_t MAX_ENTRIES = 64;
+
+	DirtyLog()
+		: m_Version( 0 )
+	{
+	}
+
+	void mark( const Box& box )
+	{
+		if( box.empty() )
+		{
+			return;
+		}
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		Entry entry = { ++m_Version, box };
+		if( m_Entries.size() >= MAX_ENTRIES )
+		{
+			size_t half = m_Entries.size() / 2;
+			std::vector<Entry> entries( 1, m_Entries[ 0 ] );
+			for( size_t e = 1; e < m_Entries.size(); ++e )
+			{
+				if( e < half )
+				{
+					entries[ 0 ].box.merge( m_Entries[ e ].box );
+					entries[ 0 ].version = m_Entries[ e ].version;
+				}
+				else
+				{
+					entries.push_back( m_Entries[ e ] );
+				}
+			}
+			m_Entries.swap( entries );
+		}
+		m_Entries.push_back( entry );
+	}
+
+	/*
+	 * Current version, it grows with every write.
+	 */
+	size_t version() const
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		return m_Version;
+	}
+
+	/*
+	 * Appends the boxes written after version since and returns the
+	 * current version.
+	 */
+	size_t dirty( size_t since, std::vector<Box>& boxes ) const
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		for( size_t e = 0; e < m_Entries.size(); ++e )
+		{
+			if( m_Entries[ e ].version > since )
+			{
+				boxes.push_back( m_Entries[ e ].box );
+			}
+		}
+		return m_Version;
+	}
+
+private:
+	DirtyLog( const DirtyLog& );
+	DirtyLog& operator=( const DirtyLog& );
+
+	struct Entry
+	{
+		size_t version;
+		Box box;
+	};
+
+private:
+	mutable std::mutex m_Mutex;
+	std::vector<Entry> m_Entries;
+	size_t m_Version;
+};
+
+/*
+ * Range of offsets an expression reads one tracked function at.
+ */
+struct DirtySource
+{
+	const DirtyLog* pLog;
+	int lo[ 3 ];
+	int hi[ 3 ];
+	size_t version;
+};
+
+/*
+ * Collects the tracked functions an expression reads and their offsets.
+ * Other leaves are taken to be constant.
+ */
+struct DirtyVisitor
+{
+	std::vector<DirtySource> sources;
+	bool bUnknown;
+
+	DirtyVisitor()
+		: bUnknown( false )
+	{
+	}
+
+	void read( const void*, int, int, int )
+	{
+	}
+
+	void tracked( const DirtyLog* pLog, int offsetX, int offsetY, int offsetZ )
+	{
+		int offset[ 3 ] = { offsetX, offsetY, offsetZ };
+		for( size_t s = 0; s < sources.size(); ++s )
+		{
+			if( sources[ s ].pLog == pLog )
+			{
+				for( int d = 0; d < 3; ++d )
+				{
+					sources[ s ].lo[ d ] = std::min( sources[ s ].lo[ d ], offset[ d ] );
+					sources[ s ].hi[ d ] = std::max( sources[ s ].hi[ d ], offset[ d ] );
+				}
+				return;
+			}
+		}
+		DirtySource source = { pLog, { offsetX, offsetY, offsetZ },
+				{ offsetX, offsetY, offsetZ }, 0 };
+		sources.push_back( source );
+	}
+
+	void unknown()
+	{
+		bUnknown = true;
+	}
+};
+
+/*
+ * Points of [ begin, end ) whose value may have changed since the sources
+ * were last seen: every dirty box, grown by the offsets it is read at.
+ * Advances the versions.
+ */
+inline void changedBoxes( std::vector<DirtySource>& sources,
+		const Box& domain, std::vector<Box>& boxes )
+{
+	std::vector<Box> dirty;
+	for( size_t s = 0; s < sources.size(); ++s )
+	{
+		DirtySource& source = sources[ s ];
+		dirty.clear();
+		source.version = source.pLog->dirty( source.version, dirty );
+		for( size_t b = 0; b < dirty.size(); ++b )
+		{
+			Box box;
+			for( int d = 0; d < 3; ++d )
+			{
+				box.lo[ d ] = std::max( domain.lo[ d ], dirty[ b ].lo[ d ] - source.hi[ d ] );
+				box.hi[ d ] = std::min( domain.hi[ d ], dirty[ b ].hi[ d ] - source.lo[ d ] );
+			}
+			if( !box.empty() )
+			{
+				boxes.push_back( box );
+			}
+		}
+	}
+}
+
+inline void readSources( std::vector<DirtySource>& sources )
+{
+	for( size_t s = 0; s < sources.size(); ++s )
+	{
+		sources[ s ].version = sources[ s ].pLog->version();
+	}
+}
+
+}
+
+/*
+ * Function that remembers which boxes have been written into it, so that
+ * expressions reading it can be brought up to date by recomputing only
+ * what depends on them, see Incremental. set(), fused() and the parallel
+ * evaluators, also through a FunctionView, record the boxes they write;
+ * writes through operator() have to be followed by written(). Copies
+ * would not share the log, so it is not copyable and expressions refer to
+ * it through FunctionRef.
+ */
+template<typename T, unsigned int Dim = 2>
+class TrackedFunction : public Function<T, Dim>, public detail::DirtyLog
+{
+public:
+	typedef FunctionRef<TrackedFunction<T, Dim>> OPERAND;
+
+public:
+	TrackedFunction()
+	{
+	}
+
+	template<typename U>
+	TrackedFunction( const U& _size )
+		: Function<T, Dim>( _size )
+	{
+	}
+
+	/*
+	 * Marks [ begin, end ) as changed.
+	 */
+	void written( int beginX, int beginY, int beginZ, int endX, int endY, int endZ )
+	{
+		detail::Box box = { { beginX, beginY, beginZ }, { endX, endY, endZ } };
+		mark( box );
+	}
+
+	void written( int beginX, int beginY, int endX, int endY )
+	{
+		written( beginX, beginY, 0, endX, endY, 1 );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		Function<T, Dim>::visit( visitor, offsetX, offsetY, offsetZ );
+	}
+
+	void visit( detail::DirtyVisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		visitor.tracked( this, offsetX, offsetY, offsetZ );
+	}
+
+	template<typename Top>
+	TrackedFunction<T, Dim>& operator=( const Top& op )
+	{
+		set( *this, op );
+		return *this;
+	}
+
+private:
+	TrackedFunction( const TrackedFunction<T, Dim>& );
+	TrackedFunction<T, Dim>& operator=( const TrackedFunction<T, Dim>& );
+};
+
+/*
+ * func = op, kept up to date by update(). The first update() evaluates
+ * all of func, later ones only the points that read a box written into a
+ * TrackedFunction since, at the offsets op reads it at. Leaves that are
+ * not tracked are taken not to change; an op whose reads are not at fixed
+ * offsets is evaluated in full every time. op must not read func.
+ */
+template<typename Tfunc, typename Top>
+class Incremental
+{
+public:
+	Incremental( Tfunc& func, const Top& op )
+		: m_pFunc( &func ), m_Op( op ), m_bValid( false )
+	{
+		detail::DirtyVisitor visitor;
+		detail::visit( m_Op, visitor );
+		m_Sources = visitor.sources;
+		m_bUnknown = visitor.bUnknown;
+	}
+
+	/*
+	 * Recomputes what has changed and returns the number of points
+	 * evaluated.
+	 */
+	size_t update()
+	{
+		detail::Box domain = { { 0, 0, 0 }, { 1, 1, 1 } };
+		for( unsigned int d = 0; d < Tfunc::DIM; ++d )
+		{
+			domain.hi[ d ] = m_pFunc->size()[ d ];
+		}
+		if( !m_bValid || m_bUnknown )
+		{
+			detail::readSources( m_Sources );
+			mm::set( *m_pFunc, m_Op );
+			m_bValid = true;
+			return volume( domain );
+		}
+
+		m_Boxes.clear();
+		detail::changedBoxes( m_Sources, domain, m_Boxes );
+		size_t points = 0;
+		for( size_t b = 0; b < m_Boxes.size(); ++b )
+		{
+			apply( m_Boxes[ b ], detail::DimTag<Tfunc::DIM>() );
+			points += volume( m_Boxes[ b ] );
+		}
+		return points;
+	}
+
+	/*
+	 * Forgets what has been computed, the next update() is a full one.
+	 */
+	void invalidate()
+	{
+		m_bValid = false;
+	}
+
+private:
+	static size_t volume( const detail::Box& box )
+	{
+		return (size_t)( box.hi[ 0 ] - box.lo[ 0 ] )
+				* ( box.hi[ 1 ] - box.lo[ 1 ] ) * ( box.hi[ 2 ] - box.lo[ 2 ] );
+	}
+
+	void apply( const detail::Box& box, detail::DimTag<2> )
+	{
+		mm::set( *m_pFunc, box.lo[ 0 ], box.lo[ 1 ], box.hi[ 0 ], box.hi[ 1 ], m_Op );
+	}
+
+	void apply( const detail::Box& box, detail::DimTag<3> )
+	{
+		mm::set( *m_pFunc, box.lo[ 0 ], box.lo[ 1 ], box.lo[ 2 ],
+				box.hi[ 0 ], box.hi[ 1 ], box.hi[ 2 ], m_Op );
+	}
+
+private:
+	Tfunc* m_pFunc;
+	const op_operand<Top> m_Op;
+	std::vector<detail::DirtySource> m_Sources;
+	std::vector<detail::Box> m_Boxes;
+	bool m_bUnknown;
+	bool m_bValid;
+};
+
+template<typename Tfunc, typename Top>
+inline Incremental<Tfunc, Top> incremental( Tfunc& func, const Top& op )
+{
+	return Incremental<Tfunc, Top>( func, op );
+}
+
+/*
+ * sum( op, begin, end ) kept up to date by update(). The domain is cut
+ * into tiles whose partial sums are kept, an update re-sums the tiles a
+ * change can reach and adds up the partials again. Re-summing rather than
+ * subtracting the old values keeps floating point sums from drifting.
+ * Which changes count is as for Incremental.
+ */
+template<typename Top, unsigned int Dim = 2, typename Tacc = void>
+class IncrementalSum
+{
+public:
+	typedef sum_dtype<Tacc, Top> ACCUM;
+	static const unsigned int DIM = Dim;
+
+	template<typename Tbegin, typename Tend>
+	IncrementalSum( const Top& op, const Tbegin& begin, const Tend& end )
+		: m_Op( op ), m_Sum( 0 ), m_bValid( false )
+	{
+		m_Domain.lo[ 2 ] = 0;
+		m_Domain.hi[ 2 ] = 1;
+		for( unsigned int d = 0; d < DIM; ++d )
+		{
+			m_Domain.lo[ d ] = begin[ d ];
+			m_Domain.hi[ d ] = end[ d ];
+		}
+		m_Tile[ 0 ] = m_Tile[ 1 ] = ( DIM > 2 ? 16 : 64 );
+		m_Tile[ 2 ] = ( DIM > 2 ? 16 : 1 );
+		for( int d = 0; d < 3; ++d )
+		{
+			m_NumTiles[ d ] = ( m_Domain.hi[ d ] - m_Domain.lo[ d ] + m_Tile[ d ] - 1 )
+					/ m_Tile[ d ];
+		}
+		m_Partials.resize( (size_t)m_NumTiles[ 0 ] * m_NumTiles[ 1 ] * m_NumTiles[ 2 ] );
+		m_Stale.resize( m_Partials.size() );
+
+		detail::DirtyVisitor visitor;
+		detail::visit( m_Op, visitor );
+		m_Sources = visitor.sources;
+		m_bUnknown = visitor.bUnknown;
+	}
+
+	/*
+	 * Brings the sum up to date and returns it.
+	 */
+	ACCUM update()
+	{
+		if( !m_bValid || m_bUnknown )
+		{
+			detail::readSources( m_Sources );
+			std::fill( m_Stale.begin(), m_Stale.end(), (char)1 );
+			m_bValid = true;
+		}
+		else
+		{
+			m_Boxes.clear();
+			detail::changedBoxes( m_Sources, m_Domain, m_Boxes );
+			for( size_t b = 0; b < m_Boxes.size(); ++b )
+			{
+				markTiles( m_Boxes[ b ] );
+			}
+		}
+
+		bool bChanged = false;
+		for( int tz = 0; tz < m_NumTiles[ 2 ]; ++tz )
+		{
+			for( int ty = 0; ty < m_NumTiles[ 1 ]; ++ty )
+			{
+				for( int tx = 0; tx < m_NumTiles[ 0 ]; ++tx )
+				{
+					size_t t = ( (size_t)tz * m_NumTiles[ 1 ] + ty ) * m_NumTiles[ 0 ] + tx;
+					if( m_Stale[ t ] )
+					{
+						m_Partials[ t ] = sumTile( tx, ty, tz, detail::DimTag<DIM>() );
+						m_Stale[ t ] = 0;
+						bChanged = true;
+					}
+				}
+			}
+		}
+		if( bChanged )
+		{
+			m_Sum = 0;
+			for( size_t t = 0; t < m_Partials.size(); ++t )
+			{
+				m_Sum += m_Partials[ t ];
+			}
+		}
+		return m_Sum;
+	}
+
+	ACCUM value() const
+	{
+		return m_Sum;
+	}
+
+private:
+	void markTiles( const detail::Box& box )
+	{
+		int lo[ 3 ];
+		int hi[ 3 ];
+		for( int d = 0; d < 3; ++d )
+		{
+			lo[ d ] = ( box.lo[ d ] - m_Domain.lo[ d ] ) / m_Tile[ d ];
+			hi[ d ] = ( box.hi[ d ] - m_Domain.lo[ d ] - 1 ) / m_Tile[ d ];
+		}
+		for( int tz = lo[ 2 ]; tz <= hi[ 2 ]; ++tz )
+		{
+			for( int ty = lo[ 1 ]; ty <= hi[ 1 ]; ++ty )
+			{
+				for( int tx = lo[ 0 ]; tx <= hi[ 0 ]; ++tx )
+				{
+					m_Stale[ ( (size_t)tz * m_NumTiles[ 1 ] + ty ) * m_NumTiles[ 0 ] + tx ] = 1;
+				}
+			}
+		}
+	}
+
+	ACCUM sumTile( int tx, int ty, int, detail::DimTag<2> ) const
+	{
+		int beginX = m_Domain.lo[ 0 ] + tx * m_Tile[ 0 ];
+		int beginY = m_Domain.lo[ 1 ] + ty * m_Tile[ 1 ];
+		return mm::sum<ACCUM>( m_Op, beginX, beginY,
+				std::min( beginX + m_Tile[ 0 ], m_Domain.hi[ 0 ] ),
+				std::min( beginY + m_Tile[ 1 ], m_Domain.hi[ 1 ] ) );
+	}
+
+	ACCUM sumTile( int tx, int ty, int tz, detail::DimTag<3> ) const
+	{
+		int beginX = m_Domain.lo[ 0 ] + tx * m_Tile[ 0 ];
+		int beginY = m_Domain.lo[ 1 ] + ty * m_Tile[ 1 ];
+		int beginZ = m_Domain.lo[ 2 ] + tz * m_Tile[ 2 ];
+		return mm::sum<ACCUM>( m_Op, beginX, beginY, beginZ,
+				std::min( beginX + m_Tile[ 0 ], m_Domain.hi[ 0 ] ),
+				std::min( beginY + m_Tile[ 1 ], m_Domain.hi[ 1 ] ),
+				std::min( beginZ + m_Tile[ 2 ], m_Domain.hi[ 2 ] ) );
+	}
+
+private:
+	const op_operand<Top> m_Op;
+	detail::Box m_Domain;
+	int m_Tile[ 3 ];
+	int m_NumTiles[ 3 ];
+	std::vector<ACCUM> m_Partials;
+	std::vector<char> m_Stale;
+	std::vector<detail::DirtySource> m_Sources;
+	std::vector<detail::Box> m_Boxes;
+	ACCUM m_Sum;
+	bool m_bUnknown;
+	bool m_bValid;
+};
+
+template<typename Tacc = void, typename Top, typename Tbegin, typename Tend>
+inline IncrementalSum<Top, detail::CoordDim<Tbegin>::value, Tacc> incrementalSum(
+		const Top& op, const Tbegin& begin, const Tend& end )
+{
+	return IncrementalSum<Top, detail::CoordDim<Tbegin>::value, Tacc>( op, begin, end );
+}
+
+}
+
+#endif
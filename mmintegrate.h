@@ -0,0 +1,465 @@
+#ifndef _MMINTEGRATE_H_
+#define _MMINTEGRATE_H_
+
+#include "metamath.h"
+#include "mmfunction.h"
+#include "mmparallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <stdexcept>
+
+namespace mm
+{
+
+namespace integrate
+{
+
+namespace detail
+{
+
+template<typename Tfunc>
+inline auto at( Tfunc& func, int x, int y, int, mm::detail::DimTag<2> )
+	-> decltype( func( x, y ) )
+{
+	return func( x, y );
+}
+
+template<typename Tfunc>
+inline auto at( Tfunc& func, int x, int y, int z, mm::detail::DimTag<3> )
+	-> decltype( func( x, y, z ) )
+{
+	return func( x, y, z );
+}
+
+/*
+ * Runs fn( x, y, z ) over the whole of size, z being 0 in 2D, with the
+ * outermost dimension split among the threads of pPool if there is one.
+ * fn returns the point's error; the maximum is returned.
+ */
+template<unsigned int Dim, typename Tsize, typename Tfn>
+inline double sweep( parallel::ThreadPool* pPool, const Tsize& size, const Tfn& fn )
+{
+	int sizeX = size[ 0 ];
+	int sizeY = size[ 1 ];
+	int sizeZ = ( Dim > 2 ? size[ Dim - 1 ] : 1 );
+	int outer = ( Dim > 2 ? sizeZ : sizeY );
+	double error = 0;
+	std::mutex mutex;
+	auto rows = [&]( int begin, int end )
+	{
+		double local = 0;
+		for( int k = ( Dim > 2 ? begin : 0 ); k < ( Dim > 2 ? end : 1 ); ++k )
+		{
+			for( int j = ( Dim > 2 ? 0 : begin ); j < ( Dim > 2 ? sizeY : end ); ++j )
+			{
+				for( int i = 0; i < sizeX; ++i )
+				{
+					double value = fn( i, j, k );
+					local = ( value > local || value != value ? value : local );
+				}
+			}
+		}
+		std::lock_guard<std::mutex> lock( mutex );
+		error = ( local > error || local != local ? local : error );
+	};
+	if( pPool != nullptr )
+	{
+		pPool->parallelFor( 0, outer, rows );
+	}
+	else
+	{
+		rows( 0, outer );
+	}
+	return error;
+}
+
+/* Error of one point, scaled by the tolerances. */
+template<typename T>
+inline double scaled( T value, T estimate, T old, double absTol, double relTol )
+{
+	double scale = absTol + relTol * std::max( std::fabs( (double)value ), std::fabs( (double)old ) );
+	return std::fabs( (double)( value - estimate ) ) / scale;
+}
+
+}
+
+/*
+ * Explicit Runge-Kutta steppers for du/dt = rhs( u, t ), where rhs is a
+ * builder returning the expression of the right-hand side for a given
+ * state, e.g.
+ *
+ * [&]( const Function<float>& s, double t ) { return utils::diffXX_YY( bc::periodic( s ), h ); }
+ *
+ * Stage buffers are allocated once by the constructor. Every stage is one
+ * sweep that evaluates rhs once per point and writes all that depends on
+ * it, so no stage derivative is stored. rhs has to read only the state it
+ * is given. The sweeps cover all of u, edges included, so a stencil has to
+ * read the state through a bc:: policy that keeps its reads inside. With
+ * a ThreadPool, sweeps split rows among its threads.
+ *
+ * step( u, rhs, t, dt ) advances u in place. The steppers with an
+ * embedded lower-order solution also have step( u, out, rhs, t, dt,
+ * absTol, relTol ), writing the new state to out and returning the max
+ * norm of the error estimate scaled by absTol + relTol |u|, computed in
+ * the last sweep; Adaptive builds on it.
+ */
+
+/* Heun's method, the two-stage SSP scheme, with Euler as the embedded one. */
+template<typename T, unsigned int Dim = 2>
+class RK2
+{
+public:
+	typedef Function<T, Dim> FUNCTION;
+	typedef typename FUNCTION::DTYPE DTYPE;
+	static const int ORDER = 2;
+
+public:
+	template<typename U>
+	RK2( const U& _size )
+		: m_pPool( nullptr ), m_Stage( _size )
+	{
+	}
+
+	template<typename U>
+	RK2( parallel::ThreadPool& pool, const U& _size )
+		: m_pPool( &pool ), m_Stage( _size )
+	{
+	}
+
+	template<typename Tbuild>
+	void step( FUNCTION& u, const Tbuild& rhs, double t, double dt )
+	{
+		step( u, u, rhs, t, dt, 0, 0, false );
+	}
+
+	template<typename Tbuild>
+	double step( const FUNCTION& u, FUNCTION& out, const Tbuild& rhs, double t, double dt,
+			double absTol, double relTol )
+	{
+		return step( u, out, rhs, t, dt, absTol, relTol, true );
+	}
+
+private:
+	template<typename Tbuild>
+	double step( const FUNCTION& u, FUNCTION& out, const Tbuild& rhs, double t, double dt,
+			double absTol, double relTol, bool bError )
+	{
+		typedef mm::detail::DimTag<Dim> TAG;
+		FUNCTION& s = m_Stage;
+		DTYPE h = (DTYPE)dt;
+		DTYPE half = (DTYPE)0.5;
+
+		auto k1 = rhs( u, t );
+		detail::sweep<Dim>( m_pPool, u.size(),
+				[&]( int x, int y, int z ) -> double
+				{
+					detail::at( s, x, y, z, TAG() ) = detail::at( u, x, y, z, TAG() )
+							+ h * detail::at( k1, x, y, z, TAG() );
+					return 0;
+				} );
+
+		auto k2 = rhs( s, t + dt );
+		return detail::sweep<Dim>( m_pPool, u.size(),
+				[&]( int x, int y, int z ) -> double
+				{
+					DTYPE old = detail::at( u, x, y, z, TAG() );
+					DTYPE euler = detail::at( s, x, y, z, TAG() );
+					DTYPE value = half * old + half * ( euler + h * detail::at( k2, x, y, z, TAG() ) );
+					detail::at( out, x, y, z, TAG() ) = value;
+					return ( bError ? detail::scaled( value, euler, old, absTol, relTol ) : 0 );
+				} );
+	}
+
+private:
+	RK2( const RK2<T, Dim>& );
+	RK2<T, Dim>& operator=( const RK2<T, Dim>& );
+
+private:
+	parallel::ThreadPool* m_pPool;
+	FUNCTION m_Stage;
+};
+
+/*
+ * The three-stage SSP scheme of Shu and Osher. Twice the second stage
+ * minus u is Heun's solution, the embedded one.
+ */
+template<typename T, unsigned int Dim = 2>
+class SSPRK3
+{
+public:
+	typedef Function<T, Dim> FUNCTION;
+	typedef typename FUNCTION::DTYPE DTYPE;
+	static const int ORDER = 3;
+
+public:
+	template<typename U>
+	SSPRK3( const U& _size )
+		: m_pPool( nullptr ), m_Stage1( _size ), m_Stage2( _size )
+	{
+	}
+
+	template<typename U>
+	SSPRK3( parallel::ThreadPool& pool, const U& _size )
+		: m_pPool( &pool ), m_Stage1( _size ), m_Stage2( _size )
+	{
+	}
+
+	template<typename Tbuild>
+	void step( FUNCTION& u, const Tbuild& rhs, double t, double dt )
+	{
+		step( u, u, rhs, t, dt, 0, 0, false );
+	}
+
+	template<typename Tbuild>
+	double step( const FUNCTION& u, FUNCTION& out, const Tbuild& rhs, double t, double dt,
+			double absTol, double relTol )
+	{
+		return step( u, out, rhs, t, dt, absTol, relTol, true );
+	}
+
+private:
+	template<typename Tbuild>
+	double step( const FUNCTION& u, FUNCTION& out, const Tbuild& rhs, double t, double dt,
+			double absTol, double relTol, bool bError )
+	{
+		typedef mm::detail::DimTag<Dim> TAG;
+		FUNCTION& s1 = m_Stage1;
+		FUNCTION& s2 = m_Stage2;
+		DTYPE h = (DTYPE)dt;
+
+		auto k1 = rhs( u, t );
+		detail::sweep<Dim>( m_pPool, u.size(),
+				[&]( int x, int y, int z ) -> double
+				{
+					detail::at( s1, x, y, z, TAG() ) = detail::at( u, x, y, z, TAG() )
+							+ h * detail::at( k1, x, y, z, TAG() );
+					return 0;
+				} );
+
+		auto k2 = rhs( s1, t + dt );
+		detail::sweep<Dim>( m_pPool, u.size(),
+				[&]( int x, int y, int z ) -> double
+				{
+					detail::at( s2, x, y, z, TAG() ) = (DTYPE)0.75 * detail::at( u, x, y, z, TAG() )
+							+ (DTYPE)0.25 * ( detail::at( s1, x, y, z, TAG() )
+								+ h * detail::at( k2, x, y, z, TAG() ) );
+					return 0;
+				} );
+
+		auto k3 = rhs( s2, t + 0.5 * dt );
+		return detail::sweep<Dim>( m_pPool, u.size(),
+				[&]( int x, int y, int z ) -> double
+				{
+					DTYPE old = detail::at( u, x, y, z, TAG() );
+					DTYPE stage = detail::at( s2, x, y, z, TAG() );
+					DTYPE value = old / 3 + (DTYPE)2 / 3 * ( stage + h * detail::at( k3, x, y, z, TAG() ) );
+					detail::at( out, x, y, z, TAG() ) = value;
+					return ( bError ? detail::scaled( value, 2 * stage - old, old, absTol, relTol ) : 0 );
+				} );
+	}
+
+private:
+	SSPRK3( const SSPRK3<T, Dim>& );
+	SSPRK3<T, Dim>& operator=( const SSPRK3<T, Dim>& );
+
+private:
+	parallel::ThreadPool* m_pPool;
+	FUNCTION m_Stage1;
+	FUNCTION m_Stage2;
+};
+
+/*
+ * The classical four-stage scheme. Each sweep adds its stage to the
+ * running combination and writes the next stage's input, so it needs
+ * three buffers; it has no embedded solution.
+ */
+template<typename T, unsigned int Dim = 2>
+class RK4
+{
+public:
+	typedef Function<T, Dim> FUNCTION;
+	typedef typename FUNCTION::DTYPE DTYPE;
+	static const int ORDER = 4;
+
+public:
+	template<typename U>
+	RK4( const U& _size )
+		: m_pPool( nullptr ), m_Sum( _size ), m_Stage1( _size ), m_Stage2( _size )
+	{
+	}
+
+	template<typename U>
+	RK4( parallel::ThreadPool& pool, const U& _size )
+		: m_pPool( &pool ), m_Sum( _size ), m_Stage1( _size ), m_Stage2( _size )
+	{
+	}
+
+	template<typename Tbuild>
+	void step( FUNCTION& u, const Tbuild& rhs, double t, double dt )
+	{
+		typedef mm::detail::DimTag<Dim> TAG;
+		FUNCTION& sum = m_Sum;
+		FUNCTION& s1 = m_Stage1;
+		FUNCTION& s2 = m_Stage2;
+		DTYPE h = (DTYPE)dt;
+		DTYPE h2 = h / 2;
+		DTYPE h3 = h / 3;
+		DTYPE h6 = h / 6;
+
+		auto k1 = rhs( u, t );
+		detail::sweep<Dim>( m_pPool, u.size(),
+				[&]( int x, int y, int z ) -> double
+				{
+					DTYPE old = detail::at( u, x, y, z, TAG() );
+					DTYPE k = detail::at( k1, x, y, z, TAG() );
+					detail::at( sum, x, y, z, TAG() ) = old + h6 * k;
+					detail::at( s1, x, y, z, TAG() ) = old + h2 * k;
+					return 0;
+				} );
+
+		auto k2 = rhs( s1, t + 0.5 * dt );
+		detail::sweep<Dim>( m_pPool, u.size(),
+				[&]( int x, int y, int z ) -> double
+				{
+					DTYPE k = detail::at( k2, x, y, z, TAG() );
+					detail::at( sum, x, y, z, TAG() ) += h3 * k;
+					detail::at( s2, x, y, z, TAG() ) = detail::at( u, x, y, z, TAG() ) + h2 * k;
+					return 0;
+				} );
+
+		auto k3 = rhs( s2, t + 0.5 * dt );
+		detail::sweep<Dim>( m_pPool, u.size(),
+				[&]( int x, int y, int z ) -> double
+				{
+					DTYPE k = detail::at( k3, x, y, z, TAG() );
+					detail::at( sum, x, y, z, TAG() ) += h3 * k;
+					detail::at( s1, x, y, z, TAG() ) = detail::at( u, x, y, z, TAG() ) + h * k;
+					return 0;
+				} );
+
+		auto k4 = rhs( s1, t + dt );
+		detail::sweep<Dim>( m_pPool, u.size(),
+				[&]( int x, int y, int z ) -> double
+				{
+					detail::at( u, x, y, z, TAG() ) = detail::at( sum, x, y, z, TAG() )
+							+ h6 * detail::at( k4, x, y, z, TAG() );
+					return 0;
+				} );
+	}
+
+private:
+	RK4( const RK4<T, Dim>& );
+	RK4<T, Dim>& operator=( const RK4<T, Dim>& );
+
+private:
+	parallel::ThreadPool* m_pPool;
+	FUNCTION m_Sum;
+	FUNCTION m_Stage1;
+	FUNCTION m_Stage2;
+};
+
+/*
+ * Step size control on top of a stepper with an embedded solution. step()
+ * retries with a smaller dt until the scaled error is at most 1, then
+ * advances u and t and proposes the next dt. An accepted step copies the
+ * candidate into u, so views and references to u see the result.
+ */
+template<typename Tstepper>
+class Adaptive
+{
+public:
+	typedef typename Tstepper::FUNCTION FUNCTION;
+
+public:
+	template<typename U>
+	Adaptive( const U& _size, double absTol, double relTol )
+		: m_pPool( nullptr ), m_Stepper( _size ), m_Candidate( _size ), m_AbsTol( absTol ),
+		  m_RelTol( relTol ), m_NumRejected( 0 )
+	{
+	}
+
+	template<typename U>
+	Adaptive( parallel::ThreadPool& pool, const U& _size, double absTol, double relTol )
+		: m_pPool( &pool ), m_Stepper( pool, _size ), m_Candidate( _size ), m_AbsTol( absTol ),
+		  m_RelTol( relTol ), m_NumRejected( 0 )
+	{
+	}
+
+	/*
+	 * Returns the step taken; dt becomes the proposal for the next one. A
+	 * non-finite error estimate rejects the step. Throws std::runtime_error
+	 * once dt is too small to advance t.
+	 */
+	template<typename Tbuild>
+	double step( FUNCTION& u, const Tbuild& rhs, double& t, double& dt )
+	{
+		const double SAFETY = 0.9;
+		const double MIN_FACTOR = 0.2;
+		const double MAX_FACTOR = 5;
+		for( ;; )
+		{
+			if( !( t + dt != t ) )
+			{
+				throw std::runtime_error( "step size underflow" );
+			}
+			double error = m_Stepper.step( u, m_Candidate, rhs, t, dt, m_AbsTol, m_RelTol );
+			if( !std::isfinite( error ) )
+			{
+				++m_NumRejected;
+				dt *= MIN_FACTOR;
+				continue;
+			}
+			double factor = ( error > 0
+					? SAFETY * std::pow( error, -1.0 / Tstepper::ORDER ) : MAX_FACTOR );
+			factor = std::min( MAX_FACTOR, std::max( MIN_FACTOR, factor ) );
+			if( error <= 1 )
+			{
+				accept( u );
+				double taken = dt;
+				t += taken;
+				dt *= factor;
+				return taken;
+			}
+			++m_NumRejected;
+			dt *= std::min( factor, SAFETY );
+		}
+	}
+
+	int numRejected() const
+	{
+		return m_NumRejected;
+	}
+
+private:
+	Adaptive( const Adaptive<Tstepper>& );
+	Adaptive<Tstepper>& operator=( const Adaptive<Tstepper>& );
+
+	void accept( FUNCTION& u )
+	{
+		static const unsigned int Dim = FUNCTION::DIM;
+		typedef mm::detail::DimTag<Dim> TAG;
+		const FUNCTION& candidate = m_Candidate;
+		detail::sweep<Dim>( m_pPool, u.size(),
+				[&]( int x, int y, int z ) -> double
+				{
+					detail::at( u, x, y, z, TAG() ) = detail::at( candidate, x, y, z, TAG() );
+					return 0;
+				} );
+	}
+
+private:
+	parallel::ThreadPool* m_pPool;
+	Tstepper m_Stepper;
+	FUNCTION m_Candidate;
+	double m_AbsTol;
+	double m_RelTol;
+	int m_NumRejected;
+};
+
+}
+
+}
+
+#endif
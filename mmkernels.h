@@ -0,0 +1,908 @@
+#ifndef _MMKERNELS_H_
+#define _MMKERNELS_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+namespace mm
+{
+
+namespace fun
+{
+
+/*
+ * Evaluation mode of the functions in mm::fun.
+ *
+ * STD       calls the scalar std:: function. Exact to the C library, but
+ *           the call keeps the surrounding loop from being vectorized.
+ * ACCURATE  branch-free polynomial kernels that inline into the caller and
+ *           vectorize. Error bounds are listed with each kernel below and
+ *           assume IEEE semantics, i.e. no -ffast-math.
+ * FAST      the same kernels with single precision polynomials also for
+ *           double (relative error below 1e-7) and without the handling of
+ *           NaN, infinite and subnormal arguments.
+ *
+ * Only float and double have kernels, other types always use STD.
+ */
+enum Mode
+{
+	STD,
+	ACCURATE,
+	FAST
+};
+
+#ifndef MM_FUN_MODE
+#define MM_FUN_MODE mm::fun::ACCURATE
+#endif
+
+/*
+ * The kernels only vectorize once inlined into the calling loop, which the
+ * compiler's size heuristics refuse for the larger ones such as pow.
+ */
+#if defined( _MSC_VER )
+#define MM_KERNEL_INLINE __forceinline
+#elif defined( __GNUC__ )
+#define MM_KERNEL_INLINE inline __attribute__(( always_inline ))
+#else
+#define MM_KERNEL_INLINE inline
+#endif
+
+namespace kernel
+{
+
+template<typename T>
+struct FloatBits;
+
+template<>
+struct FloatBits<float>
+{
+	typedef std::uint32_t UINT;
+	static const int MANT_BITS = 23;
+	static const int EXP_BIAS = 127;
+};
+
+template<>
+struct FloatBits<double>
+{
+	typedef std::uint64_t UINT;
+	static const int MANT_BITS = 52;
+	static const int EXP_BIAS = 1023;
+};
+
+template<typename T>
+struct Constants;
+
+template<>
+struct Constants<float>
+{
+	static constexpr float LOG2E = 1.44269504088896341f;
+	static constexpr float EXP_LN2_HI = 6.93359375e-1f;
+	static constexpr float EXP_LN2_LO = -2.12194440e-4f;
+	static constexpr float EXP_MIN = -110.0f;
+	static constexpr float EXP_MAX = 89.0f;
+
+	static constexpr float LOG_LN2_HI = 6.9313812256e-1f;
+	static constexpr float LOG_LN2_LO = 9.0580006145e-6f;
+	static constexpr float SQRT2 = 1.41421356237309504880f;
+	static constexpr float MIN_NORMAL = 1.17549435e-38f;
+	static constexpr float SUBNORMAL_SCALE = 33554432.0f;
+	static const int SUBNORMAL_EXP = 25;
+
+	static constexpr float PI_HI = 3.14159274101257324219f;
+	static constexpr float PI_LO = -8.7422780004e-8f;
+	static constexpr float PIO2_HI = 1.57079637050628662109f;
+	static constexpr float PIO2_LO = -4.3711390002e-8f;
+	static constexpr float PIO4_HI = 7.85398185253143310547e-1f;
+	static constexpr float PIO4_LO = -2.1855695001e-8f;
+	static constexpr float TAN3PIO8 = 2.41421356237309504880f;
+	static constexpr float TANPIO8 = 4.14213562373095048802e-1f;
+
+	static constexpr float SPLIT = 4097.0f;
+};
+
+template<>
+struct Constants<double>
+{
+	static constexpr double LOG2E = 1.44269504088896340736;
+	static constexpr double EXP_LN2_HI = 6.93145751953125e-1;
+	static constexpr double EXP_LN2_LO = 1.42860682030941723212e-6;
+	static constexpr double EXP_MIN = -750.0;
+	static constexpr double EXP_MAX = 710.0;
+
+	static constexpr double LOG_LN2_HI = 6.93147180369123816490e-1;
+	static constexpr double LOG_LN2_LO = 1.90821492927058770002e-10;
+	static constexpr double SQRT2 = 1.41421356237309504880;
+	static constexpr double MIN_NORMAL = 2.2250738585072013831e-308;
+	static constexpr double SUBNORMAL_SCALE = 18014398509481984.0;
+	static const int SUBNORMAL_EXP = 54;
+
+	static constexpr double FOPI = 1.27323954473516268615;
+	static constexpr double DP1 = 7.85398125648498535156e-1;
+	static constexpr double DP2 = 3.77489470793079817668e-8;
+	static constexpr double DP3 = 2.69515142907905952645e-15;
+	static constexpr double REDUCE_MAX = 1073741824.0;
+
+	static constexpr double PI_HI = 3.14159265358979311600;
+	static constexpr double PI_LO = 1.22464679914735320717e-16;
+	static constexpr double PIO2_HI = 1.57079632679489655800;
+	static constexpr double PIO2_LO = 6.12323399573676603587e-17;
+	static constexpr double PIO4_HI = 7.85398163397448278999e-1;
+	static constexpr double PIO4_LO = 3.06161699786838301793e-17;
+	static constexpr double TAN3PIO8 = 2.41421356237309504880;
+	static constexpr double TANPIO8 = 4.14213562373095048802e-1;
+
+	static constexpr double TWO_THIRDS_HI = 6.66666666666666629659e-1;
+	static constexpr double TWO_THIRDS_LO = 3.70074341541718826265e-17;
+
+	static constexpr double SPLIT = 134217729.0;
+};
+
+template<typename T, Mode M>
+struct Tier
+{
+	static const bool WIDE = ( sizeof( T ) == sizeof( double ) && M != FAST );
+	static const bool SPECIAL = ( M != FAST );
+};
+
+template<typename T>
+MM_KERNEL_INLINE typename FloatBits<T>::UINT toBits( T x )
+{
+	typename FloatBits<T>::UINT bits;
+	std::memcpy( &bits, &x, sizeof( bits ) );
+	return bits;
+}
+
+template<typename T>
+MM_KERNEL_INLINE T fromBits( typename FloatBits<T>::UINT bits )
+{
+	T x;
+	std::memcpy( &x, &bits, sizeof( x ) );
+	return x;
+}
+
+template<typename T>
+MM_KERNEL_INLINE T absVal( T x )
+{
+	typedef typename FloatBits<T>::UINT UINT;
+	return fromBits<T>( toBits( x ) & ~( (UINT)1 << ( sizeof( T ) * 8 - 1 ) ) );
+}
+
+template<typename T>
+MM_KERNEL_INLINE bool signBit( T x )
+{
+	return ( ( toBits( x ) >> ( sizeof( T ) * 8 - 1 ) ) != 0 );
+}
+
+template<typename T>
+MM_KERNEL_INLINE T copySign( T mag, T sgn )
+{
+	typedef typename FloatBits<T>::UINT UINT;
+	const UINT SIGN = (UINT)1 << ( sizeof( T ) * 8 - 1 );
+	return fromBits<T>( ( toBits( mag ) & ~SIGN ) | ( toBits( sgn ) & SIGN ) );
+}
+
+// a or b without a branch; a plain ?: on floating point values is easily
+// turned back into jumps, which stops the vectorizer
+template<typename T>
+MM_KERNEL_INLINE T select( bool cond, T a, T b )
+{
+	typedef typename FloatBits<T>::UINT UINT;
+	UINT mask = (UINT)0 - (UINT)cond;
+	return fromBits<T>( ( toBits( a ) & mask ) | ( toBits( b ) & ~mask ) );
+}
+
+template<typename T>
+MM_KERNEL_INLINE T negateIf( bool cond, T x )
+{
+	typedef typename FloatBits<T>::UINT UINT;
+	return fromBits<T>( toBits( x ) ^ ( (UINT)cond << ( sizeof( T ) * 8 - 1 ) ) );
+}
+
+// 2^n for n inside the normal exponent range
+template<typename T>
+MM_KERNEL_INLINE T pow2( int n )
+{
+	typedef FloatBits<T> B;
+	return fromBits<T>( (typename B::UINT)( n + B::EXP_BIAS ) << B::MANT_BITS );
+}
+
+// x * 2^n in two steps, so that results in the subnormal range round once
+template<typename T>
+MM_KERNEL_INLINE T scale2( T x, int n )
+{
+	int n1 = n / 2;
+	return ( x * pow2<T>( n1 ) * pow2<T>( n - n1 ) );
+}
+
+// exact rounding error of the product p = a * b
+template<typename T>
+MM_KERNEL_INLINE T productError( T a, T b, T p )
+{
+#ifdef __FMA__
+	return std::fma( a, b, -p );
+#else
+	T ca = Constants<T>::SPLIT * a;
+	T aHi = ca - ( ca - a );
+	T aLo = a - aHi;
+	T cb = Constants<T>::SPLIT * b;
+	T bHi = cb - ( cb - b );
+	T bLo = b - bHi;
+	return ( ( ( aHi * bHi - p ) + aHi * bLo + aLo * bHi ) + aLo * bLo );
+#endif
+}
+
+template<typename T>
+MM_KERNEL_INLINE T horner( T x, const T* c, int n )
+{
+	T res = c[ n - 1 ];
+	for( int k = n - 2; k >= 0; --k )
+	{
+		res = res * x + c[ k ];
+	}
+	return res;
+}
+
+/*
+ * Polynomial tables, lowest order first. The wide tier reaches double
+ * precision, the narrow tier single precision. The tanh, erf and atan
+ * tables are weighted minimax fits, the rest are Taylor or Cephes
+ * coefficients.
+ */
+template<typename T, bool WIDE>
+struct Poly;
+
+template<typename T>
+struct Poly<T, true>
+{
+	// ( exp( r ) - 1 ) / r, |r| <= ln( 2 ) / 2
+	static T expm1( T r )
+	{
+		static const T c[] = {
+			1.0, 5.0e-1, 1.666666666666666574148e-1, 4.166666666666666435370e-2,
+			8.333333333333333217685e-3, 1.388888888888888941894e-3,
+			1.984126984126984125263e-4, 2.480158730158730156579e-5,
+			2.755731922398589251095e-6, 2.755731922398588827579e-7,
+			2.505210838544172022387e-8, 2.087675698786810018656e-9,
+			1.605904383682161334086e-10 };
+		return horner( r, c, 13 );
+	}
+
+	// ( 2 atanh( s ) - 2 s ) / ( s z ), z = s^2 <= 0.0295
+	static T log( T z )
+	{
+		static const T c[] = {
+			6.666666666666666296592e-1, 4.000000000000000222045e-1,
+			2.857142857142856984254e-1, 2.222222222222222098864e-1,
+			1.818181818181818232283e-1, 1.538461538461538546940e-1,
+			1.333333333333333314830e-1, 1.176470588235294101320e-1,
+			1.052631578947368362620e-1, 9.523809523809523280846e-2 };
+		return horner( z, c, 10 );
+	}
+
+	// ( 2 atanh( s ) - 2 s - 2 s^3 / 3 ) / ( s^3 z )
+	static T logTail( T z )
+	{
+		static const T c[] = {
+			4.000000000000000222045e-1, 2.857142857142856984254e-1,
+			2.222222222222222098864e-1, 1.818181818181818232283e-1,
+			1.538461538461538546940e-1, 1.333333333333333314830e-1,
+			1.176470588235294101320e-1, 1.052631578947368362620e-1,
+			9.523809523809523280846e-2, 8.695652173913043236908e-2 };
+		return horner( z, c, 10 );
+	}
+
+	static T sin( T z )
+	{
+		static const T c[] = {
+			-1.66666666666666307295e-1, 8.33333333332211858878e-3,
+			-1.98412698295895385996e-4, 2.75573136213857245213e-6,
+			-2.50507477628578072866e-8, 1.58962301576546568060e-10 };
+		return horner( z, c, 6 );
+	}
+
+	static T cos( T z )
+	{
+		static const T c[] = {
+			4.16666666666665929218e-2, -1.38888888888730564116e-3,
+			2.48015872888517045348e-5, -2.75573141792967388112e-7,
+			2.08757008419747316778e-9, -1.13585365213876817300e-11 };
+		return horner( z, c, 6 );
+	}
+
+	// ( tanh( x ) - x ) / x^3, z = x^2, |x| < 0.625
+	static T tanh( T z )
+	{
+		static const T c[] = {
+			-3.333333333333285610368e-1, 1.333333333326221413430e-1,
+			-5.396825393131764866806e-2, 2.186948757710690903269e-2,
+			-8.863221014545824513323e-3, 3.591989261301677088954e-3,
+			-1.454959291216039428994e-3, 5.863177965038397554245e-4,
+			-2.285665866362671794425e-4, 7.714690986123788098272e-5,
+			-1.607374744529122476394e-5 };
+		return horner( z, c, 11 );
+	}
+
+	// ( atan( x ) - x ) / x^3, z = x^2, |x| <= tan( pi / 8 )
+	static T atan( T z )
+	{
+		static const T c[] = {
+			-3.333333333333015140957e-1, 1.999999999908906792695e-1,
+			-1.428571419526881653084e-1, 1.111110665384930742857e-1,
+			-9.090782417823736481278e-2, 7.690068367863406910504e-2,
+			-6.641121715963862025001e-2, 5.692541455930450059866e-2,
+			-4.359101650800582930227e-2, 2.125991478856515559957e-2 };
+		return horner( z, c, 10 );
+	}
+
+	// erf( x ) / x, z = x^2, |x| < 1
+	static T erf( T z )
+	{
+		static const T c[] = {
+			1.128379167095512567993, -3.761263890318352002672e-1,
+			1.128379167094420643388e-1, -2.686617064311494860933e-2,
+			5.223977606147587883112e-3, -8.548325930753046184103e-4,
+			1.205529362149373333831e-4, -1.492471319178836128588e-5,
+			1.644714297799705687538e-6, -1.620640447411729466297e-7,
+			1.371138748736596937278e-8, -7.780255963446748111736e-10 };
+		return horner( z, c, 12 );
+	}
+
+	// erfc( x ) exp( x^2 ) / t, t = 1 / ( 1 + x / 2 ), 1 <= x <= 6
+	static T erfc( T t )
+	{
+		static const T c[] = {
+			2.820948375899686790826e-1, 2.820928070430821485491e-1,
+			2.468729136350686873019e-1, 1.758126836361066094660e-1,
+			8.800306242944920661150e-2, -3.106597205805190719522e-2,
+			6.922848979710304861946e-2, -5.102279388387521951971e-1,
+			1.274097001102864696741, -2.694659672633774890379,
+			4.498078248854818950771, -5.239222761253581814745,
+			4.093244875773841445852, -2.067780100036360816946,
+			6.164364775019540223784e-1, -8.300606703649189944212e-2 };
+		return horner( t, c, 16 );
+	}
+};
+
+template<typename T>
+struct Poly<T, false>
+{
+	static T expm1( T r )
+	{
+		static const T c[] = {
+			1.0, 5.0e-1, 1.666666666666666574148e-1, 4.166666666666666435370e-2,
+			8.333333333333333217685e-3, 1.388888888888888941894e-3,
+			1.984126984126984125263e-4 };
+		return horner( r, c, 7 );
+	}
+
+	static T log( T z )
+	{
+		static const T c[] = {
+			6.666666666666666296592e-1, 4.000000000000000222045e-1,
+			2.857142857142856984254e-1, 2.222222222222222098864e-1 };
+		return horner( z, c, 4 );
+	}
+
+	static T sin( T z )
+	{
+		static const T c[] = {
+			-1.6666654611e-1, 8.3321608736e-3, -1.9515295891e-4 };
+		return horner( z, c, 3 );
+	}
+
+	static T cos( T z )
+	{
+		static const T c[] = {
+			4.166664568298827e-2, -1.388731625493765e-3, 2.443315711809948e-5 };
+		return horner( z, c, 3 );
+	}
+
+	static T tanh( T z )
+	{
+		static const T c[] = {
+			-3.333328194277457077565e-1, 1.333144221483819267371e-1,
+			-5.373971626558344083475e-2, 2.063909061796347638676e-2,
+			-5.704990370589682389677e-3 };
+		return horner( z, c, 5 );
+	}
+
+	static T atan( T z )
+	{
+		static const T c[] = {
+			-3.333294914179581312937e-1, 1.997771012535580242891e-1,
+			-1.387767966069169572500e-1, 8.053725343983334310601e-2 };
+		return horner( z, c, 4 );
+	}
+
+	static T erf( T z )
+	{
+		static const T c[] = {
+			1.128379165732292879168, -3.761262583960583393537e-1,
+			1.128358526968660980499e-1, -2.685381603209857042396e-2,
+			5.188334439454595282653e-3, -8.010247162519711225282e-4,
+			7.854024812419250475964e-5 };
+		return horner( z, c, 7 );
+	}
+
+	static T erfc( T t )
+	{
+		static const T c[] = {
+			2.821379487749459520033e-1, 2.813455098623977692414e-1,
+			2.520666642101044707257e-1, 1.584061292782072280440e-1,
+			1.087456639254552367139e-1, 1.674670622965366208488e-2,
+			-1.770167010734388174592e-1, 7.797295730014542276988e-2 };
+		return horner( t, c, 8 );
+	}
+};
+
+template<typename T>
+using enable_if_kernel = typename std::enable_if<
+	std::is_same<T, float>::value || std::is_same<T, double>::value, T>::type;
+
+template<typename T>
+using enable_if_no_kernel = typename std::enable_if<
+	!std::is_same<T, float>::value && !std::is_same<T, double>::value, T>::type;
+
+/* === BEGIN KERNELS === */
+
+// exp( hi + lo ) for |lo| much smaller than ulp( hi )
+template<Mode M, typename T>
+MM_KERNEL_INLINE T expSplit( T hi, T lo )
+{
+	typedef Constants<T> C;
+
+	T xc = select( hi >= C::EXP_MIN, hi, (T)C::EXP_MIN );
+	xc = select( xc <= C::EXP_MAX, xc, (T)C::EXP_MAX );
+	T fn = xc * C::LOG2E;
+	int n = (int)( fn + copySign( (T)0.5, fn ) );
+	T r = ( ( xc - n * C::EXP_LN2_HI ) - n * C::EXP_LN2_LO ) + lo;
+	T res = scale2( 1 + r * Poly<T, Tier<T, M>::WIDE>::expm1( r ), n );
+	if( Tier<T, M>::SPECIAL )
+	{
+		res = select( hi != hi, hi, res );
+	}
+	return res;
+}
+
+/*
+ * exp: ACCURATE float <= 1.5 ulp, double <= 1.5 ulp.
+ */
+template<Mode M, typename T>
+MM_KERNEL_INLINE enable_if_kernel<T> exp( T x )
+{
+	if( M == STD )
+	{
+		return std::exp( x );
+	}
+	return expSplit<M>( x, (T)0 );
+}
+
+/*
+ * log: ACCURATE float <= 1 ulp, double <= 1 ulp.
+ */
+template<Mode M, typename T>
+MM_KERNEL_INLINE enable_if_kernel<T> log( T x )
+{
+	typedef FloatBits<T> B;
+	typedef typename B::UINT UINT;
+	typedef Constants<T> C;
+
+	if( M == STD )
+	{
+		return std::log( x );
+	}
+
+	T xs = x;
+	int k = 0;
+	if( Tier<T, M>::SPECIAL )
+	{
+		bool subnormal = ( x < C::MIN_NORMAL );
+		xs = select( subnormal, x * C::SUBNORMAL_SCALE, x );
+		k = -C::SUBNORMAL_EXP * (int)subnormal;
+	}
+
+	UINT bits = toBits( xs );
+	k += (int)( bits >> B::MANT_BITS ) - B::EXP_BIAS;
+	T m = fromBits<T>( ( bits & ( ( (UINT)1 << B::MANT_BITS ) - 1 ) )
+			| ( (UINT)B::EXP_BIAS << B::MANT_BITS ) );
+	bool upper = ( m > C::SQRT2 );
+	m = select( upper, m * (T)0.5, m );
+	k += (int)upper;
+
+	T f = m - 1;
+	T s = f / ( 2 + f );
+	T z = s * s;
+	T R = z * Poly<T, Tier<T, M>::WIDE>::log( z );
+	T hfsq = (T)0.5 * f * f;
+	T dk = (T)k;
+	T res = dk * C::LOG_LN2_HI
+		- ( ( hfsq - ( s * ( hfsq + R ) + dk * C::LOG_LN2_LO ) ) - f );
+
+	if( Tier<T, M>::SPECIAL )
+	{
+		const T INF = std::numeric_limits<T>::infinity();
+		res = select( x == INF, x, res );
+		res = select( x == 0, -INF, res );
+		res = select( ( x < 0 ) | ( x != x ), std::numeric_limits<T>::quiet_NaN(), res );
+	}
+	return res;
+}
+
+// reduces |x| to z in [ -pi / 4, pi / 4 ] and the quadrant q in [ 0, 3 ];
+// q is kept as a floating point value so that every lane condition below
+// has the width of T
+template<typename T>
+MM_KERNEL_INLINE T reduceQuadrant( T ax, T& q )
+{
+	typedef Constants<T> C;
+
+	T fj = ax * C::FOPI;
+	fj = select( fj < C::REDUCE_MAX, fj, (T)C::REDUCE_MAX );
+	int j = (int)fj;
+	j += ( j & 1 );
+	T y = (T)j;
+	q = (T)( ( j >> 1 ) & 3 );
+	return ( ( ( ax - y * C::DP1 ) - y * C::DP2 ) - y * C::DP3 );
+}
+
+// float arguments are reduced in double, which keeps results near the
+// zeros of sin and cos accurate
+MM_KERNEL_INLINE float reduceQuadrant( float ax, float& q )
+{
+	double qd;
+	float z = (float)reduceQuadrant( (double)ax, qd );
+	q = (float)qd;
+	return z;
+}
+
+/*
+ * sin, cos: ACCURATE float <= 2 ulp, double <= 2 ulp for |x| <= 1e6. float
+ * is reduced in double. Arguments past 2^30 * pi / 4 are not reduced
+ * correctly, use STD for those.
+ */
+template<Mode M, typename T>
+MM_KERNEL_INLINE enable_if_kernel<T> sin( T x )
+{
+	typedef Poly<T, Tier<T, M>::WIDE> P;
+
+	if( M == STD )
+	{
+		return std::sin( x );
+	}
+
+	T ax = absVal( x );
+	T q;
+	T z = reduceQuadrant( ax, q );
+	T zz = z * z;
+	T res = select( ( q == 1 ) | ( q == 3 ),
+		1 - (T)0.5 * zz + zz * zz * P::cos( zz ),
+		z + z * zz * P::sin( zz ) );
+	res = negateIf( ( q >= 2 ) != signBit( x ), res );
+
+	if( Tier<T, M>::SPECIAL )
+	{
+		res = select( ax <= std::numeric_limits<T>::max(),
+			res, std::numeric_limits<T>::quiet_NaN() );
+	}
+	return res;
+}
+
+template<Mode M, typename T>
+MM_KERNEL_INLINE enable_if_kernel<T> cos( T x )
+{
+	typedef Poly<T, Tier<T, M>::WIDE> P;
+
+	if( M == STD )
+	{
+		return std::cos( x );
+	}
+
+	T ax = absVal( x );
+	T q;
+	T z = reduceQuadrant( ax, q );
+	T zz = z * z;
+	T res = select( ( q == 1 ) | ( q == 3 ),
+		z + z * zz * P::sin( zz ),
+		1 - (T)0.5 * zz + zz * zz * P::cos( zz ) );
+	res = negateIf( ( q == 1 ) | ( q == 2 ), res );
+
+	if( Tier<T, M>::SPECIAL )
+	{
+		res = select( ax <= std::numeric_limits<T>::max(),
+			res, std::numeric_limits<T>::quiet_NaN() );
+	}
+	return res;
+}
+
+/*
+ * tan: ACCURATE float <= 4 ulp, double <= 4 ulp, same argument range as sin.
+ */
+template<Mode M, typename T>
+MM_KERNEL_INLINE enable_if_kernel<T> tan( T x )
+{
+	typedef Poly<T, Tier<T, M>::WIDE> P;
+
+	if( M == STD )
+	{
+		return std::tan( x );
+	}
+
+	T ax = absVal( x );
+	T q;
+	T z = reduceQuadrant( ax, q );
+	T zz = z * z;
+	T s = z + z * zz * P::sin( zz );
+	T c = 1 - (T)0.5 * zz + zz * zz * P::cos( zz );
+	T res = select( ( q == 1 ) | ( q == 3 ), -c / s, s / c );
+	res = negateIf( signBit( x ), res );
+
+	if( Tier<T, M>::SPECIAL )
+	{
+		res = select( ax <= std::numeric_limits<T>::max(),
+			res, std::numeric_limits<T>::quiet_NaN() );
+	}
+	return res;
+}
+
+/*
+ * sqrt: correctly rounded. std::sqrt is a single instruction on every
+ * target we care about; loops containing it vectorize once errno handling
+ * is disabled (-fno-math-errno).
+ */
+template<Mode M, typename T>
+MM_KERNEL_INLINE enable_if_kernel<T> sqrt( T x )
+{
+	return std::sqrt( x );
+}
+
+/*
+ * tanh: ACCURATE float <= 2 ulp, double <= 2 ulp.
+ */
+template<Mode M, typename T>
+MM_KERNEL_INLINE enable_if_kernel<T> tanh( T x )
+{
+	if( M == STD )
+	{
+		return std::tanh( x );
+	}
+
+	T ax = absVal( x );
+	T z = x * x;
+	T small = x + x * z * Poly<T, Tier<T, M>::WIDE>::tanh( z );
+	T large = 1 - 2 / ( exp<M>( 2 * ax ) + 1 );
+	return copySign( select( ax < (T)0.625, small, large ), x );
+}
+
+// atan( t ) for t >= 0
+template<Mode M, typename T>
+MM_KERNEL_INLINE T atanPositive( T t )
+{
+	typedef Constants<T> C;
+
+	bool big = ( t > C::TAN3PIO8 );
+	bool mid = ( t > C::TANPIO8 );
+	T u = select( big, -1 / t, select( mid, ( t - 1 ) / ( t + 1 ), t ) );
+	T hi = select( big, (T)C::PIO2_HI, select( mid, (T)C::PIO4_HI, (T)0 ) );
+	T lo = select( big, (T)C::PIO2_LO, select( mid, (T)C::PIO4_LO, (T)0 ) );
+	T z = u * u;
+	return ( hi + ( u + ( u * z * Poly<T, Tier<T, M>::WIDE>::atan( z ) + lo ) ) );
+}
+
+/*
+ * atan2: ACCURATE float <= 3 ulp, double <= 3 ulp.
+ */
+template<Mode M, typename T>
+MM_KERNEL_INLINE enable_if_kernel<T> atan2( T y, T x )
+{
+	typedef Constants<T> C;
+
+	if( M == STD )
+	{
+		return std::atan2( y, x );
+	}
+
+	T ax = absVal( x );
+	T ay = absVal( y );
+	bool swap = ( ay > ax );
+	T num = select( swap, ax, ay );
+	T den = select( swap, ay, ax );
+	T t = num / den;
+	if( Tier<T, M>::SPECIAL )
+	{
+		const T INF = std::numeric_limits<T>::infinity();
+		t = select( den == 0, (T)0, t );
+		t = select( ( ax == INF ) & ( ay == INF ), (T)1, t );
+	}
+
+	T res = atanPositive<M>( t );
+	res = select( swap, ( C::PIO2_HI - res ) + C::PIO2_LO, res );
+	res = select( signBit( x ), ( C::PI_HI - res ) + C::PI_LO, res );
+	res = copySign( res, y );
+	if( Tier<T, M>::SPECIAL )
+	{
+		// the den == 0 case above would turn NaN / 0 into 0
+		res = select( ( x != x ) | ( y != y ), std::numeric_limits<T>::quiet_NaN(), res );
+	}
+	return res;
+}
+
+/*
+ * erf: ACCURATE float <= 1 ulp, double <= 2 ulp. float is evaluated with
+ * the double kernel.
+ */
+template<Mode M, typename T>
+MM_KERNEL_INLINE typename std::enable_if<std::is_same<T, double>::value, T>::type
+erf( T x )
+{
+	typedef Poly<T, Tier<T, M>::WIDE> P;
+
+	if( M == STD )
+	{
+		return std::erf( x );
+	}
+
+	T ax = absVal( x );
+	T z = x * x;
+	T small = x * P::erf( z );
+	T t = 1 / ( 1 + (T)0.5 * ax );
+	T large = 1 - exp<M>( -z ) * t * P::erfc( t );
+	// NaN fails ax >= 6 and propagates through large
+	large = select( ax >= 6, (T)1, large );
+	return copySign( select( ax < 1, small, large ), x );
+}
+
+template<Mode M, typename T>
+MM_KERNEL_INLINE typename std::enable_if<std::is_same<T, float>::value, T>::type
+erf( T x )
+{
+	if( M == STD )
+	{
+		return std::erf( x );
+	}
+	return (float)erf<M>( (double)x );
+}
+
+/*
+ * pow: ACCURATE double <= 2 ulp, log( x ) is carried in double-double so
+ * the error does not grow with |y log( x )|. float <= 1 ulp, evaluated
+ * with the double kernel. FAST is exp( y log( x ) ) and requires x > 0.
+ */
+template<Mode M, typename T>
+MM_KERNEL_INLINE typename std::enable_if<std::is_same<T, double>::value, T>::type
+pow( T x, T y )
+{
+	typedef FloatBits<T> B;
+	typedef typename B::UINT UINT;
+	typedef Constants<T> C;
+
+	if( M == STD )
+	{
+		return std::pow( x, y );
+	}
+	if( !Tier<T, M>::SPECIAL )
+	{
+		return exp<M>( y * log<M>( x ) );
+	}
+
+	const T INF = std::numeric_limits<T>::infinity();
+	const T NaN = std::numeric_limits<T>::quiet_NaN();
+	const T ROUND = (T)( (UINT)1 << B::MANT_BITS );
+
+	T ax = absVal( x );
+	bool subnormal = ( ax < C::MIN_NORMAL );
+	T xs = select( subnormal, ax * C::SUBNORMAL_SCALE, ax );
+	UINT bits = toBits( xs );
+	int k = (int)( bits >> B::MANT_BITS ) - B::EXP_BIAS
+		- C::SUBNORMAL_EXP * (int)subnormal;
+	T m = fromBits<T>( ( bits & ( ( (UINT)1 << B::MANT_BITS ) - 1 ) )
+			| ( (UINT)B::EXP_BIAS << B::MANT_BITS ) );
+	bool upper = ( m > C::SQRT2 );
+	m = select( upper, m * (T)0.5, m );
+	k += (int)upper;
+
+	// log( m ) = 2 atanh( s ) = 2 s + 2 s^3 / 3 + ... with s = f / ( 2 + f )
+	// carried as sHi + sLo and the two leading terms in double-double
+	T f = m - 1;
+	T d = 2 + f;
+	T dLo = f - ( d - 2 );
+	T sHi = f / d;
+	T prod = sHi * d;
+	T rem = ( f - prod ) - productError( sHi, d, prod );
+	T sLo = ( rem - sHi * dLo ) / d;
+	T z = sHi * sHi;
+	T zLo = productError( sHi, sHi, z );
+	T cHi = sHi * z;
+	T cLo = productError( sHi, z, cHi ) + sHi * zLo;
+	T tHi = cHi * C::TWO_THIRDS_HI;
+	T tLo = productError( cHi, (T)C::TWO_THIRDS_HI, tHi )
+		+ cHi * C::TWO_THIRDS_LO + cLo * C::TWO_THIRDS_HI;
+	T lmHi = 2 * sHi + tHi;
+	T lmLo = ( ( 2 * sHi - lmHi ) + tHi ) + tLo + 2 * sLo / ( 1 - z )
+		+ cHi * z * Poly<T, true>::logTail( z );
+
+	// log( x ) = k ln( 2 ) + log( m ) as lHi + lLo
+	T dk = (T)k;
+	T kHi = dk * C::LOG_LN2_HI;
+	T lHi = kHi + lmHi;
+	T bb = lHi - kHi;
+	T err = ( kHi - ( lHi - bb ) ) + ( lmHi - bb );
+	T lLo = err + lmLo + dk * C::LOG_LN2_LO;
+	T sum = lHi + lLo;
+	lLo = lLo - ( sum - lHi );
+	lHi = sum;
+
+	T pHi = y * lHi;
+	T pLo = productError( y, lHi, pHi ) + y * lLo;
+	bool inRange = ( ( pHi > C::EXP_MIN ) & ( pHi < C::EXP_MAX ) );
+	T res = expSplit<M>( select( inRange, pHi, (T)0 ), select( inRange, pLo, (T)0 ) );
+	res = select( inRange, res, select( pHi > 0, INF, (T)0 ) );
+
+	// integer and odd-integer exponents decide the sign for negative x
+	T ay = absVal( y );
+	T yr = ( ay + ROUND ) - ROUND;
+	T hy = (T)0.5 * ay;
+	T hyr = ( hy + ROUND ) - ROUND;
+	bool yInt = ( ( ay >= ROUND ) | ( yr == ay ) );
+	bool yOdd = ( ( ay < ROUND ) & yInt & ( hyr != hy ) );
+
+	res = select( ax == 0, select( y > 0, (T)0, INF ), res );
+	res = select( ax == INF, select( y > 0, INF, (T)0 ), res );
+	res = select( ( ax == 1 ) & ( ay == INF ), (T)1, res );
+	res = negateIf( signBit( x ) & yOdd, res );
+	res = select( ( x < 0 ) & ( ax != INF ) & !yInt, NaN, res );
+	res = select( ( x != x ) | ( y != y ), NaN, res );
+	res = select( ( y == 0 ) | ( x == 1 ), (T)1, res );
+	return res;
+}
+
+template<Mode M, typename T>
+MM_KERNEL_INLINE typename std::enable_if<std::is_same<T, float>::value, T>::type
+pow( T x, T y )
+{
+	if( M == STD )
+	{
+		return std::pow( x, y );
+	}
+	return (float)pow<M>( (double)x, (double)y );
+}
+
+#define MM_KERNEL_STD_FALLBACK(funName) \
+template<Mode M, typename T> \
+MM_KERNEL_INLINE enable_if_no_kernel<T> funName( T x ) \
+{ \
+	return std::funName( x ); \
+}
+
+#define MM_KERNEL_STD_FALLBACK2(funName) \
+template<Mode M, typename T> \
+MM_KERNEL_INLINE enable_if_no_kernel<T> funName( T x, T y ) \
+{ \
+	return std::funName( x, y ); \
+}
+
+MM_KERNEL_STD_FALLBACK( exp )
+MM_KERNEL_STD_FALLBACK( log )
+MM_KERNEL_STD_FALLBACK( sin )
+MM_KERNEL_STD_FALLBACK( cos )
+MM_KERNEL_STD_FALLBACK( tan )
+MM_KERNEL_STD_FALLBACK( sqrt )
+MM_KERNEL_STD_FALLBACK( tanh )
+MM_KERNEL_STD_FALLBACK( erf )
+MM_KERNEL_STD_FALLBACK2( atan2 )
+MM_KERNEL_STD_FALLBACK2( pow )
+
+#undef MM_KERNEL_STD_FALLBACK2
+#undef MM_KERNEL_STD_FALLBACK
+
+/* === END KERNELS === */
+
+}
+
+}
+
+}
+
+#endif
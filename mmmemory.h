@@ -0,0 +1,116 @@
+#ifndef _MMMEMORY_H_
+#define _MMMEMORY_H_
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <new>
+
+#if defined( __linux__ )
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace mm
+{
+
+namespace memory
+{
+
+/*
+ * Where the pages of a Function end up on a NUMA machine. HEAP is plain
+ * new[], so pages land on the node of whichever thread writes them first,
+ * usually the one initializing the data. INTERLEAVED spreads the pages
+ * round robin over all nodes. FIRST_TOUCH maps untouched pages so that a
+ * parallel first write, see parallel::touch(), places every page on the
+ * node of the thread that will sweep it.
+ */
+enum Placement
+{
+	HEAP,
+	INTERLEAVED,
+	FIRST_TOUCH
+};
+
+namespace detail
+{
+
+// keeps the mapping size, one cache line so the data stays aligned
+const size_t HEADER_BYTES = 64;
+const size_t HUGE_PAGE_BYTES = 2 << 20;
+// MPOL_INTERLEAVE of <linux/mempolicy.h>
+const int POLICY_INTERLEAVE = 3;
+
+}
+
+/*
+ * Maps bytes of zeroed memory with the given placement, backed by
+ * transparent huge pages if asked for. Falls back to the heap where
+ * mappings are not available.
+ */
+inline void* allocate( size_t bytes, Placement placement, bool bHugePages )
+{
+#if defined( __linux__ )
+	size_t size = bytes + detail::HEADER_BYTES;
+	if( bHugePages )
+	{
+		size = ( size + detail::HUGE_PAGE_BYTES - 1 )
+			/ detail::HUGE_PAGE_BYTES * detail::HUGE_PAGE_BYTES;
+	}
+	void* pBase = mmap( nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if( pBase == MAP_FAILED )
+	{
+		throw std::bad_alloc();
+	}
+	// both are hints, the memory is usable if the kernel declines
+	if( bHugePages )
+	{
+		madvise( pBase, size, MADV_HUGEPAGE );
+	}
+	if( placement == INTERLEAVED )
+	{
+		// kernels built for fewer nodes reject set bits past their limit,
+		// so the mask shrinks until accepted; without NUMA support the
+		// pages keep the default policy
+		unsigned long pNodes[ 16 ];
+		for( int i = 0; i < 16; ++i )
+		{
+			pNodes[ i ] = ~0ul;
+		}
+		for( unsigned long numNodes = sizeof( pNodes ) * 8; numNodes >= 2; numNodes /= 2 )
+		{
+			if( syscall( SYS_mbind, pBase, size, detail::POLICY_INTERLEAVE,
+					pNodes, numNodes, 0 ) == 0 || errno != EINVAL )
+			{
+				break;
+			}
+		}
+	}
+	*static_cast<size_t*>( pBase ) = size;
+	return static_cast<char*>( pBase ) + detail::HEADER_BYTES;
+#else
+	(void)placement;
+	(void)bHugePages;
+	void* pBase = ::operator new( bytes + detail::HEADER_BYTES );
+	std::memset( pBase, 0, bytes + detail::HEADER_BYTES );
+	return static_cast<char*>( pBase ) + detail::HEADER_BYTES;
+#endif
+}
+
+inline void release( void* pData )
+{
+	void* pBase = static_cast<char*>( pData ) - detail::HEADER_BYTES;
+#if defined( __linux__ )
+	munmap( pBase, *static_cast<size_t*>( pBase ) );
+#else
+	::operator delete( pBase );
+#endif
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef _MMPACKET_H_
+#define _MMPACKET_H_
+
+#include <type_traits>
+#include <utility>
+
+#ifndef MM_PACKET_BYTES
+#define MM_PACKET_BYTES 32
+#endif
+
+namespace mm
+{
+
+/*
+ * Fixed-width group of consecutive values along x. Every operation is a
+ * plain loop over the lanes, which compilers map onto SIMD registers when
+ * the lane body is branch-free and fully inlined.
+ */
+template<typename T, int N = MM_PACKET_BYTES / sizeof( T )>
+struct Packet
+{
+public:
+	static const int SIZE = N;
+
+	Packet()
+	{
+	}
+
+	explicit Packet( T value )
+	{
+		for( int k = 0; k < N; ++k )
+		{
+			v[ k ] = value;
+		}
+	}
+
+	T& operator[]( int k )
+	{
+		return v[ k ];
+	}
+
+	const T& operator[]( int k ) const
+	{
+		return v[ k ];
+	}
+
+public:
+	T v[ N ];
+};
+
+#define MM_PACKET_BINARY_OP(opName) \
+template<typename T1, typename T2, int N> \
+inline Packet<decltype(std::declval<T1>() opName std::declval<T2>()), N> \
+operator opName( const Packet<T1, N>& p1, const Packet<T2, N>& p2 ) \
+{ \
+	Packet<decltype(std::declval<T1>() opName std::declval<T2>()), N> res; \
+	for( int k = 0; k < N; ++k ) \
+	{ \
+		res.v[ k ] = p1.v[ k ] opName p2.v[ k ]; \
+	} \
+	return res; \
+} \
+\
+template<typename T, int N> \
+inline Packet<T, N> operator opName( const Packet<T, N>& p, T s ) \
+{ \
+	Packet<T, N> res; \
+	for( int k = 0; k < N; ++k ) \
+	{ \
+		res.v[ k ] = p.v[ k ] opName s; \
+	} \
+	return res; \
+} \
+\
+template<typename T, int N> \
+inline Packet<T, N> operator opName( T s, const Packet<T, N>& p ) \
+{ \
+	Packet<T, N> res; \
+	for( int k = 0; k < N; ++k ) \
+	{ \
+		res.v[ k ] = s opName p.v[ k ]; \
+	} \
+	return res; \
+}
+
+MM_PACKET_BINARY_OP( + )
+MM_PACKET_BINARY_OP( - )
+MM_PACKET_BINARY_OP( * )
+MM_PACKET_BINARY_OP( / )
+
+#undef MM_PACKET_BINARY_OP
+
+template<typename T, int N>
+inline Packet<T, N> operator-( const Packet<T, N>& p )
+{
+	Packet<T, N> res;
+	for( int k = 0; k < N; ++k )
+	{
+		res.v[ k ] = -p.v[ k ];
+	}
+	return res;
+}
+
+namespace detail
+{
+
+template<typename Top, int N>
+class has_packet
+{
+private:
+	template<typename U>
+	static auto test( int ) -> decltype(
+			std::declval<const U&>().template packet<N>( 0, 0 ),
+			std::true_type() );
+
+	template<typename U>
+	static std::false_type test( ... );
+
+public:
+	static const bool value = decltype( test<Top>( 0 ) )::value;
+};
+
+template<int N, typename Top>
+inline auto packet( const Top& op, int x, int y, std::true_type )
+	-> decltype( op.template packet<N>( x, y ) )
+{
+	return op.template packet<N>( x, y );
+}
+
+template<int N, typename Top>
+inline Packet<typename std::remove_cv<typename std::remove_reference<
+	decltype( std::declval<const Top&>()( 0, 0 ) )>::type>::type, N>
+packet( const Top& op, int x, int y, std::false_type )
+{
+	Packet<typename std::remove_cv<typename std::remove_reference<
+		decltype( op( 0, 0 ) )>::type>::type, N> res;
+	for( int k = 0; k < N; ++k )
+	{
+		res.v[ k ] = op( x + k, y );
+	}
+	return res;
+}
+
+}
+
+/*
+ * Evaluates op at ( x, y ) ... ( x + N - 1, y ). Operators that provide a
+ * packet<N>() member are evaluated lane-parallel, anything else is gathered
+ * one value at a time.
+ */
+template<int N, typename Top>
+inline auto packet( const Top& op, int x, int y )
+	-> decltype( detail::packet<N>( op, x, y,
+			std::integral_constant<bool, detail::has_packet<Top, N>::value>() ) )
+{
+	return detail::packet<N>( op, x, y,
+			std::integral_constant<bool, detail::has_packet<Top, N>::value>() );
+}
+
+}
+
+#endif
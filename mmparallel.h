@@ -0,0 +1,649 @@
+#ifndef _MMPARALLEL_H_
+#define _MMPARALLEL_H_
+
+#include "metamath.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined( __linux__ )
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace mm
+{
+
+namespace parallel
+{
+
+/*
+ * Pins the calling thread to one core, where the platform supports it.
+ */
+inline void pinThread( unsigned int core )
+{
+#if defined( __linux__ )
+	cpu_set_t cpus;
+	CPU_ZERO( &cpus );
+	CPU_SET( core % std::max( 1u, std::thread::hardware_concurrency() ), &cpus );
+	pthread_setaffinity_np( pthread_self(), sizeof( cpus ), &cpus );
+#else
+	(void)core;
+#endif
+}
+
+namespace detail
+{
+
+/*
+ * Pins the calling thread to one core for its lifetime and then restores
+ * the affinity the thread had before.
+ */
+class ScopedPin
+{
+public:
+	ScopedPin( bool bPin, unsigned int core )
+		: m_bRestore( false )
+	{
+#if defined( __linux__ )
+		if( bPin )
+		{
+			m_bRestore = ( pthread_getaffinity_np( pthread_self(),
+					sizeof( m_Saved ), &m_Saved ) == 0 );
+			pinThread( core );
+		}
+#else
+		(void)bPin;
+		(void)core;
+#endif
+	}
+
+	~ScopedPin()
+	{
+#if defined( __linux__ )
+		if( m_bRestore )
+		{
+			pthread_setaffinity_np( pthread_self(), sizeof( m_Saved ), &m_Saved );
+		}
+#endif
+	}
+
+private:
+	ScopedPin( const ScopedPin& );
+	ScopedPin& operator=( const ScopedPin& );
+
+#if defined( __linux__ )
+	cpu_set_t m_Saved;
+#endif
+	bool m_bRestore;
+};
+
+}
+
+/*
+ * Fixed set of worker threads that run one parallelFor() at a time. The
+ * calling thread works on the range as well, so a pool of size() threads
+ * keeps size() + 1 cores busy.
+ *
+ * A pinned pool binds worker i to core i + 1, and the calling thread to
+ * core 0 while it works on a job, after which the caller gets its own
+ * affinity back. Its parallelFor() without a grain hands every thread the
+ * same contiguous share of the range on every call, so pages first
+ * touched by one sweep, see touch(), are local to the thread that sweeps
+ * them later.
+ */
+class ThreadPool
+{
+public:
+	explicit ThreadPool( unsigned int numThreads =
+			std::max( 1u, std::thread::hardware_concurrency() ) - 1,
+			bool bPinned = false )
+		: m_bPinned( bPinned ), m_bStop( false ), m_Generation( 0 ), m_NumBusy( 0 )
+	{
+		for( unsigned int i = 0; i < numThreads; ++i )
+		{
+			m_Threads.push_back( std::thread( &ThreadPool::run, this, i + 1 ) );
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock( m_Mutex );
+			m_bStop = true;
+		}
+		m_WakeUp.notify_all();
+		for( size_t i = 0; i < m_Threads.size(); ++i )
+		{
+			m_Threads[ i ].join();
+		}
+	}
+
+	unsigned int size() const
+	{
+		return (unsigned int)m_Threads.size();
+	}
+
+	/*
+	 * Calls fn( begin, end ) on disjoint chunks of [ begin, end ) of at most
+	 * grain iterations and returns once all chunks are done. Chunks are
+	 * handed out dynamically, so uneven chunk costs balance out. A call made
+	 * from inside a chunk of any pool runs fn on the whole range inline.
+	 */
+	template<typename Tfn>
+	void parallelFor( int begin, int end, int grain, const Tfn& fn )
+	{
+		grain = std::max( 1, grain );
+		if( m_Threads.empty() || end - begin <= grain || nested() )
+		{
+			if( begin < end )
+			{
+				fn( begin, end );
+			}
+			return;
+		}
+		dispatch( begin, end, grain, false, fn );
+	}
+
+	template<typename Tfn>
+	void parallelFor( int begin, int end, const Tfn& fn )
+	{
+		if( m_bPinned && !m_Threads.empty() && begin < end && !nested() )
+		{
+			dispatch( begin, end, 1, true, fn );
+			return;
+		}
+		int numChunks = 4 * ( (int)m_Threads.size() + 1 );
+		parallelFor( begin, end, ( end - begin + numChunks - 1 ) / numChunks, fn );
+	}
+
+	bool pinned() const
+	{
+		return m_bPinned;
+	}
+
+	static ThreadPool& instance()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
+
+private:
+	ThreadPool( const ThreadPool& );
+	ThreadPool& operator=( const ThreadPool& );
+
+	/*
+	 * Set while the calling thread runs chunks of a job, so nested calls
+	 * don't wait for workers that are busy running their callers.
+	 */
+	static bool& nested()
+	{
+		static thread_local bool bNested = false;
+		return bNested;
+	}
+
+	template<typename Tfn>
+	void dispatch( int begin, int end, int grain, bool bStatic, const Tfn& fn )
+	{
+		std::lock_guard<std::mutex> callLock( m_CallMutex );
+		{
+			std::lock_guard<std::mutex> lock( m_Mutex );
+			m_Job = [&fn, end]( int chunkBegin, int chunkGrain )
+			{
+				fn( chunkBegin, std::min( end, chunkBegin + chunkGrain ) );
+			};
+			m_Next = begin;
+			m_Begin = begin;
+			m_End = end;
+			m_Grain = grain;
+			m_bStatic = bStatic;
+			m_NumBusy = (unsigned int)m_Threads.size();
+			++m_Generation;
+		}
+		m_WakeUp.notify_all();
+
+		{
+			detail::ScopedPin pin( m_bPinned, 0 );
+			work( 0 );
+		}
+
+		std::unique_lock<std::mutex> lock( m_Mutex );
+		m_Done.wait( lock, [this]() { return m_NumBusy == 0; } );
+		m_Job = nullptr;
+	}
+
+	/*
+	 * Runs chunks of the current job, the caller being thread 0. Static
+	 * jobs give thread t the t-th of size() + 1 equal shares.
+	 */
+	void work( unsigned int thread )
+	{
+		struct Nest
+		{
+			Nest() { nested() = true; }
+			~Nest() { nested() = false; }
+		} nest;
+
+		if( m_bStatic )
+		{
+			long long length = m_End - m_Begin;
+			long long numThreads = (long long)m_Threads.size() + 1;
+			int chunkBegin = m_Begin + (int)( length * thread / numThreads );
+			int chunkEnd = m_Begin + (int)( length * ( thread + 1 ) / numThreads );
+			if( chunkBegin < chunkEnd )
+			{
+				m_Job( chunkBegin, chunkEnd - chunkBegin );
+			}
+			return;
+		}
+		for( ;; )
+		{
+			int chunkBegin = m_Next.fetch_add( m_Grain );
+			if( chunkBegin >= m_End )
+			{
+				return;
+			}
+			m_Job( chunkBegin, m_Grain );
+		}
+	}
+
+	void run( unsigned int thread )
+	{
+		if( m_bPinned )
+		{
+			pinThread( thread );
+		}
+
+		unsigned int generation = 0;
+		for( ;; )
+		{
+			{
+				std::unique_lock<std::mutex> lock( m_Mutex );
+				m_WakeUp.wait( lock, [this, generation]()
+						{ return m_bStop || m_Generation != generation; } );
+				if( m_bStop )
+				{
+					return;
+				}
+				generation = m_Generation;
+			}
+
+			work( thread );
+
+			std::lock_guard<std::mutex> lock( m_Mutex );
+			if( --m_NumBusy == 0 )
+			{
+				m_Done.notify_one();
+			}
+		}
+	}
+
+private:
+	std::vector<std::thread> m_Threads;
+	std::mutex m_CallMutex;
+	std::mutex m_Mutex;
+	std::condition_variable m_WakeUp;
+	std::condition_variable m_Done;
+	std::function<void( int, int )> m_Job;
+	std::atomic<int> m_Next;
+	int m_Begin;
+	int m_End;
+	int m_Grain;
+	bool m_bStatic;
+	bool m_bPinned;
+	bool m_bStop;
+	unsigned int m_Generation;
+	unsigned int m_NumBusy;
+};
+
+namespace detail
+{
+
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
+inline void set( ThreadPool& pool, Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Top& op, mm::detail::DimTag<2> )
+{
+	int beginX = begin[ 0 ];
+	int endX = end[ 0 ];
+	pool.parallelFor( begin[ 1 ], end[ 1 ],
+			[&]( int beginY, int endY )
+			{
+				mm::set( func, beginX, beginY, endX, endY, op );
+			} );
+}
+
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
+inline void set( ThreadPool& pool, Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Top& op, mm::detail::DimTag<3> )
+{
+	int beginX = begin[ 0 ];
+	int beginY = begin[ 1 ];
+	int endX = end[ 0 ];
+	int endY = end[ 1 ];
+	pool.parallelFor( begin[ 2 ], end[ 2 ],
+			[&]( int beginZ, int endZ )
+			{
+				mm::set( func, beginX, beginY, beginZ, endX, endY, endZ, op );
+			} );
+}
+
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend,
+	typename Ttile>
+inline void setTiled( ThreadPool& pool, Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Ttile& tile, const Top& op, mm::detail::DimTag<2> )
+{
+	int beginX = begin[ 0 ];
+	int beginY = begin[ 1 ];
+	int endX = end[ 0 ];
+	int endY = end[ 1 ];
+	int tileX = tile[ 0 ];
+	int tileY = tile[ 1 ];
+	int numX = ( endX - beginX + tileX - 1 ) / tileX;
+	int numY = ( endY - beginY + tileY - 1 ) / tileY;
+	pool.parallelFor( 0, numX * numY, 1,
+			[&]( int first, int last )
+			{
+				for( int t = first; t < last; ++t )
+				{
+					int x = beginX + ( t % numX ) * tileX;
+					int y = beginY + ( t / numX ) * tileY;
+					mm::set( func, x, y, std::min( x + tileX, endX ),
+							std::min( y + tileY, endY ), op );
+				}
+			} );
+}
+
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend,
+	typename Ttile>
+inline void setTiled( ThreadPool& pool, Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Ttile& tile, const Top& op, mm::detail::DimTag<3> )
+{
+	int beginX = begin[ 0 ];
+	int beginY = begin[ 1 ];
+	int beginZ = begin[ 2 ];
+	int endX = end[ 0 ];
+	int endY = end[ 1 ];
+	int endZ = end[ 2 ];
+	int tileX = tile[ 0 ];
+	int tileY = tile[ 1 ];
+	int tileZ = tile[ 2 ];
+	int numX = ( endX - beginX + tileX - 1 ) / tileX;
+	int numY = ( endY - beginY + tileY - 1 ) / tileY;
+	int numZ = ( endZ - beginZ + tileZ - 1 ) / tileZ;
+	pool.parallelFor( 0, numX * numY * numZ, 1,
+			[&]( int first, int last )
+			{
+				for( int t = first; t < last; ++t )
+				{
+					int x = beginX + ( t % numX ) * tileX;
+					int y = beginY + ( t / numX % numY ) * tileY;
+					int z = beginZ + ( t / ( numX * numY ) ) * tileZ;
+					mm::set( func, x, y, z, std::min( x + tileX, endX ),
+							std::min( y + tileY, endY ),
+							std::min( z + tileZ, endZ ), op );
+				}
+			} );
+}
+
+template<typename Tfunc>
+inline Tuple<int, mm::detail::FuncDim<Tfunc>::value> zero( const Tfunc& )
+{
+	return Tuple<int, mm::detail::FuncDim<Tfunc>::value>();
+}
+
+}
+
+/*
+ * Parallel set(): the outermost dimension (y in 2D, z in 3D) is split
+ * among the threads of the pool. op must not read func, as rows are
+ * written concurrently.
+ */
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
+inline void set( ThreadPool& pool, Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Top& op )
+{
+	detail::set( pool, func, begin, end, op,
+			mm::detail::DimTag<mm::detail::CoordDim<Tbegin>::value>() );
+}
+
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
+inline void set( Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Top& op )
+{
+	parallel::set( ThreadPool::instance(), func, begin, end, op );
+}
+
+template<typename Tfunc, typename Top>
+inline void set( ThreadPool& pool, Tfunc& func, const Top& op )
+{
+	parallel::set( pool, func, detail::zero( func ), func.size(), op );
+}
+
+template<typename Tfunc, typename Top>
+inline void set( Tfunc& func, const Top& op )
+{
+	parallel::set( ThreadPool::instance(), func, op );
+}
+
+/*
+ * Zeroes func with the partitioning of parallel set(). On a pinned pool
+ * this is the first touch that places memory::FIRST_TOUCH pages on the
+ * node of the thread that sweeps them.
+ */
+template<typename Tfunc>
+inline void touch( ThreadPool& pool, Tfunc& func )
+{
+	parallel::set( pool, func, mm::constant( op_dtype<Tfunc>() ) );
+}
+
+/*
+ * Like set(), but walks the region in tiles of the given extents, each
+ * tile evaluated by one thread. Tiles that fit into the cache keep
+ * stencil neighbors in y and z resident, which matters for 3D volumes.
+ */
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend,
+	typename Ttile>
+inline void setTiled( ThreadPool& pool, Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Ttile& tile, const Top& op )
+{
+	detail::setTiled( pool, func, begin, end, tile, op,
+			mm::detail::DimTag<mm::detail::CoordDim<Tbegin>::value>() );
+}
+
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend,
+	typename Ttile>
+inline void setTiled( Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Ttile& tile, const Top& op )
+{
+	parallel::setTiled( ThreadPool::instance(), func, begin, end, tile, op );
+}
+
+template<typename Tfunc, typename Top, typename Ttile>
+inline void setTiled( Tfunc& func, const Ttile& tile, const Top& op )
+{
+	parallel::setTiled( ThreadPool::instance(), func, detail::zero( func ),
+			func.size(), tile, op );
+}
+
+
+namespace detail
+{
+
+/*
+ * Reach of an in-place update into the rows of its own target: whether op
+ * reads func in any other row, and how far along x those reads go.
+ */
+struct WavefrontVisitor
+{
+	mm::detail::FusedTarget target;
+	int reach;
+	bool bRows;
+	bool bUnknown;
+
+	void read( const void* pData, int offsetX, int offsetY, int offsetZ )
+	{
+		if( pData != target.pData )
+		{
+			return;
+		}
+		int dx = offsetX - target.offset[ 0 ];
+		if( offsetY != target.offset[ 1 ] || offsetZ != target.offset[ 2 ] )
+		{
+			bRows = true;
+			reach = std::max( reach, ( dx < 0 ? -dx : dx ) );
+		}
+	}
+
+	void unknown()
+	{
+		bUnknown = true;
+	}
+};
+
+template<typename Tfunc, typename Top>
+inline void setRow( Tfunc& func, int beginX, int endX, int y, int, const Top& op,
+		mm::detail::DimTag<2> )
+{
+	for( int i = beginX; i < endX; ++i )
+	{
+		func( i, y ) = op( i, y );
+	}
+}
+
+template<typename Tfunc, typename Top>
+inline void setRow( Tfunc& func, int beginX, int endX, int y, int z, const Top& op,
+		mm::detail::DimTag<3> )
+{
+	for( int i = beginX; i < endX; ++i )
+	{
+		func( i, y, z ) = op( i, y, z );
+	}
+}
+
+template<unsigned int Dim>
+inline void rowBox( const int* pBegin, const int* pEnd, int* pBegin3, int* pEnd3 )
+{
+	for( unsigned int i = 0; i < 3; ++i )
+	{
+		pBegin3[ i ] = ( i < Dim ? pBegin[ i ] : 0 );
+		pEnd3[ i ] = ( i < Dim ? pEnd[ i ] : 1 );
+	}
+}
+
+}
+
+/*
+ * In-place func = op over [ begin, end ) in lexicographic order (x fastest,
+ * then y, then z), with the exact result of a serial set(), as natural
+ * ordering Gauss-Seidel needs. Rows are handed to the threads of pool in
+ * order and evaluated in blocks of BLOCK points; a block waits until the
+ * row before it is done up to the block's end plus the x reach of op's
+ * reads of func in other rows. Every row then sees the rows before it
+ * already updated and the rows after it not yet touched. Updates that do
+ * not read func in other rows run all rows at once; ones whose reads of
+ * func are not known fall back to set().
+ */
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
+inline void setWavefront( ThreadPool& pool, Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Top& op )
+{
+	static const unsigned int DIM = mm::detail::CoordDim<Tbegin>::value;
+	static const int BLOCK = 64;
+
+	detail::WavefrontVisitor visitor;
+	visitor.reach = 0;
+	visitor.bRows = false;
+	visitor.bUnknown = false;
+	visitor.target.pData = nullptr;
+	mm::detail::TargetVisitor targetVisitor = { &visitor.target, false };
+	mm::detail::visit( func, targetVisitor );
+	mm::detail::visit( op, visitor );
+	if( targetVisitor.bUnknown || visitor.bUnknown || visitor.target.pData == nullptr )
+	{
+		mm::set( func, begin, end, op );
+		return;
+	}
+
+	int pBegin[ DIM ];
+	int pEnd[ DIM ];
+	for( unsigned int i = 0; i < DIM; ++i )
+	{
+		pBegin[ i ] = begin[ i ];
+		pEnd[ i ] = end[ i ];
+	}
+	int box[ 2 ][ 3 ];
+	detail::rowBox<DIM>( pBegin, pEnd, box[ 0 ], box[ 1 ] );
+	int beginX = box[ 0 ][ 0 ];
+	int endX = box[ 1 ][ 0 ];
+	int numY = box[ 1 ][ 1 ] - box[ 0 ][ 1 ];
+	int numRows = numY * ( box[ 1 ][ 2 ] - box[ 0 ][ 2 ] );
+	if( numRows <= 0 || beginX >= endX )
+	{
+		return;
+	}
+
+	int reach = visitor.reach;
+	bool bRows = visitor.bRows;
+	std::unique_ptr<std::atomic<int>[]> pDone( new std::atomic<int>[ numRows ] );
+	for( int r = 0; r < numRows; ++r )
+	{
+		pDone[ r ].store( beginX, std::memory_order_relaxed );
+	}
+	pool.parallelFor( 0, numRows, 1,
+			[&]( int first, int last )
+			{
+				for( int r = first; r < last; ++r )
+				{
+					int y = box[ 0 ][ 1 ] + r % numY;
+					int z = box[ 0 ][ 2 ] + r / numY;
+					for( int x = beginX; x < endX; x += BLOCK )
+					{
+						int blockEnd = std::min( x + BLOCK, endX );
+						if( bRows && r > 0 )
+						{
+							int need = std::min( blockEnd + reach, endX );
+							while( pDone[ r - 1 ].load( std::memory_order_acquire ) < need )
+							{
+								std::this_thread::yield();
+							}
+						}
+						detail::setRow( func, x, blockEnd, y, z, op,
+								mm::detail::DimTag<DIM>() );
+						pDone[ r ].store( blockEnd, std::memory_order_release );
+					}
+				}
+			} );
+	mm::detail::written( func, box[ 0 ][ 0 ], box[ 0 ][ 1 ], box[ 0 ][ 2 ],
+			box[ 1 ][ 0 ], box[ 1 ][ 1 ], box[ 1 ][ 2 ] );
+}
+
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
+inline void setWavefront( Tfunc& func, const Tbegin& begin, const Tend& end,
+		const Top& op )
+{
+	parallel::setWavefront( ThreadPool::instance(), func, begin, end, op );
+}
+
+template<typename Tfunc, typename Top>
+inline void setWavefront( ThreadPool& pool, Tfunc& func, const Top& op )
+{
+	parallel::setWavefront( pool, func, detail::zero( func ), func.size(), op );
+}
+
+template<typename Tfunc, typename Top>
+inline void setWavefront( Tfunc& func, const Top& op )
+{
+	parallel::setWavefront( ThreadPool::instance(), func, op );
+}
+
+}
+
+}
+
+#endif
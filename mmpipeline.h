@@ -0,0 +1,459 @@
+#ifndef _MMPIPELINE_H_
+#define _MMPIPELINE_H_
+
+#include "metamath.h"
+#include "mmfunction.h"
+#include "mmparallel.h"
+
+#include <algorithm>
+#include <climits>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+namespace mm
+{
+
+namespace detail
+{
+
+/*
+ * Line buffer ring used by the calling thread, see LineBuffer.
+ */
+inline int& lineBufferSlot()
+{
+	static thread_local int slot = 0;
+	return slot;
+}
+
+}
+
+/*
+ * Intermediate stage of a pipeline(). Instead of the full grid it keeps
+ * the few rows of its producer that the consumers still read, in a ring
+ * indexed by y modulo a power of two, one ring per thread running the
+ * pipeline. The rows are only valid during pipeline(), and expressions
+ * refer to the buffer through FunctionRef.
+ */
+template<typename T>
+class LineBuffer
+{
+public:
+	typedef precision_type<T> PRECISION;
+	typedef typename PRECISION::COMPUTE DTYPE;
+	typedef typename PRECISION::STORAGE STYPE;
+	typedef typename PRECISION::ACCUM ACCUM;
+	typedef FunctionRef<LineBuffer<T>> OPERAND;
+	static const unsigned int DIM = 2;
+
+private:
+	typedef detail::PrecisionAccess<PRECISION> ACCESS;
+
+public:
+	typedef typename ACCESS::REFERENCE REFERENCE;
+	typedef typename ACCESS::CONST_REFERENCE CONST_REFERENCE;
+
+public:
+	LineBuffer()
+		: m_OriginX( 0 ), m_Width( 0 ), m_Mask( 0 ), m_SlotSize( 0 )
+	{
+	}
+
+	REFERENCE operator()( int x, int y )
+	{
+		return ACCESS::ref( m_Data[ index( x, y ) ] );
+	}
+
+	CONST_REFERENCE operator()( int x, int y ) const
+	{
+		return ACCESS::cref( m_Data[ index( x, y ) ] );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		Packet<DTYPE, N> res;
+		const STYPE* pRow = &m_Data[ index( x, y ) ];
+		for( int k = 0; k < N; ++k )
+		{
+			res.v[ k ] = PRECISION::load( pRow[ k ] );
+		}
+		return res;
+	}
+
+	/*
+	 * Width of the buffered rows and number of rows in the ring.
+	 */
+	Tuple<int> size() const
+	{
+		return Tuple<int>( m_Width, m_Mask + 1 );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		visitor.read( this, offsetX, offsetY, offsetZ );
+	}
+
+	/*
+	 * Makes room for numRows rows of x in [ originX, originX + width ) in
+	 * each of numSlots rings.
+	 */
+	void reserve( int originX, int width, int numRows, int numSlots )
+	{
+		int rows = 1;
+		while( rows < numRows )
+		{
+			rows *= 2;
+		}
+		m_OriginX = originX;
+		m_Width = width;
+		m_Mask = rows - 1;
+		m_SlotSize = rows * width;
+		m_Data.resize( (size_t)m_SlotSize * numSlots );
+	}
+
+private:
+	LineBuffer( const LineBuffer<T>& );
+	LineBuffer<T>& operator=( const LineBuffer<T>& );
+
+	int index( int x, int y ) const
+	{
+		return ( detail::lineBufferSlot() * m_SlotSize
+				+ ( y & m_Mask ) * m_Width + x - m_OriginX );
+	}
+
+private:
+	std::vector<STYPE> m_Data;
+	int m_OriginX;
+	int m_Width;
+	int m_Mask;
+	int m_SlotSize;
+};
+
+namespace detail
+{
+
+/*
+ * Rows [ y + lo[ 1 ], y + hi[ 1 ] ] and columns [ beginX + lo[ 0 ],
+ * endX + hi[ 0 ] ) of a stage that are needed while the output is at
+ * row y.
+ */
+struct Footprint
+{
+	int lo[ 2 ];
+	int hi[ 2 ];
+	bool bUsed;
+};
+
+/*
+ * Collects the offsets at which an expression reads each stage.
+ */
+struct FootprintVisitor
+{
+	const void* const* pStages;
+	Footprint* pReads;
+	int numStages;
+	bool bUnknown;
+
+	void read( const void* pData, int offsetX, int offsetY, int )
+	{
+		for( int s = 0; s < numStages; ++s )
+		{
+			if( pStages[ s ] == pData )
+			{
+				Footprint& reads = pReads[ s ];
+				reads.lo[ 0 ] = std::min( reads.lo[ 0 ], offsetX );
+				reads.lo[ 1 ] = std::min( reads.lo[ 1 ], offsetY );
+				reads.hi[ 0 ] = std::max( reads.hi[ 0 ], offsetX );
+				reads.hi[ 1 ] = std::max( reads.hi[ 1 ], offsetY );
+				reads.bUsed = true;
+			}
+		}
+	}
+
+	void unknown()
+	{
+		bUnknown = true;
+	}
+};
+
+template<typename T>
+struct IsLineBuffer : std::false_type
+{
+};
+
+template<typename T>
+struct IsLineBuffer<LineBuffer<T>> : std::true_type
+{
+};
+
+template<typename Tassign>
+inline void findStages( const void**, const Tassign& )
+{
+}
+
+/*
+ * Stages are matched by the address LineBuffer::visit() reports; any
+ * other target would never be found among the reads and never computed.
+ */
+template<typename Tassign, typename Tnext, typename... Trest>
+inline void findStages( const void** pStages, const Tassign& stage,
+		const Tnext& next, const Trest&... rest )
+{
+	static_assert( IsLineBuffer<typename std::remove_reference<
+			decltype( stage.func() )>::type>::value,
+			"pipeline(): all assignments but the last must write a LineBuffer" );
+	*pStages = &stage.func();
+	findStages( pStages + 1, next, rest... );
+}
+
+inline bool findReads( const void* const*, Footprint*, int )
+{
+	return true;
+}
+
+template<typename Tassign, typename... Trest>
+inline bool findReads( const void* const* pStages, Footprint* pReads,
+		int numStages, const Tassign& assign, const Trest&... rest )
+{
+	for( int s = 0; s < numStages; ++s )
+	{
+		pReads[ s ].lo[ 0 ] = pReads[ s ].lo[ 1 ] = INT_MAX;
+		pReads[ s ].hi[ 0 ] = pReads[ s ].hi[ 1 ] = INT_MIN;
+		pReads[ s ].bUsed = false;
+	}
+	FootprintVisitor visitor = { pStages, pReads, numStages, false };
+	detail::visit( assign.op(), visitor );
+	return ( !visitor.bUnknown
+			&& findReads( pStages, pReads + numStages, numStages, rest... ) );
+}
+
+/*
+ * Propagates the footprints from the output back through the stages. The
+ * reads of assignment c, the output being the last, are in
+ * pReads[ c * numStages ... ].
+ */
+inline void findFootprints( Footprint* pFootprints,
+		const Footprint* pReads, int numStages )
+{
+	int numAssigns = numStages + 1;
+	Footprint& output = pFootprints[ numStages ];
+	output.lo[ 0 ] = output.lo[ 1 ] = 0;
+	output.hi[ 0 ] = output.hi[ 1 ] = 0;
+	output.bUsed = true;
+	for( int s = numStages - 1; s >= 0; --s )
+	{
+		Footprint& stage = pFootprints[ s ];
+		stage.lo[ 0 ] = stage.lo[ 1 ] = INT_MAX;
+		stage.hi[ 0 ] = stage.hi[ 1 ] = INT_MIN;
+		stage.bUsed = false;
+		for( int c = s + 1; c < numAssigns; ++c )
+		{
+			const Footprint& consumer = pFootprints[ c ];
+			const Footprint& reads = pReads[ c * numStages + s ];
+			if( !consumer.bUsed || !reads.bUsed )
+			{
+				continue;
+			}
+			for( int d = 0; d < 2; ++d )
+			{
+				stage.lo[ d ] = std::min( stage.lo[ d ], consumer.lo[ d ] + reads.lo[ d ] );
+				stage.hi[ d ] = std::max( stage.hi[ d ], consumer.hi[ d ] + reads.hi[ d ] );
+			}
+			stage.bUsed = true;
+		}
+	}
+}
+
+template<typename Tassign>
+inline void reserveStages( const Footprint*, int, int, int, const Tassign& )
+{
+}
+
+template<typename Tassign, typename Tnext, typename... Trest>
+inline void reserveStages( const Footprint* pFootprint, int beginX, int endX,
+		int numSlots, const Tassign& stage, const Tnext& next, const Trest&... rest )
+{
+	if( pFootprint->bUsed )
+	{
+		stage.func().reserve( beginX + pFootprint->lo[ 0 ],
+				endX + pFootprint->hi[ 0 ] - ( beginX + pFootprint->lo[ 0 ] ),
+				pFootprint->hi[ 1 ] - pFootprint->lo[ 1 ] + 1, numSlots );
+	}
+	reserveStages( pFootprint + 1, beginX, endX, numSlots, next, rest... );
+}
+
+/*
+ * One step of the sliding window: every stage produces the newest row its
+ * consumers need while the output is at row y, then the output row is
+ * computed once y has reached the block.
+ */
+template<typename Tassign>
+inline void pipelineStep( const Footprint*, int beginX, int endX,
+		int beginY, int y, const Tassign& output )
+{
+	if( y >= beginY )
+	{
+		mm::set( output.func(), beginX, y, endX, y + 1, output.op() );
+	}
+}
+
+template<typename Tassign, typename Tnext, typename... Trest>
+inline void pipelineStep( const Footprint* pFootprint, int beginX, int endX,
+		int beginY, int y, const Tassign& stage, const Tnext& next,
+		const Trest&... rest )
+{
+	int row = y + pFootprint->hi[ 1 ];
+	if( pFootprint->bUsed && row >= beginY + pFootprint->lo[ 1 ] )
+	{
+		mm::set( stage.func(), beginX + pFootprint->lo[ 0 ], row,
+				endX + pFootprint->hi[ 0 ], row + 1, stage.op() );
+	}
+	pipelineStep( pFootprint + 1, beginX, endX, beginY, y, next, rest... );
+}
+
+template<typename... Tassign>
+inline void pipelineBlock( const Footprint* pFootprints, int numStages,
+		int beginX, int endX, int beginY, int endY, const Tassign&... assigns )
+{
+	int lead = 0;
+	for( int s = 0; s < numStages; ++s )
+	{
+		if( pFootprints[ s ].bUsed )
+		{
+			lead = std::max( lead, pFootprints[ s ].hi[ 1 ] - pFootprints[ s ].lo[ 1 ] );
+		}
+	}
+	for( int y = beginY - lead; y < endY; ++y )
+	{
+		pipelineStep( pFootprints, beginX, endX, beginY, y, assigns... );
+	}
+}
+
+/*
+ * Shared part of the serial and parallel pipeline(): derives the
+ * footprints, sizes the stages for numSlots threads and returns false if
+ * a stage is read other than at fixed offsets.
+ */
+template<typename... Tassign>
+inline bool preparePipeline( std::vector<Footprint>& footprints,
+		int beginX, int endX, int numSlots, const Tassign&... assigns )
+{
+	const int numStages = (int)sizeof...( Tassign ) - 1;
+	std::vector<const void*> stages( numStages + 1 );
+	std::vector<Footprint> reads( ( numStages + 1 ) * ( numStages + 1 ) );
+	findStages( stages.data(), assigns... );
+	if( !findReads( stages.data(), reads.data(), numStages, assigns... ) )
+	{
+		return false;
+	}
+	footprints.resize( numStages + 1 );
+	findFootprints( footprints.data(), reads.data(), numStages );
+	reserveStages( footprints.data(), beginX, endX, numSlots, assigns... );
+	return true;
+}
+
+}
+
+/*
+ * Evaluates a chain of stages without materializing the intermediates:
+ *
+ * LineBuffer<float> dx;
+ * pipeline( begin, end, assign( dx, utils::diffX( u, h ) ),
+ *		assign( out, utils::diffY( dx, h ) ) );
+ *
+ * All assignments but the last write LineBuffers, listed producer first,
+ * and the last one writes the output over [ begin, end ). The rows and
+ * columns each stage has to provide follow from the offsets its consumers
+ * read it at, so dx above keeps three rows. Returns false, without
+ * evaluating anything, if a stage is read other than at fixed offsets.
+ */
+template<typename Tbegin, typename Tend, typename... Tassign>
+inline bool pipeline( const Tbegin& begin, const Tend& end,
+		const Tassign&... assigns )
+{
+	std::vector<detail::Footprint> footprints;
+	if( !detail::preparePipeline( footprints, begin[ 0 ], end[ 0 ], 1, assigns... ) )
+	{
+		return false;
+	}
+	int slot = detail::lineBufferSlot();
+	detail::lineBufferSlot() = 0;
+	detail::pipelineBlock( footprints.data(), (int)footprints.size() - 1,
+			begin[ 0 ], end[ 0 ], begin[ 1 ], end[ 1 ], assigns... );
+	detail::lineBufferSlot() = slot;
+	return true;
+}
+
+namespace parallel
+{
+
+/*
+ * Parallel pipeline(): the output is split into blocks of blockRows rows,
+ * each run as its own sliding window with a ring per thread. Every block
+ * recomputes the stage rows above it, so blocks should be well taller
+ * than the stencils.
+ */
+template<typename Tbegin, typename Tend, typename... Tassign>
+inline bool pipeline( ThreadPool& pool, const Tbegin& begin, const Tend& end,
+		int blockRows, const Tassign&... assigns )
+{
+	int numSlots = (int)pool.size() + 1;
+	std::vector<mm::detail::Footprint> footprints;
+	if( !mm::detail::preparePipeline( footprints, begin[ 0 ], end[ 0 ],
+			numSlots, assigns... ) )
+	{
+		return false;
+	}
+
+	std::mutex mutex;
+	std::vector<int> freeSlots;
+	for( int s = numSlots - 1; s >= 0; --s )
+	{
+		freeSlots.push_back( s );
+	}
+	int beginX = begin[ 0 ];
+	int beginY = begin[ 1 ];
+	int endX = end[ 0 ];
+	int endY = end[ 1 ];
+	blockRows = std::max( 1, blockRows );
+	int numBlocks = ( endY - beginY + blockRows - 1 ) / blockRows;
+	pool.parallelFor( 0, numBlocks, 1,
+			[&]( int first, int last )
+			{
+				int slot;
+				{
+					std::lock_guard<std::mutex> lock( mutex );
+					slot = freeSlots.back();
+					freeSlots.pop_back();
+				}
+				int prevSlot = mm::detail::lineBufferSlot();
+				mm::detail::lineBufferSlot() = slot;
+				for( int b = first; b < last; ++b )
+				{
+					int y = beginY + b * blockRows;
+					mm::detail::pipelineBlock( footprints.data(),
+							(int)footprints.size() - 1, beginX, endX,
+							y, std::min( y + blockRows, endY ), assigns... );
+				}
+				mm::detail::lineBufferSlot() = prevSlot;
+				std::lock_guard<std::mutex> lock( mutex );
+				freeSlots.push_back( slot );
+			} );
+	return true;
+}
+
+template<typename Tbegin, typename Tend, typename... Tassign>
+inline bool pipeline( const Tbegin& begin, const Tend& end,
+		int blockRows, const Tassign&... assigns )
+{
+	return parallel::pipeline( ThreadPool::instance(), begin, end,
+			blockRows, assigns... );
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,305 @@
+#ifndef _MMPRECISION_H_
+#define _MMPRECISION_H_
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace mm
+{
+
+namespace detail
+{
+
+inline std::uint32_t floatBits( float x )
+{
+	std::uint32_t bits;
+	std::memcpy( &bits, &x, sizeof( bits ) );
+	return bits;
+}
+
+inline float bitsFloat( std::uint32_t bits )
+{
+	float x;
+	std::memcpy( &x, &bits, sizeof( x ) );
+	return x;
+}
+
+}
+
+/*
+ * IEEE 754 binary16 storage type. There is no arithmetic on it, values
+ * convert to float on load and are rounded to nearest even on store. Both
+ * conversions are branch-free so that they vectorize with the loop.
+ */
+struct half
+{
+public:
+	half()
+		: bits( 0 )
+	{
+	}
+
+	explicit half( float value )
+		: bits( fromFloat( value ) )
+	{
+	}
+
+	operator float() const
+	{
+		return toFloat( bits );
+	}
+
+	static std::uint16_t fromFloat( float value )
+	{
+		std::uint32_t f = detail::floatBits( value );
+		std::uint32_t sign = f & 0x80000000u;
+		f ^= sign;
+
+		// normal range: rebias and round to nearest even on the dropped bits
+		std::uint32_t normal = ( f + ( ( 15u - 127u ) << 23 ) + 0xfffu
+				+ ( ( f >> 13 ) & 1u ) ) >> 13;
+		// subnormal range: let the float adder do the rounding
+		std::uint32_t subnormal = detail::floatBits(
+				detail::bitsFloat( f ) + detail::bitsFloat( 126u << 23 ) )
+			- ( 126u << 23 );
+		// overflow to infinity, NaN stays quiet NaN
+		std::uint32_t special = ( f > 0x7f800000u ? 0x7e00u : 0x7c00u );
+
+		std::uint32_t res = ( f < ( 113u << 23 ) ? subnormal : normal );
+		res = ( f >= ( 143u << 23 ) ? special : res );
+		return (std::uint16_t)( res | ( sign >> 16 ) );
+	}
+
+	static float toFloat( std::uint16_t value )
+	{
+		std::uint32_t o = (std::uint32_t)( value & 0x7fffu ) << 13;
+		float f = detail::bitsFloat( o ) * detail::bitsFloat( ( 254u - 15u ) << 23 );
+		o = detail::floatBits( f );
+		o |= ( f >= detail::bitsFloat( ( 127u + 16u ) << 23 ) ? 0x7f800000u : 0u );
+		return detail::bitsFloat( o | ( (std::uint32_t)( value & 0x8000u ) << 16 ) );
+	}
+
+public:
+	std::uint16_t bits;
+};
+
+/*
+ * bfloat16 storage type: the upper half of a float. Same range as float
+ * with 8 bits of mantissa, rounded to nearest even on store.
+ */
+struct bfloat16
+{
+public:
+	bfloat16()
+		: bits( 0 )
+	{
+	}
+
+	explicit bfloat16( float value )
+		: bits( fromFloat( value ) )
+	{
+	}
+
+	operator float() const
+	{
+		return toFloat( bits );
+	}
+
+	static std::uint16_t fromFloat( float value )
+	{
+		std::uint32_t f = detail::floatBits( value );
+		std::uint32_t rounded = ( f + 0x7fffu + ( ( f >> 16 ) & 1u ) ) >> 16;
+		std::uint32_t nan = ( f >> 16 ) | 0x40u;
+		return (std::uint16_t)( ( f & 0x7fffffffu ) > 0x7f800000u ? nan : rounded );
+	}
+
+	static float toFloat( std::uint16_t value )
+	{
+		return detail::bitsFloat( (std::uint32_t)value << 16 );
+	}
+
+public:
+	std::uint16_t bits;
+};
+
+namespace detail
+{
+
+template<typename T>
+struct DefaultCompute
+{
+	typedef T type;
+};
+
+template<>
+struct DefaultCompute<half>
+{
+	typedef float type;
+};
+
+template<>
+struct DefaultCompute<bfloat16>
+{
+	typedef float type;
+};
+
+}
+
+/*
+ * Precision policy of a Function. Values are kept in memory as Tstorage,
+ * converted to Tcompute when loaded into an expression and back when
+ * stored. Reductions such as sum() accumulate in Taccum.
+ *
+ * Function<Precision<half, float, double>> f( size );
+ *
+ * holds 2 bytes per point, evaluates stencils in float and sums in double.
+ * A plain element type T is the same as Precision<T>.
+ */
+template<typename Tstorage,
+	typename Tcompute = typename detail::DefaultCompute<Tstorage>::type,
+	typename Taccum = Tcompute>
+struct Precision
+{
+public:
+	typedef Tstorage STORAGE;
+	typedef Tcompute COMPUTE;
+	typedef Taccum ACCUM;
+
+	static const bool CONVERTS = !std::is_same<Tstorage, Tcompute>::value;
+
+public:
+	static COMPUTE load( const STORAGE& value )
+	{
+		return (COMPUTE)value;
+	}
+
+	static STORAGE store( const COMPUTE& value )
+	{
+		return (STORAGE)value;
+	}
+};
+
+namespace detail
+{
+
+template<typename T>
+struct PrecisionOf
+{
+	typedef Precision<T> type;
+};
+
+template<typename Tstorage, typename Tcompute, typename Taccum>
+struct PrecisionOf<Precision<Tstorage, Tcompute, Taccum>>
+{
+	typedef Precision<Tstorage, Tcompute, Taccum> type;
+};
+
+}
+
+template<typename T>
+using precision_type = typename detail::PrecisionOf<T>::type;
+
+/*
+ * Writable reference to a converting storage element. Reads load the
+ * compute value, writes round it back to storage.
+ */
+template<typename Tprecision>
+class PrecisionRef
+{
+public:
+	typedef typename Tprecision::STORAGE STORAGE;
+	typedef typename Tprecision::COMPUTE COMPUTE;
+
+public:
+	explicit PrecisionRef( STORAGE& ref )
+		: m_Ref( ref )
+	{
+	}
+
+	operator COMPUTE() const
+	{
+		return Tprecision::load( m_Ref );
+	}
+
+	PrecisionRef<Tprecision>& operator=( const PrecisionRef<Tprecision>& rhs )
+	{
+		m_Ref = rhs.m_Ref;
+		return *this;
+	}
+
+	PrecisionRef<Tprecision>& operator=( const COMPUTE& value )
+	{
+		m_Ref = Tprecision::store( value );
+		return *this;
+	}
+
+	PrecisionRef<Tprecision>& operator+=( const COMPUTE& value )
+	{
+		return ( *this = Tprecision::load( m_Ref ) + value );
+	}
+
+	PrecisionRef<Tprecision>& operator-=( const COMPUTE& value )
+	{
+		return ( *this = Tprecision::load( m_Ref ) - value );
+	}
+
+	PrecisionRef<Tprecision>& operator*=( const COMPUTE& value )
+	{
+		return ( *this = Tprecision::load( m_Ref ) * value );
+	}
+
+	PrecisionRef<Tprecision>& operator/=( const COMPUTE& value )
+	{
+		return ( *this = Tprecision::load( m_Ref ) / value );
+	}
+
+private:
+	STORAGE& m_Ref;
+};
+
+namespace detail
+{
+
+template<typename Tprecision, bool Converts = Tprecision::CONVERTS>
+struct PrecisionAccess
+{
+	typedef typename Tprecision::STORAGE STORAGE;
+	typedef typename Tprecision::COMPUTE COMPUTE;
+	typedef PrecisionRef<Tprecision> REFERENCE;
+	typedef COMPUTE CONST_REFERENCE;
+
+	static REFERENCE ref( STORAGE& value )
+	{
+		return REFERENCE( value );
+	}
+
+	static CONST_REFERENCE cref( const STORAGE& value )
+	{
+		return Tprecision::load( value );
+	}
+};
+
+template<typename Tprecision>
+struct PrecisionAccess<Tprecision, false>
+{
+	typedef typename Tprecision::STORAGE STORAGE;
+	typedef STORAGE& REFERENCE;
+	typedef const STORAGE& CONST_REFERENCE;
+
+	static REFERENCE ref( STORAGE& value )
+	{
+		return value;
+	}
+
+	static CONST_REFERENCE cref( const STORAGE& value )
+	{
+		return value;
+	}
+};
+
+}
+
+}
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef _MMSAMPLE_H_
+#define _MMSAMPLE_H_
+
+#include "metamath.h"
+
+#include <cmath>
+
+namespace mm
+{
+
+namespace interp
+{
+
+/*
+ * Boundary handling of sample(). position() brings a fractional position
+ * into the domain before the stencil is placed, index() maps the stencil's
+ * neighbours, which then lie at most two points outside. Both are
+ * branch-free, so lanes of a packet evaluate without divergence. A NaN
+ * position lands on 0, so the truncation in at() stays defined.
+ */
+struct Clamp
+{
+	template<typename T>
+	static T position( T p, int n )
+	{
+		T hi = T( n - 1 );
+		p = ( p >= 0 ? p : T( 0 ) );
+		return ( p <= hi ? p : hi );
+	}
+
+	static int index( int i, int n )
+	{
+		i = ( i < 0 ? 0 : i );
+		return ( i >= n ? n - 1 : i );
+	}
+};
+
+struct Periodic
+{
+	template<typename T>
+	static T position( T p, int n )
+	{
+		p -= T( n ) * std::floor( p / T( n ) );
+		// rounding can leave p at n or just below 0, infinities give NaN
+		return ( p >= 0 && p < T( n ) ? p : T( 0 ) );
+	}
+
+	static int index( int i, int n )
+	{
+		i = ( i < 0 ? i + n : i );
+		return ( i >= n ? i - n : i );
+	}
+};
+
+/*
+ * Interpolation kernels of sample(). at() evaluates func at ( px, py ),
+ * which position() has already brought into [ 0, n ), so truncation
+ * rounds down.
+ */
+struct Nearest
+{
+	template<typename Tboundary, typename Tfunc, typename T>
+	static T at( const Tfunc& func, T px, T py, int sizeX, int sizeY )
+	{
+		int ix = Tboundary::index( (int)( px + T( 0.5 ) ), sizeX );
+		int iy = Tboundary::index( (int)( py + T( 0.5 ) ), sizeY );
+		return func( ix, iy );
+	}
+};
+
+struct Linear
+{
+	template<typename Tboundary, typename Tfunc, typename T>
+	static T at( const Tfunc& func, T px, T py, int sizeX, int sizeY )
+	{
+		int x0 = (int)px;
+		int y0 = (int)py;
+		T tx = px - T( x0 );
+		T ty = py - T( y0 );
+		int x1 = Tboundary::index( x0 + 1, sizeX );
+		int y1 = Tboundary::index( y0 + 1, sizeY );
+		T v0 = func( x0, y0 ) + tx * ( T( func( x1, y0 ) ) - T( func( x0, y0 ) ) );
+		T v1 = func( x0, y1 ) + tx * ( T( func( x1, y1 ) ) - T( func( x0, y1 ) ) );
+		return ( v0 + ty * ( v1 - v0 ) );
+	}
+};
+
+/* Catmull-Rom: interpolates, and reproduces quadratics exactly. */
+struct Cubic
+{
+	template<typename Tboundary, typename Tfunc, typename T>
+	static T at( const Tfunc& func, T px, T py, int sizeX, int sizeY )
+	{
+		int x0 = (int)px;
+		int y0 = (int)py;
+		T wx[ 4 ];
+		T wy[ 4 ];
+		weights( px - T( x0 ), wx );
+		weights( py - T( y0 ), wy );
+		int ix[ 4 ];
+		for( int i = 0; i < 4; ++i )
+		{
+			ix[ i ] = Tboundary::index( x0 + i - 1, sizeX );
+		}
+		T res = 0;
+		for( int j = 0; j < 4; ++j )
+		{
+			int iy = Tboundary::index( y0 + j - 1, sizeY );
+			T row = 0;
+			for( int i = 0; i < 4; ++i )
+			{
+				row += wx[ i ] * T( func( ix[ i ], iy ) );
+			}
+			res += wy[ j ] * row;
+		}
+		return res;
+	}
+
+private:
+	template<typename T>
+	static void weights( T t, T* pW )
+	{
+		T t2 = t * t;
+		pW[ 0 ] = T( 0.5 ) * ( ( T( 2 ) - t ) * t2 - t );
+		pW[ 1 ] = ( T( 1.5 ) * t - T( 2.5 ) ) * t2 + T( 1 );
+		pW[ 2 ] = T( 0.5 ) * ( ( T( 4 ) - T( 3 ) * t ) * t2 + t );
+		pW[ 3 ] = T( 0.5 ) * ( t - T( 1 ) ) * t2;
+	}
+};
+
+}
+
+namespace op
+{
+
+/*
+ * Value of the 2D leaf func at the fractional point ( x + dx, y + dy ),
+ * where dx and dy are expressions. The packet path interpolates every lane
+ * with the same branch-free code, which compilers turn into gathers.
+ * Reads of func cannot be placed at fixed offsets, so the op reports them
+ * as unknown: fused() and setBounded() treat it as reading anywhere, and
+ * func must not be the function being written.
+ */
+template<typename Tfunc, typename Tdx, typename Tdy, typename Tinterp, typename Tboundary>
+class Sample
+{
+public:
+	typedef op_accum<Tfunc> ACCUM;
+
+private:
+	typedef op_dtype<Tfunc> DTYPE;
+
+public:
+	Sample( const Tfunc& func, const Tdx& dx, const Tdy& dy )
+		: m_Func( func ), m_Dx( dx ), m_Dy( dy ),
+		  m_SizeX( func.size()[ 0 ] ), m_SizeY( func.size()[ 1 ] )
+	{
+	}
+
+	DTYPE operator()( int x, int y ) const
+	{
+		return at( DTYPE( x ) + DTYPE( m_Dx( x, y ) ), DTYPE( y ) + DTYPE( m_Dy( x, y ) ) );
+	}
+
+	template<int N>
+	Packet<DTYPE, N> packet( int x, int y ) const
+	{
+		Packet<op_dtype<Tdx>, N> dx = mm::packet<N>( m_Dx, x, y );
+		Packet<op_dtype<Tdy>, N> dy = mm::packet<N>( m_Dy, x, y );
+		Packet<DTYPE, N> res;
+		for( int k = 0; k < N; ++k )
+		{
+			res.v[ k ] = at( DTYPE( x + k ) + DTYPE( dx.v[ k ] ), DTYPE( y ) + DTYPE( dy.v[ k ] ) );
+		}
+		return res;
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		detail::visit( m_Dx, visitor, offsetX, offsetY, offsetZ );
+		detail::visit( m_Dy, visitor, offsetX, offsetY, offsetZ );
+		visitor.unknown();
+	}
+
+private:
+	DTYPE at( DTYPE px, DTYPE py ) const
+	{
+		return Tinterp::template at<Tboundary>( m_Func,
+				Tboundary::position( px, m_SizeX ), Tboundary::position( py, m_SizeY ),
+				m_SizeX, m_SizeY );
+	}
+
+private:
+	const op_operand<Tfunc> m_Func;
+	const op_operand<Tdx> m_Dx;
+	const op_operand<Tdy> m_Dy;
+	int m_SizeX;
+	int m_SizeY;
+};
+
+}
+
+/*
+ * func interpolated at ( x + dx, y + dy ), bilinear and clamped unless
+ * chosen otherwise. A semi-Lagrangian advection step is then one set():
+ *
+ * set( qNew, sample<interp::Cubic>( q, -dt * u, -dt * v ) );
+ */
+template<typename Tinterp = interp::Linear, typename Tboundary = interp::Clamp,
+	typename Tfunc, typename Tdx, typename Tdy>
+inline op::Sample<Tfunc, Tdx, Tdy, Tinterp, Tboundary> sample( const Tfunc& func,
+		const Tdx& dx, const Tdy& dy )
+{
+	return op::Sample<Tfunc, Tdx, Tdy, Tinterp, Tboundary>( func, dx, dy );
+}
+
+}
+
+#endif
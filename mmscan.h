@@ -0,0 +1,443 @@
+#ifndef _MMSCAN_H_
+#define _MMSCAN_H_
+
+#include "metamath.h"
+#include "mmfunction.h"
+#include "mmparallel.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace mm
+{
+
+namespace scan
+{
+
+/*
+ * Accumulator with compensated summation (Kahan-Babuska), for scans and
+ * tables over large grids: scan::rows<Compensated<float>>( op ). The
+ * error term is selected without branches, so column scans still
+ * vectorize. It does not survive -ffast-math.
+ */
+template<typename T>
+struct Compensated
+{
+	Compensated( T value = T( 0 ) )
+		: sum( value ), error( 0 )
+	{
+	}
+
+	Compensated<T>& operator+=( T value )
+	{
+		T t = sum + value;
+		T absSum = ( sum < 0 ? -sum : sum );
+		T absValue = ( value < 0 ? -value : value );
+		error += ( absSum >= absValue ? ( sum - t ) + value : ( value - t ) + sum );
+		sum = t;
+		return *this;
+	}
+
+	Compensated<T>& operator+=( const Compensated<T>& other )
+	{
+		*this += other.sum;
+		error += other.error;
+		return *this;
+	}
+
+	T value() const
+	{
+		return sum + error;
+	}
+
+	T sum;
+	T error;
+};
+
+namespace detail
+{
+
+template<typename Tacc>
+struct Value
+{
+	typedef Tacc type;
+
+	static Tacc get( const Tacc& acc )
+	{
+		return acc;
+	}
+};
+
+template<typename T>
+struct Value<Compensated<T>>
+{
+	typedef T type;
+
+	static T get( const Compensated<T>& acc )
+	{
+		return acc.value();
+	}
+};
+
+template<typename Tacc>
+inline typename Value<Tacc>::type value( const Tacc& acc )
+{
+	return Value<Tacc>::get( acc );
+}
+
+}
+
+/*
+ * Summed-area table of an expression over [ begin, end ). operator()
+ * gives the sum over [ begin, ( x, y ) ] inclusive, so the table is also
+ * an expression leaf, and sum() the sum over any rectangle inside in
+ * O( 1 ). A zero row and column in front of the region keep both free of
+ * branches. T is what the table holds; build() accumulates in T or in
+ * the Tacc it is given, e.g. Compensated<double>.
+ */
+template<typename T = double>
+class SummedArea
+{
+public:
+	typedef T DTYPE;
+	typedef T ACCUM;
+	typedef FunctionRef<SummedArea<T>> OPERAND;
+	static const unsigned int DIM = 2;
+
+public:
+	SummedArea()
+		: m_BeginX( 0 ), m_BeginY( 0 ), m_Width( 0 ), m_Height( 0 )
+	{
+	}
+
+	template<typename Tacc = T, typename Top, typename Tbegin, typename Tend>
+	void build( const Top& op, const Tbegin& begin, const Tend& end )
+	{
+		resize( begin, end );
+		std::vector<Tacc> columns( m_Width );
+		buildRows( op, 0, m_Height, columns.data() );
+	}
+
+	/*
+	 * Rows are split into one share per thread. Each share builds the
+	 * table of its own rows, the column totals of the shares are then
+	 * accumulated in order, and every share but the first adds the totals
+	 * of the shares above it to its rows.
+	 */
+	template<typename Tacc = T, typename Top, typename Tbegin, typename Tend>
+	void build( parallel::ThreadPool& pool, const Top& op, const Tbegin& begin,
+			const Tend& end )
+	{
+		resize( begin, end );
+		int numShares = std::min( (int)pool.size() + 1, std::max( m_Height, 1 ) );
+		int rows = ( m_Height + numShares - 1 ) / numShares;
+		std::vector<Tacc> totals( (size_t)numShares * m_Width );
+		pool.parallelFor( 0, numShares, 1,
+				[&]( int first, int last )
+				{
+					for( int s = first; s < last; ++s )
+					{
+						buildRows( op, s * rows, std::min( ( s + 1 ) * rows, m_Height ),
+								&totals[ (size_t)s * m_Width ] );
+					}
+				} );
+		for( int s = 1; s < numShares; ++s )
+		{
+			Tacc* pTotal = &totals[ (size_t)s * m_Width ];
+			const Tacc* pAbove = &totals[ (size_t)( s - 1 ) * m_Width ];
+			for( int i = 0; i < m_Width; ++i )
+			{
+				Tacc total = pAbove[ i ];
+				total += pTotal[ i ];
+				pTotal[ i ] = total;
+			}
+		}
+		pool.parallelFor( 1, numShares, 1,
+				[&]( int first, int last )
+				{
+					for( int s = first; s < last; ++s )
+					{
+						addRows( s * rows, std::min( ( s + 1 ) * rows, m_Height ),
+								&totals[ (size_t)( s - 1 ) * m_Width ] );
+					}
+				} );
+	}
+
+	DTYPE operator()( int x, int y ) const
+	{
+		return m_Data[ index( x, y ) ];
+	}
+
+	/* Sum over [ beginX, endX ) x [ beginY, endY ), inside the table. */
+	DTYPE sum( int beginX, int beginY, int endX, int endY ) const
+	{
+		return ( m_Data[ index( endX - 1, endY - 1 ) ] - m_Data[ index( beginX - 1, endY - 1 ) ] )
+				- ( m_Data[ index( endX - 1, beginY - 1 ) ]
+						- m_Data[ index( beginX - 1, beginY - 1 ) ] );
+	}
+
+	template<typename Tbegin, typename Tend>
+	DTYPE sum( const Tbegin& begin, const Tend& end ) const
+	{
+		return sum( begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ] );
+	}
+
+	template<typename Tbegin, typename Tend>
+	DTYPE mean( const Tbegin& begin, const Tend& end ) const
+	{
+		return sum( begin, end )
+				/ DTYPE( ( end[ 0 ] - begin[ 0 ] ) * ( end[ 1 ] - begin[ 1 ] ) );
+	}
+
+	/* Size of the region the table was built over. */
+	Tuple<int> size() const
+	{
+		return Tuple<int>( m_Width, m_Height );
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		visitor.read( this, offsetX, offsetY, offsetZ );
+	}
+
+private:
+	SummedArea( const SummedArea<T>& );
+	SummedArea<T>& operator=( const SummedArea<T>& );
+
+	size_t index( int x, int y ) const
+	{
+		return (size_t)( y - m_BeginY + 1 ) * ( m_Width + 1 ) + ( x - m_BeginX + 1 );
+	}
+
+	template<typename Tbegin, typename Tend>
+	void resize( const Tbegin& begin, const Tend& end )
+	{
+		m_BeginX = begin[ 0 ];
+		m_BeginY = begin[ 1 ];
+		m_Width = std::max( end[ 0 ] - begin[ 0 ], 0 );
+		m_Height = std::max( end[ 1 ] - begin[ 1 ], 0 );
+		m_Data.resize( (size_t)( m_Width + 1 ) * ( m_Height + 1 ) );
+		std::fill_n( m_Data.begin(), m_Width + 1, T( 0 ) );
+		for( int j = 1; j <= m_Height; ++j )
+		{
+			m_Data[ (size_t)j * ( m_Width + 1 ) ] = T( 0 );
+		}
+	}
+
+	/*
+	 * Table of rows [ first, last ) alone, the region's rows counted from
+	 * 0. The row sums run along x, the column sums in pColumns, which
+	 * starts at zero and is left holding the column totals.
+	 */
+	template<typename Top, typename Tacc>
+	void buildRows( const Top& op, int first, int last, Tacc* pColumns )
+	{
+		typedef typename detail::Value<Tacc>::type VALUE;
+		std::vector<VALUE> row( m_Width );
+		VALUE* pRow = row.data();
+		for( int j = first; j < last; ++j )
+		{
+			int y = m_BeginY + j;
+			for( int i = 0; i < m_Width; ++i )
+			{
+				pRow[ i ] = op( m_BeginX + i, y );
+			}
+			Tacc acc = VALUE( 0 );
+			for( int i = 0; i < m_Width; ++i )
+			{
+				acc += pRow[ i ];
+				pRow[ i ] = detail::value( acc );
+			}
+			T* pOut = &m_Data[ index( m_BeginX, y ) ];
+			for( int i = 0; i < m_Width; ++i )
+			{
+				pColumns[ i ] += pRow[ i ];
+				pOut[ i ] = T( detail::value( pColumns[ i ] ) );
+			}
+		}
+	}
+
+	template<typename Tacc>
+	void addRows( int first, int last, const Tacc* pAbove )
+	{
+		for( int j = first; j < last; ++j )
+		{
+			T* pOut = &m_Data[ index( m_BeginX, m_BeginY + j ) ];
+			for( int i = 0; i < m_Width; ++i )
+			{
+				Tacc acc = pAbove[ i ];
+				acc += pOut[ i ];
+				pOut[ i ] = T( detail::value( acc ) );
+			}
+		}
+	}
+
+private:
+	std::vector<T> m_Data;
+	int m_BeginX;
+	int m_BeginY;
+	int m_Width;
+	int m_Height;
+};
+
+/*
+ * Inclusive scan of src along x (Axis 0) or y (Axis 1), starting at the
+ * begin of the range set() writes: func( x, y ) = sum of src from begin to
+ * ( x, y ) along the axis. Accumulates in sum_dtype<Tacc, Tsrc>.
+ */
+template<typename Tsrc, typename Tacc, int Axis>
+class Scanned
+{
+public:
+	typedef sum_dtype<Tacc, Tsrc> ACC;
+
+public:
+	explicit Scanned( const Tsrc& src )
+		: m_Src( src )
+	{
+	}
+
+	/* Rows are independent and scanned along x one at a time. */
+	template<typename Tfunc>
+	void apply( Tfunc& func, int beginX, int beginY, int endX, int endY,
+			std::integral_constant<int, 0> ) const
+	{
+		typedef typename detail::Value<ACC>::type VALUE;
+		std::vector<VALUE> row( std::max( endX - beginX, 0 ) );
+		VALUE* pRow = row.data();
+		for( int y = beginY; y < endY; ++y )
+		{
+			for( int x = beginX; x < endX; ++x )
+			{
+				pRow[ x - beginX ] = m_Src( x, y );
+			}
+			ACC acc = VALUE( 0 );
+			for( int x = beginX; x < endX; ++x )
+			{
+				acc += pRow[ x - beginX ];
+				func( x, y ) = detail::value( acc );
+			}
+		}
+	}
+
+	/* Columns advance together down the rows, which vectorizes along x. */
+	template<typename Tfunc>
+	void apply( Tfunc& func, int beginX, int beginY, int endX, int endY,
+			std::integral_constant<int, 1> ) const
+	{
+		typedef typename detail::Value<ACC>::type VALUE;
+		int n = std::max( endX - beginX, 0 );
+		std::vector<ACC> columns( n, ACC( VALUE( 0 ) ) );
+		std::vector<VALUE> row( n );
+		ACC* pColumns = columns.data();
+		VALUE* pRow = row.data();
+		for( int y = beginY; y < endY; ++y )
+		{
+			for( int i = 0; i < n; ++i )
+			{
+				pRow[ i ] = m_Src( beginX + i, y );
+			}
+			for( int i = 0; i < n; ++i )
+			{
+				pColumns[ i ] += pRow[ i ];
+				func( beginX + i, y ) = detail::value( pColumns[ i ] );
+			}
+		}
+	}
+
+	/*
+	 * Shares of whole scan lines, the rows for a scan along x and strips
+	 * of columns for one along y.
+	 */
+	template<typename Tfunc>
+	void apply( parallel::ThreadPool& pool, Tfunc& func, int beginX, int beginY,
+			int endX, int endY ) const
+	{
+		std::integral_constant<int, Axis> axis;
+		if( Axis == 0 )
+		{
+			pool.parallelFor( beginY, endY,
+					[&]( int first, int last )
+					{
+						apply( func, beginX, first, endX, last, axis );
+					} );
+			return;
+		}
+		int numChunks = (int)pool.size() + 1;
+		int grain = ( ( endX - beginX + numChunks - 1 ) / numChunks + 63 ) / 64 * 64;
+		pool.parallelFor( beginX, endX, grain,
+				[&]( int first, int last )
+				{
+					apply( func, first, beginY, last, endY, axis );
+				} );
+	}
+
+private:
+	const op_operand<Tsrc> m_Src;
+};
+
+template<typename Tacc = void, typename Tsrc>
+inline Scanned<Tsrc, Tacc, 0> rows( const Tsrc& src )
+{
+	return Scanned<Tsrc, Tacc, 0>( src );
+}
+
+template<typename Tacc = void, typename Tsrc>
+inline Scanned<Tsrc, Tacc, 1> columns( const Tsrc& src )
+{
+	return Scanned<Tsrc, Tacc, 1>( src );
+}
+
+}
+
+template<typename Tfunc, typename Tbegin, typename Tend, typename Tsrc, typename Tacc, int Axis>
+inline void set( Tfunc& func, const Tbegin& begin, const Tend& end,
+		const scan::Scanned<Tsrc, Tacc, Axis>& scanned )
+{
+	scanned.apply( func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ],
+			std::integral_constant<int, Axis>() );
+	detail::written( func, begin[ 0 ], begin[ 1 ], 0, end[ 0 ], end[ 1 ], 1 );
+}
+
+template<typename Tfunc, typename Tsrc, typename Tacc, int Axis>
+inline void set( Tfunc& func, const scan::Scanned<Tsrc, Tacc, Axis>& scanned )
+{
+	mm::set( func, parallel::detail::zero( func ), func.size(), scanned );
+}
+
+namespace parallel
+{
+
+template<typename Tfunc, typename Tbegin, typename Tend, typename Tsrc, typename Tacc, int Axis>
+inline void set( ThreadPool& pool, Tfunc& func, const Tbegin& begin, const Tend& end,
+		const scan::Scanned<Tsrc, Tacc, Axis>& scanned )
+{
+	scanned.apply( pool, func, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ] );
+	mm::detail::written( func, begin[ 0 ], begin[ 1 ], 0, end[ 0 ], end[ 1 ], 1 );
+}
+
+template<typename Tfunc, typename Tbegin, typename Tend, typename Tsrc, typename Tacc, int Axis>
+inline void set( Tfunc& func, const Tbegin& begin, const Tend& end,
+		const scan::Scanned<Tsrc, Tacc, Axis>& scanned )
+{
+	parallel::set( ThreadPool::instance(), func, begin, end, scanned );
+}
+
+template<typename Tfunc, typename Tsrc, typename Tacc, int Axis>
+inline void set( ThreadPool& pool, Tfunc& func, const scan::Scanned<Tsrc, Tacc, Axis>& scanned )
+{
+	parallel::set( pool, func, detail::zero( func ), func.size(), scanned );
+}
+
+template<typename Tfunc, typename Tsrc, typename Tacc, int Axis>
+inline void set( Tfunc& func, const scan::Scanned<Tsrc, Tacc, Axis>& scanned )
+{
+	parallel::set( ThreadPool::instance(), func, scanned );
+}
+
+}
+
+}
+
+#endif
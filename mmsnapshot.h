@@ -0,0 +1,331 @@
+#ifndef _MMSNAPSHOT_H_
+#define _MMSNAPSHOT_H_
+
+#include "metamath.h"
+#include "mmfunction.h"
+#include "mmprecision.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace mm
+{
+
+template<typename T, unsigned int Dim>
+class Snapshot;
+
+namespace detail
+{
+
+/*
+ * Pages of a CowFunction. A page is a band of ROWS consecutive rows (of
+ * rows along x, counted across y and then z), stored as in a Function,
+ * so a row never crosses pages and loops along x index a single page.
+ * Pages are shared between a function and its snapshots; pData caches
+ * their addresses for reading.
+ */
+template<typename STYPE>
+struct CowTable
+{
+	std::vector<std::shared_ptr<std::vector<STYPE>>> pages;
+	std::vector<STYPE*> pData;
+};
+
+template<unsigned int Dim>
+class PageGrid
+{
+public:
+	static const int SHIFT = 4;
+	static const int ROWS = 1 << SHIFT;
+	static const int MASK = ROWS - 1;
+
+protected:
+	template<typename U>
+	void resize( const U& _size )
+	{
+		int numRows = 1;
+		for( unsigned int i = 0; i < Dim; ++i )
+		{
+			m_Size[ i ] = _size[ i ];
+			numRows *= ( i > 0 ? m_Size[ i ] : 1 );
+		}
+		m_NumPages = ( numRows + MASK ) >> SHIFT;
+		m_PagePoints = ROWS * m_Size[ 0 ];
+	}
+
+	static int page( int row )
+	{
+		return row >> SHIFT;
+	}
+
+	int offset( int x, int row ) const
+	{
+		return ( row & MASK ) * m_Size[ 0 ] + x;
+	}
+
+	int row( int y, int z ) const
+	{
+		return z * m_Size[ 1 ] + y;
+	}
+
+protected:
+	Tuple<int, Dim> m_Size;
+	int m_NumPages;
+	int m_PagePoints;
+};
+
+}
+
+/*
+ * Function stored in pages that are shared copy-on-write with the
+ * snapshots taken of it. snapshot() is O(1), restore() O(pages); the
+ * first write to a page after either duplicates that page only if a
+ * snapshot still holds it. Reads cost as much as those of a Function;
+ * writes also compare a per-page stamp with the current generation, which
+ * keeps set() loops from vectorizing. Concurrent writes, as from
+ * parallel::set(), are safe. Expressions refer to it through FunctionRef.
+ */
+template<typename T, unsigned int Dim = 2>
+class CowFunction : public detail::PageGrid<Dim>
+{
+public:
+	typedef precision_type<T> PRECISION;
+	typedef typename PRECISION::COMPUTE DTYPE;
+	typedef typename PRECISION::STORAGE STYPE;
+	typedef typename PRECISION::ACCUM ACCUM;
+	typedef FunctionRef<CowFunction<T, Dim>> OPERAND;
+	static const unsigned int DIM = Dim;
+
+private:
+	typedef detail::PageGrid<Dim> GRID;
+	typedef detail::CowTable<STYPE> TABLE;
+	typedef detail::PrecisionAccess<PRECISION> ACCESS;
+
+public:
+	typedef typename ACCESS::REFERENCE REFERENCE;
+	typedef typename ACCESS::CONST_REFERENCE CONST_REFERENCE;
+
+public:
+	template<typename U>
+	CowFunction( const U& _size )
+		: m_pTable( std::make_shared<TABLE>() ), m_Generation( 0 )
+	{
+		GRID::resize( _size );
+		m_pTable->pages.resize( GRID::m_NumPages );
+		m_pTable->pData.resize( GRID::m_NumPages );
+		for( int p = 0; p < GRID::m_NumPages; ++p )
+		{
+			m_pTable->pages[ p ] = std::make_shared<std::vector<STYPE>>( GRID::m_PagePoints );
+			m_pTable->pData[ p ] = m_pTable->pages[ p ]->data();
+		}
+		allocate();
+	}
+
+	/* Starts from the contents of snapshot, sharing all of its pages. */
+	CowFunction( const Snapshot<T, Dim>& snapshot )
+		: m_Generation( 0 )
+	{
+		GRID::resize( snapshot.size() );
+		allocate();
+		restore( snapshot );
+	}
+
+	REFERENCE operator()( int x, int y )
+	{
+		return ACCESS::ref( writable( y )[ GRID::offset( x, y ) ] );
+	}
+
+	CONST_REFERENCE operator()( int x, int y ) const
+	{
+		return ACCESS::cref( m_ppData[ GRID::page( y ) ][ GRID::offset( x, y ) ] );
+	}
+
+	REFERENCE operator()( int x, int y, int z )
+	{
+		int row = GRID::row( y, z );
+		return ACCESS::ref( writable( row )[ GRID::offset( x, row ) ] );
+	}
+
+	CONST_REFERENCE operator()( int x, int y, int z ) const
+	{
+		int row = GRID::row( y, z );
+		return ACCESS::cref( m_ppData[ GRID::page( row ) ][ GRID::offset( x, row ) ] );
+	}
+
+	const Tuple<int, Dim>& size() const
+	{
+		return GRID::m_Size;
+	}
+
+	/*
+	 * Current contents, kept unchanged by later writes. Not to be called
+	 * while func is being written.
+	 */
+	Snapshot<T, Dim> snapshot()
+	{
+		++m_Generation;
+		return Snapshot<T, Dim>( m_pTable, GRID::m_Size );
+	}
+
+	/* Rolls back to snapshot, which has to have the same extents. */
+	void restore( const Snapshot<T, Dim>& snapshot )
+	{
+		m_pTable = std::const_pointer_cast<TABLE>( snapshot.m_pTable );
+		std::copy( m_pTable->pData.begin(), m_pTable->pData.end(), m_ppData.get() );
+		++m_Generation;
+	}
+
+	/* Pages not shared with any snapshot, i.e. the memory this one adds. */
+	int ownPages() const
+	{
+		if( m_pTable.use_count() > 1 )
+		{
+			return 0;
+		}
+		int count = 0;
+		for( int p = 0; p < GRID::m_NumPages; ++p )
+		{
+			count += ( m_pTable->pages[ p ].use_count() == 1 );
+		}
+		return count;
+	}
+
+	template<typename Top>
+	CowFunction<T, Dim>& operator=( const Top& op )
+	{
+		set( *this, op );
+		return *this;
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		visitor.read( this, offsetX, offsetY, offsetZ );
+	}
+
+private:
+	void allocate()
+	{
+		m_ppData.reset( new STYPE*[ GRID::m_NumPages ] );
+		m_pStamps.reset( new std::atomic<unsigned int>[ GRID::m_NumPages ] );
+		for( int p = 0; p < GRID::m_NumPages; ++p )
+		{
+			m_pStamps[ p ].store( m_Generation, std::memory_order_relaxed );
+		}
+		if( m_pTable )
+		{
+			std::copy( m_pTable->pData.begin(), m_pTable->pData.end(), m_ppData.get() );
+		}
+	}
+
+	STYPE* writable( int row )
+	{
+		int p = GRID::page( row );
+		if( m_pStamps[ p ].load( std::memory_order_acquire ) != m_Generation )
+		{
+			unshare( p );
+		}
+		return m_ppData[ p ];
+	}
+
+	/*
+	 * Makes page p private to this function: first the table, if a
+	 * snapshot holds it, then the page itself.
+	 */
+	void unshare( int p )
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		if( m_pStamps[ p ].load( std::memory_order_relaxed ) == m_Generation )
+		{
+			return;
+		}
+		if( m_pTable.use_count() > 1 )
+		{
+			m_pTable = std::make_shared<TABLE>( *m_pTable );
+		}
+		std::shared_ptr<std::vector<STYPE>>& pPage = m_pTable->pages[ p ];
+		if( pPage.use_count() > 1 )
+		{
+			pPage = std::make_shared<std::vector<STYPE>>( *pPage );
+			m_pTable->pData[ p ] = pPage->data();
+			m_ppData[ p ] = pPage->data();
+		}
+		m_pStamps[ p ].store( m_Generation, std::memory_order_release );
+	}
+
+private:
+	CowFunction( const CowFunction<T, Dim>& );
+	CowFunction<T, Dim>& operator=( const CowFunction<T, Dim>& );
+
+private:
+	std::shared_ptr<TABLE> m_pTable;
+	std::unique_ptr<STYPE*[]> m_ppData;
+	std::unique_ptr<std::atomic<unsigned int>[]> m_pStamps;
+	unsigned int m_Generation;
+	std::mutex m_Mutex;
+};
+
+/*
+ * Read-only contents of a CowFunction at the time snapshot() was called.
+ * Copies are cheap and share the pages, so it is an ordinary leaf.
+ */
+template<typename T, unsigned int Dim = 2>
+class Snapshot : public detail::PageGrid<Dim>
+{
+	friend class CowFunction<T, Dim>;
+
+public:
+	typedef precision_type<T> PRECISION;
+	typedef typename PRECISION::COMPUTE DTYPE;
+	typedef typename PRECISION::STORAGE STYPE;
+	typedef typename PRECISION::ACCUM ACCUM;
+	static const unsigned int DIM = Dim;
+
+private:
+	typedef detail::PageGrid<Dim> GRID;
+	typedef detail::CowTable<STYPE> TABLE;
+	typedef detail::PrecisionAccess<PRECISION> ACCESS;
+
+public:
+	typedef typename ACCESS::CONST_REFERENCE CONST_REFERENCE;
+
+public:
+	CONST_REFERENCE operator()( int x, int y ) const
+	{
+		return ACCESS::cref( m_pTable->pData[ GRID::page( y ) ][ GRID::offset( x, y ) ] );
+	}
+
+	CONST_REFERENCE operator()( int x, int y, int z ) const
+	{
+		int row = GRID::row( y, z );
+		return ACCESS::cref( m_pTable->pData[ GRID::page( row ) ][ GRID::offset( x, row ) ] );
+	}
+
+	const Tuple<int, Dim>& size() const
+	{
+		return GRID::m_Size;
+	}
+
+	template<typename Tvisitor>
+	void visit( Tvisitor& visitor, int offsetX, int offsetY, int offsetZ ) const
+	{
+		visitor.read( m_pTable.get(), offsetX, offsetY, offsetZ );
+	}
+
+private:
+	Snapshot( const std::shared_ptr<TABLE>& pTable, const Tuple<int, Dim>& _size )
+		: m_pTable( pTable )
+	{
+		GRID::resize( _size );
+	}
+
+private:
+	std::shared_ptr<const TABLE> m_pTable;
+};
+
+}
+
+#endif
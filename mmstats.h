@@ -0,0 +1,752 @@
+#ifndef _MMSTATS_H_
+#define _MMSTATS_H_
+
+#include "metamath.h"
+#include "mmparallel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace mm
+{
+
+/*
+ * Distributions of an expression over a 2D range: histograms, quantiles
+ * and the locations of the largest values. Each pass evaluates the
+ * expression row by row into a buffer, shares of rows run on the threads
+ * of a pool with state of their own, and the states are merged at the
+ * end, so the expression is never stored. NaN values are not supported.
+ */
+namespace stats
+{
+
+/*
+ * Counts of values in numBins equal bins over [ lo, hi ], the last bin
+ * closed, and of the values below and above. lo < hi has to hold with a
+ * finite width.
+ */
+class Histogram
+{
+public:
+	Histogram( int numBins, double lo, double hi )
+		: m_Counts( numBins, 0 ), m_Lo( lo ), m_Hi( hi ),
+		  m_Scale( numBins / ( hi - lo ) ), m_Below( 0 ), m_Above( 0 )
+	{
+		if( numBins < 1 || !( lo < hi ) || !( hi - lo < std::numeric_limits<double>::infinity() )
+				|| !( m_Scale < std::numeric_limits<double>::infinity() ) )
+		{
+			throw std::runtime_error( "Histogram: needs a bin and lo < hi with a finite width" );
+		}
+	}
+
+	void add( double x )
+	{
+		if( x < m_Lo )
+		{
+			++m_Below;
+		}
+		else if( x > m_Hi )
+		{
+			++m_Above;
+		}
+		else
+		{
+			int bin = (int)( ( x - m_Lo ) * m_Scale );
+			++m_Counts[ std::min( bin, numBins() - 1 ) ];
+		}
+	}
+
+	void merge( const Histogram& other )
+	{
+		for( int i = 0; i < numBins(); ++i )
+		{
+			m_Counts[ i ] += other.m_Counts[ i ];
+		}
+		m_Below += other.m_Below;
+		m_Above += other.m_Above;
+	}
+
+	int numBins() const
+	{
+		return (int)m_Counts.size();
+	}
+
+	std::uint64_t operator[]( int bin ) const
+	{
+		return m_Counts[ bin ];
+	}
+
+	double binLow( int bin ) const
+	{
+		return m_Lo + bin / m_Scale;
+	}
+
+	std::uint64_t below() const
+	{
+		return m_Below;
+	}
+
+	std::uint64_t above() const
+	{
+		return m_Above;
+	}
+
+	std::uint64_t count() const
+	{
+		std::uint64_t res = m_Below + m_Above;
+		for( int i = 0; i < numBins(); ++i )
+		{
+			res += m_Counts[ i ];
+		}
+		return res;
+	}
+
+	/*
+	 * Approximate q-quantile, interpolated linearly inside its bin. Ranks
+	 * below or above the range give lo or hi.
+	 */
+	double quantile( double q ) const
+	{
+		double rank = q * count();
+		double seen = (double)m_Below;
+		if( rank <= seen )
+		{
+			return m_Lo;
+		}
+		for( int i = 0; i < numBins(); ++i )
+		{
+			if( m_Counts[ i ] > 0 && rank <= seen + m_Counts[ i ] )
+			{
+				return binLow( i ) + ( rank - seen ) / m_Counts[ i ] / m_Scale;
+			}
+			seen += m_Counts[ i ];
+		}
+		return m_Hi;
+	}
+
+private:
+	std::vector<std::uint64_t> m_Counts;
+	double m_Lo;
+	double m_Hi;
+	double m_Scale;
+	std::uint64_t m_Below;
+	std::uint64_t m_Above;
+};
+
+/*
+ * Mergeable quantile sketch that needs no range up front. Magnitudes are
+ * counted in buckets taken from the leading bits of their representation,
+ * the exponent and the top mantissaBits of the mantissa, so a bucket
+ * spans a factor of 1 + 2^-mantissaBits and quantile() is within a
+ * relative 2^-( mantissaBits + 1 ) of a value of the right rank. Buckets
+ * are only kept between the smallest and largest magnitude seen.
+ */
+class Sketch
+{
+public:
+	explicit Sketch( int mantissaBits = 7 )
+		: m_Shift( 52 - mantissaBits ), m_PosBase( 0 ), m_NegBase( 0 ), m_Zero( 0 ),
+		  m_Count( 0 ), m_Min( std::numeric_limits<double>::infinity() ),
+		  m_Max( -std::numeric_limits<double>::infinity() )
+	{
+	}
+
+	void add( double x )
+	{
+		++m_Count;
+		m_Min = std::min( m_Min, x );
+		m_Max = std::max( m_Max, x );
+		if( x > 0 )
+		{
+			count( m_Pos, m_PosBase, key( x ) );
+		}
+		else if( x < 0 )
+		{
+			count( m_Neg, m_NegBase, key( -x ) );
+		}
+		else
+		{
+			++m_Zero;
+		}
+	}
+
+	void merge( const Sketch& other )
+	{
+		for( size_t i = 0; i < other.m_Pos.size(); ++i )
+		{
+			add( m_Pos, m_PosBase, other.m_PosBase + (int)i, other.m_Pos[ i ] );
+		}
+		for( size_t i = 0; i < other.m_Neg.size(); ++i )
+		{
+			add( m_Neg, m_NegBase, other.m_NegBase + (int)i, other.m_Neg[ i ] );
+		}
+		m_Zero += other.m_Zero;
+		m_Count += other.m_Count;
+		m_Min = std::min( m_Min, other.m_Min );
+		m_Max = std::max( m_Max, other.m_Max );
+	}
+
+	std::uint64_t count() const
+	{
+		return m_Count;
+	}
+
+	double min() const
+	{
+		return m_Min;
+	}
+
+	double max() const
+	{
+		return m_Max;
+	}
+
+	/* Value of rank q ( count() - 1 ), rounded down. */
+	double quantile( double q ) const
+	{
+		if( m_Count == 0 )
+		{
+			return 0;
+		}
+		std::uint64_t rank = (std::uint64_t)( q * ( m_Count - 1 ) );
+		std::uint64_t seen = 0;
+		for( size_t i = m_Neg.size(); i-- > 0; )
+		{
+			seen += m_Neg[ i ];
+			if( rank < seen )
+			{
+				return clamp( -middle( m_NegBase + (int)i ) );
+			}
+		}
+		seen += m_Zero;
+		if( rank < seen )
+		{
+			return 0;
+		}
+		for( size_t i = 0; i < m_Pos.size(); ++i )
+		{
+			seen += m_Pos[ i ];
+			if( rank < seen )
+			{
+				return clamp( middle( m_PosBase + (int)i ) );
+			}
+		}
+		return m_Max;
+	}
+
+private:
+	int key( double magnitude ) const
+	{
+		std::uint64_t bits;
+		std::memcpy( &bits, &magnitude, sizeof( bits ) );
+		return (int)( bits >> m_Shift );
+	}
+
+	double bound( int key ) const
+	{
+		std::uint64_t bits = (std::uint64_t)key << m_Shift;
+		double res;
+		std::memcpy( &res, &bits, sizeof( res ) );
+		return res;
+	}
+
+	double middle( int key ) const
+	{
+		return 0.5 * ( bound( key ) + bound( key + 1 ) );
+	}
+
+	double clamp( double x ) const
+	{
+		return std::min( std::max( x, m_Min ), m_Max );
+	}
+
+	static void count( std::vector<std::uint64_t>& buckets, int& base, int key )
+	{
+		unsigned int i = (unsigned int)( key - base );
+		if( i < buckets.size() )
+		{
+			++buckets[ i ];
+		}
+		else
+		{
+			add( buckets, base, key, 1 );
+		}
+	}
+
+	static void add( std::vector<std::uint64_t>& buckets, int& base, int key,
+			std::uint64_t count )
+	{
+		if( count == 0 )
+		{
+			return;
+		}
+		if( buckets.empty() )
+		{
+			base = key;
+		}
+		else if( key < base )
+		{
+			buckets.insert( buckets.begin(), base - key, 0 );
+			base = key;
+		}
+		if( key - base >= (int)buckets.size() )
+		{
+			buckets.resize( key - base + 1, 0 );
+		}
+		buckets[ key - base ] += count;
+	}
+
+private:
+	int m_Shift;
+	std::vector<std::uint64_t> m_Pos;
+	std::vector<std::uint64_t> m_Neg;
+	int m_PosBase;
+	int m_NegBase;
+	std::uint64_t m_Zero;
+	std::uint64_t m_Count;
+	double m_Min;
+	double m_Max;
+};
+
+/* Value of op at ( x, y ). */
+template<typename T>
+struct Location
+{
+	T value;
+	int x;
+	int y;
+};
+
+namespace detail
+{
+
+/*
+ * Shares of the rows [ beginY, endY ) on the threads of pool. Every share
+ * starts from a copy of the initial state, gets row( state, pValues, y )
+ * called with the values of op on each of its rows and is then merged
+ * into state under a lock.
+ */
+template<typename Tstate, typename Top, typename Trow, typename Tmerge>
+inline void reduceRows( parallel::ThreadPool& pool, const Top& op, int beginX,
+		int beginY, int endX, int endY, Tstate& total, const Trow& row, const Tmerge& merge )
+{
+	typedef op_dtype<Top> T;
+	const Tstate init( total );
+	std::mutex mutex;
+	int n = std::max( endX - beginX, 0 );
+	pool.parallelFor( beginY, endY,
+			[&]( int first, int last )
+			{
+				Tstate state( init );
+				std::vector<T> values( n );
+				T* pValues = values.data();
+				for( int y = first; y < last; ++y )
+				{
+					for( int i = 0; i < n; ++i )
+					{
+						pValues[ i ] = op( beginX + i, y );
+					}
+					row( state, pValues, y );
+				}
+				std::lock_guard<std::mutex> lock( mutex );
+				merge( total, state );
+			} );
+}
+
+/*
+ * Value order of topK(): larger values first, ties by position, so that
+ * the result does not depend on how rows were shared among threads.
+ */
+template<typename T>
+inline bool before( const Location<T>& a, const Location<T>& b )
+{
+	return ( a.value > b.value
+			|| ( a.value == b.value && ( a.y < b.y || ( a.y == b.y && a.x < b.x ) ) ) );
+}
+
+/*
+ * One narrowing step of quantile(): the values that fell into bin of
+ * numBins equal bins starting at lo. Refinements keep the binning of
+ * every earlier step, so which values count as inside, below or above
+ * does not depend on rounding when the bounds of a bin are computed.
+ */
+struct Refinement
+{
+	double lo;
+	double scale;
+	int bin;
+};
+
+/* Bin counts with the smallest and largest value seen in each bin. */
+struct Bins
+{
+	Bins( int numBins )
+		: counts( numBins, 0 ), lows( numBins, std::numeric_limits<double>::infinity() ),
+		  highs( numBins, -std::numeric_limits<double>::infinity() ), below( 0 )
+	{
+	}
+
+	std::vector<std::uint64_t> counts;
+	std::vector<double> lows;
+	std::vector<double> highs;
+	std::uint64_t below;
+};
+
+/*
+ * Bins are taken on halves, so the width of a range of finite values does
+ * not overflow, and clamped before the conversion to int.
+ */
+inline double binScale( double lo, double hi, int numBins )
+{
+	return numBins / ( 0.5 * hi - 0.5 * lo );
+}
+
+inline int binOf( double x, double lo, double scale, int numBins )
+{
+	double bin = ( 0.5 * x - 0.5 * lo ) * scale;
+	if( !( bin > 0 ) )
+	{
+		return 0;
+	}
+	return ( bin < numBins ? (int)bin : numBins - 1 );
+}
+
+/*
+ * -1 below, 0 inside, 1 above the values selected by refinements.
+ * Infinities are never selected.
+ */
+inline int side( double x, const std::vector<Refinement>& refinements, int numBins )
+{
+	if( x == std::numeric_limits<double>::infinity() || x == -std::numeric_limits<double>::infinity() )
+	{
+		return ( x < 0 ? -1 : 1 );
+	}
+	for( size_t l = 0; l < refinements.size(); ++l )
+	{
+		const Refinement& r = refinements[ l ];
+		int bin = binOf( x, r.lo, r.scale, numBins );
+		if( bin != r.bin )
+		{
+			return ( bin < r.bin ? -1 : 1 );
+		}
+	}
+	return 0;
+}
+
+}
+
+/* Histogram of op over [ begin, end ), see Histogram. */
+template<typename Top, typename Tbegin, typename Tend>
+inline Histogram histogram( parallel::ThreadPool& pool, const Top& op, const Tbegin& begin,
+		const Tend& end, int numBins, double lo, double hi )
+{
+	typedef op_dtype<Top> T;
+	Histogram res( numBins, lo, hi );
+	int n = end[ 0 ] - begin[ 0 ];
+	detail::reduceRows( pool, op, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], res,
+			[n]( Histogram& state, const T* pValues, int )
+			{
+				for( int i = 0; i < n; ++i )
+				{
+					state.add( (double)pValues[ i ] );
+				}
+			},
+			[]( Histogram& total, const Histogram& state )
+			{
+				total.merge( state );
+			} );
+	return res;
+}
+
+template<typename Top, typename Tbegin, typename Tend>
+inline Histogram histogram( const Top& op, const Tbegin& begin, const Tend& end,
+		int numBins, double lo, double hi )
+{
+	return stats::histogram( parallel::ThreadPool::instance(), op, begin, end, numBins, lo, hi );
+}
+
+/* Quantile sketch of op over [ begin, end ), see Sketch. */
+template<typename Top, typename Tbegin, typename Tend>
+inline Sketch sketch( parallel::ThreadPool& pool, const Top& op, const Tbegin& begin,
+		const Tend& end, int mantissaBits = 7 )
+{
+	typedef op_dtype<Top> T;
+	Sketch res( mantissaBits );
+	int n = end[ 0 ] - begin[ 0 ];
+	detail::reduceRows( pool, op, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], res,
+			[n]( Sketch& state, const T* pValues, int )
+			{
+				for( int i = 0; i < n; ++i )
+				{
+					state.add( (double)pValues[ i ] );
+				}
+			},
+			[]( Sketch& total, const Sketch& state )
+			{
+				total.merge( state );
+			} );
+	return res;
+}
+
+template<typename Top, typename Tbegin, typename Tend>
+inline Sketch sketch( const Top& op, const Tbegin& begin, const Tend& end,
+		int mantissaBits = 7 )
+{
+	return stats::sketch( parallel::ThreadPool::instance(), op, begin, end, mantissaBits );
+}
+
+/*
+ * Exact q-quantile of op over [ begin, end ): the value of rank
+ * q ( count - 1 ), rounded down, so q = 0.5 gives the lower median.
+ * Selection narrows in passes instead of sorting. The first finds the
+ * range of the finite values and counts the infinite ones, each further
+ * one histograms the values still selected into 4096 bins and keeps the
+ * bin that holds the rank, and once at most 64k values are left, or a
+ * pass does not narrow, they are gathered and put in place with
+ * std::nth_element. op is evaluated once per pass, typically three
+ * times. An empty range throws std::runtime_error.
+ */
+template<typename Top, typename Tbegin, typename Tend>
+inline op_dtype<Top> quantile( parallel::ThreadPool& pool, const Top& op, const Tbegin& begin,
+		const Tend& end, double q )
+{
+	typedef op_dtype<Top> T;
+	const int BINS = 4096;
+	const std::uint64_t GATHER = 65536;
+	int beginX = begin[ 0 ];
+	int beginY = begin[ 1 ];
+	int endX = end[ 0 ];
+	int endY = end[ 1 ];
+	int n = endX - beginX;
+	std::uint64_t count = ( n > 0 && endY > beginY ? (std::uint64_t)n * ( endY - beginY ) : 0 );
+	if( count == 0 )
+	{
+		throw std::runtime_error( "quantile(): empty range" );
+	}
+	std::uint64_t rank = (std::uint64_t)( q * ( count - 1 ) );
+	rank = std::min( rank, count - 1 );
+
+	// lowest and highest finite value, then the counts of -inf and +inf
+	const double INF = std::numeric_limits<double>::infinity();
+	std::vector<double> range( 4, 0.0 );
+	range[ 0 ] = INF;
+	range[ 1 ] = -INF;
+	detail::reduceRows( pool, op, beginX, beginY, endX, endY, range,
+			[n]( std::vector<double>& state, const T* pValues, int )
+			{
+				const double INF = std::numeric_limits<double>::infinity();
+				double lo = state[ 0 ];
+				double hi = state[ 1 ];
+				for( int i = 0; i < n; ++i )
+				{
+					double x = (double)pValues[ i ];
+					if( x == -INF )
+					{
+						state[ 2 ] += 1;
+					}
+					else if( x == INF )
+					{
+						state[ 3 ] += 1;
+					}
+					else
+					{
+						lo = std::min( lo, x );
+						hi = std::max( hi, x );
+					}
+				}
+				state[ 0 ] = lo;
+				state[ 1 ] = hi;
+			},
+			[]( std::vector<double>& total, const std::vector<double>& state )
+			{
+				total[ 0 ] = std::min( total[ 0 ], state[ 0 ] );
+				total[ 1 ] = std::max( total[ 1 ], state[ 1 ] );
+				total[ 2 ] += state[ 2 ];
+				total[ 3 ] += state[ 3 ];
+			} );
+	std::uint64_t negative = (std::uint64_t)range[ 2 ];
+	std::uint64_t positive = (std::uint64_t)range[ 3 ];
+	if( rank < negative )
+	{
+		return T( -INF );
+	}
+	if( rank >= count - positive )
+	{
+		return T( INF );
+	}
+
+	std::vector<detail::Refinement> refinements;
+	std::uint64_t below = negative;
+	std::uint64_t selected = count - negative - positive;
+	double lo = range[ 0 ];
+	double hi = range[ 1 ];
+	while( selected > GATHER && lo < hi )
+	{
+		double scale = detail::binScale( lo, hi, BINS );
+		if( !( scale < INF ) )
+		{
+			break;
+		}
+		detail::Bins bins( BINS );
+		detail::reduceRows( pool, op, beginX, beginY, endX, endY, bins,
+				[&]( detail::Bins& state, const T* pValues, int )
+				{
+					for( int i = 0; i < n; ++i )
+					{
+						double x = (double)pValues[ i ];
+						int where = detail::side( x, refinements, BINS );
+						if( where < 0 )
+						{
+							++state.below;
+						}
+						else if( where == 0 )
+						{
+							int bin = detail::binOf( x, lo, scale, BINS );
+							++state.counts[ bin ];
+							state.lows[ bin ] = std::min( state.lows[ bin ], x );
+							state.highs[ bin ] = std::max( state.highs[ bin ], x );
+						}
+					}
+				},
+				[]( detail::Bins& total, const detail::Bins& state )
+				{
+					for( size_t i = 0; i < total.counts.size(); ++i )
+					{
+						total.counts[ i ] += state.counts[ i ];
+						total.lows[ i ] = std::min( total.lows[ i ], state.lows[ i ] );
+						total.highs[ i ] = std::max( total.highs[ i ], state.highs[ i ] );
+					}
+					total.below += state.below;
+				} );
+		std::uint64_t before = bins.below;
+		int bin = 0;
+		while( before + bins.counts[ bin ] <= rank )
+		{
+			before += bins.counts[ bin ];
+			++bin;
+		}
+		if( bins.counts[ bin ] == selected )
+		{
+			break;
+		}
+		below = before;
+		detail::Refinement refinement = { lo, scale, bin };
+		refinements.push_back( refinement );
+		selected = bins.counts[ bin ];
+		lo = bins.lows[ bin ];
+		hi = bins.highs[ bin ];
+	}
+	if( !( lo < hi ) )
+	{
+		return T( lo );
+	}
+
+	std::vector<T> values;
+	detail::reduceRows( pool, op, beginX, beginY, endX, endY, values,
+			[&]( std::vector<T>& state, const T* pValues, int )
+			{
+				for( int i = 0; i < n; ++i )
+				{
+					if( detail::side( (double)pValues[ i ], refinements, BINS ) == 0 )
+					{
+						state.push_back( pValues[ i ] );
+					}
+				}
+			},
+			[]( std::vector<T>& total, const std::vector<T>& state )
+			{
+				total.insert( total.end(), state.begin(), state.end() );
+			} );
+	T* pValues = values.data();
+	std::nth_element( pValues, pValues + ( rank - below ), pValues + values.size() );
+	return pValues[ rank - below ];
+}
+
+template<typename Top, typename Tbegin, typename Tend>
+inline op_dtype<Top> quantile( const Top& op, const Tbegin& begin, const Tend& end, double q )
+{
+	return stats::quantile( parallel::ThreadPool::instance(), op, begin, end, q );
+}
+
+template<typename Top, typename Tbegin, typename Tend>
+inline op_dtype<Top> median( parallel::ThreadPool& pool, const Top& op, const Tbegin& begin,
+		const Tend& end )
+{
+	return stats::quantile( pool, op, begin, end, 0.5 );
+}
+
+template<typename Top, typename Tbegin, typename Tend>
+inline op_dtype<Top> median( const Top& op, const Tbegin& begin, const Tend& end )
+{
+	return stats::quantile( op, begin, end, 0.5 );
+}
+
+/*
+ * The k largest values of op over [ begin, end ) with their positions,
+ * largest first; topK( -op, ... ) gives the smallest. Every share keeps
+ * its k best in a heap, so most values cost one comparison.
+ */
+template<typename Top, typename Tbegin, typename Tend>
+inline std::vector<Location<op_dtype<Top>>> topK( parallel::ThreadPool& pool, const Top& op,
+		const Tbegin& begin, const Tend& end, int k )
+{
+	typedef op_dtype<Top> T;
+	typedef std::vector<Location<T>> HEAP;
+	int beginX = begin[ 0 ];
+	int n = end[ 0 ] - begin[ 0 ];
+	size_t size = (size_t)std::max( k, 0 );
+	HEAP res;
+	auto push = [size]( HEAP& heap, const Location<T>& location )
+	{
+		if( heap.size() < size )
+		{
+			heap.push_back( location );
+			std::push_heap( heap.begin(), heap.end(), detail::before<T> );
+		}
+		else if( size > 0 && detail::before( location, heap.front() ) )
+		{
+			std::pop_heap( heap.begin(), heap.end(), detail::before<T> );
+			heap.back() = location;
+			std::push_heap( heap.begin(), heap.end(), detail::before<T> );
+		}
+	};
+	detail::reduceRows( pool, op, begin[ 0 ], begin[ 1 ], end[ 0 ], end[ 1 ], res,
+			[&]( HEAP& heap, const T* pValues, int y )
+			{
+				for( int i = 0; i < n; ++i )
+				{
+					if( heap.size() < size || pValues[ i ] >= heap.front().value )
+					{
+						Location<T> location = { pValues[ i ], beginX + i, y };
+						push( heap, location );
+					}
+				}
+			},
+			[&]( HEAP& total, const HEAP& heap )
+			{
+				for( size_t i = 0; i < heap.size(); ++i )
+				{
+					push( total, heap[ i ] );
+				}
+			} );
+	std::sort_heap( res.begin(), res.end(), detail::before<T> );
+	return res;
+}
+
+template<typename Top, typename Tbegin, typename Tend>
+inline std::vector<Location<op_dtype<Top>>> topK( const Top& op, const Tbegin& begin,
+		const Tend& end, int k )
+{
+	return stats::topK( parallel::ThreadPool::instance(), op, begin, end, k );
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,507 @@
+#ifndef _MMTASKS_H_
+#define _MMTASKS_H_
+
+#include "metamath.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mm
+{
+
+namespace parallel
+{
+
+namespace detail
+{
+
+/*
+ * Box [ lo, hi ) of a leaf that a task reads or writes, in the leaf's own
+ * coordinates. A null pData stands for anything, i.e. an operand that did
+ * not report its reads.
+ */
+struct Access
+{
+	const void* pData;
+	int lo[ 3 ];
+	int hi[ 3 ];
+
+	bool overlaps( const Access& other ) const
+	{
+		if( pData != nullptr && other.pData != nullptr && pData != other.pData )
+		{
+			return false;
+		}
+		for( int d = 0; d < 3; ++d )
+		{
+			if( lo[ d ] >= other.hi[ d ] || other.lo[ d ] >= hi[ d ] )
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+/*
+ * Turns the reads reported by visit() into boxes: the evaluated region
+ * shifted by each offset, merged per leaf.
+ */
+struct AccessVisitor
+{
+	std::vector<Access>* pAccesses;
+	int lo[ 3 ];
+	int hi[ 3 ];
+
+	void read( const void* pData, int offsetX, int offsetY, int offsetZ )
+	{
+		int offset[ 3 ] = { offsetX, offsetY, offsetZ };
+		Access access = { pData, { 0, 0, 0 }, { 0, 0, 0 } };
+		for( int d = 0; d < 3; ++d )
+		{
+			access.lo[ d ] = lo[ d ] + offset[ d ];
+			access.hi[ d ] = hi[ d ] + offset[ d ];
+		}
+		for( size_t i = 0; i < pAccesses->size(); ++i )
+		{
+			Access& other = ( *pAccesses )[ i ];
+			if( other.pData == pData )
+			{
+				for( int d = 0; d < 3; ++d )
+				{
+					other.lo[ d ] = std::min( other.lo[ d ], access.lo[ d ] );
+					other.hi[ d ] = std::max( other.hi[ d ], access.hi[ d ] );
+				}
+				return;
+			}
+		}
+		pAccesses->push_back( access );
+	}
+
+	void unknown()
+	{
+		Access access = { nullptr, { INT_MIN, INT_MIN, INT_MIN },
+			{ INT_MAX, INT_MAX, INT_MAX } };
+		pAccesses->push_back( access );
+	}
+};
+
+struct TaskNode
+{
+	std::vector<Access> reads;
+	std::vector<Access> writes;
+	std::function<void( int, int )> body;
+	std::vector<std::shared_ptr<TaskNode>> dependents;
+	std::promise<void> promise;
+	int numPending;
+	std::atomic<int> numTiles;
+	std::mutex exceptionMutex;
+	std::exception_ptr pException;
+};
+
+struct Tile
+{
+	std::shared_ptr<TaskNode> pNode;
+	int begin;
+	int end;
+};
+
+inline bool conflicts( const TaskNode& first, const TaskNode& second )
+{
+	for( size_t i = 0; i < first.writes.size(); ++i )
+	{
+		for( size_t j = 0; j < second.reads.size(); ++j )
+		{
+			if( first.writes[ i ].overlaps( second.reads[ j ] ) )
+			{
+				return true;
+			}
+		}
+		for( size_t j = 0; j < second.writes.size(); ++j )
+		{
+			if( first.writes[ i ].overlaps( second.writes[ j ] ) )
+			{
+				return true;
+			}
+		}
+	}
+	for( size_t i = 0; i < first.reads.size(); ++i )
+	{
+		for( size_t j = 0; j < second.writes.size(); ++j )
+		{
+			if( first.reads[ i ].overlaps( second.writes[ j ] ) )
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/*
+ * Whether the task reads a leaf it writes anywhere but at the written
+ * point, so that its tiles may not run concurrently.
+ */
+inline bool readsOwnNeighbours( const TaskNode& node )
+{
+	for( size_t i = 0; i < node.writes.size(); ++i )
+	{
+		const Access& write = node.writes[ i ];
+		for( size_t j = 0; j < node.reads.size(); ++j )
+		{
+			const Access& read = node.reads[ j ];
+			if( !write.overlaps( read ) )
+			{
+				continue;
+			}
+			for( int d = 0; d < 3; ++d )
+			{
+				if( read.pData != write.pData || read.lo[ d ] != write.lo[ d ]
+						|| read.hi[ d ] != write.hi[ d ] )
+				{
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+}
+
+/*
+ * Runs assignments asynchronously on its own worker threads. Each set()
+ * is recorded as a task with the boxes it reads and writes, derived from
+ * the leaves and offsets the expressions report through visit(). A task
+ * starts once every earlier task it conflicts with has finished, so
+ * independent assignments overlap while the results stay those of
+ * program order. Large tasks are split into tiles along the outermost
+ * dimension, which idle workers steal from each other; a task that reads
+ * its own target at another point runs as one tile. An exception thrown
+ * by a task is passed on through its future.
+ *
+ * TaskGraph tasks;
+ * tasks.set( a, e1( u ) );
+ * tasks.set( b, e2( v ) );		// runs alongside a
+ * tasks.set( c, a + b );			// waits for both
+ * tasks.wait();
+ *
+ * Targets and the leaves read must stay alive until their task is done.
+ */
+class TaskGraph
+{
+public:
+	explicit TaskGraph( unsigned int numThreads =
+			std::max( 1u, std::thread::hardware_concurrency() ),
+			int tilePoints = 1 << 14 )
+		: m_Queues( std::max( 1u, numThreads ) ), m_TilePoints( tilePoints ),
+		m_NumQueued( 0 ), m_NextQueue( 0 ), m_bStop( false )
+	{
+		for( unsigned int i = 0; i < m_Queues.size(); ++i )
+		{
+			m_Threads.push_back( std::thread( &TaskGraph::run, this, i ) );
+		}
+	}
+
+	~TaskGraph()
+	{
+		wait();
+		{
+			std::lock_guard<std::mutex> lock( m_SleepMutex );
+			m_bStop = true;
+		}
+		m_WakeUp.notify_all();
+		for( size_t i = 0; i < m_Threads.size(); ++i )
+		{
+			m_Threads[ i ].join();
+		}
+	}
+
+	template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
+	std::shared_future<void> set( Tfunc& func, const Tbegin& begin,
+			const Tend& end, const Top& op )
+	{
+		return set( func, begin, end, op,
+				mm::detail::DimTag<mm::detail::CoordDim<Tbegin>::value>() );
+	}
+
+	template<typename Tfunc, typename Top>
+	std::shared_future<void> set( Tfunc& func, const Top& op )
+	{
+		Tuple<int, mm::detail::FuncDim<Tfunc>::value> begin;
+		return set( func, begin, func.size(), op );
+	}
+
+	/*
+	 * Blocks until every recorded task is done.
+	 */
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock( m_Mutex );
+		m_Done.wait( lock, [this]() { return m_Active.empty(); } );
+	}
+
+private:
+	typedef detail::TaskNode Node;
+	typedef detail::Tile Tile;
+
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Tile> tiles;
+	};
+
+	TaskGraph( const TaskGraph& );
+	TaskGraph& operator=( const TaskGraph& );
+
+	template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
+	std::shared_future<void> set( Tfunc& func, const Tbegin& begin,
+			const Tend& end, const Top& op, mm::detail::DimTag<2> )
+	{
+		int beginX = begin[ 0 ];
+		int endX = end[ 0 ];
+		Tfunc* pFunc = &func;
+		op_operand<Top> operand( op );
+		int lo[ 3 ] = { begin[ 0 ], begin[ 1 ], 0 };
+		int hi[ 3 ] = { end[ 0 ], end[ 1 ], 1 };
+		return submit( func, op, lo, hi, 1, endX - beginX,
+				[pFunc, operand, beginX, endX]( int beginY, int endY )
+				{
+					mm::set( *pFunc, beginX, beginY, endX, endY, operand );
+				} );
+	}
+
+	template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
+	std::shared_future<void> set( Tfunc& func, const Tbegin& begin,
+			const Tend& end, const Top& op, mm::detail::DimTag<3> )
+	{
+		int beginX = begin[ 0 ];
+		int beginY = begin[ 1 ];
+		int endX = end[ 0 ];
+		int endY = end[ 1 ];
+		Tfunc* pFunc = &func;
+		op_operand<Top> operand( op );
+		int lo[ 3 ] = { begin[ 0 ], begin[ 1 ], begin[ 2 ] };
+		int hi[ 3 ] = { end[ 0 ], end[ 1 ], end[ 2 ] };
+		return submit( func, op, lo, hi, 2, ( endX - beginX ) * ( endY - beginY ),
+				[pFunc, operand, beginX, beginY, endX, endY]( int beginZ, int endZ )
+				{
+					mm::set( *pFunc, beginX, beginY, beginZ, endX, endY, endZ, operand );
+				} );
+	}
+
+	/*
+	 * Records a task writing func and reading op over the box [ lo, hi ),
+	 * split into tiles along dimension outer of about m_TilePoints points.
+	 */
+	template<typename Tfunc, typename Top>
+	std::shared_future<void> submit( const Tfunc& func, const Top& op,
+			const int* lo, const int* hi, int outer, int slicePoints,
+			const std::function<void( int, int )>& body )
+	{
+		std::shared_ptr<Node> pNode = std::make_shared<Node>();
+		detail::AccessVisitor writes = { &pNode->writes,
+			{ lo[ 0 ], lo[ 1 ], lo[ 2 ] }, { hi[ 0 ], hi[ 1 ], hi[ 2 ] } };
+		mm::detail::visit( func, writes );
+		detail::AccessVisitor reads = { &pNode->reads,
+			{ lo[ 0 ], lo[ 1 ], lo[ 2 ] }, { hi[ 0 ], hi[ 1 ], hi[ 2 ] } };
+		mm::detail::visit( op, reads );
+		pNode->body = body;
+		pNode->numPending = 0;
+		std::shared_future<void> future = pNode->promise.get_future().share();
+
+		int grain = std::max( 1, m_TilePoints / std::max( 1, slicePoints ) );
+		if( detail::readsOwnNeighbours( *pNode ) )
+		{
+			grain = std::max( 1, hi[ outer ] - lo[ outer ] );
+		}
+		std::vector<Tile> tiles;
+		for( int begin = lo[ outer ]; begin < hi[ outer ]; begin += grain )
+		{
+			Tile tile = { pNode, begin, std::min( begin + grain, hi[ outer ] ) };
+			tiles.push_back( tile );
+		}
+		pNode->numTiles = (int)tiles.size();
+		if( tiles.empty() )
+		{
+			pNode->promise.set_value();
+			return future;
+		}
+
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		for( size_t i = 0; i < m_Active.size(); ++i )
+		{
+			if( detail::conflicts( *m_Active[ i ], *pNode ) )
+			{
+				m_Active[ i ]->dependents.push_back( pNode );
+				++pNode->numPending;
+			}
+		}
+		m_Active.push_back( pNode );
+		m_Tiles.push_back( tiles );
+		if( pNode->numPending == 0 )
+		{
+			schedule( pNode, -1 );
+		}
+		return future;
+	}
+
+	/*
+	 * Queues the tiles of a ready task, on the given worker's queue or
+	 * spread over all queues. Called with m_Mutex held.
+	 */
+	void schedule( const std::shared_ptr<Node>& pNode, int worker )
+	{
+		std::vector<Tile> tiles;
+		for( size_t i = 0; i < m_Tiles.size(); ++i )
+		{
+			if( m_Tiles[ i ].front().pNode == pNode )
+			{
+				tiles.swap( m_Tiles[ i ] );
+				m_Tiles[ i ].swap( m_Tiles.back() );
+				m_Tiles.pop_back();
+				break;
+			}
+		}
+		for( size_t i = 0; i < tiles.size(); ++i )
+		{
+			size_t queue = ( worker >= 0 ? (size_t)worker
+					: m_NextQueue++ % m_Queues.size() );
+			std::lock_guard<std::mutex> lock( m_Queues[ queue ].mutex );
+			m_Queues[ queue ].tiles.push_back( tiles[ i ] );
+		}
+		{
+			std::lock_guard<std::mutex> lock( m_SleepMutex );
+			m_NumQueued += (int)tiles.size();
+		}
+		m_WakeUp.notify_all();
+	}
+
+	void finish( const std::shared_ptr<Node>& pNode, int worker )
+	{
+		{
+			std::lock_guard<std::mutex> lock( m_Mutex );
+			for( size_t i = 0; i < pNode->dependents.size(); ++i )
+			{
+				const std::shared_ptr<Node>& pDependent = pNode->dependents[ i ];
+				if( --pDependent->numPending == 0 )
+				{
+					schedule( pDependent, worker );
+				}
+			}
+			pNode->dependents.clear();
+			m_Active.erase( std::find( m_Active.begin(), m_Active.end(), pNode ) );
+			if( m_Active.empty() )
+			{
+				m_Done.notify_all();
+			}
+		}
+		if( pNode->pException )
+		{
+			pNode->promise.set_exception( pNode->pException );
+		}
+		else
+		{
+			pNode->promise.set_value();
+		}
+	}
+
+	/*
+	 * Takes the newest tile of the worker's own queue, or steals the
+	 * oldest one of another queue.
+	 */
+	bool pop( unsigned int worker, Tile& tile )
+	{
+		for( size_t i = 0; i < m_Queues.size(); ++i )
+		{
+			Queue& queue = m_Queues[ ( worker + i ) % m_Queues.size() ];
+			std::lock_guard<std::mutex> lock( queue.mutex );
+			if( !queue.tiles.empty() )
+			{
+				if( i == 0 )
+				{
+					tile = queue.tiles.back();
+					queue.tiles.pop_back();
+				}
+				else
+				{
+					tile = queue.tiles.front();
+					queue.tiles.pop_front();
+				}
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void run( unsigned int worker )
+	{
+		for( ;; )
+		{
+			{
+				std::unique_lock<std::mutex> lock( m_SleepMutex );
+				m_WakeUp.wait( lock, [this]() { return m_bStop || m_NumQueued > 0; } );
+				if( m_NumQueued == 0 )
+				{
+					return;
+				}
+				--m_NumQueued;
+			}
+
+			// a tile is reserved, but may sit in any queue
+			Tile tile;
+			while( !pop( worker, tile ) )
+			{
+				std::this_thread::yield();
+			}
+			try
+			{
+				tile.pNode->body( tile.begin, tile.end );
+			}
+			catch( ... )
+			{
+				std::lock_guard<std::mutex> lock( tile.pNode->exceptionMutex );
+				if( !tile.pNode->pException )
+				{
+					tile.pNode->pException = std::current_exception();
+				}
+			}
+			if( --tile.pNode->numTiles == 0 )
+			{
+				finish( tile.pNode, (int)worker );
+			}
+		}
+	}
+
+private:
+	std::vector<std::thread> m_Threads;
+	std::vector<Queue> m_Queues;
+	int m_TilePoints;
+
+	std::mutex m_Mutex;
+	std::condition_variable m_Done;
+	std::vector<std::shared_ptr<Node>> m_Active;
+	std::vector<std::vector<Tile>> m_Tiles;
+
+	std::mutex m_SleepMutex;
+	std::condition_variable m_WakeUp;
+	int m_NumQueued;
+	size_t m_NextQueue;
+	bool m_bStop;
+};
+
+}
+
+}
+
+#endif
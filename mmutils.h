@@ -26,6 +26,13 @@ public:
 	typedef mm::op::Scale<mm::op::Sub<mm::op::Eval<Top,0,+1>,mm::op::Eval<Top,0,-1>>> type;
 };
 
+template<typename Top>
+class DiffZ
+{
+public:
+	typedef mm::op::Scale<mm::op::Sub<mm::op::Eval<Top,0,0,+1>,mm::op::Eval<Top,0,0,-1>>> type;
+};
+
 template<typename Top>
 class DiffX_Fw
 {
@@ -40,6 +47,13 @@ public:
 	typedef mm::op::Scale<mm::op::Sub<mm::op::Eval<Top,0,+1>,Top>> type;
 };
 
+template<typename Top>
+class DiffZ_Fw
+{
+public:
+	typedef mm::op::Scale<mm::op::Sub<mm::op::Eval<Top,0,0,+1>,Top>> type;
+};
+
 template<typename Top>
 class DiffX_Bw
 {
@@ -54,6 +68,13 @@ public:
 	typedef mm::op::Scale<mm::op::Sub<Top,mm::op::Eval<Top,0,-1>>> type;
 };
 
+template<typename Top>
+class DiffZ_Bw
+{
+public:
+	typedef mm::op::Scale<mm::op::Sub<Top,mm::op::Eval<Top,0,0,-1>>> type;
+};
+
 template<typename Top>
 class DiffXX
 {
@@ -68,6 +89,13 @@ public:
 	typedef mm::op::Scale<mm::op::Add<mm::op::Sub<mm::op::Eval<Top,0,-1>,mm::op::Scale<Top>>,mm::op::Eval<Top,0,+1>>> type;
 };
 
+template<typename Top>
+class DiffZZ
+{
+public:
+	typedef mm::op::Scale<mm::op::Add<mm::op::Sub<mm::op::Eval<Top,0,0,-1>,mm::op::Scale<Top>>,mm::op::Eval<Top,0,0,+1>>> type;
+};
+
 template<typename Top>
 class DiffXX_YY
 {
@@ -78,6 +106,17 @@ public:
 		mm::op::Scale<Top>> type;
 };
 
+template<typename Top>
+class DiffXX_YY_ZZ
+{
+public:
+	typedef mm::op::Sub<mm::op::Add<mm::op::Add<
+		mm::op::Scale<mm::op::Add<mm::op::Eval<Top,-1,0>,mm::op::Eval<Top,+1,0>>>,
+		mm::op::Scale<mm::op::Add<mm::op::Eval<Top,0,-1>,mm::op::Eval<Top,0,+1>>>>,
+		mm::op::Scale<mm::op::Add<mm::op::Eval<Top,0,0,-1>,mm::op::Eval<Top,0,0,+1>>>>,
+		mm::op::Scale<Top>> type;
+};
+
 }
 
 template<typename Top>
@@ -92,6 +131,12 @@ inline typename op::DiffY<Top>::type diffY( const Top& op, op_dtype<Top> h )
 	return ( 1 / ( 2 * h ) * ( mm::eval<0,+1>( op ) - mm::eval<0,-1>( op ) ) );
 }
 
+template<typename Top>
+inline typename op::DiffZ<Top>::type diffZ( const Top& op, op_dtype<Top> h )
+{
+	return ( 1 / ( 2 * h ) * ( mm::eval<0,0,+1>( op ) - mm::eval<0,0,-1>( op ) ) );
+}
+
 template<typename Top>
 inline typename op::DiffX_Fw<Top>::type diffX_Fw( const Top& op, op_dtype<Top> h )
 {
@@ -104,6 +149,12 @@ inline typename op::DiffY_Fw<Top>::type diffY_Fw( const Top& op, op_dtype<Top> h
 	return ( 1 / h * ( mm::eval<0,+1>( op ) - op ) );
 }
 
+template<typename Top>
+inline typename op::DiffZ_Fw<Top>::type diffZ_Fw( const Top& op, op_dtype<Top> h )
+{
+	return ( 1 / h * ( mm::eval<0,0,+1>( op ) - op ) );
+}
+
 template<typename Top>
 inline typename op::DiffX_Bw<Top>::type diffX_Bw( const Top& op, op_dtype<Top> h )
 {
@@ -116,6 +167,12 @@ inline typename op::DiffY_Bw<Top>::type diffY_Bw( const Top& op, op_dtype<Top> h
 	return ( 1 / h * ( op - mm::eval<0,-1>( op ) ) );
 }
 
+template<typename Top>
+inline typename op::DiffZ_Bw<Top>::type diffZ_Bw( const Top& op, op_dtype<Top> h )
+{
+	return ( 1 / h * ( op - mm::eval<0,0,-1>( op ) ) );
+}
+
 template<typename Top>
 inline typename op::DiffXX<Top>::type diffXX( const Top& op, op_dtype<Top> h )
 {
@@ -128,6 +185,12 @@ inline typename op::DiffYY<Top>::type diffYY( const Top& op, op_dtype<Top> h )
 	return ( 1 / ( h * h ) * ( mm::eval<0,-1>( op ) - 2 * op + mm::eval<0,+1>( op ) ) );
 }
 
+template<typename Top>
+inline typename op::DiffZZ<Top>::type diffZZ( const Top& op, op_dtype<Top> h )
+{
+	return ( 1 / ( h * h ) * ( mm::eval<0,0,-1>( op ) - 2 * op + mm::eval<0,0,+1>( op ) ) );
+}
+
 template<typename Top, typename Th>
 inline typename op::DiffXX_YY<Top>::type diffXX_YY( const Top& op, const Th& h )
 {
@@ -136,6 +199,16 @@ inline typename op::DiffXX_YY<Top>::type diffXX_YY( const Top& op, const Th& h )
 			- ( 2 / ( h[ 0 ] * h[ 0 ] ) + 2 / ( h[ 1 ] * h[ 1 ] ) ) * op );
 }
 
+template<typename Top, typename Th>
+inline typename op::DiffXX_YY_ZZ<Top>::type diffXX_YY_ZZ( const Top& op, const Th& h )
+{
+	return ( 1 / ( h[ 0 ] * h[ 0 ] ) * ( mm::eval<-1,0>( op ) + mm::eval<+1,0>( op ) )
+			+ 1 / ( h[ 1 ] * h[ 1 ] ) * ( mm::eval<0,-1>( op ) + mm::eval<0,+1>( op ) )
+			+ 1 / ( h[ 2 ] * h[ 2 ] ) * ( mm::eval<0,0,-1>( op ) + mm::eval<0,0,+1>( op ) )
+			- ( 2 / ( h[ 0 ] * h[ 0 ] ) + 2 / ( h[ 1 ] * h[ 1 ] )
+				+ 2 / ( h[ 2 ] * h[ 2 ] ) ) * op );
+}
+
 template<typename Tfunc, typename Top, typename Tbegin, typename Tend>
 inline void setCheckered( Tfunc& func, const Tbegin& begin,
 		const Tend& end, bool color, const Top& op )
@@ -151,6 +224,7 @@ inline void setCheckered( Tfunc& func, const Tbegin& begin,
 			func( i, j ) = op( i, j );
 		}
 	}
+	mm::detail::written( func, beginX, beginY, 0, endX, endY, 1 );
 }
 
 template<typename Tfunc, typename Top, typename Tmask>
@@ -166,6 +240,7 @@ inline void setMasked( Tfunc& func, const Tmask& mask, const Top& op )
 			}
 		}
 	}
+	mm::detail::written( func, 0, 0, 0, func.size().x, func.size().y, 1 );
 }
 
 template<typename Tfunc, typename Top, typename Tmask,
@@ -187,6 +262,84 @@ inline void setMasked( Tfunc& func, const Tbegin& begin,
 			}
 		}
 	}
+	mm::detail::written( func, beginX, beginY, 0, endX, endY, 1 );
+}
+
+/*
+ * setCheckered() and setMasked() that also reduce over what they write, as
+ * setReduce() does. For red-black sweeps the replaced value is the previous
+ * iterate, so reduce::MaxAbsChange<>() measures the update directly.
+ */
+template<typename Tfunc, typename Top, typename Tbegin, typename Tend, typename Treducer>
+inline typename Treducer::RESULT setCheckeredReduce( Tfunc& func, const Tbegin& begin,
+		const Tend& end, bool color, const Top& op, const Treducer& reducer )
+{
+	typedef op_dtype<Top> DTYPE;
+	static const int L = Treducer::LANES;
+
+	Treducer acc( reducer );
+	int beginX = begin[ 0 ];
+	int beginY = begin[ 1 ];
+	int endX = end[ 0 ];
+	int endY = end[ 1 ];
+	for( int j = beginY; j < endY; ++j )
+	{
+		int i = beginX + ( j + color ) % 2;
+		for( ; i + 2 * ( L - 1 ) < endX; i += 2 * L )
+		{
+			for( int k = 0; k < L; ++k )
+			{
+				DTYPE now = op( i + 2 * k, j );
+				acc( k, now, (DTYPE)func( i + 2 * k, j ), i + 2 * k, j );
+				func( i + 2 * k, j ) = now;
+			}
+		}
+		for( ; i < endX; i += 2 )
+		{
+			DTYPE now = op( i, j );
+			acc( 0, now, (DTYPE)func( i, j ), i, j );
+			func( i, j ) = now;
+		}
+	}
+	mm::detail::written( func, beginX, beginY, 0, endX, endY, 1 );
+	return acc.result();
+}
+
+template<typename Tfunc, typename Top, typename Tmask,
+	typename Tbegin, typename Tend, typename Treducer>
+inline typename Treducer::RESULT setMaskedReduce( Tfunc& func, const Tbegin& begin,
+		const Tend& end, const Tmask& mask, const Top& op, const Treducer& reducer )
+{
+	typedef op_dtype<Top> DTYPE;
+	static const int L = Treducer::LANES;
+
+	Treducer acc( reducer );
+	int beginX = begin[ 0 ];
+	int beginY = begin[ 1 ];
+	int endX = end[ 0 ];
+	int endY = end[ 1 ];
+	for( int j = beginY; j < endY; ++j )
+	{
+		for( int i = beginX; i < endX; ++i )
+		{
+			if( mask( i, j ) )
+			{
+				DTYPE now = op( i, j );
+				acc( i % L, now, (DTYPE)func( i, j ), i, j );
+				func( i, j ) = now;
+			}
+		}
+	}
+	mm::detail::written( func, beginX, beginY, 0, endX, endY, 1 );
+	return acc.result();
+}
+
+template<typename Tfunc, typename Top, typename Tmask, typename Treducer>
+inline typename Treducer::RESULT setMaskedReduce( Tfunc& func, const Tmask& mask,
+		const Top& op, const Treducer& reducer )
+{
+	Tuple<int, 2> begin;
+	return setMaskedReduce( func, begin, func.size(), mask, op, reducer );
 }
 
 }
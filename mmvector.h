@@ -0,0 +1,593 @@
+#ifndef _MMVECTOR_H_
+#define _MMVECTOR_H_
+
+#include "metamath.h"
+#include "mmfunction.h"
+#include "mmutils.h"
+
+#include <type_traits>
+#include <utility>
+
+namespace mm
+{
+
+namespace vec
+{
+
+/*
+ * Vector-valued expression: one scalar expression per component, of
+ * possibly different types, evaluated plane by plane. Vectors combine
+ * component-wise through the operators below and are written by set(),
+ * which evaluates all components in one sweep.
+ */
+template<typename Tx, typename Ty, typename Tz = void>
+class Vector
+{
+public:
+	static const unsigned int N = 3;
+
+public:
+	template<typename Ux, typename Uy, typename Uz>
+	Vector( Ux&& x, Uy&& y, Uz&& z )
+		: m_X( std::forward<Ux>( x ) ), m_Y( std::forward<Uy>( y ) ),
+		  m_Z( std::forward<Uz>( z ) )
+	{
+	}
+
+	const op_operand<Tx>& x() const
+	{
+		return m_X;
+	}
+
+	const op_operand<Ty>& y() const
+	{
+		return m_Y;
+	}
+
+	const op_operand<Tz>& z() const
+	{
+		return m_Z;
+	}
+
+protected:
+	op_operand<Tx> m_X;
+	op_operand<Ty> m_Y;
+	op_operand<Tz> m_Z;
+};
+
+template<typename Tx, typename Ty>
+class Vector<Tx, Ty, void>
+{
+public:
+	static const unsigned int N = 2;
+
+public:
+	template<typename Ux, typename Uy>
+	Vector( Ux&& x, Uy&& y )
+		: m_X( std::forward<Ux>( x ) ), m_Y( std::forward<Uy>( y ) )
+	{
+	}
+
+	const op_operand<Tx>& x() const
+	{
+		return m_X;
+	}
+
+	const op_operand<Ty>& y() const
+	{
+		return m_Y;
+	}
+
+protected:
+	op_operand<Tx> m_X;
+	op_operand<Ty> m_Y;
+};
+
+template<typename Tx, typename Ty>
+inline Vector<Tx, Ty> vector( const Tx& x, const Ty& y )
+{
+	return Vector<Tx, Ty>( x, y );
+}
+
+template<typename Tx, typename Ty, typename Tz>
+inline Vector<Tx, Ty, Tz> vector( const Tx& x, const Ty& y, const Tz& z )
+{
+	return Vector<Tx, Ty, Tz>( x, y, z );
+}
+
+namespace detail
+{
+
+template<typename T, unsigned int N, unsigned int Dim>
+struct Planes
+{
+	typedef Function<T, Dim> PLANE;
+	typedef typename std::conditional<N == 2, Vector<PLANE, PLANE>,
+			Vector<PLANE, PLANE, PLANE>>::type type;
+
+	template<typename U>
+	static type make( const U& _size, std::integral_constant<unsigned int, 2> )
+	{
+		return type( PLANE( _size ), PLANE( _size ) );
+	}
+
+	template<typename U>
+	static type make( const U& _size, std::integral_constant<unsigned int, 3> )
+	{
+		return type( PLANE( _size ), PLANE( _size ), PLANE( _size ) );
+	}
+};
+
+}
+
+/*
+ * Field of N component vectors stored as N separate planes, so that
+ * every component is a contiguous Function and expressions over it
+ * vectorize like scalar ones. It is itself a Vector of its planes, which
+ * it owns; expressions alias them.
+ */
+template<typename T, unsigned int N = 2, unsigned int Dim = 2>
+class VectorField : public detail::Planes<T, N, Dim>::type
+{
+public:
+	typedef Function<T, Dim> PLANE;
+
+private:
+	typedef typename detail::Planes<T, N, Dim>::type BASE;
+
+public:
+	template<typename U>
+	VectorField( const U& _size )
+		: BASE( detail::Planes<T, N, Dim>::make( _size,
+				std::integral_constant<unsigned int, N>() ) )
+	{
+	}
+
+	PLANE& operator[]( int c )
+	{
+		return ( c == 0 ? BASE::m_X : ( c == 1 ? BASE::m_Y : plane( c ) ) );
+	}
+
+	const PLANE& operator[]( int c ) const
+	{
+		return const_cast<VectorField<T, N, Dim>&>( *this )[ c ];
+	}
+
+	const Tuple<int, Dim>& size() const
+	{
+		return BASE::m_X.size();
+	}
+
+	/* The field as a Vector of its planes. */
+	const BASE& planes() const
+	{
+		return *this;
+	}
+
+	template<typename Tv>
+	VectorField<T, N, Dim>& operator=( const Tv& v )
+	{
+		set( *this, v );
+		return *this;
+	}
+
+private:
+	PLANE& plane( int c )
+	{
+		return plane( c, std::integral_constant<bool, ( N > 2 )>() );
+	}
+
+	PLANE& plane( int, std::true_type )
+	{
+		return this->m_Z;
+	}
+
+	PLANE& plane( int, std::false_type )
+	{
+		return BASE::m_Y;
+	}
+
+private:
+	VectorField( const VectorField<T, N, Dim>& );
+	VectorField<T, N, Dim>& operator=( const VectorField<T, N, Dim>& );
+};
+
+/* === Component-wise arithmetic === */
+
+template<typename Ax, typename Ay, typename Bx, typename By>
+inline Vector<mm::op::Add<Ax, Bx>, mm::op::Add<Ay, By>> operator+(
+		const Vector<Ax, Ay>& a, const Vector<Bx, By>& b )
+{
+	return vector( a.x() + b.x(), a.y() + b.y() );
+}
+
+template<typename Ax, typename Ay, typename Az, typename Bx, typename By, typename Bz>
+inline Vector<mm::op::Add<Ax, Bx>, mm::op::Add<Ay, By>, mm::op::Add<Az, Bz>> operator+(
+		const Vector<Ax, Ay, Az>& a, const Vector<Bx, By, Bz>& b )
+{
+	return vector( a.x() + b.x(), a.y() + b.y(), a.z() + b.z() );
+}
+
+template<typename Ax, typename Ay, typename Bx, typename By>
+inline Vector<mm::op::Sub<Ax, Bx>, mm::op::Sub<Ay, By>> operator-(
+		const Vector<Ax, Ay>& a, const Vector<Bx, By>& b )
+{
+	return vector( a.x() - b.x(), a.y() - b.y() );
+}
+
+template<typename Ax, typename Ay, typename Az, typename Bx, typename By, typename Bz>
+inline Vector<mm::op::Sub<Ax, Bx>, mm::op::Sub<Ay, By>, mm::op::Sub<Az, Bz>> operator-(
+		const Vector<Ax, Ay, Az>& a, const Vector<Bx, By, Bz>& b )
+{
+	return vector( a.x() - b.x(), a.y() - b.y(), a.z() - b.z() );
+}
+
+template<typename Ax, typename Ay>
+inline Vector<mm::op::Neg<Ax>, mm::op::Neg<Ay>> operator-( const Vector<Ax, Ay>& a )
+{
+	return vector( -a.x(), -a.y() );
+}
+
+template<typename Ax, typename Ay, typename Az>
+inline Vector<mm::op::Neg<Ax>, mm::op::Neg<Ay>, mm::op::Neg<Az>> operator-(
+		const Vector<Ax, Ay, Az>& a )
+{
+	return vector( -a.x(), -a.y(), -a.z() );
+}
+
+template<typename Ax, typename Ay>
+inline Vector<mm::op::Scale<Ax>, mm::op::Scale<Ay>> operator*(
+		op_dtype<Ax> factor, const Vector<Ax, Ay>& a )
+{
+	return vector( factor * a.x(), factor * a.y() );
+}
+
+template<typename Ax, typename Ay, typename Az>
+inline Vector<mm::op::Scale<Ax>, mm::op::Scale<Ay>, mm::op::Scale<Az>> operator*(
+		op_dtype<Ax> factor, const Vector<Ax, Ay, Az>& a )
+{
+	return vector( factor * a.x(), factor * a.y(), factor * a.z() );
+}
+
+/* Scalar field times vector. */
+template<typename Top, typename Ax, typename Ay,
+	typename Enable = enable_if_compound<Top>>
+inline Vector<mm::op::Mul<Top, Ax>, mm::op::Mul<Top, Ay>> operator*(
+		const Top& op, const Vector<Ax, Ay>& a )
+{
+	return vector( op * a.x(), op * a.y() );
+}
+
+template<typename Top, typename Ax, typename Ay, typename Az,
+	typename Enable = enable_if_compound<Top>>
+inline Vector<mm::op::Mul<Top, Ax>, mm::op::Mul<Top, Ay>, mm::op::Mul<Top, Az>> operator*(
+		const Top& op, const Vector<Ax, Ay, Az>& a )
+{
+	return vector( op * a.x(), op * a.y(), op * a.z() );
+}
+
+/*
+ * The generic scalar operators of mm match a VectorField exactly and would
+ * win over the Vector overloads above, which need a derived-to-base
+ * conversion; these more specialized ones forward to its planes instead.
+ */
+template<typename T, unsigned int N, unsigned int Dim, typename Tb>
+inline auto operator+( const VectorField<T, N, Dim>& a, const Tb& b )
+	-> decltype( a.planes() + b )
+{
+	return a.planes() + b;
+}
+
+template<typename Ta, typename T, unsigned int N, unsigned int Dim>
+inline auto operator+( const Ta& a, const VectorField<T, N, Dim>& b )
+	-> decltype( a + b.planes() )
+{
+	return a + b.planes();
+}
+
+template<typename T, unsigned int N, unsigned int Dim, typename U, unsigned int M>
+inline auto operator+( const VectorField<T, N, Dim>& a, const VectorField<U, M, Dim>& b )
+	-> decltype( a.planes() + b.planes() )
+{
+	return a.planes() + b.planes();
+}
+
+template<typename T, unsigned int N, unsigned int Dim, typename Tb>
+inline auto operator-( const VectorField<T, N, Dim>& a, const Tb& b )
+	-> decltype( a.planes() - b )
+{
+	return a.planes() - b;
+}
+
+template<typename Ta, typename T, unsigned int N, unsigned int Dim>
+inline auto operator-( const Ta& a, const VectorField<T, N, Dim>& b )
+	-> decltype( a - b.planes() )
+{
+	return a - b.planes();
+}
+
+template<typename T, unsigned int N, unsigned int Dim, typename U, unsigned int M>
+inline auto operator-( const VectorField<T, N, Dim>& a, const VectorField<U, M, Dim>& b )
+	-> decltype( a.planes() - b.planes() )
+{
+	return a.planes() - b.planes();
+}
+
+template<typename T, unsigned int N, unsigned int Dim>
+inline auto operator-( const VectorField<T, N, Dim>& a ) -> decltype( -a.planes() )
+{
+	return -a.planes();
+}
+
+/* Constant factor or scalar field times the field. */
+template<typename Ts, typename T, unsigned int N, unsigned int Dim>
+inline auto operator*( const Ts& s, const VectorField<T, N, Dim>& a )
+	-> decltype( s * a.planes() )
+{
+	return s * a.planes();
+}
+
+template<typename Ax, typename Ay, typename Bx, typename By>
+inline mm::op::Add<mm::op::Mul<Ax, Bx>, mm::op::Mul<Ay, By>> dot(
+		const Vector<Ax, Ay>& a, const Vector<Bx, By>& b )
+{
+	return a.x() * b.x() + a.y() * b.y();
+}
+
+template<typename Ax, typename Ay, typename Az, typename Bx, typename By, typename Bz>
+inline mm::op::Add<mm::op::Add<mm::op::Mul<Ax, Bx>, mm::op::Mul<Ay, By>>, mm::op::Mul<Az, Bz>> dot(
+		const Vector<Ax, Ay, Az>& a, const Vector<Bx, By, Bz>& b )
+{
+	return a.x() * b.x() + a.y() * b.y() + a.z() * b.z();
+}
+
+template<typename Ax, typename Ay, typename Az, typename Bx, typename By, typename Bz>
+inline Vector<mm::op::Sub<mm::op::Mul<Ay, Bz>, mm::op::Mul<Az, By>>,
+		mm::op::Sub<mm::op::Mul<Az, Bx>, mm::op::Mul<Ax, Bz>>,
+		mm::op::Sub<mm::op::Mul<Ax, By>, mm::op::Mul<Ay, Bx>>> cross(
+		const Vector<Ax, Ay, Az>& a, const Vector<Bx, By, Bz>& b )
+{
+	return vector( a.y() * b.z() - a.z() * b.y(), a.z() * b.x() - a.x() * b.z(),
+			a.x() * b.y() - a.y() * b.x() );
+}
+
+/* === Differential operators, central differences of spacing h === */
+
+namespace detail
+{
+
+template<typename Top, unsigned int Dim = mm::detail::FuncDim<Top>::value>
+struct Gradient
+{
+	typedef Vector<typename utils::op::DiffX<Top>::type,
+			typename utils::op::DiffY<Top>::type> type;
+
+	template<typename Th>
+	static type make( const Top& op, const Th& h )
+	{
+		return vector( utils::diffX( op, h[ 0 ] ), utils::diffY( op, h[ 1 ] ) );
+	}
+};
+
+template<typename Top>
+struct Gradient<Top, 3>
+{
+	typedef Vector<typename utils::op::DiffX<Top>::type,
+			typename utils::op::DiffY<Top>::type,
+			typename utils::op::DiffZ<Top>::type> type;
+
+	template<typename Th>
+	static type make( const Top& op, const Th& h )
+	{
+		return vector( utils::diffX( op, h[ 0 ] ), utils::diffY( op, h[ 1 ] ),
+				utils::diffZ( op, h[ 2 ] ) );
+	}
+};
+
+}
+
+/* 2D or 3D by the DIM of op. */
+template<typename Top, typename Th>
+inline typename detail::Gradient<Top>::type gradient( const Top& op, const Th& h )
+{
+	return detail::Gradient<Top>::make( op, h );
+}
+
+template<typename Ax, typename Ay, typename Th>
+inline mm::op::Add<typename utils::op::DiffX<Ax>::type, typename utils::op::DiffY<Ay>::type>
+divergence( const Vector<Ax, Ay>& a, const Th& h )
+{
+	return utils::diffX( a.x(), h[ 0 ] ) + utils::diffY( a.y(), h[ 1 ] );
+}
+
+template<typename Ax, typename Ay, typename Az, typename Th>
+inline mm::op::Add<mm::op::Add<typename utils::op::DiffX<Ax>::type,
+		typename utils::op::DiffY<Ay>::type>, typename utils::op::DiffZ<Az>::type>
+divergence( const Vector<Ax, Ay, Az>& a, const Th& h )
+{
+	return utils::diffX( a.x(), h[ 0 ] ) + utils::diffY( a.y(), h[ 1 ] )
+			+ utils::diffZ( a.z(), h[ 2 ] );
+}
+
+/* The scalar curl dvy/dx - dvx/dy of a 2D field. */
+template<typename Ax, typename Ay, typename Th>
+inline mm::op::Sub<typename utils::op::DiffX<Ay>::type, typename utils::op::DiffY<Ax>::type>
+curl( const Vector<Ax, Ay>& a, const Th& h )
+{
+	return utils::diffX( a.y(), h[ 0 ] ) - utils::diffY( a.x(), h[ 1 ] );
+}
+
+template<typename Ax, typename Ay, typename Az, typename Th>
+inline Vector<mm::op::Sub<typename utils::op::DiffY<Az>::type, typename utils::op::DiffZ<Ay>::type>,
+		mm::op::Sub<typename utils::op::DiffZ<Ax>::type, typename utils::op::DiffX<Az>::type>,
+		mm::op::Sub<typename utils::op::DiffX<Ay>::type, typename utils::op::DiffY<Ax>::type>>
+curl( const Vector<Ax, Ay, Az>& a, const Th& h )
+{
+	return vector( utils::diffY( a.z(), h[ 1 ] ) - utils::diffZ( a.y(), h[ 2 ] ),
+			utils::diffZ( a.x(), h[ 2 ] ) - utils::diffX( a.z(), h[ 0 ] ),
+			utils::diffX( a.y(), h[ 0 ] ) - utils::diffY( a.x(), h[ 1 ] ) );
+}
+
+/* === Assignment === */
+
+namespace detail
+{
+
+template<typename Tfunc, typename Top>
+inline void setRow( Tfunc& func, int beginX, int endX, int y, const Top& op )
+{
+	for( int i = beginX; i < endX; ++i )
+	{
+		func( i, y ) = op( i, y );
+	}
+}
+
+inline void setRows( int, int, int )
+{
+}
+
+template<typename Tassign, typename... Trest>
+inline void setRows( int beginX, int endX, int y, const Tassign& assign,
+		const Trest&... rest )
+{
+	setRow( assign.func(), beginX, endX, y, assign.op() );
+	setRows( beginX, endX, y, rest... );
+}
+
+/*
+ * Flags reads of another component's target at any offset, the point
+ * itself included: the components are assigned together, so each has to
+ * see the values from before the assignment.
+ */
+struct CrossVisitor
+{
+	const mm::detail::FusedTarget* pTargets;
+	int numTargets;
+	int self;
+	bool bCross;
+
+	void read( const void* pData, int, int, int )
+	{
+		for( int m = 0; m < numTargets; ++m )
+		{
+			if( m != self && pTargets[ m ].pData == pData )
+			{
+				bCross = true;
+			}
+		}
+	}
+
+	void unknown()
+	{
+		bCross = true;
+	}
+};
+
+inline bool findCross( const mm::detail::FusedTarget*, int, int )
+{
+	return false;
+}
+
+template<typename Tassign, typename... Trest>
+inline bool findCross( const mm::detail::FusedTarget* pTargets, int numTargets,
+		int self, const Tassign& assign, const Trest&... rest )
+{
+	CrossVisitor visitor = { pTargets, numTargets, self, false };
+	mm::detail::visit( assign.op(), visitor );
+	return ( visitor.bCross || findCross( pTargets, numTargets, self + 1, rest... ) );
+}
+
+template<typename... Tassign>
+inline bool readsOther( const Tassign&... assigns )
+{
+	mm::detail::FusedTarget pTargets[ sizeof...( Tassign ) ];
+	return ( !mm::detail::findTargets( pTargets, assigns... )
+			|| findCross( pTargets, (int)sizeof...( Tassign ), 0, assigns... ) );
+}
+
+/*
+ * 2D: one row of every component in turn, so the operands of a row are
+ * still cached when the next component reads them, while each row loop
+ * only streams what its own component needs. Falls back to set() per
+ * component where fused() would.
+ */
+template<typename Tbegin, typename Tend, typename... Tassign>
+inline void sweep( const Tbegin& begin, const Tend& end, mm::detail::DimTag<2>,
+		const Tassign&... assigns )
+{
+	if( !mm::detail::canFuse( assigns... ) )
+	{
+		mm::detail::setEach( begin, end, assigns... );
+		return;
+	}
+	int beginX = begin[ 0 ];
+	int beginY = begin[ 1 ];
+	int endX = end[ 0 ];
+	int endY = end[ 1 ];
+	for( int j = beginY; j < endY; ++j )
+	{
+		setRows( beginX, endX, j, assigns... );
+	}
+	mm::detail::writtenAll( beginX, beginY, 0, endX, endY, 1, assigns... );
+}
+
+template<typename Tbegin, typename Tend, typename... Tassign>
+inline void sweep( const Tbegin& begin, const Tend& end, mm::detail::DimTag<3>,
+		const Tassign&... assigns )
+{
+	fused( begin, end, assigns... );
+}
+
+}
+
+/*
+ * field = v over [ begin, end ), all components in one sweep. As with
+ * setPacket(), a component must not read its own plane at a negative x
+ * offset. If one reads another component's plane, v is evaluated into a
+ * temporary field first and copied, so every component sees the old values.
+ */
+template<typename T, unsigned int Dim, typename Tbegin, typename Tend,
+	typename Ax, typename Ay>
+inline void set( VectorField<T, 2, Dim>& field, const Tbegin& begin, const Tend& end,
+		const Vector<Ax, Ay>& v )
+{
+	if( detail::readsOther( assign( field[ 0 ], v.x() ), assign( field[ 1 ], v.y() ) ) )
+	{
+		VectorField<T, 2, Dim> result( field.size() );
+		vec::set( result, begin, end, v );
+		vec::set( field, begin, end, result.planes() );
+		return;
+	}
+	detail::sweep( begin, end, mm::detail::DimTag<mm::detail::CoordDim<Tbegin>::value>(),
+			assign( field[ 0 ], v.x() ), assign( field[ 1 ], v.y() ) );
+}
+
+template<typename T, unsigned int Dim, typename Tbegin, typename Tend,
+	typename Ax, typename Ay, typename Az>
+inline void set( VectorField<T, 3, Dim>& field, const Tbegin& begin, const Tend& end,
+		const Vector<Ax, Ay, Az>& v )
+{
+	if( detail::readsOther( assign( field[ 0 ], v.x() ), assign( field[ 1 ], v.y() ),
+			assign( field[ 2 ], v.z() ) ) )
+	{
+		VectorField<T, 3, Dim> result( field.size() );
+		vec::set( result, begin, end, v );
+		vec::set( field, begin, end, result.planes() );
+		return;
+	}
+	detail::sweep( begin, end, mm::detail::DimTag<mm::detail::CoordDim<Tbegin>::value>(),
+			assign( field[ 0 ], v.x() ), assign( field[ 1 ], v.y() ),
+			assign( field[ 2 ], v.z() ) );
+}
+
+template<typename T, unsigned int N, unsigned int Dim, typename Tv>
+inline void set( VectorField<T, N, Dim>& field, const Tv& v )
+{
+	vec::set( field, Tuple<int, Dim>(), field.size(), v );
+}
+
+}
+
+}
+
+#endif